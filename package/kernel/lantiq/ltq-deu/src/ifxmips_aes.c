@@ -72,12 +72,28 @@ extern int ifx_danube_pre_1_4;
 #endif
 
 /* DMA related header and variables */
+#if defined(CONFIG_CRYPTO_DEV_DMA)
+#include <linux/scatterlist.h>
+#include <linux/dma-mapping.h>
+#include "ifxmips_deu_dma.h"
+
+/* requests at least this long are fed to the DEU by DMA */
+static int deu_dma_min = 256;
+module_param(deu_dma_min, int, 0644);
+MODULE_PARM_DESC(deu_dma_min, "Smallest AES request to process by DMA");
+#endif
 
 spinlock_t aes_lock;
 #define CRTCL_SECT_INIT        spin_lock_init(&aes_lock)
 #define CRTCL_SECT_START       spin_lock_irqsave(&aes_lock, flag)
 #define CRTCL_SECT_END         spin_unlock_irqrestore(&aes_lock, flag)
 
+#if defined(CONFIG_CRYPTO_DEV_DMA)
+/* the DMA request that has the engine, under aes_lock */
+static struct ablkcipher_request *aes_dma_req;
+static int aes_dma_registered;
+#endif
+
 /* Definition of constants */
 #define AES_START   IFX_AES_CON
 #define AES_MIN_KEY_SIZE    16
@@ -86,6 +102,8 @@ spinlock_t aes_lock;
 #define CTR_RFC3686_NONCE_SIZE    4
 #define CTR_RFC3686_IV_SIZE       8
 #define CTR_RFC3686_MAX_KEY_SIZE  (AES_MAX_KEY_SIZE + CTR_RFC3686_NONCE_SIZE)
+/* microseconds to wait for the engine before giving up on it */
+#define AES_IDLE_LOOPS      1000
 
 #ifdef CRYPTO_DEBUG
 extern char debug_level;
@@ -149,35 +167,21 @@ int aes_set_key (struct crypto_tfm *tfm, const u8 *in_key, unsigned int key_len)
 }
 
 
-/*! \fn void ifx_deu_aes (void *ctx_arg, u8 *out_arg, const u8 *in_arg, u8 *iv_arg, size_t nbytes, int encdec, int mode)
+/*! \fn static int ifx_deu_aes_setup (struct aes_ctx *ctx, u8 *iv_arg, int encdec, int mode)
  *  \ingroup IFX_AES_FUNCTIONS
- *  \brief main interface to AES hardware
- *  \param ctx_arg crypto algo context  
- *  \param out_arg output bytestream  
- *  \param in_arg input bytestream   
+ *  \brief load key, direction, mode and IV into the AES hardware, called locked
+ *  \param ctx crypto algo context  
  *  \param iv_arg initialization vector  
- *  \param nbytes length of bytestream  
  *  \param encdec 1 for encrypt; 0 for decrypt  
  *  \param mode operation mode such as ebc, cbc, ctr  
- *
+ *  \return -EINVAL - bad key length, 0 - SUCCESS
 */                                 
-void ifx_deu_aes (void *ctx_arg, u8 *out_arg, const u8 *in_arg,
-        u8 *iv_arg, size_t nbytes, int encdec, int mode)
-
+static int ifx_deu_aes_setup (struct aes_ctx *ctx, u8 *iv_arg, int encdec, int mode)
 {
-    /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~ */
     volatile struct aes_t *aes = (volatile struct aes_t *) AES_START;
-    struct aes_ctx *ctx = (struct aes_ctx *)ctx_arg;
     u32 *in_key = ctx->buf;
-    unsigned long flag;
-    /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~ */
     int key_len = ctx->key_length;
 
-    int i = 0;
-    int byte_cnt = nbytes; 
-
-
-    CRTCL_SECT_START;
     /* 128, 192 or 256 bit key length */
     aes->controlr.K = key_len / 8 - 2;
         if (key_len == 128 / 8) {
@@ -206,8 +210,7 @@ void ifx_deu_aes (void *ctx_arg, u8 *out_arg, const u8 *in_arg,
     }
     else {
         printk (KERN_ERR "[%s %s %d]: Invalid key_len : %d\n", __FILE__, __func__, __LINE__, key_len);
-        CRTCL_SECT_END;
-        return;// -EINVAL;
+        return -EINVAL;
     }
 
     /* let HW pre-process DEcryption key in any case (even if
@@ -227,8 +230,60 @@ void ifx_deu_aes (void *ctx_arg, u8 *out_arg, const u8 *in_arg,
         aes->IV0R = DEU_ENDIAN_SWAP(*((u32 *) iv_arg + 3));
     };
 
+    return 0;
+}
+
+/*! \fn static void ifx_deu_aes_iv_out (u8 *iv_arg, int mode)
+ *  \ingroup IFX_AES_FUNCTIONS
+ *  \brief copy the chained IV back out of the AES hardware, called locked
+ *  \param iv_arg initialization vector  
+ *  \param mode operation mode such as ebc, cbc, ctr  
+*/                                 
+static void ifx_deu_aes_iv_out (u8 *iv_arg, int mode)
+{
+    volatile struct aes_t *aes = (volatile struct aes_t *) AES_START;
+
+    //tc.chen : copy iv_arg back
+    if (mode > 0) {
+        *((u32 *) iv_arg) = DEU_ENDIAN_SWAP(aes->IV3R);
+        *((u32 *) iv_arg + 1) = DEU_ENDIAN_SWAP(aes->IV2R);
+        *((u32 *) iv_arg + 2) = DEU_ENDIAN_SWAP(aes->IV1R);
+        *((u32 *) iv_arg + 3) = DEU_ENDIAN_SWAP(aes->IV0R);
+    }
+}
+
+/*! \fn static int ifx_deu_aes_idle (void)
+ *  \ingroup IFX_AES_FUNCTIONS
+ *  \brief wait a bounded time for the AES hardware to finish
+ *  \return 0 - idle, -ETIMEDOUT - still busy
+*/                                 
+static int ifx_deu_aes_idle (void)
+{
+    volatile struct aes_t *aes = (volatile struct aes_t *) AES_START;
+    int loops = AES_IDLE_LOOPS;
+
+    while (aes->controlr.BUS) {
+        if (!loops--)
+            return -ETIMEDOUT;
+        udelay(1);
+    }
+    return 0;
+}
+
+/*! \fn static int ifx_deu_aes_pio (u8 *out_arg, const u8 *in_arg, size_t nbytes)
+ *  \ingroup IFX_AES_FUNCTIONS
+ *  \brief push data through the AES hardware a block at a time, called locked
+ *  \param out_arg output bytestream  
+ *  \param in_arg input bytestream   
+ *  \param nbytes length of bytestream  
+ *  \return 0 - SUCCESS, -ETIMEDOUT - the hardware hung
+*/                                 
+static int ifx_deu_aes_pio (u8 *out_arg, const u8 *in_arg, size_t nbytes)
+{
+    volatile struct aes_t *aes = (volatile struct aes_t *) AES_START;
+    int byte_cnt = nbytes; 
+    int i = 0;
 
-    i = 0;
     while (byte_cnt >= 16) {
 
         aes->ID3R = INPUT_ENDIAN_SWAP(*((u32 *) in_arg + (i * 4) + 0));
@@ -236,8 +291,9 @@ void ifx_deu_aes (void *ctx_arg, u8 *out_arg, const u8 *in_arg,
         aes->ID1R = INPUT_ENDIAN_SWAP(*((u32 *) in_arg + (i * 4) + 2));
         aes->ID0R = INPUT_ENDIAN_SWAP(*((u32 *) in_arg + (i * 4) + 3));    /* start crypto */
         
-        while (aes->controlr.BUS) {
-            // this will not take long
+        if (ifx_deu_aes_idle()) {
+            printk (KERN_ERR "[%s %s %d]: AES hardware stuck busy\n", __FILE__, __func__, __LINE__);
+            return -ETIMEDOUT;
         }
 
         *((volatile u32 *) out_arg + (i * 4) + 0) = aes->OD3R;
@@ -248,19 +304,66 @@ void ifx_deu_aes (void *ctx_arg, u8 *out_arg, const u8 *in_arg,
         i++;
         byte_cnt -= 16;
     }
+    return 0;
+}
+
+/*! \fn void ifx_deu_aes (void *ctx_arg, u8 *out_arg, const u8 *in_arg, u8 *iv_arg, size_t nbytes, int encdec, int mode)
+ *  \ingroup IFX_AES_FUNCTIONS
+ *  \brief main interface to AES hardware
+ *  \param ctx_arg crypto algo context  
+ *  \param out_arg output bytestream  
+ *  \param in_arg input bytestream   
+ *  \param iv_arg initialization vector  
+ *  \param nbytes length of bytestream  
+ *  \param encdec 1 for encrypt; 0 for decrypt  
+ *  \param mode operation mode such as ebc, cbc, ctr  
+ *
+*/                                 
+void ifx_deu_aes (void *ctx_arg, u8 *out_arg, const u8 *in_arg,
+        u8 *iv_arg, size_t nbytes, int encdec, int mode)
 
+{
+    struct aes_ctx *ctx = (struct aes_ctx *)ctx_arg;
+    unsigned long flag;
 
-    //tc.chen : copy iv_arg back
-    if (mode > 0) {
-        *((u32 *) iv_arg) = DEU_ENDIAN_SWAP(*((u32 *) iv_arg));
-        *((u32 *) iv_arg + 1) = DEU_ENDIAN_SWAP(*((u32 *) iv_arg + 1));             
-        *((u32 *) iv_arg + 2) = DEU_ENDIAN_SWAP(*((u32 *) iv_arg + 2));             
-        *((u32 *) iv_arg + 3) = DEU_ENDIAN_SWAP(*((u32 *) iv_arg + 3));              
+    CRTCL_SECT_START;
+#if defined(CONFIG_CRYPTO_DEV_DMA)
+    /* wait for a DMA request to let go of the engine, helping it along */
+    while (aes_dma_req) {
+        CRTCL_SECT_END;
+        deu_dma_poll();
+        udelay(1);
+        CRTCL_SECT_START;
     }
-
+#endif
+    if (ifx_deu_aes_setup(ctx, iv_arg, encdec, mode) == 0 &&
+            ifx_deu_aes_pio(out_arg, in_arg, nbytes) == 0)
+        ifx_deu_aes_iv_out(iv_arg, mode);
     CRTCL_SECT_END;
 }
 
+/*! \fn int ifxdeu_aes_set_dma (int enable)
+ *  \ingroup IFX_AES_FUNCTIONS
+ *  \brief switch AES between DMA and PIO, used by the speed tests
+ *  \param enable 1 for DMA, 0 for PIO  
+ *  \return previous setting or -ENODEV - no DMA
+*/                                 
+int ifxdeu_aes_set_dma (int enable)
+{
+    int old = !disable_deudma;
+
+#if defined(CONFIG_CRYPTO_DEV_DMA)
+    if (enable && !aes_dma_registered)
+        return -ENODEV;
+#else
+    if (enable)
+        return -ENODEV;
+#endif
+    disable_deudma = !enable;
+    return old;
+}
+EXPORT_SYMBOL(ifxdeu_aes_set_dma);
+
 /*!
  *  \fn int ctr_rfc3686_aes_set_key (struct crypto_tfm *tfm, const uint8_t *in_key, unsigned int key_len)
  *  \ingroup IFX_AES_FUNCTIONS
@@ -820,6 +923,522 @@ struct crypto_alg ifxdeu_ctr_rfc3686_aes_alg = {
 };
 
 
+#if defined(CONFIG_CRYPTO_DEV_DMA)
+/*
+ * DMA mode.  The ablkcipher algorithms below map the request's
+ * scatterlists and hand them to the DEU one DMA transfer at a time,
+ * moving on to the next transfer from the completion interrupt.  The
+ * request owns the engine from its first transfer until its last, with
+ * aes_lock dropped in between; PIO users wait for it in ifx_deu_aes().
+ * Requests the DMA cannot take go to the PIO blkcipher of the same mode.
+ */
+#define AES_DMA_QUEUE_LEN   64
+
+struct aes_dma_ctx {
+    struct aes_ctx aes;                 /* first, for aes_set_key() */
+    struct crypto_blkcipher *fallback;
+};
+
+struct aes_dma_reqctx {
+    u8 iv[AES_BLOCK_SIZE];              /* rfc3686 counter block */
+    u8 *ivp;                            /* the IV the engine chains */
+    int encdec;
+    int mode;
+    int err;
+    int src_nents;
+    int dst_nents;
+
+    /* where the next transfer starts */
+    struct scatterlist *src;
+    struct scatterlist *dst;
+    unsigned int src_off;
+    unsigned int dst_off;
+    unsigned int nbytes;
+};
+
+struct aes_dma_alg {
+    struct crypto_alg alg;
+    const char *pio_name;
+    int mode;
+    int rfc3686;
+};
+
+static struct crypto_queue aes_dma_queue;      /* (aes_lock) */
+static LIST_HEAD(aes_dma_done_list);            /* (aes_lock) */
+static void ifx_deu_aes_dma_tasklet (unsigned long data);
+static DECLARE_TASKLET(aes_dma_tasklet, ifx_deu_aes_dma_tasklet, 0);
+
+/*! \fn static int ifx_deu_aes_dma_nents (struct scatterlist *sg, unsigned int nbytes, int oalign, int lalign)
+ *  \ingroup IFX_AES_FUNCTIONS
+ *  \brief count the entries covering nbytes of sg, if the DMA can use them
+ *  \param sg scatterlist  
+ *  \param nbytes data size in bytes  
+ *  \param oalign required alignment of each entry's offset  
+ *  \param lalign required alignment of each entry's length  
+ *  \return number of entries, 0 if the list does not suit the DMA
+*/                                 
+static int ifx_deu_aes_dma_nents (struct scatterlist *sg, unsigned int nbytes,
+        int oalign, int lalign)
+{
+    unsigned int len;
+    int nents = 0;
+
+    for (; nbytes; sg = sg_next(sg)) {
+        if (!sg)
+            return 0;
+        len = min(sg->length, nbytes);
+        if ((sg->offset & (oalign - 1)) || (len & (lalign - 1)))
+            return 0;
+        nbytes -= len;
+        nents++;
+    }
+    return nents;
+}
+
+/*! \fn static int ifx_deu_aes_dma_map (struct ablkcipher_request *req)
+ *  \ingroup IFX_AES_FUNCTIONS
+ *  \brief map the request's scatterlists for the DMA
+ *  \param req ablkcipher request  
+ *  \return 0 - SUCCESS, -ENOMEM
+*/                                 
+static int ifx_deu_aes_dma_map (struct ablkcipher_request *req)
+{
+    struct aes_dma_reqctx *rctx = ablkcipher_request_ctx(req);
+
+    if (req->src == req->dst)
+        return dma_map_sg(NULL, req->src, rctx->src_nents,
+                DMA_BIDIRECTIONAL) ? 0 : -ENOMEM;
+
+    if (!dma_map_sg(NULL, req->src, rctx->src_nents, DMA_TO_DEVICE))
+        return -ENOMEM;
+    if (!dma_map_sg(NULL, req->dst, rctx->dst_nents, DMA_FROM_DEVICE)) {
+        dma_unmap_sg(NULL, req->src, rctx->src_nents, DMA_TO_DEVICE);
+        return -ENOMEM;
+    }
+    return 0;
+}
+
+/*! \fn static void ifx_deu_aes_dma_unmap (struct ablkcipher_request *req)
+ *  \ingroup IFX_AES_FUNCTIONS
+ *  \brief undo ifx_deu_aes_dma_map(), the DMA must be done with the buffers
+ *  \param req ablkcipher request  
+*/                                 
+static void ifx_deu_aes_dma_unmap (struct ablkcipher_request *req)
+{
+    struct aes_dma_reqctx *rctx = ablkcipher_request_ctx(req);
+
+    if (req->src == req->dst) {
+        dma_unmap_sg(NULL, req->src, rctx->src_nents, DMA_BIDIRECTIONAL);
+        return;
+    }
+    dma_unmap_sg(NULL, req->src, rctx->src_nents, DMA_TO_DEVICE);
+    dma_unmap_sg(NULL, req->dst, rctx->dst_nents, DMA_FROM_DEVICE);
+}
+
+static void ifx_deu_aes_dma_done (void *priv, int err);
+
+/*! \fn static int ifx_deu_aes_dma_next (struct ablkcipher_request *req)
+ *  \ingroup IFX_AES_FUNCTIONS
+ *  \brief start the transfer for the next contiguous piece of the request
+ *  \param req ablkcipher request, which has the engine  
+ *  \return 0 - SUCCESS, otherwise the deu_dma_start() error
+*/                                 
+static int ifx_deu_aes_dma_next (struct ablkcipher_request *req)
+{
+    struct aes_dma_reqctx *rctx = ablkcipher_request_ctx(req);
+    dma_addr_t src, dst;
+    unsigned int len;
+
+    len = min(sg_dma_len(rctx->src) - rctx->src_off,
+            sg_dma_len(rctx->dst) - rctx->dst_off);
+    len = min_t(unsigned int, min(len, rctx->nbytes), DEU_DMA_MAX_LEN);
+    src = sg_dma_address(rctx->src) + rctx->src_off;
+    dst = sg_dma_address(rctx->dst) + rctx->dst_off;
+
+    /* the completion may run before deu_dma_start() returns */
+    rctx->nbytes -= len;
+    rctx->src_off += len;
+    if (rctx->src_off == sg_dma_len(rctx->src)) {
+        rctx->src = sg_next(rctx->src);
+        rctx->src_off = 0;
+    }
+    rctx->dst_off += len;
+    if (rctx->dst_off == sg_dma_len(rctx->dst)) {
+        rctx->dst = sg_next(rctx->dst);
+        rctx->dst_off = 0;
+    }
+
+    return deu_dma_start(src, dst, len, ifx_deu_aes_dma_done, req);
+}
+
+/*! \fn static int ifx_deu_aes_dma_begin (struct ablkcipher_request *req)
+ *  \ingroup IFX_AES_FUNCTIONS
+ *  \brief set up the engine for req and start its first transfer, called locked
+ *  \param req ablkcipher request, which has just been given the engine  
+ *  \return 0 - SUCCESS, -EINVAL - bad key length, or the DMA error
+*/                                 
+static int ifx_deu_aes_dma_begin (struct ablkcipher_request *req)
+{
+    volatile struct aes_t *aes = (volatile struct aes_t *) AES_START;
+    volatile struct deu_dma_t *dma = (struct deu_dma_t *) IFX_DEU_DMA_CON;
+    struct aes_dma_ctx *ctx = crypto_ablkcipher_ctx(crypto_ablkcipher_reqtfm(req));
+    struct aes_dma_reqctx *rctx = ablkcipher_request_ctx(req);
+    int err;
+
+    err = ifx_deu_aes_setup(&ctx->aes, rctx->ivp, rctx->encdec, rctx->mode);
+    if (err)
+        return err;
+
+    dma->controlr.ALGO = 1;     /* AES */
+    dma->controlr.BS = 0;
+    aes->controlr.DAU = 0;
+    dma->controlr.EN = 1;
+
+    err = ifx_deu_aes_dma_next(req);
+    if (err)
+        dma->controlr.EN = 0;
+    return err;
+}
+
+/*! \fn static void ifx_deu_aes_dma_done (void *priv, int err)
+ *  \ingroup IFX_AES_FUNCTIONS
+ *  \brief a transfer is in, start the next one or give up the engine
+ *
+ *  Called from the DMA interrupt or from whoever polls the DMA, so the
+ *  request itself is completed from aes_dma_tasklet.
+ *  \param priv ablkcipher request  
+ *  \param err 0 or the DMA error  
+*/                                 
+static void ifx_deu_aes_dma_done (void *priv, int err)
+{
+    volatile struct deu_dma_t *dma = (struct deu_dma_t *) IFX_DEU_DMA_CON;
+    struct ablkcipher_request *req = priv;
+    struct aes_dma_reqctx *rctx = ablkcipher_request_ctx(req);
+    unsigned long flag;
+
+    if (!err && rctx->nbytes) {
+        err = ifx_deu_aes_dma_next(req);
+        if (!err)
+            return;
+    }
+
+    CRTCL_SECT_START;
+    if (!err)
+        err = ifx_deu_aes_idle();
+    if (!err)
+        ifx_deu_aes_iv_out(rctx->ivp, rctx->mode);
+    dma->controlr.EN = 0;
+    rctx->err = err;
+    list_add_tail(&req->base.list, &aes_dma_done_list);
+    aes_dma_req = NULL;
+    CRTCL_SECT_END;
+
+    tasklet_schedule(&aes_dma_tasklet);
+}
+
+/*! \fn static void ifx_deu_aes_dma_run (void)
+ *  \ingroup IFX_AES_FUNCTIONS
+ *  \brief give the engine to the next queued request if it is free
+*/                                 
+static void ifx_deu_aes_dma_run (void)
+{
+    struct crypto_async_request *backlog;
+    struct ablkcipher_request *req;
+    unsigned long flag;
+    int err;
+
+    for (;;) {
+        CRTCL_SECT_START;
+        if (aes_dma_req) {
+            CRTCL_SECT_END;
+            return;
+        }
+        backlog = crypto_get_backlog(&aes_dma_queue);
+        req = ablkcipher_dequeue_request(&aes_dma_queue);
+        if (!req) {
+            CRTCL_SECT_END;
+            return;
+        }
+        aes_dma_req = req;
+        err = ifx_deu_aes_dma_begin(req);
+        if (err)
+            aes_dma_req = NULL;
+        CRTCL_SECT_END;
+
+        if (backlog)
+            backlog->complete(backlog, -EINPROGRESS);
+        if (!err)
+            return;
+
+        ifx_deu_aes_dma_unmap(req);
+        req->base.complete(&req->base, err);
+    }
+}
+
+/*! \fn static void ifx_deu_aes_dma_tasklet (unsigned long data)
+ *  \ingroup IFX_AES_FUNCTIONS
+ *  \brief start the next request, then complete the finished ones
+ *  \param data not used  
+*/                                 
+static void ifx_deu_aes_dma_tasklet (unsigned long data)
+{
+    struct ablkcipher_request *req;
+    struct aes_dma_reqctx *rctx;
+    unsigned long flag;
+
+    ifx_deu_aes_dma_run();
+
+    for (;;) {
+        req = NULL;
+        CRTCL_SECT_START;
+        if (!list_empty(&aes_dma_done_list)) {
+            req = list_first_entry(&aes_dma_done_list,
+                    struct ablkcipher_request, base.list);
+            list_del(&req->base.list);
+        }
+        CRTCL_SECT_END;
+        if (!req)
+            break;
+
+        rctx = ablkcipher_request_ctx(req);
+        ifx_deu_aes_dma_unmap(req);
+        if (rctx->err)
+            printk (KERN_ERR "[%s %s %d]: DMA request failed: %d\n", __FILE__, __func__, __LINE__, rctx->err);
+        req->base.complete(&req->base, rctx->err);
+    }
+}
+
+/*! \fn static int ifx_deu_aes_dma_fallback (struct ablkcipher_request *req, int encdec)
+ *  \ingroup IFX_AES_FUNCTIONS
+ *  \brief process req synchronously with the PIO blkcipher
+ *  \param req ablkcipher request  
+ *  \param encdec 1 for encrypt; 0 for decrypt  
+ *  \return err
+*/                                 
+static int ifx_deu_aes_dma_fallback (struct ablkcipher_request *req, int encdec)
+{
+    struct aes_dma_ctx *ctx = crypto_ablkcipher_ctx(crypto_ablkcipher_reqtfm(req));
+    struct blkcipher_desc desc = {
+        .tfm = ctx->fallback,
+        .info = req->info,
+        .flags = req->base.flags,
+    };
+
+    if (encdec == CRYPTO_DIR_ENCRYPT)
+        return crypto_blkcipher_encrypt_iv(&desc, req->dst, req->src, req->nbytes);
+    return crypto_blkcipher_decrypt_iv(&desc, req->dst, req->src, req->nbytes);
+}
+
+/*! \fn static int ifx_deu_aes_dma_crypt (struct ablkcipher_request *req, int encdec)
+ *  \ingroup IFX_AES_FUNCTIONS
+ *  \brief queue req for the DMA, or do it by PIO if the DMA cannot take it
+ *  \param req ablkcipher request  
+ *  \param encdec 1 for encrypt; 0 for decrypt  
+ *  \return -EINPROGRESS, -EBUSY if backlogged or the queue is full, 0 or error if done by PIO
+*/                                 
+static int ifx_deu_aes_dma_crypt (struct ablkcipher_request *req, int encdec)
+{
+    struct crypto_tfm *tfm = crypto_ablkcipher_tfm(crypto_ablkcipher_reqtfm(req));
+    struct aes_dma_ctx *ctx = crypto_tfm_ctx(tfm);
+    struct aes_dma_alg *alg = container_of(tfm->__crt_alg, struct aes_dma_alg, alg);
+    struct aes_dma_reqctx *rctx = ablkcipher_request_ctx(req);
+    int align = max(dma_get_cache_alignment(), AES_BLOCK_SIZE);
+    unsigned long flag;
+    int err;
+
+    rctx->src_nents = 0;
+    rctx->dst_nents = 0;
+    if (!disable_deudma && req->nbytes >= deu_dma_min &&
+            !(req->nbytes & (AES_BLOCK_SIZE - 1))) {
+        rctx->src_nents = ifx_deu_aes_dma_nents(req->src, req->nbytes,
+                1, AES_BLOCK_SIZE);
+        /* invalidating part of a cache line would lose whatever shares it */
+        rctx->dst_nents = ifx_deu_aes_dma_nents(req->dst, req->nbytes,
+                align, align);
+    }
+    if (!rctx->src_nents || !rctx->dst_nents)
+        return ifx_deu_aes_dma_fallback(req, encdec);
+
+    rctx->encdec = encdec;
+    rctx->mode = alg->mode;
+    rctx->ivp = alg->mode ? req->info : NULL;
+    if (alg->rfc3686) {
+        memcpy(rctx->iv, ctx->aes.nonce, CTR_RFC3686_NONCE_SIZE);
+        memcpy(rctx->iv + CTR_RFC3686_NONCE_SIZE, req->info, CTR_RFC3686_IV_SIZE);
+        *(__be32 *)(rctx->iv + CTR_RFC3686_NONCE_SIZE + CTR_RFC3686_IV_SIZE) =
+            cpu_to_be32(1);
+        rctx->ivp = rctx->iv;
+    }
+    rctx->src = req->src;
+    rctx->dst = req->dst;
+    rctx->src_off = 0;
+    rctx->dst_off = 0;
+    rctx->nbytes = req->nbytes;
+
+    err = ifx_deu_aes_dma_map(req);
+    if (err)
+        return err;
+
+    CRTCL_SECT_START;
+    err = ablkcipher_enqueue_request(&aes_dma_queue, req);
+    CRTCL_SECT_END;
+    if (err == -EBUSY && !(req->base.flags & CRYPTO_TFM_REQ_MAY_BACKLOG)) {
+        ifx_deu_aes_dma_unmap(req);
+        return err;
+    }
+
+    ifx_deu_aes_dma_run();
+    return err;
+}
+
+/*! \fn static int ifx_deu_aes_dma_encrypt (struct ablkcipher_request *req)
+ *  \ingroup IFX_AES_FUNCTIONS
+ *  \brief AES encrypt using linux crypto ablkcipher, by DMA
+ *  \param req ablkcipher request  
+ *  \return err
+*/                                 
+static int ifx_deu_aes_dma_encrypt (struct ablkcipher_request *req)
+{
+    return ifx_deu_aes_dma_crypt(req, CRYPTO_DIR_ENCRYPT);
+}
+
+/*! \fn static int ifx_deu_aes_dma_decrypt (struct ablkcipher_request *req)
+ *  \ingroup IFX_AES_FUNCTIONS
+ *  \brief AES decrypt using linux crypto ablkcipher, by DMA
+ *  \param req ablkcipher request  
+ *  \return err
+*/                                 
+static int ifx_deu_aes_dma_decrypt (struct ablkcipher_request *req)
+{
+    return ifx_deu_aes_dma_crypt(req, CRYPTO_DIR_DECRYPT);
+}
+
+/*! \fn static int ifx_deu_aes_dma_setkey (struct crypto_ablkcipher *cipher, const u8 *in_key, unsigned int key_len)
+ *  \ingroup IFX_AES_FUNCTIONS
+ *  \brief sets the AES keys, for the DMA and for the PIO fallback
+ *  \param cipher linux crypto ablkcipher transform  
+ *  \param in_key input key  
+ *  \param key_len key length, with the nonce for rfc3686  
+ *  \return -EINVAL - bad key length, 0 - SUCCESS
+*/                                 
+static int ifx_deu_aes_dma_setkey (struct crypto_ablkcipher *cipher,
+        const u8 *in_key, unsigned int key_len)
+{
+    struct crypto_tfm *tfm = crypto_ablkcipher_tfm(cipher);
+    struct aes_dma_ctx *ctx = crypto_tfm_ctx(tfm);
+    struct aes_dma_alg *alg = container_of(tfm->__crt_alg, struct aes_dma_alg, alg);
+    int err;
+
+    crypto_blkcipher_clear_flags(ctx->fallback, CRYPTO_TFM_REQ_MASK);
+    crypto_blkcipher_set_flags(ctx->fallback,
+            crypto_ablkcipher_get_flags(cipher) & CRYPTO_TFM_REQ_MASK);
+    err = crypto_blkcipher_setkey(ctx->fallback, in_key, key_len);
+    crypto_ablkcipher_set_flags(cipher,
+            crypto_blkcipher_get_flags(ctx->fallback) & CRYPTO_TFM_RES_MASK);
+    if (err)
+        return err;
+
+    if (alg->rfc3686)
+        return ctr_rfc3686_aes_set_key(tfm, in_key, key_len);
+    return aes_set_key(tfm, in_key, key_len);
+}
+
+/*! \fn static int ifx_deu_aes_dma_init_tfm (struct crypto_tfm *tfm)
+ *  \ingroup IFX_AES_FUNCTIONS
+ *  \brief get the PIO fallback for a new transform
+ *  \param tfm linux crypto algo transform  
+ *  \return 0 - SUCCESS, or the crypto_alloc_blkcipher() error
+*/                                 
+static int ifx_deu_aes_dma_init_tfm (struct crypto_tfm *tfm)
+{
+    struct aes_dma_ctx *ctx = crypto_tfm_ctx(tfm);
+    struct aes_dma_alg *alg = container_of(tfm->__crt_alg, struct aes_dma_alg, alg);
+
+    ctx->fallback = crypto_alloc_blkcipher(alg->pio_name, 0, 0);
+    if (IS_ERR(ctx->fallback)) {
+        printk (KERN_ERR "[%s %s %d]: cannot get %s\n", __FILE__, __func__, __LINE__, alg->pio_name);
+        return PTR_ERR(ctx->fallback);
+    }
+    tfm->crt_ablkcipher.reqsize = sizeof(struct aes_dma_reqctx);
+    return 0;
+}
+
+/*! \fn static void ifx_deu_aes_dma_exit_tfm (struct crypto_tfm *tfm)
+ *  \ingroup IFX_AES_FUNCTIONS
+ *  \brief release the PIO fallback
+ *  \param tfm linux crypto algo transform  
+*/                                 
+static void ifx_deu_aes_dma_exit_tfm (struct crypto_tfm *tfm)
+{
+    struct aes_dma_ctx *ctx = crypto_tfm_ctx(tfm);
+
+    crypto_free_blkcipher(ctx->fallback);
+}
+
+#define AES_DMA_ALG(name, pio, max_key, iv_size, hw_mode, is_rfc3686) { \
+    .alg = { \
+        .cra_name           =   name, \
+        .cra_driver_name    =   "ifxdeu-dma-" name, \
+        .cra_priority       =   300, \
+        .cra_flags          =   CRYPTO_ALG_TYPE_ABLKCIPHER | CRYPTO_ALG_ASYNC, \
+        .cra_blocksize      =   AES_BLOCK_SIZE, \
+        .cra_ctxsize        =   sizeof(struct aes_dma_ctx), \
+        .cra_type           =   &crypto_ablkcipher_type, \
+        .cra_module         =   THIS_MODULE, \
+        .cra_init           =   ifx_deu_aes_dma_init_tfm, \
+        .cra_exit           =   ifx_deu_aes_dma_exit_tfm, \
+        .cra_u              =   { \
+            .ablkcipher = { \
+                .min_keysize    =   AES_MIN_KEY_SIZE, \
+                .max_keysize    =   max_key, \
+                .ivsize         =   iv_size, \
+                .setkey         =   ifx_deu_aes_dma_setkey, \
+                .encrypt        =   ifx_deu_aes_dma_encrypt, \
+                .decrypt        =   ifx_deu_aes_dma_decrypt, \
+            } \
+        } \
+    }, \
+    .pio_name   =   pio, \
+    .mode       =   hw_mode, \
+    .rfc3686    =   is_rfc3686, \
+}
+
+/* 
+ * \brief AES function mappings, DMA
+*/
+static struct aes_dma_alg ifxdeu_aes_dma_algs[] = {
+    AES_DMA_ALG("ecb(aes)", "ifxdeu-ecb(aes)", AES_MAX_KEY_SIZE, 0, 0, 0),
+    AES_DMA_ALG("cbc(aes)", "ifxdeu-cbc(aes)", AES_MAX_KEY_SIZE, AES_BLOCK_SIZE, 1, 0),
+    AES_DMA_ALG("ctr(aes)", "ifxdeu-ctr(aes)", AES_MAX_KEY_SIZE, AES_BLOCK_SIZE, 4, 0),
+    AES_DMA_ALG("rfc3686(ctr(aes))", "ifxdeu-ctr-rfc3686(aes)",
+            CTR_RFC3686_MAX_KEY_SIZE, CTR_RFC3686_IV_SIZE, 4, 1),
+};
+
+/*! \fn static int ifxdeu_init_aes_dma (void)
+ *  \ingroup IFX_AES_FUNCTIONS
+ *  \brief register the DMA algorithms, after the PIO ones they fall back to
+ *  \return ret 
+*/                                 
+static int ifxdeu_init_aes_dma (void)
+{
+    int i, ret = 0;
+
+    crypto_init_queue(&aes_dma_queue, AES_DMA_QUEUE_LEN);
+
+    for (i = 0; i < ARRAY_SIZE(ifxdeu_aes_dma_algs); i++) {
+        if ((ret = crypto_register_alg(&ifxdeu_aes_dma_algs[i].alg))) {
+            printk (KERN_ERR "IFX %s initialization failed!\n",
+                    ifxdeu_aes_dma_algs[i].alg.cra_driver_name);
+            while (i--)
+                crypto_unregister_alg(&ifxdeu_aes_dma_algs[i].alg);
+            return ret;
+        }
+    }
+    aes_dma_registered = 1;
+    return 0;
+}
+#endif
+
 /*! \fn int __init ifxdeu_init_aes (void)
  *  \ingroup IFX_AES_FUNCTIONS
  *  \brief function to initialize AES driver   
@@ -861,6 +1480,11 @@ int __init ifxdeu_init_aes (void)
 
     CRTCL_SECT_INIT;
 
+#if defined(CONFIG_CRYPTO_DEV_DMA)
+    /* DMA stays off unless asked for, and PIO if its algorithms fail */
+    if (!disable_deudma && ifxdeu_init_aes_dma())
+        disable_deudma = 1;
+#endif
 
     printk (KERN_NOTICE "IFX DEU AES initialized%s%s.\n", disable_multiblock ? "" : " (multiblock)", disable_deudma ? "" : " (DMA)");
     return ret;
@@ -899,6 +1523,15 @@ void __exit ifxdeu_fini_aes (void)
     crypto_unregister_alg (&ifxdeu_ctr_basic_aes_alg);
     crypto_unregister_alg (&ifxdeu_ctr_rfc3686_aes_alg);
 
+#if defined(CONFIG_CRYPTO_DEV_DMA)
+    if (aes_dma_registered) {
+        int i;
+
+        for (i = 0; i < ARRAY_SIZE(ifxdeu_aes_dma_algs); i++)
+            crypto_unregister_alg (&ifxdeu_aes_dma_algs[i].alg);
+        tasklet_kill(&aes_dma_tasklet);
+    }
+#endif
 }
 
 
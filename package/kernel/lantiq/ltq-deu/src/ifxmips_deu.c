@@ -69,6 +69,9 @@
 #endif /* CONFIG_xxxx */
 
 int disable_deudma = 1;
+module_param(disable_deudma, int, 0);
+MODULE_PARM_DESC (disable_deudma,
+          "Feed the AES engine by PIO rather than DMA.");
 
 void chip_version(void);
 
@@ -90,6 +93,15 @@ static int ltq_deu_probe(struct platform_device *pdev)
 
     FIND_DEU_CHIP_VERSION;
 
+#if defined(CONFIG_CRYPTO_DEV_DMA)
+    if (deu_dma_init ()) {
+        printk (KERN_ERR "IFX DEU DMA initialization failed, using PIO!\n");
+        disable_deudma = 1;
+    }
+#else
+    disable_deudma = 1;
+#endif
+
 #if defined(CONFIG_CRYPTO_DEV_DES)
     if ((ret = ifxdeu_init_des ())) {
         printk (KERN_ERR "IFX DES initialization failed!\n");
@@ -163,6 +175,9 @@ static int ltq_deu_remove(struct platform_device *pdev)
     #if defined(CONFIG_CRYPTO_DEV_MD5_HMAC)
     ifxdeu_fini_md5_hmac ();
     #endif
+    #if defined(CONFIG_CRYPTO_DEV_DMA)
+    ifxdeu_fini_dma ();
+    #endif
     printk("DEU has exited successfully\n");
 
 	return 0;
@@ -47,6 +47,7 @@
 #define IFX_AES_CON                             ((volatile u32 *)(IFX_DEU_BASE_ADDR + 0x0050))
 #define IFX_HASH_CON                            ((volatile u32 *)(IFX_DEU_BASE_ADDR + 0x00B0))
 #define IFX_ARC4_CON                            ((volatile u32 *)(IFX_DEU_BASE_ADDR + 0x0100))
+#define IFX_DEU_DMA_CON                         ((volatile u32 *)(IFX_DEU_BASE_ADDR + 0x00EC))
 
 #define PFX	"ifxdeu: "
 #define CLC_START IFX_DEU_CLK
@@ -130,6 +131,7 @@ void __exit lqdeu_fini_async_aes(void);
 void __exit lqdeu_fini_async_des(void);
 void __exit deu_fini (void);
 int deu_dma_init (void);
+int ifxdeu_aes_set_dma (int enable);
 
 
 
@@ -38,5 +38,279 @@
  \brief deu-dma driver functions
 */
 
-/* Project header files */ 
+/* Project header files */
+#include <linux/module.h>
+#include <linux/init.h>
+#include <linux/types.h>
+#include <linux/errno.h>
+#include <linux/interrupt.h>
+#include <linux/spinlock.h>
+#include <linux/timer.h>
+#include <linux/jiffies.h>
+#include <linux/dma-mapping.h>
+#include <xway_dma.h>
+#include <lantiq_soc.h>
 
+#include "ifxmips_deu.h"
+#include "ifxmips_deu_dma.h"
+
+/*
+ * The DEU sits on DMA port 1 with one channel feeding it and one
+ * draining it.  We only ever have one transfer in flight, so each
+ * transfer is a single descriptor on each channel.
+ *
+ * Transfers are asynchronous: the caller maps its buffers, posts them
+ * with deu_dma_start() and is called back once the output descriptor
+ * comes back, from the rx channel interrupt.  A transfer that does not
+ * come back in time has both channels reset before its callback is told,
+ * so the buffers can be unmapped safely.  Anyone who has to wait for the
+ * engine can drive the same thing with deu_dma_poll().
+ */
+static int deu_dma_tx_chan = DEU_DMA_TX_CHAN;
+module_param(deu_dma_tx_chan, int, 0);
+MODULE_PARM_DESC(deu_dma_tx_chan, "DMA channel carrying data to the DEU");
+
+static int deu_dma_rx_chan = DEU_DMA_RX_CHAN;
+module_param(deu_dma_rx_chan, int, 0);
+MODULE_PARM_DESC(deu_dma_rx_chan, "DMA channel carrying data from the DEU");
+
+static struct {
+    struct ltq_dma_channel tx;
+    struct ltq_dma_channel rx;
+    spinlock_t lock;
+    struct timer_list timer;
+    int ready;
+
+    /* the transfer in flight, under lock */
+    int busy;
+    unsigned long deadline;
+    int polls;
+    void (*done)(void *priv, int err);
+    void *priv;
+} deu_dma;
+
+#define DEU_DMA_TIMEOUT    (HZ / 10)
+/* deu_dma_poll() calls before giving up, for waiters that keep jiffies still */
+#define DEU_DMA_POLLS      100000
+
+/*! \fn int deu_dma_available(void)
+ *  \ingroup IFX_DMA_FUNCTIONS
+ *  \brief check whether the DMA channels were set up
+ *  \return 1 if DMA transfers can be made, 0 otherwise
+*/
+int deu_dma_available(void)
+{
+    return deu_dma.ready;
+}
+
+/*! \fn int deu_dma_start(dma_addr_t src, dma_addr_t dst, int len, void (*done)(void *priv, int err), void *priv)
+ *  \ingroup IFX_DMA_FUNCTIONS
+ *  \brief post one transfer of len bytes from src through the DEU to dst
+ *
+ *  The engine must already be configured and both buffers mapped; dst
+ *  has to be whole cache lines.  done(priv, err) is called once the
+ *  output is in, from interrupt context, or with -ETIMEDOUT after the
+ *  channels were reset.  It may start the next transfer.
+ *  \param src bus address of the input
+ *  \param dst bus address of the output
+ *  \param len length, a multiple of the block size and at most DEU_DMA_MAX_LEN
+ *  \param done completion callback
+ *  \param priv passed to done
+ *  \return 0 - transfer started, -EINVAL - bad length, -EBUSY
+*/
+int deu_dma_start(dma_addr_t src, dma_addr_t dst, int len,
+        void (*done)(void *priv, int err), void *priv)
+{
+    struct ltq_dma_desc *tx, *rx;
+    unsigned long flags;
+    int offset;
+
+    if (len <= 0 || len > DEU_DMA_MAX_LEN)
+        return -EINVAL;
+
+    spin_lock_irqsave(&deu_dma.lock, flags);
+    tx = &deu_dma.tx.desc_base[deu_dma.tx.desc];
+    rx = &deu_dma.rx.desc_base[deu_dma.rx.desc];
+    if (deu_dma.busy || ((tx->ctl | rx->ctl) & LTQ_DMA_OWN)) {
+        spin_unlock_irqrestore(&deu_dma.lock, flags);
+        return -EBUSY;
+    }
+
+    deu_dma.busy = 1;
+    deu_dma.polls = 0;
+    deu_dma.done = done;
+    deu_dma.priv = priv;
+    deu_dma.deadline = jiffies + DEU_DMA_TIMEOUT;
+    mod_timer(&deu_dma.timer, deu_dma.deadline);
+
+    /* output first so it is ready before the DEU produces anything */
+    rx->addr = dst;
+    wmb();
+    rx->ctl = LTQ_DMA_OWN | (len & LTQ_DMA_SIZE_MASK);
+
+    /* input has to start on a 16 byte boundary, the offset covers the rest */
+    offset = src % 16;
+    tx->addr = src - offset;
+    wmb();
+    tx->ctl = LTQ_DMA_OWN | LTQ_DMA_SOP | LTQ_DMA_EOP |
+        LTQ_DMA_TX_OFFSET(offset) | (len & LTQ_DMA_SIZE_MASK);
+    spin_unlock_irqrestore(&deu_dma.lock, flags);
+
+    return 0;
+}
+
+/*! \fn static void deu_dma_reset(void)
+ *  \ingroup IFX_DMA_FUNCTIONS
+ *  \brief stop both channels and give them fresh descriptors, called locked
+*/
+static void deu_dma_reset(void)
+{
+    /* freeing closes the channel, allocating resets it */
+    ltq_dma_free(&deu_dma.tx);
+    ltq_dma_free(&deu_dma.rx);
+    ltq_dma_alloc_tx(&deu_dma.tx);
+    ltq_dma_alloc_rx(&deu_dma.rx);
+    ltq_dma_open(&deu_dma.rx);
+    ltq_dma_open(&deu_dma.tx);
+    ltq_dma_disable_irq(&deu_dma.tx);
+}
+
+/*! \fn static void deu_dma_complete(int expired)
+ *  \ingroup IFX_DMA_FUNCTIONS
+ *  \brief finish the transfer in flight if it is done or out of time
+ *  \param expired give up on it even if the deadline has not passed
+*/
+static void deu_dma_complete(int expired)
+{
+    struct ltq_dma_desc *tx, *rx;
+    void (*done)(void *priv, int err);
+    void *priv;
+    unsigned long flags;
+    int err = 0;
+
+    spin_lock_irqsave(&deu_dma.lock, flags);
+    if (!deu_dma.busy) {
+        spin_unlock_irqrestore(&deu_dma.lock, flags);
+        return;
+    }
+
+    tx = &deu_dma.tx.desc_base[deu_dma.tx.desc];
+    rx = &deu_dma.rx.desc_base[deu_dma.rx.desc];
+    if ((rx->ctl & (LTQ_DMA_OWN | LTQ_DMA_C)) == LTQ_DMA_C) {
+        tx->ctl = 0;
+        rx->ctl = 0;
+        deu_dma.tx.desc = (deu_dma.tx.desc + 1) % LTQ_DESC_NUM;
+        deu_dma.rx.desc = (deu_dma.rx.desc + 1) % LTQ_DESC_NUM;
+    } else if (expired || time_after_eq(jiffies, deu_dma.deadline)) {
+        /* the engine may still write, stop it before the buffers go */
+        deu_dma_reset();
+        err = -ETIMEDOUT;
+    } else {
+        spin_unlock_irqrestore(&deu_dma.lock, flags);
+        return;
+    }
+
+    deu_dma.busy = 0;
+    done = deu_dma.done;
+    priv = deu_dma.priv;
+    del_timer(&deu_dma.timer);
+    spin_unlock_irqrestore(&deu_dma.lock, flags);
+
+    if (err)
+        printk(KERN_ERR "[%s %s %d]: DMA timed out\n", __FILE__, __func__, __LINE__);
+    done(priv, err);
+}
+
+/*! \fn static irqreturn_t deu_dma_irq(int irq, void *priv)
+ *  \ingroup IFX_DMA_FUNCTIONS
+ *  \brief output descriptor completed
+*/
+static irqreturn_t deu_dma_irq(int irq, void *priv)
+{
+    ltq_dma_ack_irq(&deu_dma.rx);
+    deu_dma_complete(0);
+    return IRQ_HANDLED;
+}
+
+/*! \fn static void deu_dma_timeout(unsigned long data)
+ *  \ingroup IFX_DMA_FUNCTIONS
+ *  \brief the transfer in flight ran out of time
+*/
+static void deu_dma_timeout(unsigned long data)
+{
+    deu_dma_complete(0);
+}
+
+/*! \fn void deu_dma_poll(void)
+ *  \ingroup IFX_DMA_FUNCTIONS
+ *  \brief do what the interrupt would, for callers waiting on the engine
+ *
+ *  Such callers may have interrupts or bottom halves off, so a stalled
+ *  transfer is also given up after DEU_DMA_POLLS calls.
+*/
+void deu_dma_poll(void)
+{
+    unsigned long flags;
+    int expired;
+
+    spin_lock_irqsave(&deu_dma.lock, flags);
+    expired = deu_dma.busy && ++deu_dma.polls > DEU_DMA_POLLS;
+    spin_unlock_irqrestore(&deu_dma.lock, flags);
+
+    deu_dma_complete(expired);
+}
+
+/*! \fn int deu_dma_init(void)
+ *  \ingroup IFX_DMA_FUNCTIONS
+ *  \brief set up the DEU DMA channels and their interrupt
+ *  \return 0 - SUCCESS, or the request_irq() error
+*/
+int deu_dma_init(void)
+{
+    int err;
+
+    spin_lock_init(&deu_dma.lock);
+    setup_timer(&deu_dma.timer, deu_dma_timeout, 0);
+
+    ltq_dma_init_port(DMA_PORT_DEU);
+
+    deu_dma.tx.nr = deu_dma_tx_chan;
+    ltq_dma_alloc_tx(&deu_dma.tx);
+
+    deu_dma.rx.nr = deu_dma_rx_chan;
+    deu_dma.rx.irq = LTQ_DMA_CH0_INT + deu_dma_rx_chan;
+    ltq_dma_alloc_rx(&deu_dma.rx);
+
+    err = request_irq(deu_dma.rx.irq, deu_dma_irq, 0, "deu_dma", &deu_dma);
+    if (err) {
+        printk(KERN_ERR PFX "cannot get DMA irq %d\n", deu_dma.rx.irq);
+        ltq_dma_free(&deu_dma.tx);
+        ltq_dma_free(&deu_dma.rx);
+        return err;
+    }
+
+    /* opening turns the channel interrupts on, only the output one is used */
+    ltq_dma_open(&deu_dma.rx);
+    ltq_dma_open(&deu_dma.tx);
+    ltq_dma_disable_irq(&deu_dma.tx);
+    deu_dma.ready = 1;
+    return 0;
+}
+
+/*! \fn void __exit ifxdeu_fini_dma(void)
+ *  \ingroup IFX_DMA_FUNCTIONS
+ *  \brief release the DEU DMA channels
+*/
+void __exit ifxdeu_fini_dma(void)
+{
+    if (!deu_dma.ready)
+        return;
+
+    deu_dma.ready = 0;
+    ltq_dma_close(&deu_dma.tx);
+    ltq_dma_close(&deu_dma.rx);
+    free_irq(deu_dma.rx.irq, &deu_dma);
+    del_timer_sync(&deu_dma.timer);
+    ltq_dma_free(&deu_dma.tx);
+    ltq_dma_free(&deu_dma.rx);
+}
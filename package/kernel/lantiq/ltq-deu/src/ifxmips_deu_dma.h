@@ -43,6 +43,11 @@
 // must match the size of memory block allocated for g_dma_block and g_dma_block2
 #define DEU_MAX_PACKET_SIZE    (PAGE_SIZE >> 1)
 
+/* DMA channels of the DEU port and the largest single transfer */
+#define DEU_DMA_RX_CHAN        10
+#define DEU_DMA_TX_CHAN        11
+#define DEU_DMA_MAX_LEN        PAGE_SIZE
+
 typedef struct ifx_deu_device {
 	struct dma_device_info *dma_device;
 	u8 *dst;
@@ -66,4 +71,9 @@ extern void deu_dma_activate_poll (struct dma_device_info* dma_dev);
 extern struct dma_device_info* deu_dma_reserve(struct dma_device_info** dma_device);
 extern int deu_dma_release(struct dma_device_info** dma_device);
 
+extern int deu_dma_available(void);
+extern int deu_dma_start(dma_addr_t src, dma_addr_t dst, int len,
+        void (*done)(void *priv, int err), void *priv);
+extern void deu_dma_poll(void);
+
 #endif	/* IFMIPS_DEU_DMA_H */
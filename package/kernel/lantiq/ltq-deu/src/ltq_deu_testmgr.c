@@ -1516,7 +1516,14 @@ static int test_skcipher_speed(struct crypto_ablkcipher *tfm, int enc,
                 printk("test %u (%d bit key, %d byte blocks): ", i,
                         *keysize * 8, *block_size);                
 
-                memset(tvmem_buf[0], 0xff, PAGE_SIZE);
+                sg_init_table(sg, 4); 
+
+                for (j = 0; j < 4; j++) {
+		    tvmem_buf[j] = xbuf[j];
+		    memset(tvmem_buf[j], 0xff, PAGE_SIZE);
+                    sg_set_buf(sg + j, tvmem_buf[j], PAGE_SIZE);
+                }
+
                 key = tvmem_buf[0];
 
                 for (j = 0; j < tcount; j++) {
@@ -1531,14 +1538,6 @@ static int test_skcipher_speed(struct crypto_ablkcipher *tfm, int enc,
                     goto out;
                 }
 
-                sg_init_table(sg, 4); 
-
-                for (j = 0; j < 4; j++) {
-		    tvmem_buf[j] = xbuf[j];
-		    memset(tvmem_buf[j], 0xff, PAGE_SIZE);
-                    sg_set_buf(sg + j, tvmem_buf[j], PAGE_SIZE);
-                }
-
 		iv_len = crypto_ablkcipher_ivsize(tfm);
                 if (iv_len) {
                     memset(&iv, 0xff, iv_len);
@@ -3659,6 +3658,32 @@ static int do_test(int m)
 				  speed_template_16_32);
 		break;
 
+#if defined(CONFIG_CRYPTO_DEV_AES) && defined(CONFIG_CRYPTO_DEV_DMA)
+	case 210:
+	{
+		/* PIO against DMA, both through the async DMA driver */
+		int old = ifxdeu_aes_set_dma(1);
+
+		if (old < 0) {
+			printk("AES DMA not available\n");
+			break;
+		}
+
+		ifxdeu_aes_set_dma(0);
+		printk("\n ******* AES PIO ******* \n");
+		ifx_alg_speed_test("ifxdeu-dma-cbc(aes)", "cbc(aes)", sec,
+				NULL, 0, speed_template_16_24_32);
+
+		ifxdeu_aes_set_dma(1);
+		printk("\n ******* AES DMA ******* \n");
+		ifx_alg_speed_test("ifxdeu-dma-cbc(aes)", "cbc(aes)", sec,
+				NULL, 0, speed_template_16_24_32);
+
+		ifxdeu_aes_set_dma(old);
+		break;
+	}
+#endif
+
 	case 300:
 		/* fall through */
 
@@ -3872,6 +3897,12 @@ aes_err:
      err = do_test(mode);
      if (err) 
          goto speed_err;
+#if   defined(CONFIG_CRYPTO_DEV_DMA)
+     mode = 210;
+     err = do_test(mode);
+     if (err) 
+         goto speed_err;
+#endif
 #endif
 #if   defined (CONFIG_CRYPTO_DEV_DES)
       mode = 201;
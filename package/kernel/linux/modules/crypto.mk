@@ -585,6 +585,27 @@ endef
 $(eval $(call KernelPackage,crypto-ocf-hifnhipp))
 
 
+define KernelPackage/crypto-ocf-test
+  TITLE:=OCF driver tests and fake crypto engine
+  DEPENDS:=@!TARGET_uml kmod-crypto-ocf
+  KCONFIG:= \
+	CONFIG_OCF_OCFNULL \
+	CONFIG_OCF_TEST
+  FILES:= \
+	$(LINUX_DIR)/crypto/ocf/ocfnull/ocfnull.ko \
+	$(LINUX_DIR)/crypto/ocf/ocf-test.ko
+  $(call AddDepends/crypto)
+endef
+
+define KernelPackage/crypto-ocf-test/description
+ Known answer and cryptosoft comparison tests for OCF drivers (ocf-test)
+ and a fake engine with a configurable queue and latency (ocfnull).
+ Neither is loaded automatically.
+endef
+
+$(eval $(call KernelPackage,crypto-ocf-test))
+
+
 define KernelPackage/crypto-null
   TITLE:=Null CryptoAPI module
   KCONFIG:=CONFIG_CRYPTO_NULL
@@ -216,6 +216,36 @@ struct crypt_op {
 	caddr_t		iv;
 };
 
+/*
+ * Batched operations.  CIOCCRYPTMULTI submits up to CRYPTO_MAX_MULTI
+ * crypt_ops in one call and reports a crypt_res for each.  Normally it
+ * returns when they have all completed;  with CRM_F_ASYNC it returns as
+ * soon as they are queued (a non-zero cr_error means that op was not)
+ * and the results are collected later with CIOCCRYPTPOLL,  which also
+ * copies out dst and mac.  The descriptor polls readable while results
+ * are waiting.
+ */
+#define CRYPTO_MAX_MULTI	32
+
+struct crypt_res {
+	caddr_t		cr_op;		/* user address of the crypt_op */
+	int		cr_error;	/* 0 or an errno */
+};
+
+struct crypt_mop {
+	u_int		crm_count;	/* # of ops (in), # queued/done (out) */
+	u_int		crm_flags;
+#define	CRM_F_ASYNC	0x0001		/* don't wait, see CIOCCRYPTPOLL */
+	struct crypt_op	*crm_ops;	/* crm_count ops */
+	struct crypt_res *crm_res;	/* crm_count results */
+};
+
+struct crypt_poll {
+	u_int		crpl_count;	/* room in crpl_res (in), # found (out) */
+	int		crpl_timeout;	/* ms to wait for one, -1 for ever */
+	struct crypt_res *crpl_res;
+};
+
 /*
  * Parameters for looking up a crypto driver/device by
  * device name or by id.  The latter are returned for
@@ -273,6 +303,8 @@ struct crypt_kop {
 #define CIOCGSESSION2	_IOWR('c', 106, struct session2_op)
 #define CIOCKEY2	_IOWR('c', 107, struct crypt_kop)
 #define CIOCFINDDEV	_IOWR('c', 108, struct crypt_find_op)
+#define CIOCCRYPTMULTI	_IOWR('c', 109, struct crypt_mop)
+#define CIOCCRYPTPOLL	_IOWR('c', 110, struct crypt_poll)
 
 struct cryptotstat {
 	struct timespec	acc;		/* total accumulated time */
@@ -302,6 +334,10 @@ struct cryptostats {
 	struct cryptotstat cs_finis;	/* callback -> callback return */
 
 	u_int32_t	cs_drops;		/* crypto ops dropped due to congestion */
+
+	u_int32_t	cs_pool_hits;	/* requests taken from the request pool */
+	u_int32_t	cs_pool_misses;	/* requests that fell back to the slab */
+	u_int32_t	cs_pool_fails;	/* requests that could not be allocated */
 };
 
 #ifdef __KERNEL__
@@ -376,6 +412,9 @@ struct cryptop {
 	struct cryptodesc *crp_desc;	/* Linked list of processing descriptors */
 
 	int (*crp_callback)(struct cryptop *); /* Callback function */
+
+	u_int64_t	crp_vsid;	/* Virtual session it was routed from */
+	u_int64_t	crp_tstart;	/* When the driver got it, in ns */
 };
 
 #define CRYPTO_BUF_CONTIG	0x0
@@ -426,6 +465,7 @@ extern	int crypto_freesession(u_int64_t sid);
 #define CRYPTOCAP_F_HARDWARE	CRYPTO_FLAG_HARDWARE
 #define CRYPTOCAP_F_SOFTWARE	CRYPTO_FLAG_SOFTWARE
 #define CRYPTOCAP_F_SYNC	0x04000000	/* operates synchronously */
+#define CRYPTOCAP_F_IOVEC	0x08000000	/* takes multi-segment CRYPTO_F_IOV */
 extern	int32_t crypto_get_driverid(device_t dev, int flags);
 extern	int crypto_find_driver(const char *);
 extern	device_t crypto_find_device_byhid(int hid);
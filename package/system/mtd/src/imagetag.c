@@ -184,7 +184,7 @@ trx_fixup(int fd, const char *name)
 	cfelen = imagelen = imagestart = imagecrc = rootfscrc = headercrc = rootfslen = 0;
 
 
-	if (ioctl(fd, MEMGETINFO, &mtdInfo) < 0) {
+	if (mtd_get_info(fd, &mtdInfo) < 0) {
 		fprintf(stderr, "Failed to get mtd info\n");
 		goto err;
 	}
@@ -327,6 +327,7 @@ mtd_fixtrx(const char *mtd, size_t offset)
 		perror("pread");
 		exit(1);
 	}
+	bench_bytes += res;
 
 	tag = (struct bcm_tag *) (buf + offset);
 
@@ -396,6 +397,8 @@ mtd_fixtrx(const char *mtd, size_t offset)
 		fprintf(stderr, "Error writing block (%s)\n", strerror(errno));
 		exit(1);
 	}
+	mtd_write_delay(erasesize);
+	bench_bytes += erasesize;
 
 	if (quiet < 2)
 		fprintf(stderr, "Done.\n");
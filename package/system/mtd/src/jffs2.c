@@ -32,6 +32,9 @@
 
 #define PAD(x) (((x)+3)&~3)
 
+/* data nodes never cross a page boundary of the file */
+#define JFFS2_PAGE_SIZE	4096
+
 #if BYTE_ORDER == BIG_ENDIAN
 # define CLEANMARKER "\x19\x85\x20\x03\x00\x00\x00\x0c\xf0\x60\xdc\x98"
 #else
@@ -45,6 +48,7 @@ static int ofs = 0;
 static int outfd = -1;
 static int mtdofs = 0;
 static int target_ino = 0;
+static int target_version = 0;
 
 static void prep_eraseblock(void);
 
@@ -70,6 +74,7 @@ static void pad(int size)
 		}
 		mtd_erase_block(outfd, mtdofs);
 		write(outfd, buf, erasesize);
+		mtd_write_delay(erasesize);
 		mtdofs += erasesize;
 	}
 }
@@ -101,7 +106,7 @@ static int add_dirent(const char *name, const char type, int parent)
 {
 	struct jffs2_raw_dirent *de;
 
-	if (ofs - erasesize < sizeof(struct jffs2_raw_dirent) + strlen(name))
+	if (rbytes() < sizeof(struct jffs2_raw_dirent) + strlen(name))
 		pad(erasesize);
 
 	prep_eraseblock();
@@ -160,12 +165,85 @@ static int add_dir(const char *name, int parent)
 	return inode;
 }
 
+/*
+ * Same algorithm as fs/jffs2/compr_rtime.c. zlib and lzo are not enabled
+ * in our kernels, rtime always is.
+ */
+static int rtime_compress(const unsigned char *data_in, unsigned char *cpage_out,
+			  uint32_t *sourcelen, uint32_t *dstlen)
+{
+	unsigned short positions[256];
+	uint32_t outpos = 0;
+	uint32_t pos = 0;
+
+	if (*dstlen <= 3)
+		return -1;
+
+	memset(positions, 0, sizeof(positions));
+
+	while (pos < *sourcelen && outpos <= *dstlen - 2) {
+		int backpos, runlen = 0;
+		unsigned char value;
+
+		value = data_in[pos];
+
+		cpage_out[outpos++] = data_in[pos++];
+
+		backpos = positions[value];
+		positions[value] = pos;
+
+		while ((backpos < pos) && (pos < *sourcelen) &&
+		       (data_in[pos] == data_in[backpos++]) && (runlen < 255)) {
+			pos++;
+			runlen++;
+		}
+		cpage_out[outpos++] = runlen;
+	}
+
+	if (outpos >= pos)
+		return -1;
+
+	*sourcelen = pos;
+	*dstlen = outpos;
+	return 0;
+}
+
+/* pick the node compression for len bytes, returns the data to write */
+static const char *compress_data(const char *data, char *cbuf, int len,
+				 uint8_t *compr, uint32_t *csize)
+{
+	uint32_t slen = len, dlen = len;
+	int i;
+
+	for (i = 0; i < len; i++)
+		if (data[i])
+			break;
+
+	if (i == len) {
+		*compr = JFFS2_COMPR_ZERO;
+		*csize = 0;
+		return data;
+	}
+
+	if (!rtime_compress((const unsigned char *) data, (unsigned char *) cbuf,
+			    &slen, &dlen) && slen == len) {
+		*compr = JFFS2_COMPR_RTIME;
+		*csize = dlen;
+		return cbuf;
+	}
+
+	*compr = JFFS2_COMPR_NONE;
+	*csize = len;
+	return data;
+}
+
 static void add_file(const char *name, int parent)
 {
 	int inode, f_offset = 0, fd;
 	struct jffs2_raw_inode ri;
 	struct stat st;
-	char wbuf[4096];
+	char wbuf[JFFS2_PAGE_SIZE];
+	char cbuf[JFFS2_PAGE_SIZE];
 	const char *fname;
 
 	if (stat(name, &st)) {
@@ -201,34 +279,43 @@ static void add_file(const char *name, int parent)
 	}
 
 	for (;;) {
+		const char *data;
+		uint32_t csize;
 		int len = 0;
 
 		for (;;) {
 			len = rbytes() - sizeof(ri);
-			if (len > 128)
+			if (len > JFFS2_MIN_DATA_LEN)
 				break;
 
 			pad(erasesize);
 			prep_eraseblock();
 		}
 
-		if (len > sizeof(wbuf))
-			len = sizeof(wbuf);
+		/*
+		 * limit the node to what fits uncompressed, so that the
+		 * data stream stays dense across eraseblocks
+		 */
+		if (len > JFFS2_PAGE_SIZE - (f_offset % JFFS2_PAGE_SIZE))
+			len = JFFS2_PAGE_SIZE - (f_offset % JFFS2_PAGE_SIZE);
 
 		len = read(fd, wbuf, len);
 		if (len <= 0)
 			break;
 
-		ri.totlen = sizeof(ri) + len;
+		data = compress_data(wbuf, cbuf, len, &ri.compr, &csize);
+
+		ri.totlen = sizeof(ri) + csize;
 		ri.hdr_crc = crc32(0, &ri, sizeof(struct jffs2_unknown_node) - 4);
 		ri.version = ++last_version;
 		ri.offset = f_offset;
-		ri.csize = ri.dsize = len;
+		ri.csize = csize;
+		ri.dsize = len;
 		ri.node_crc = crc32(0, &ri, sizeof(ri) - 8);
-		ri.data_crc = crc32(0, wbuf, len);
+		ri.data_crc = crc32(0, data, csize);
 		f_offset += len;
 		add_data((char *) &ri, sizeof(ri));
-		add_data(wbuf, len);
+		add_data((char *) data, csize);
 		pad(4);
 		prep_eraseblock();
 	}
@@ -261,9 +348,17 @@ void mtd_parse_jffs2data(const char *buf, const char *dir)
 	struct jffs2_unknown_node *node = (struct jffs2_unknown_node *) buf;
 	unsigned int ofs = 0;
 
-	while (ofs < erasesize) {
+	while (ofs + sizeof(*node) <= erasesize) {
 		node = (struct jffs2_unknown_node *) (buf + ofs);
-		if (node->magic != 0x1985)
+
+		/* skip erased space left behind by the kernel's write buffer */
+		if (node->magic == JFFS2_EMPTY_BITMASK &&
+		    node->nodetype == JFFS2_EMPTY_BITMASK) {
+			ofs += 4;
+			continue;
+		}
+
+		if (node->magic != 0x1985 || node->totlen < sizeof(*node))
 			break;
 
 		ofs += PAD(node->totlen);
@@ -271,14 +366,25 @@ void mtd_parse_jffs2data(const char *buf, const char *dir)
 			struct jffs2_raw_dirent *de = (struct jffs2_raw_dirent *) node;
 
 			/* is this the right directory name and is it a subdirectory of / */
-			if (*dir && (de->pino == 1) && !strncmp((char *) de->name, dir, de->nsize))
+			if (*dir && (de->pino == 1) && (de->nsize == strlen(dir)) &&
+			    !strncmp((char *) de->name, dir, de->nsize) &&
+			    (de->version >= target_version)) {
 				target_ino = de->ino;
+				target_version = de->version;
+			}
 
 			/* store the last inode and version numbers for adding extra files */
 			if (last_ino < de->ino)
 				last_ino = de->ino;
 			if (last_version < de->version)
 				last_version = de->version;
+		} else if (node->nodetype == JFFS2_NODETYPE_INODE) {
+			struct jffs2_raw_inode *ri = (struct jffs2_raw_inode *) node;
+
+			if (last_ino < ri->ino)
+				last_ino = ri->ino;
+			if (last_version < ri->version)
+				last_version = ri->version;
 		}
 	}
 }
@@ -308,6 +414,15 @@ int mtd_write_jffs2(const char *mtd, const char *filename, const char *dir)
 	for(;;) {
 		struct jffs2_unknown_node *node = (struct jffs2_unknown_node *) buf;
 
+		if ((mtdofs < mtdsize) && mtd_block_is_bad(outfd, mtdofs)) {
+			if (!quiet)
+				fprintf(stderr, "Skipping bad block at 0x%08x\n", mtdofs);
+
+			mtdofs += erasesize;
+			lseek(outfd, erasesize, SEEK_CUR);
+			continue;
+		}
+
 		if (read(outfd, buf, erasesize) != erasesize) {
 			fdeof = 1;
 			break;
@@ -0,0 +1,103 @@
+#!/bin/sh
+#
+# mtd-bench.sh - write/verify/fixtrx throughput of mtd on emulated flash
+#
+# Runs the mtd tool against a plain image file for each flash layout
+# below (see mtd -E) and prints one line per layout and command with
+# the average of the -t figures over all rounds. Meant for a build
+# host, to catch performance regressions in the flash tooling.
+#
+# usage: mtd-bench.sh [-m <mtd binary>] [-s <image KiB>] [-r <rounds>] [<layout>...]
+#
+
+MTD=./mtd
+SIZE=1024
+ROUNDS=3
+
+while getopts "m:s:r:" opt; do
+	case "$opt" in
+		m) MTD="$OPTARG";;
+		s) SIZE="$OPTARG";;
+		r) ROUNDS="$OPTARG";;
+		*) sed -n 's/^# usage: /usage: /p' "$0" >&2; exit 1;;
+	esac
+done
+shift $((OPTIND - 1))
+
+LAYOUTS="$*"
+[ -n "$LAYOUTS" ] || LAYOUTS="
+	nor,erasesize=65536
+	nor,erasesize=65536,erase_us=1000,write_us=50
+	nand,erasesize=131072
+	nand,erasesize=131072,bad=131072
+	nand,erasesize=131072,erase_us=2000,write_us=100
+"
+
+[ -x "$MTD" ] || {
+	echo "$MTD: mtd binary not found, use -m" >&2
+	exit 1
+}
+
+WORK="$(mktemp -d)" || exit 1
+trap 'rm -rf "$WORK"' EXIT INT TERM
+
+# a trx image whose header still needs fixing
+IMAGE="$WORK/image.trx"
+DEVICE="$WORK/flash.img"
+{ printf 'HDR0'; head -c $((SIZE * 1024 - 4)) /dev/urandom; } > "$IMAGE"
+
+HAVE_FIXTRX=0
+"$MTD" 2>&1 | grep -q fixtrx && HAVE_FIXTRX=1
+
+# run <layout> <command> [<args>...]: print "<bytes> <seconds>" from -t
+run() {
+	local layout="$1"; shift
+
+	"$MTD" -q -q -f -t -E "$layout" "$@" 2>&1 | \
+		sed -n 's/^[a-z]*: \([0-9]*\) bytes in \([0-9.]*\) s.*/\1 \2/p'
+}
+
+bench() {
+	local layout="$1" cmd="$2"
+	local i=0 result
+
+	while [ $i -lt "$ROUNDS" ]; do
+		# flash twice the image size, so bad blocks still leave room
+		dd if=/dev/zero of="$DEVICE" bs=1k count=$((SIZE * 2)) 2>/dev/null
+		case "$cmd" in
+			write)
+				result="$result
+$(run "$layout" write "$IMAGE" "$DEVICE")"
+			;;
+			verify)
+				run "$layout" write "$IMAGE" "$DEVICE" >/dev/null
+				result="$result
+$(run "$layout" verify "$IMAGE" "$DEVICE")"
+			;;
+			fixtrx)
+				run "$layout" write "$IMAGE" "$DEVICE" >/dev/null
+				result="$result
+$(run "$layout" fixtrx "$DEVICE")"
+			;;
+		esac
+		i=$((i + 1))
+	done
+
+	echo "$result" | awk -v layout="$layout" -v cmd="$cmd" '
+		NF == 2 { bytes += $1; secs += $2; n++ }
+		END {
+			if (!n) { printf "%-48s %-7s failed\n", layout, cmd; exit }
+			printf "%-48s %-7s %10d bytes %8.3f s %10.1f KiB/s\n", layout, cmd,
+				bytes / n, secs / n, (secs > 0 ? bytes / secs / 1024 : 0)
+		}'
+}
+
+for layout in $LAYOUTS; do
+	bench "$layout" write
+	case "$layout" in
+		# verify reads the flash linearly and cannot skip bad blocks
+		*bad=*) ;;
+		*) bench "$layout" verify;;
+	esac
+	[ "$HAVE_FIXTRX" = 1 ] && bench "$layout" fixtrx
+done
@@ -61,6 +61,24 @@ int erasesize = 0;
 int jffs2_skip_bytes=0;
 int mtdtype = 0;
 
+#define MAX_BAD_BLOCKS	32
+
+/* flash emulation for image files, see -E */
+static struct {
+	int type;
+	int erasesize;
+	int bad[MAX_BAD_BLOCKS];
+	int n_bad;
+	int erase_us;
+	int write_us;
+} emul = {
+	.type = MTD_NORFLASH,
+	.erasesize = 64 * 1024,
+};
+static int mtdfile = 0;
+static int benchmark = 0;
+uint64_t bench_bytes = 0;
+
 int mtd_open(const char *mtd, bool block)
 {
 	FILE *fp;
@@ -89,6 +107,71 @@ int mtd_open(const char *mtd, bool block)
 	return open(mtd, flags);
 }
 
+static int emul_parse(char *spec)
+{
+	char *word, *brkt, *val;
+
+	for (word = strtok_r(spec, ",", &brkt);
+	     word;
+	     word = strtok_r(NULL, ",", &brkt)) {
+		val = strchr(word, '=');
+		if (val)
+			*val++ = 0;
+
+		if (!strcmp(word, "nor")) {
+			emul.type = MTD_NORFLASH;
+		} else if (!strcmp(word, "nand")) {
+			emul.type = MTD_NANDFLASH;
+		} else if (!val) {
+			return -1;
+		} else if (!strcmp(word, "erasesize")) {
+			emul.erasesize = strtoul(val, NULL, 0);
+		} else if (!strcmp(word, "bad")) {
+			if (emul.n_bad >= MAX_BAD_BLOCKS)
+				return -1;
+			emul.bad[emul.n_bad++] = strtoul(val, NULL, 0);
+		} else if (!strcmp(word, "erase_us")) {
+			emul.erase_us = strtoul(val, NULL, 0);
+		} else if (!strcmp(word, "write_us")) {
+			emul.write_us = strtoul(val, NULL, 0);
+		} else {
+			return -1;
+		}
+	}
+
+	if (emul.erasesize <= 0 || (emul.erasesize & (emul.erasesize - 1)))
+		return -1;
+
+	return 0;
+}
+
+int mtd_get_info(int fd, struct mtd_info_user *mtdInfo)
+{
+	struct stat st;
+
+	if (fstat(fd, &st) || !S_ISREG(st.st_mode)) {
+		mtdfile = 0;
+		return ioctl(fd, MEMGETINFO, mtdInfo);
+	}
+
+	/* a plain image file, emulate the flash described by -E */
+	mtdfile = 1;
+	memset(mtdInfo, 0, sizeof(*mtdInfo));
+	mtdInfo->type = emul.type;
+	mtdInfo->flags = MTD_WRITEABLE;
+	mtdInfo->erasesize = emul.erasesize;
+	mtdInfo->size = st.st_size & ~(emul.erasesize - 1);
+	mtdInfo->writesize = (emul.type == MTD_NANDFLASH) ? 2048 : 1;
+
+	return 0;
+}
+
+void mtd_write_delay(int len)
+{
+	if (mtdfile && emul.write_us)
+		usleep((uint64_t) emul.write_us * len / 1024);
+}
+
 int mtd_check_open(const char *mtd)
 {
 	struct mtd_info_user mtdInfo;
@@ -100,7 +183,7 @@ int mtd_check_open(const char *mtd)
 		return -1;
 	}
 
-	if(ioctl(fd, MEMGETINFO, &mtdInfo)) {
+	if(mtd_get_info(fd, &mtdInfo)) {
 		fprintf(stderr, "Could not get MTD device info from %s\n", mtd);
 		close(fd);
 		return -1;
@@ -117,6 +200,19 @@ int mtd_block_is_bad(int fd, int offset)
 	int r = 0;
 	loff_t o = offset;
 
+	if (mtdfile) {
+		int i;
+
+		if (mtdtype != MTD_NANDFLASH)
+			return 0;
+
+		for (i = 0; i < emul.n_bad; i++)
+			if ((emul.bad[i] & ~(erasesize - 1)) == offset)
+				return 1;
+
+		return 0;
+	}
+
 	if (mtdtype == MTD_NANDFLASH)
 	{
 		r = ioctl(fd, MEMGETBADBLOCK, &o);
@@ -129,10 +225,38 @@ int mtd_block_is_bad(int fd, int offset)
 	return r;
 }
 
+static int emul_erase_block(int fd, int offset)
+{
+	char *buf;
+	int ret = 0;
+	int i;
+
+	for (i = 0; i < emul.n_bad; i++)
+		if ((emul.bad[i] & ~(erasesize - 1)) == offset)
+			return -1;
+
+	buf = malloc(erasesize);
+	if (!buf)
+		return -1;
+
+	memset(buf, 0xff, erasesize);
+	if (pwrite(fd, buf, erasesize, offset) != erasesize)
+		ret = -1;
+	free(buf);
+
+	if (emul.erase_us)
+		usleep(emul.erase_us);
+
+	return ret;
+}
+
 int mtd_erase_block(int fd, int offset)
 {
 	struct erase_info_user mtdEraseInfo;
 
+	if (mtdfile)
+		return emul_erase_block(fd, offset);
+
 	mtdEraseInfo.start = offset;
 	mtdEraseInfo.length = erasesize;
 	ioctl(fd, MEMUNLOCK, &mtdEraseInfo);
@@ -146,6 +270,7 @@ int mtd_write_buffer(int fd, const char *buf, int offset, int length)
 {
 	lseek(fd, offset, SEEK_SET);
 	write(fd, buf, length);
+	mtd_write_delay(length);
 	return 0;
 }
 
@@ -227,7 +352,8 @@ mtd_unlock(const char *mtd)
 
 		mtdLockInfo.start = 0;
 		mtdLockInfo.length = mtdsize;
-		ioctl(fd, MEMUNLOCK, &mtdLockInfo);
+		if (!mtdfile)
+			ioctl(fd, MEMUNLOCK, &mtdLockInfo);
 		close(fd);
 		mtd = next;
 	} while (next);
@@ -262,8 +388,7 @@ mtd_erase(const char *mtd)
 			if (!quiet)
 				fprintf(stderr, "\nSkipping bad block at 0x%x   ", mtdEraseInfo.start);
 		} else {
-			ioctl(fd, MEMUNLOCK, &mtdEraseInfo);
-			if(ioctl(fd, MEMERASE, &mtdEraseInfo))
+			if (mtd_erase_block(fd, mtdEraseInfo.start))
 				fprintf(stderr, "Failed to erase block on %s at 0x%x\n", mtd, mtdEraseInfo.start);
 		}
 	}
@@ -364,6 +489,7 @@ mtd_verify(const char *mtd, char *file)
 			break;
 		md5_hash(buf, rlen, &ctx);
 		s.st_size -= rlen;
+		bench_bytes += rlen;
 	} while (s.st_size > 0);
 
 	md5_end(m_md5, &ctx);
@@ -602,7 +728,9 @@ resume:
 				exit(1);
 			}
 		}
+		mtd_write_delay(buflen);
 		w += buflen;
+		bench_bytes += buflen;
 
 		buflen = 0;
 		offset = 0;
@@ -660,7 +788,12 @@ static void usage(void)
 	"        -j <name>               integrate <file> into jffs2 data when writing an image\n"
 	"        -s <number>             skip the first n bytes when appending data to the jffs2 partiton, defaults to \"0\"\n"
 	"        -p                      write beginning at partition offset\n"
-	"        -l <length>             the length of data that we want to dump\n");
+	"        -l <length>             the length of data that we want to dump\n"
+	"        -t                      print the time taken and the throughput of the command\n"
+	"        -E <option>[,<option>...]\n"
+	"                                flash to emulate when <device> is a plain image file:\n"
+	"                                nor|nand, erasesize=<bytes>, bad=<offset> (nand only, repeatable),\n"
+	"                                erase_us=<usec per block>, write_us=<usec per KiB>\n");
 	if (mtd_fixtrx) {
 	    fprintf(stderr,
 	"        -o offset               offset of the image header in the partition(for fixtrx)\n");
@@ -694,6 +827,7 @@ static void do_reboot(void)
 int main (int argc, char **argv)
 {
 	int ch, i, boot, imagefd = 0, force, unlocked;
+	struct timespec start, end;
 	char *erase[MAX_ARGS], *device = NULL;
 	char *fis_layout = NULL;
 	size_t offset = 0, part_offset = 0, dump_len = 0;
@@ -719,7 +853,7 @@ int main (int argc, char **argv)
 #ifdef FIS_SUPPORT
 			"F:"
 #endif
-			"frnqe:d:s:j:p:o:l:")) != -1)
+			"frnqte:d:s:j:p:o:l:E:")) != -1)
 		switch (ch) {
 			case 'f':
 				force = 1;
@@ -744,6 +878,15 @@ int main (int argc, char **argv)
 			case 'q':
 				quiet++;
 				break;
+			case 't':
+				benchmark = 1;
+				break;
+			case 'E':
+				if (emul_parse(optarg)) {
+					fprintf(stderr, "-E: illegal flash emulation option\n");
+					usage();
+				}
+				break;
 			case 'e':
 				i = 0;
 				while ((erase[i] != NULL) && ((i + 1) < MAX_ARGS))
@@ -862,6 +1005,8 @@ int main (int argc, char **argv)
 		i++;
 	}
 
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
 	switch (cmd) {
 		case CMD_UNLOCK:
 			if (!unlocked)
@@ -900,6 +1045,20 @@ int main (int argc, char **argv)
 
 	sync();
 
+	if (benchmark) {
+		double elapsed;
+
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		elapsed = (end.tv_sec - start.tv_sec) +
+			  (end.tv_nsec - start.tv_nsec) / 1e9;
+
+		fprintf(stderr, "%s: %llu bytes in %.3f s", argv[0],
+			(unsigned long long) bench_bytes, elapsed);
+		if (bench_bytes && elapsed > 0)
+			fprintf(stderr, " (%.1f KiB/s)", bench_bytes / elapsed / 1024);
+		fprintf(stderr, "\n");
+	}
+
 	if (boot)
 		do_reboot();
 
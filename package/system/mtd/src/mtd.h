@@ -2,6 +2,7 @@
 #define __mtd_h
 
 #include <stdbool.h>
+#include <stdint.h>
 
 #ifdef target_brcm47xx
 #define target_brcm 1
@@ -12,8 +13,13 @@
 extern int quiet;
 extern int mtdsize;
 extern int erasesize;
+extern uint64_t bench_bytes;
+
+struct mtd_info_user;
 
 extern int mtd_open(const char *mtd, bool block);
+extern int mtd_get_info(int fd, struct mtd_info_user *mtdInfo);
+extern void mtd_write_delay(int len);
 extern int mtd_check_open(const char *mtd);
 extern int mtd_block_is_bad(int fd, int offset);
 extern int mtd_erase_block(int fd, int offset);
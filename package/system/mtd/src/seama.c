@@ -149,6 +149,7 @@ mtd_fixseama(const char *mtd, size_t offset)
 		perror("pread");
 		exit(1);
 	}
+	bench_bytes += res;
 
 	if (seama_fix_md5(buf, mtdsize))
 		goto out;
@@ -166,6 +167,8 @@ mtd_fixseama(const char *mtd, size_t offset)
 		fprintf(stderr, "Error writing block (%s)\n", strerror(errno));
 		exit(1);
 	}
+	mtd_write_delay(erasesize);
+	bench_bytes += erasesize;
 
 	if (quiet < 2)
 		fprintf(stderr, "Done.\n");
@@ -63,7 +63,7 @@ trx_fixup(int fd, const char *name)
 	void *ptr, *scan;
 	int bfd;
 
-	if (ioctl(fd, MEMGETINFO, &mtdInfo) < 0) {
+	if (mtd_get_info(fd, &mtdInfo) < 0) {
 		fprintf(stderr, "Failed to get mtd info\n");
 		goto err;
 	}
@@ -181,6 +181,7 @@ mtd_fixtrx(const char *mtd, size_t offset)
 		perror("pread");
 		exit(1);
 	}
+	bench_bytes += res;
 
 	trx = (struct trx_header *) (buf + offset);
 	if (trx->magic != STORE32_LE(0x30524448)) {
@@ -210,6 +211,8 @@ mtd_fixtrx(const char *mtd, size_t offset)
 		fprintf(stderr, "Error writing block (%s)\n", strerror(errno));
 		exit(1);
 	}
+	mtd_write_delay(erasesize);
+	bench_bytes += erasesize;
 
 	if (quiet < 2)
 		fprintf(stderr, "Done.\n");
@@ -1675,27 +1675,36 @@ int mpi_is_prime( mpi *X, int (*f_rng)(void *), void *p_rng )
      * test trivial factors first
      */
     if( ( X->p[0] & 1 ) == 0 )
-        return( POLARSSL_ERR_MPI_NOT_ACCEPTABLE );
+    {
+        ret = POLARSSL_ERR_MPI_NOT_ACCEPTABLE;
+        goto cleanup;
+    }
 
     for( i = 0; small_prime[i] > 0; i++ )
     {
         t_int r;
 
         if( mpi_cmp_int( X, small_prime[i] ) <= 0 )
-            return( 0 );
+        {
+            ret = 0;
+            goto cleanup;
+        }
 
         MPI_CHK( mpi_mod_int( &r, X, small_prime[i] ) );
 
         if( r == 0 )
-            return( POLARSSL_ERR_MPI_NOT_ACCEPTABLE );
+        {
+            ret = POLARSSL_ERR_MPI_NOT_ACCEPTABLE;
+            goto cleanup;
+        }
     }
 
     /*
      * W = |X| - 1
      * R = W >> lsb( W )
      */
-    s = mpi_lsb( &W );
     MPI_CHK( mpi_sub_int( &W, X, 1 ) );
+    s = mpi_lsb( &W );
     MPI_CHK( mpi_copy( &R, &W ) );
     MPI_CHK( mpi_shift_r( &R, s ) );
 
@@ -1767,19 +1776,75 @@ cleanup:
 }
 
 /*
- * Prime number generation
+ * Odd primes below 2^16 for sieving candidates, built on first use
  */
-int mpi_gen_prime( mpi *X, int nbits, int dh_flag,
-                   int (*f_rng)(void *), void *p_rng )
+#define SIEVE_BOUND     65536
+#define SIEVE_PRIMES    6541
+#define SIEVE_SIZE      2048    /* odd candidates per sieve window */
+
+static unsigned short sieve_prime[SIEVE_PRIMES];
+static int sieve_primes = 0;
+
+static void mpi_sieve_init( void )
+{
+    int i, n;
+
+    if( sieve_primes != 0 )
+        return;
+
+    for( n = 3; n < SIEVE_BOUND && sieve_primes < SIEVE_PRIMES; n += 2 )
+    {
+        for( i = 0; i < sieve_primes; i++ )
+        {
+            if( sieve_prime[i] * sieve_prime[i] > n )
+                break;
+            if( n % sieve_prime[i] == 0 )
+                break;
+        }
+
+        if( i == sieve_primes || sieve_prime[i] * sieve_prime[i] > n )
+            sieve_prime[sieve_primes++] = (unsigned short) n;
+    }
+}
+
+/*
+ * Mark the k in [0, SIEVE_SIZE) with X + 2k = t (mod p), X = r (mod p)
+ */
+static void mpi_sieve_mark( unsigned char *sieve, t_int r, int p, int t )
 {
-    int ret, k, n;
+    int k;
+
+    /* 2k = t - r (mod p), halved with p odd */
+    k = (int) ( ( (t_int) t + p - r ) % p );
+    if( k & 1 )
+        k += p;
+    k >>= 1;
+
+    for( ; k < SIEVE_SIZE; k += p )
+        sieve[k] = 1;
+}
+
+/*
+ * Prime search shared by mpi_gen_prime and mpi_gen_rsa_prime
+ *
+ * Candidates are taken a window at a time; those with a factor below
+ * 2^16 (or, for DH, with one in (X - 1) / 2, or for RSA with e | X - 1)
+ * are struck out before any Miller-Rabin test is run.
+ */
+static int mpi_gen_prime_hlp( mpi *X, int nbits, int dh_flag, int e,
+                              int (*f_rng)(void *), void *p_rng )
+{
+    int ret, i, k, n;
     unsigned char *p;
-    mpi Y;
+    unsigned char sieve[SIEVE_SIZE];
+    t_int r;
+    mpi Y, T;
 
     if( nbits < 3 )
         return( POLARSSL_ERR_MPI_BAD_INPUT_DATA );
 
-    mpi_init( &Y, NULL );
+    mpi_sieve_init();
+    mpi_init( &Y, &T, NULL );
 
     n = BITS_TO_LIMBS( nbits );
 
@@ -1794,50 +1859,103 @@ int mpi_gen_prime( mpi *X, int nbits, int dh_flag,
     if( k < nbits ) MPI_CHK( mpi_shift_l( X, nbits - k ) );
     if( k > nbits ) MPI_CHK( mpi_shift_r( X, k - nbits ) );
 
+    /*
+     * with the two top bits set the product of two such
+     * primes is as long as their lengths added together
+     */
+    if( e != 0 )
+        X->p[(nbits - 2) / biL] |= (t_int) 1 << ( (nbits - 2) % biL );
+
     X->p[0] |= 3;
 
-    if( dh_flag == 0 )
+    while( 1 )
     {
-        while( ( ret = mpi_is_prime( X, f_rng, p_rng ) ) != 0 )
+        memset( sieve, 0, sizeof( sieve ) );
+
+        /*
+         * X >= 2^(nbits - 1), so below that no sieve prime can
+         * strike out a candidate that is itself prime
+         */
+        for( i = 0; i < sieve_primes; i++ )
         {
-            if( ret != POLARSSL_ERR_MPI_NOT_ACCEPTABLE )
-                goto cleanup;
+            if( nbits <= 17 && sieve_prime[i] >= ( 1 << ( nbits - 1 ) ) )
+                break;
+
+            MPI_CHK( mpi_mod_int( &r, X, sieve_prime[i] ) );
 
-            MPI_CHK( mpi_add_int( X, X, 2 ) );
+            mpi_sieve_mark( sieve, r, sieve_prime[i], 0 );
+            if( dh_flag != 0 )
+                mpi_sieve_mark( sieve, r, sieve_prime[i], 1 );
         }
-    }
-    else
-    {
-        MPI_CHK( mpi_sub_int( &Y, X, 1 ) );
-        MPI_CHK( mpi_shift_r( &Y, 1 ) );
 
-        while( 1 )
+        if( e > 2 )
+        {
+            MPI_CHK( mpi_mod_int( &r, X, e ) );
+            mpi_sieve_mark( sieve, r, e, 1 );
+        }
+
+        /*
+         * X = 3 (mod 4) keeps (X - 1) / 2 odd
+         */
+        if( dh_flag != 0 )
+            for( k = 1; k < SIEVE_SIZE; k += 2 )
+                sieve[k] = 1;
+
+        for( k = 0; k < SIEVE_SIZE; k++ )
         {
-            if( ( ret = mpi_is_prime( X, f_rng, p_rng ) ) == 0 )
+            if( sieve[k] )
+                continue;
+
+            MPI_CHK( mpi_add_int( &T, X, 2 * k ) );
+
+            if( ( ret = mpi_is_prime( &T, f_rng, p_rng ) ) == 0 && dh_flag != 0 )
             {
-                if( ( ret = mpi_is_prime( &Y, f_rng, p_rng ) ) == 0 )
-                    break;
+                MPI_CHK( mpi_copy( &Y, &T ) );
+                MPI_CHK( mpi_shift_r( &Y, 1 ) );
+                ret = mpi_is_prime( &Y, f_rng, p_rng );
+            }
 
-                if( ret != POLARSSL_ERR_MPI_NOT_ACCEPTABLE )
-                    goto cleanup;
+            if( ret == 0 )
+            {
+                MPI_CHK( mpi_copy( X, &T ) );
+                goto cleanup;
             }
 
             if( ret != POLARSSL_ERR_MPI_NOT_ACCEPTABLE )
                 goto cleanup;
-
-            MPI_CHK( mpi_add_int( &Y, X, 1 ) );
-            MPI_CHK( mpi_add_int(  X, X, 2 ) );
-            MPI_CHK( mpi_shift_r( &Y, 1 ) );
         }
+
+        MPI_CHK( mpi_add_int( X, X, 2 * SIEVE_SIZE ) );
     }
 
 cleanup:
 
-    mpi_free( &Y, NULL );
+    mpi_free( &T, &Y, NULL );
 
     return( ret );
 }
 
+/*
+ * Prime number generation
+ */
+int mpi_gen_prime( mpi *X, int nbits, int dh_flag,
+                   int (*f_rng)(void *), void *p_rng )
+{
+    return( mpi_gen_prime_hlp( X, nbits, dh_flag, 0, f_rng, p_rng ) );
+}
+
+/*
+ * Prime number generation for RSA
+ */
+int mpi_gen_rsa_prime( mpi *X, int nbits, int e,
+                       int (*f_rng)(void *), void *p_rng )
+{
+    if( e < 3 )
+        return( POLARSSL_ERR_MPI_BAD_INPUT_DATA );
+
+    return( mpi_gen_prime_hlp( X, nbits, 0, e, f_rng, p_rng ) );
+}
+
 #endif
 
 #if defined(POLARSSL_SELF_TEST)
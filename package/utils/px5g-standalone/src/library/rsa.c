@@ -84,34 +84,51 @@ int rsa_gen_key( rsa_context *ctx, int nbits, int exponent )
 
     /*
      * find primes P and Q with Q < P so that:
-     * GCD( E, (P-1)*(Q-1) ) == 1
+     * GCD( E, P-1 ) == GCD( E, Q-1 ) == 1
+     *
+     * each prime is checked on its own, so only the one that
+     * fails is drawn again; with the two top bits of both set
+     * N always has exactly nbits
      */
     MPI_CHK( mpi_lset( &ctx->E, exponent ) );
 
     do
     {
-        MPI_CHK( mpi_gen_prime( &ctx->P, ( nbits + 1 ) >> 1, 0, 
-                                ctx->f_rng, ctx->p_rng ) );
+        MPI_CHK( mpi_gen_rsa_prime( &ctx->P, ( nbits + 1 ) >> 1, exponent,
+                                    ctx->f_rng, ctx->p_rng ) );
 
-        MPI_CHK( mpi_gen_prime( &ctx->Q, ( nbits + 1 ) >> 1, 0,
-                                ctx->f_rng, ctx->p_rng ) );
+        MPI_CHK( mpi_sub_int( &P1, &ctx->P, 1 ) );
+        MPI_CHK( mpi_gcd( &G, &ctx->E, &P1 ) );
+    }
+    while( mpi_cmp_int( &G, 1 ) != 0 ||
+           mpi_msb( &ctx->P ) != ( ( nbits + 1 ) >> 1 ) );
 
-        if( mpi_cmp_mpi( &ctx->P, &ctx->Q ) < 0 )
-            mpi_swap( &ctx->P, &ctx->Q );
+    do
+    {
+        MPI_CHK( mpi_gen_rsa_prime( &ctx->Q, nbits >> 1, exponent,
+                                    ctx->f_rng, ctx->p_rng ) );
 
-        if( mpi_cmp_mpi( &ctx->P, &ctx->Q ) == 0 )
-            continue;
+        MPI_CHK( mpi_sub_int( &Q1, &ctx->Q, 1 ) );
+        MPI_CHK( mpi_gcd( &G, &ctx->E, &Q1 ) );
+    }
+    while( mpi_cmp_int( &G, 1 ) != 0 ||
+           mpi_msb( &ctx->Q ) != ( nbits >> 1 ) ||
+           mpi_cmp_mpi( &ctx->P, &ctx->Q ) == 0 );
 
-        MPI_CHK( mpi_mul_mpi( &ctx->N, &ctx->P, &ctx->Q ) );
-        if( mpi_msb( &ctx->N ) != nbits )
-            continue;
+    if( mpi_cmp_mpi( &ctx->P, &ctx->Q ) < 0 )
+    {
+        mpi_swap( &ctx->P, &ctx->Q );
+        mpi_swap( &P1, &Q1 );
+    }
 
-        MPI_CHK( mpi_sub_int( &P1, &ctx->P, 1 ) );
-        MPI_CHK( mpi_sub_int( &Q1, &ctx->Q, 1 ) );
-        MPI_CHK( mpi_mul_mpi( &H, &P1, &Q1 ) );
-        MPI_CHK( mpi_gcd( &G, &ctx->E, &H  ) );
+    MPI_CHK( mpi_mul_mpi( &ctx->N, &ctx->P, &ctx->Q ) );
+    if( mpi_msb( &ctx->N ) != nbits )
+    {
+        ret = POLARSSL_ERR_RSA_BAD_INPUT_DATA;
+        goto cleanup;
     }
-    while( mpi_cmp_int( &G, 1 ) != 0 );
+
+    MPI_CHK( mpi_mul_mpi( &H, &P1, &Q1 ) );
 
     /*
      * D  = E^-1 mod ((P-1)*(Q-1))
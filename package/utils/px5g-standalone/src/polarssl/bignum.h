@@ -36,6 +36,7 @@
 #define POLARSSL_BIGNUM_H
 
 #include <stdio.h>
+#include <limits.h>
 
 #define POLARSSL_ERR_MPI_FILE_IO_ERROR                     -0x0002
 #define POLARSSL_ERR_MPI_BAD_INPUT_DATA                    -0x0004
@@ -57,6 +58,10 @@ typedef unsigned short t_dbl;
 #if defined(POLARSSL_HAVE_INT16)
 typedef unsigned short t_int;
 typedef unsigned long  t_dbl;
+#else
+#if defined(POLARSSL_HAVE_INT32)
+typedef unsigned int       t_int;
+typedef unsigned long long t_dbl;
 #else
   typedef unsigned long t_int;
   #if defined(_MSC_VER) && defined(_M_IX86)
@@ -64,14 +69,20 @@ typedef unsigned long  t_dbl;
   #else
     #if defined(__amd64__) || defined(__x86_64__)    || \
         defined(__ppc64__) || defined(__powerpc64__) || \
-        defined(__ia64__)  || defined(__alpha__)
+        defined(__ia64__)  || defined(__alpha__)     || \
+        defined(__SIZEOF_INT128__)
     typedef unsigned int t_dbl __attribute__((mode(TI)));
     #else
     typedef unsigned long long t_dbl;
+    #if ULONG_MAX > 0xFFFFFFFFUL
+    /* 64-bit limbs without a 128-bit type, use the generic C code */
+    #undef POLARSSL_HAVE_LONGLONG
+    #endif
     #endif
   #endif
 #endif
 #endif
+#endif
 
 /**
  * \brief          MPI structure
@@ -423,6 +434,25 @@ int mpi_is_prime( mpi *X, int (*f_rng)(void *), void *p_rng );
 int mpi_gen_prime( mpi *X, int nbits, int dh_flag,
                    int (*f_rng)(void *), void *p_rng );
 
+/**
+ * \brief          Prime number generation for RSA
+ *
+ * \param X        destination mpi
+ * \param nbits    required size of X in bits
+ * \param e        public exponent, X - 1 will not be a multiple of it
+ * \param f_rng    RNG function
+ * \param p_rng    RNG parameter
+ *
+ * \return         0 if successful (probably prime),
+ *                 1 if memory allocation failed,
+ *                 POLARSSL_ERR_MPI_BAD_INPUT_DATA if nbits is < 3 or e < 3
+ *
+ * \note           The two top bits of X are set, so the product of two
+ *                 such primes is exactly as long as both added together.
+ */
+int mpi_gen_rsa_prime( mpi *X, int nbits, int e,
+                       int (*f_rng)(void *), void *p_rng );
+
 /**
  * \brief          Checkup routine
  *
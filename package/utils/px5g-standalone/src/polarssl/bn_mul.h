@@ -489,28 +489,49 @@
 
 #endif /* TriCore */
 
-#if defined(__arm__)
+#if defined(__arm__) && !( defined(__thumb__) && !defined(__thumb2__) )
 
+/*
+ * One constrained asm per limb, so the compiler keeps s, d and c
+ * in registers across the unrolled loop instead of reloading them
+ */
 #define MULADDC_INIT                            \
-    asm( "ldr    r0, %0         " :: "m" (s));  \
-    asm( "ldr    r1, %0         " :: "m" (d));  \
-    asm( "ldr    r2, %0         " :: "m" (c));  \
-    asm( "ldr    r3, %0         " :: "m" (b));
+{                                               \
+    t_int r0, r1;
+
+#if defined(__ARM_ARCH_6__)  || defined(__ARM_ARCH_6J__)  || \
+    defined(__ARM_ARCH_6K__) || defined(__ARM_ARCH_6Z__)  || \
+    defined(__ARM_ARCH_6ZK__) || defined(__ARM_ARCH_7__)  || \
+    defined(__ARM_ARCH_7A__) || defined(__ARM_ARCH_7R__)  || \
+    ( defined(__ARM_ARCH) && __ARM_ARCH >= 6 && !defined(__ARM_ARCH_6M__) )
 
 #define MULADDC_CORE                            \
-    asm( "ldr    r4, [r0], #4   " );            \
-    asm( "mov    r5, #0         " );            \
-    asm( "ldr    r6, [r1]       " );            \
-    asm( "umlal  r2, r5, r3, r4 " );            \
-    asm( "adds   r7, r6, r2     " );            \
-    asm( "adc    r2, r5, #0     " );            \
-    asm( "str    r7, [r1], #4   " );
+    asm( "ldr    %0, [%3], #4       \n\t"       \
+         "ldr    %1, [%4]           \n\t"       \
+         "umaal  %1, %2, %0, %5     \n\t"       \
+         "str    %1, [%4], #4       \n\t"       \
+         : "=&r" (r0), "=&r" (r1), "+r" (c),    \
+           "+r" (s), "+r" (d)                   \
+         : "r" (b) : "memory" );
+
+#else
+
+#define MULADDC_CORE                            \
+    asm( "ldr    %0, [%3], #4       \n\t"       \
+         "mov    %1, #0             \n\t"       \
+         "umlal  %2, %1, %0, %5     \n\t"       \
+         "ldr    %0, [%4]           \n\t"       \
+         "adds   %0, %0, %2         \n\t"       \
+         "adc    %2, %1, #0         \n\t"       \
+         "str    %0, [%4], #4       \n\t"       \
+         : "=&r" (r0), "=&r" (r1), "+r" (c),    \
+           "+r" (s), "+r" (d)                   \
+         : "r" (b) : "cc", "memory" );
+
+#endif /* ARMv6 */
 
 #define MULADDC_STOP                            \
-    asm( "str    r2, %0         " : "=m" (c));  \
-    asm( "str    r1, %0         " : "=m" (d));  \
-    asm( "str    r0, %0         " : "=m" (s) :: \
-    "r0", "r1", "r2", "r3", "r4", "r5", "r6", "r7" );
+}
 
 #endif /* ARMv3 */
 
@@ -545,35 +566,34 @@
 
 #endif /* Alpha */
 
-#if defined(__mips__)
+#if defined(__mips__) && !defined(__mips64) && !defined(__mips16) && \
+    !( defined(__mips_isa_rev) && __mips_isa_rev >= 6 )
 
 #define MULADDC_INIT                            \
-    asm( "lw     $10, %0        " :: "m" (s));  \
-    asm( "lw     $11, %0        " :: "m" (d));  \
-    asm( "lw     $12, %0        " :: "m" (c));  \
-    asm( "lw     $13, %0        " :: "m" (b));
+{                                               \
+    t_int r0, r1;
 
 #define MULADDC_CORE                            \
-    asm( "lw     $14, 0($10)    " );            \
-    asm( "multu  $13, $14       " );            \
-    asm( "addi   $10, $10, 4    " );            \
-    asm( "mflo   $14            " );            \
-    asm( "mfhi   $9             " );            \
-    asm( "addu   $14, $12, $14  " );            \
-    asm( "lw     $15, 0($11)    " );            \
-    asm( "sltu   $12, $14, $12  " );            \
-    asm( "addu   $15, $14, $15  " );            \
-    asm( "sltu   $14, $15, $14  " );            \
-    asm( "addu   $12, $12, $9   " );            \
-    asm( "sw     $15, 0($11)    " );            \
-    asm( "addu   $12, $12, $14  " );            \
-    asm( "addi   $11, $11, 4    " );
+    asm( "lw     %0, 0(%3)          \n\t"       \
+         "lw     %1, 0(%4)          \n\t"       \
+         "multu  %0, %5             \n\t"       \
+         "addiu  %3, %3, 4          \n\t"       \
+         "mflo   %0                 \n\t"       \
+         "addu   %0, %0, %2         \n\t"       \
+         "sltu   %2, %0, %2         \n\t"       \
+         "addu   %1, %1, %0         \n\t"       \
+         "sltu   %0, %1, %0         \n\t"       \
+         "sw     %1, 0(%4)          \n\t"       \
+         "addu   %2, %2, %0         \n\t"       \
+         "mfhi   %0                 \n\t"       \
+         "addu   %2, %2, %0         \n\t"       \
+         "addiu  %4, %4, 4          \n\t"       \
+         : "=&r" (r0), "=&r" (r1), "+r" (c),    \
+           "+r" (s), "+r" (d)                   \
+         : "r" (b) : "hi", "lo", "memory" );
 
 #define MULADDC_STOP                            \
-    asm( "sw     $12, %0        " : "=m" (c));  \
-    asm( "sw     $11, %0        " : "=m" (d));  \
-    asm( "sw     $10, %0        " : "=m" (s) :: \
-    "$9", "$10", "$11", "$12", "$13", "$14", "$15" );
+}
 
 #endif /* MIPS */
 #endif /* GNUC */
@@ -56,15 +56,23 @@
  */
 
 /*
- * Uncomment if the compiler supports long long.
-#define POLARSSL_HAVE_LONGLONG
+ * Comment out if the compiler does not support long long.
  */
+#define POLARSSL_HAVE_LONGLONG
 
+/*
+ * Uncomment to force 32-bit limbs on 64-bit hosts.
+#define POLARSSL_HAVE_INT32
+ */
 
 /*
- * Uncomment to enable the use of assembly code.
+ * Uncomment to enable the use of assembly code. Only the constrained
+ * ARM and MIPS32 multipliers are turned on by default.
  */
 /* #define POLARSSL_HAVE_ASM */
+#if defined(__GNUC__) && ( defined(__arm__) || defined(__mips__) )
+#define POLARSSL_HAVE_ASM
+#endif
 
 /*
  * Uncomment if the CPU supports SSE2 (IA-32 specific).
@@ -27,6 +27,7 @@
 #include "polarssl/bignum.h"
 #include "polarssl/x509.h"
 #include "polarssl/rsa.h"
+#include "polarssl/timing.h"
 
 #define PX5G_VERSION "0.1"
 #define PX5G_COPY "Copyright (c) 2009 Steven Barth <steven@midlink.org>"
@@ -183,6 +184,71 @@ int selfsigned(char **arg) {
 	return 0;
 }
 
+int bench(char **arg) {
+	static char *defsizes[] = { "512", "1024", "2048", NULL };
+	havege_state hs;
+	rsa_context rsa;
+	struct hr_time timer;
+
+	int rounds = 3;
+	int exp = 65537;
+	unsigned long ms, min, max, sum;
+	int ksize, i;
+
+	while (*arg && **arg == '-') {
+		if (!strcmp(*arg, "-n") && arg[1]) {
+			rounds = atoi(arg[1]);
+			arg++;
+		} else if (!strcmp(*arg, "-3")) {
+			exp = 3;
+		}
+		arg++;
+	}
+
+	if (rounds < 1)
+		rounds = 1;
+
+	if (!*arg)
+		arg = defsizes;
+
+	havege_init(&hs);
+
+	for (; *arg; arg++) {
+		ksize = atoi(*arg);
+		min = ULONG_MAX;
+		max = sum = 0;
+
+		for (i = 0; i < rounds; i++) {
+			rsa_init(&rsa, RSA_PKCS_V15, 0, havege_rand, &hs);
+
+			get_timer(&timer, 1);
+			if (rsa_gen_key(&rsa, ksize, exp)) {
+				fprintf(stderr, "error: key generation failed\n");
+				return 1;
+			}
+			ms = get_timer(&timer, 0);
+
+			if (rsa_check_privkey(&rsa)) {
+				fprintf(stderr, "error: generated key is invalid\n");
+				return 1;
+			}
+
+			rsa_free(&rsa);
+
+			sum += ms;
+			if (ms < min)
+				min = ms;
+			if (ms > max)
+				max = ms;
+		}
+
+		printf("rsa %5d bits: %d keys, avg %lu ms, min %lu ms, max %lu ms\n",
+			ksize, rounds, sum / rounds, min, max);
+	}
+
+	return 0;
+}
+
 int main(int argc, char *argv[]) {
 	if (!argv[1]) {
 		//Usage
@@ -190,11 +256,13 @@ int main(int argc, char *argv[]) {
 		return rsakey(argv+2);
 	} else if (!strcmp(argv[1], "selfsigned")) {
 		return selfsigned(argv+2);
+	} else if (!strcmp(argv[1], "bench")) {
+		return bench(argv+2);
 	}
 
 	fprintf(stderr,
 		"PX5G X.509 Certificate Generator Utility v" PX5G_VERSION "\n" PX5G_COPY
 		"\nbased on PolarSSL by Christophe Devine and Paul Bakker\n\n");
-	fprintf(stderr, "Usage: %s [rsakey|selfsigned]\n", *argv);
+	fprintf(stderr, "Usage: %s [rsakey|selfsigned|bench]\n", *argv);
 	return 1;
 }
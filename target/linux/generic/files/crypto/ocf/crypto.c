@@ -74,11 +74,21 @@ __FBSDID("$FreeBSD: src/sys/opencrypto/crypto.c,v 1.16 2005/01/07 02:29:16 imp E
 #include <linux/wait.h>
 #include <linux/sched.h>
 #include <linux/spinlock.h>
+#include <linux/bitops.h>
+#include <linux/ktime.h>
+#include <linux/jhash.h>
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,4)
 #include <linux/kthread.h>
 #endif
 #include <cryptodev.h>
 
+#ifndef CONFIG_NR_CPUS
+#define CONFIG_NR_CPUS 1
+#endif
+#ifndef BITS_TO_LONGS
+#define BITS_TO_LONGS(nr) (((nr) + BITS_PER_LONG - 1) / BITS_PER_LONG)
+#endif
+
 /*
  * keep track of whether or not we have been initialised, a big
  * issue if we are linked into the kernel and a driver gets started before
@@ -118,6 +128,12 @@ static int			crypto_drivers_locked;		/* for non-SMP boxes */
 			 	} \
 			 })
 
+/*
+ * Completion latency is tracked per driver for requests of up to 64,
+ * 128, ... 4096 bytes and bigger,  see crypto_lat_class().
+ */
+#define CRYPTO_LAT_CLASSES	8
+
 /*
  * Crypto device/driver capabilities structure.
  *
@@ -145,6 +161,20 @@ struct cryptocap {
 
 	int		cc_unqblocked;		/* (q) symmetric q blocked */
 	int		cc_unkqblocked;		/* (q) asymmetric q blocked */
+
+	/*
+	 * With crypto_pcpu_queues the symmetric blocked state is kept per
+	 * CPU, one bit per CPU, under that CPU's queue lock.
+	 */
+	unsigned long	cc_cpu_qblocked[BITS_TO_LONGS(CONFIG_NR_CPUS)];
+	unsigned long	cc_cpu_unqblocked[BITS_TO_LONGS(CONFIG_NR_CPUS)];
+
+	/*
+	 * With crypto_route,  a running average of the time from
+	 * crypto_invoke to crypto_done in ns,  0 until measured.  Updated
+	 * without a lock,  losing the odd sample doesn't matter.
+	 */
+	u_int32_t	cc_lat[CRYPTO_LAT_CLASSES];
 };
 static struct cryptocap *crypto_drivers = NULL;
 static int crypto_drivers_num = 0;
@@ -204,6 +234,64 @@ static spinlock_t crypto_ret_q_lock;
 			 })
 #define	CRYPTO_RETQ_EMPTY()	(list_empty(&crp_ret_q) && list_empty(&crp_ret_kq))
 
+/*
+ * Optionally the symmetric queues above are replaced by one request and
+ * one return queue per CPU, each with its own lock and its own pair of
+ * bound kernel threads.  crypto_dispatch() queues on the submitting CPU
+ * and crypto_done() on the completing one, so the common path touches
+ * neither crypto_q_lock nor crypto_ret_q_lock.  A driver returning
+ * ERESTART blocks only the CPU that saw it; crypto_unblock() clears it
+ * everywhere.  The asymmetric queues stay global.  When a CPU goes
+ * down whatever is left on its queues is moved to an online CPU, and the
+ * dead queue is marked so that nothing more is added to it.
+ *
+ * (c) - protected by CRYPTO_CPUQ_LOCK()
+ * (r) - protected by CRYPTO_CPURETQ_LOCK()
+ */
+static int crypto_pcpu_queues = 0;
+module_param(crypto_pcpu_queues, int, 0444);
+MODULE_PARM_DESC(crypto_pcpu_queues,
+		"Use per-CPU symmetric request/return queues and threads");
+
+struct crypto_cpuq {
+	spinlock_t		cq_lock;
+	struct list_head	cq_q;		/* (c) request queue */
+	int			cq_all_qblocked;	/* (c) */
+	int			cq_dead;	/* (c) CPU is offline */
+	wait_queue_head_t	cq_wait;
+
+	spinlock_t		cq_ret_lock;
+	struct list_head	cq_ret_q;	/* (r) callback queue */
+	wait_queue_head_t	cq_ret_wait;
+
+	struct task_struct	*cq_proc;
+	struct task_struct	*cq_ret_proc;
+} ____cacheline_aligned;
+
+static struct crypto_cpuq crypto_cpuqs[CONFIG_NR_CPUS];
+static atomic_t crypto_pcpu_q_cnt = ATOMIC_INIT(0);
+
+#define	CRYPTO_CPUQ_LOCK(cq) \
+			({ \
+				spin_lock_irqsave(&(cq)->cq_lock, q_flags); \
+			 	dprintk("%s,%d: CPUQ_LOCK()\n", __FILE__, __LINE__); \
+			 })
+#define	CRYPTO_CPUQ_UNLOCK(cq) \
+			({ \
+			 	dprintk("%s,%d: CPUQ_UNLOCK()\n", __FILE__, __LINE__); \
+				spin_unlock_irqrestore(&(cq)->cq_lock, q_flags); \
+			 })
+#define	CRYPTO_CPURETQ_LOCK(cq) \
+			({ \
+				spin_lock_irqsave(&(cq)->cq_ret_lock, r_flags); \
+			 	dprintk("%s,%d: CPURETQ_LOCK()\n", __FILE__, __LINE__); \
+			 })
+#define	CRYPTO_CPURETQ_UNLOCK(cq) \
+			({ \
+			 	dprintk("%s,%d: CPURETQ_UNLOCK()\n", __FILE__, __LINE__); \
+				spin_unlock_irqrestore(&(cq)->cq_ret_lock, r_flags); \
+			 })
+
 #if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,20)
 static kmem_cache_t *cryptop_zone;
 static kmem_cache_t *cryptodesc_zone;
@@ -212,6 +300,56 @@ static struct kmem_cache *cryptop_zone;
 static struct kmem_cache *cryptodesc_zone;
 #endif
 
+/*
+ * crypto_getreq() is called for every packet,  so rather than a trip
+ * through both zones each time,  requests come from a per-CPU pool of
+ * cryptops with their descriptors attached,  preallocated at load time.
+ * Only when the pool is empty,  or more descriptors are wanted than a
+ * bundle holds,  do we fall back to the zones.  A request goes back to
+ * the pool it came from,  whichever CPU frees it.
+ *
+ * Each bundle records its pool in cb_pool.  Zone requests are allocated
+ * with room up to cb_pool as well, which is left NULL.  That way
+ * crypto_freereq() finds the home of any request without searching
+ * the pools.
+ *
+ * (p) - protected by CRYPTO_POOL_LOCK()
+ */
+#define	CRYPTO_POOL_DESCS	2	/* enough for cipher + mac */
+
+static int crypto_pool_size = 64;
+module_param(crypto_pool_size, int, 0444);
+MODULE_PARM_DESC(crypto_pool_size,
+		"Number of preallocated requests per CPU (0 to disable)");
+
+struct crypto_bundle {
+	struct cryptop		cb_crp;
+	struct crypto_pool	*cb_pool;	/* owner,  NULL if from the zone */
+	struct cryptodesc	cb_desc[CRYPTO_POOL_DESCS];
+};
+
+#define	CRYPTO_BUNDLE(crp)	container_of(crp, struct crypto_bundle, cb_crp)
+
+struct crypto_pool {
+	spinlock_t		cp_lock;
+	struct list_head	cp_free;	/* (p) free bundles */
+	struct crypto_bundle	*cp_bundles;
+	int			cp_size;
+} ____cacheline_aligned;
+
+static struct crypto_pool crypto_pools[CONFIG_NR_CPUS];
+
+#define	CRYPTO_POOL_LOCK(cp) \
+			({ \
+				spin_lock_irqsave(&(cp)->cp_lock, p_flags); \
+			 	dprintk("%s,%d: POOL_LOCK()\n", __FILE__, __LINE__); \
+			 })
+#define	CRYPTO_POOL_UNLOCK(cp) \
+			({ \
+			 	dprintk("%s,%d: POOL_UNLOCK()\n", __FILE__, __LINE__); \
+				spin_unlock_irqrestore(&(cp)->cp_lock, p_flags); \
+			 })
+
 #define debug crypto_debug
 int crypto_debug = 0;
 module_param(crypto_debug, int, 0644);
@@ -227,6 +365,9 @@ EXPORT_SYMBOL(crypto_debug);
  *
  * We cannot print errors when this condition occurs,  we are already too
  * slow,  printing anything will just kill us
+ *
+ * With crypto_pcpu_queues the count is kept in crypto_pcpu_q_cnt
+ * instead, so as not to need crypto_q_lock.
  */
 
 static int crypto_q_cnt = 0;
@@ -272,9 +413,32 @@ module_param(crypto_max_loopcount, int, 0644);
 MODULE_PARM_DESC(crypto_max_loopcount,
 	   "Maximum number of crypto ops to do before yielding to other processes");
 
-#ifndef CONFIG_NR_CPUS
-#define CONFIG_NR_CPUS 1
-#endif
+/*
+ * With crypto_route on,  sessions that may use either hardware or software
+ * get a session on both and each request goes to whichever driver has been
+ * quicker for requests of its size.  Until both have been measured at that
+ * size,  software takes requests up to crypto_route_small bytes.
+ */
+static int crypto_route = 0;
+module_param(crypto_route, int, 0644);
+MODULE_PARM_DESC(crypto_route,
+	   "Route requests to the driver measured fastest for their size");
+
+static int crypto_route_small = 256;
+module_param(crypto_route_small, int, 0644);
+MODULE_PARM_DESC(crypto_route_small,
+	   "Requests up to this size go to software until measured");
+
+/*
+ * Sessions with the same algorithms and keys share one driver session,
+ * and up to this many that nobody is using are kept for the next time the
+ * same keys turn up.  Stream ciphers (ARC4) are never shared.  0 turns the
+ * cache off.
+ */
+static int crypto_session_cache = 16;
+module_param(crypto_session_cache, int, 0644);
+MODULE_PARM_DESC(crypto_session_cache,
+	   "Number of idle sessions to keep for reuse");
 
 static struct task_struct *cryptoproc[CONFIG_NR_CPUS];
 static struct task_struct *cryptoretproc[CONFIG_NR_CPUS];
@@ -283,6 +447,8 @@ static DECLARE_WAIT_QUEUE_HEAD(cryptoretproc_wait);
 
 static	int crypto_proc(void *arg);
 static	int crypto_ret_proc(void *arg);
+static	int crypto_cpu_proc(void *arg);
+static	int crypto_cpu_ret_proc(void *arg);
 static	int crypto_invoke(struct cryptocap *cap, struct cryptop *crp, int hint);
 static	int crypto_kinvoke(struct cryptkop *krp, int flags);
 static	void crypto_exit(void);
@@ -290,6 +456,13 @@ static  int crypto_init(void);
 
 static	struct cryptostats cryptostats;
 
+module_param_named(crypto_pool_hits, cryptostats.cs_pool_hits, uint, 0444);
+MODULE_PARM_DESC(crypto_pool_hits, "Requests allocated from the pool");
+module_param_named(crypto_pool_misses, cryptostats.cs_pool_misses, uint, 0444);
+MODULE_PARM_DESC(crypto_pool_misses, "Requests allocated from the slab");
+module_param_named(crypto_pool_fails, cryptostats.cs_pool_fails, uint, 0444);
+MODULE_PARM_DESC(crypto_pool_fails, "Requests that could not be allocated");
+
 static struct cryptocap *
 crypto_checkdriver(u_int32_t hid)
 {
@@ -315,16 +488,67 @@ driver_suitable(const struct cryptocap *cap, const struct cryptoini *cri)
 }
 
 
+/*
+ * Latency class of a request of len bytes.
+ */
+static inline int
+crypto_lat_class(int len)
+{
+	int c = len > 64 ? fls(len - 1) - 6 : 0;
+
+	return c < CRYPTO_LAT_CLASSES ? c : CRYPTO_LAT_CLASSES - 1;
+}
+
+/*
+ * Full sized ethernet frames,  what we compare drivers on when choosing
+ * one for a session.
+ */
+#define CRYPTO_LAT_SELECT	crypto_lat_class(1500)
+
+static void
+crypto_lat_update(struct cryptop *crp)
+{
+	struct cryptocap *cap = crypto_checkdriver(CRYPTO_SESID2HID(crp->crp_sid));
+	s64 ns = ktime_to_ns(ktime_get()) - crp->crp_tstart;
+	u_int32_t *lat;
+
+	if (cap == NULL || crp->crp_etype != 0 || ns < 0)
+		return;
+	if (ns > 100000000)
+		ns = 100000000;
+	lat = &cap->cc_lat[crypto_lat_class(crp->crp_ilen)];
+	*lat = *lat ? (*lat * 7 + (u_int32_t) ns) / 8 : (u_int32_t) ns;
+}
+
+/*
+ * Is driver a a better choice for a new session than b ?  With crypto_route
+ * that is the one quickest at CRYPTO_LAT_SELECT sized requests once scaled
+ * by how many sessions it already has,  a driver not yet measured going
+ * first so it gets measured.  Otherwise,  or if they tie,  the one with the
+ * fewest sessions.
+ */
+static int
+crypto_driver_better(const struct cryptocap *a, const struct cryptocap *b)
+{
+	u_int64_t sa, sb;
+
+	if (b == NULL)
+		return 1;
+	if (crypto_route) {
+		sa = (u_int64_t) a->cc_lat[CRYPTO_LAT_SELECT] * (a->cc_sessions + 1);
+		sb = (u_int64_t) b->cc_lat[CRYPTO_LAT_SELECT] * (b->cc_sessions + 1);
+		if (sa != sb)
+			return sa < sb;
+	}
+	return a->cc_sessions < b->cc_sessions;
+}
+
 /*
  * Select a driver for a new session that supports the specified
  * algorithms and, optionally, is constrained according to the flags.
- * The algorithm we use here is pretty stupid; just use the
- * first driver that supports all the algorithms we need. If there
- * are multiple drivers we choose the driver with the fewest active
- * sessions.  We prefer hardware-backed drivers to software ones.
- *
- * XXX We need more smarts here (in real life too, but that's
- * XXX another story altogether).
+ * Of the drivers that support all the algorithms we need we take the
+ * best according to crypto_driver_better().  We prefer hardware-backed
+ * drivers to software ones.
  */
 static struct cryptocap *
 crypto_select_driver(const struct cryptoini *cri, int flags)
@@ -356,11 +580,8 @@ again:
 			continue;
 
 		/* verify all the algorithms are supported. */
-		if (driver_suitable(cap, cri)) {
-			if (best == NULL ||
-			    cap->cc_sessions < best->cc_sessions)
-				best = cap;
-		}
+		if (driver_suitable(cap, cri) && crypto_driver_better(cap, best))
+			best = cap;
 	}
 	if (best != NULL)
 		return best;
@@ -373,13 +594,13 @@ again:
 }
 
 /*
- * Create a new session.  The crid argument specifies a crypto
+ * Create a new session on a driver.  The crid argument specifies a crypto
  * driver to use or constraints on a driver to select (hardware
  * only, software only, either).  Whatever driver is selected
  * must be capable of the requested crypto algorithms.
  */
-int
-crypto_newsession(u_int64_t *sid, struct cryptoini *cri, int crid)
+static int
+crypto_newsession_driver(u_int64_t *sid, struct cryptoini *cri, int crid)
 {
 	struct cryptocap *cap;
 	u_int32_t hid, lid;
@@ -435,11 +656,11 @@ crypto_remove(struct cryptocap *cap)
 }
 
 /*
- * Delete an existing session (or a reserved session on an unregistered
- * driver).
+ * Delete an existing driver session (or a reserved session on an
+ * unregistered driver).
  */
-int
-crypto_freesession(u_int64_t sid)
+static int
+crypto_freesession_driver(u_int64_t sid)
 {
 	struct cryptocap *cap;
 	u_int32_t hid;
@@ -482,6 +703,467 @@ done:
 	return err;
 }
 
+/*
+ * Virtual sessions.  With crypto_route a session that may go to either
+ * hardware or software is a pair of driver sessions,  one of each,  and
+ * crypto_dispatch() picks one for each request.  The session id the
+ * caller sees has CRYPTO_VSES_HID for its driver and an index into
+ * crypto_vses for its local id.
+ *
+ * Virtual sessions and the session cache are protected by crypto_ses_lock.
+ */
+#define CRYPTO_VSES_HID		0x00ffffff
+#define CRYPTO_VSES_SW		0
+#define CRYPTO_VSES_HW		1
+
+struct crypto_vses {
+	u_int64_t	vs_sid[2];	/* (s) software,  hardware */
+	u_int32_t	vs_count;	/* requests,  racy */
+};
+
+static spinlock_t crypto_ses_lock;
+static struct crypto_vses **crypto_vses = NULL;
+static int crypto_vses_num = 0;
+
+#define	CRYPTO_SES_LOCK() \
+			({ \
+				spin_lock_irqsave(&crypto_ses_lock, s_flags); \
+			 	dprintk("%s,%d: SES_LOCK()\n", __FILE__, __LINE__); \
+			 })
+#define	CRYPTO_SES_UNLOCK() \
+			({ \
+			 	dprintk("%s,%d: SES_UNLOCK()\n", __FILE__, __LINE__); \
+				spin_unlock_irqrestore(&crypto_ses_lock, s_flags); \
+			 })
+
+static int
+crypto_vses_add(u_int64_t *sid, u_int64_t sw, u_int64_t hw)
+{
+	struct crypto_vses *vs, **nvses;
+	u_int32_t caps;
+	int lid, num;
+	unsigned long s_flags;
+
+	vs = kmalloc(sizeof(*vs), GFP_ATOMIC);
+	if (vs == NULL)
+		return ENOMEM;
+	vs->vs_sid[CRYPTO_VSES_SW] = sw;
+	vs->vs_sid[CRYPTO_VSES_HW] = hw;
+	vs->vs_count = 0;
+
+	CRYPTO_SES_LOCK();
+	for (lid = 0; lid < crypto_vses_num; lid++)
+		if (crypto_vses[lid] == NULL)
+			break;
+	if (lid == crypto_vses_num) {
+		num = crypto_vses_num ? crypto_vses_num * 2 : 16;
+		nvses = kmalloc(num * sizeof(*nvses), GFP_ATOMIC);
+		if (nvses == NULL) {
+			CRYPTO_SES_UNLOCK();
+			kfree(vs);
+			return ENOMEM;
+		}
+		memset(nvses, 0, num * sizeof(*nvses));
+		if (crypto_vses) {
+			memcpy(nvses, crypto_vses, crypto_vses_num * sizeof(*nvses));
+			kfree(crypto_vses);
+		}
+		crypto_vses = nvses;
+		crypto_vses_num = num;
+	}
+	crypto_vses[lid] = vs;
+	CRYPTO_SES_UNLOCK();
+
+	/* only claim what both halves can do */
+	caps = CRYPTO_SESID2CAPS(sw) & CRYPTO_SESID2CAPS(hw);
+	*sid = ((u_int64_t) (caps | CRYPTO_VSES_HID) << 32) | lid;
+	return 0;
+}
+
+static struct crypto_vses *
+crypto_vses_find(u_int64_t sid)
+{
+	u_int32_t lid = CRYPTO_SESID2LID(sid);
+
+	if (CRYPTO_SESID2HID(sid) != CRYPTO_VSES_HID || lid >= crypto_vses_num)
+		return NULL;
+	return crypto_vses[lid];
+}
+
+/*
+ * Pick the half of a virtual session to send crp to.
+ */
+static int
+crypto_vses_route(struct cryptop *crp)
+{
+	struct crypto_vses *vs;
+	struct cryptocap *sw, *hw;
+	u_int64_t sid[2];
+	u_int32_t count;
+	int c, i;
+	unsigned long s_flags;
+
+	CRYPTO_SES_LOCK();
+	vs = crypto_vses_find(crp->crp_sid);
+	if (vs) {
+		sid[CRYPTO_VSES_SW] = vs->vs_sid[CRYPTO_VSES_SW];
+		sid[CRYPTO_VSES_HW] = vs->vs_sid[CRYPTO_VSES_HW];
+		count = ++vs->vs_count;
+	}
+	CRYPTO_SES_UNLOCK();
+	if (vs == NULL)
+		return EINVAL;
+
+	c = crypto_lat_class(crp->crp_ilen);
+	sw = crypto_checkdriver(CRYPTO_SESID2HID(sid[CRYPTO_VSES_SW]));
+	hw = crypto_checkdriver(CRYPTO_SESID2HID(sid[CRYPTO_VSES_HW]));
+	if (sw && hw && sw->cc_lat[c] && hw->cc_lat[c])
+		i = hw->cc_lat[c] < sw->cc_lat[c];
+	else
+		i = crp->crp_ilen > crypto_route_small;
+	/* every so often try the other one so its numbers stay current */
+	if ((count & 63) == 0)
+		i = !i;
+	if (sid[i] == 0)
+		i = !i;
+
+	crp->crp_vsid = crp->crp_sid;
+	crp->crp_sid = sid[i];
+	return 0;
+}
+
+/*
+ * The driver behind one half of a virtual session went away,  give it
+ * the migrated session nid or,  failing that,  the other half.  Returns
+ * non-zero if old was replaced;  every request queued on old comes
+ * through here but only the first finds it.
+ */
+static int
+crypto_vses_migrate(u_int64_t vsid, u_int64_t old, u_int64_t nid)
+{
+	struct crypto_vses *vs;
+	int i, replaced = 0;
+	unsigned long s_flags;
+
+	CRYPTO_SES_LOCK();
+	vs = crypto_vses_find(vsid);
+	for (i = 0; vs && i < 2; i++)
+		if (vs->vs_sid[i] == old) {
+			vs->vs_sid[i] = nid ? nid : vs->vs_sid[!i];
+			replaced = 1;
+		}
+	CRYPTO_SES_UNLOCK();
+	return replaced;
+}
+
+/*
+ * Create a session,  a virtual one if routing between hardware and
+ * software is possible.
+ */
+static int
+crypto_newsession_vses(u_int64_t *sid, struct cryptoini *cri, int crid)
+{
+	u_int64_t sw, hw;
+	int both = CRYPTOCAP_F_HARDWARE | CRYPTOCAP_F_SOFTWARE;
+
+	if (!crypto_route || (crid & both) != both)
+		return crypto_newsession_driver(sid, cri, crid);
+
+	if (crypto_newsession_driver(&hw, cri, CRYPTOCAP_F_HARDWARE) != 0)
+		return crypto_newsession_driver(sid, cri, crid);
+
+	if (crypto_newsession_driver(&sw, cri, CRYPTOCAP_F_SOFTWARE) == 0) {
+		if (crypto_vses_add(sid, sw, hw) == 0)
+			return 0;
+		crypto_freesession_driver(sw);
+	}
+	*sid = hw;
+	return 0;
+}
+
+static int
+crypto_freesession_vses(u_int64_t sid)
+{
+	struct crypto_vses *vs;
+	unsigned long s_flags;
+
+	if (CRYPTO_SESID2HID(sid) != CRYPTO_VSES_HID)
+		return crypto_freesession_driver(sid);
+
+	CRYPTO_SES_LOCK();
+	vs = crypto_vses_find(sid);
+	if (vs)
+		crypto_vses[CRYPTO_SESID2LID(sid)] = NULL;
+	CRYPTO_SES_UNLOCK();
+	if (vs == NULL)
+		return ENOENT;
+
+	crypto_freesession_driver(vs->vs_sid[CRYPTO_VSES_SW]);
+	if (vs->vs_sid[CRYPTO_VSES_HW] != vs->vs_sid[CRYPTO_VSES_SW])
+		crypto_freesession_driver(vs->vs_sid[CRYPTO_VSES_HW]);
+	kfree(vs);
+	return 0;
+}
+
+/*
+ * Does session sid use driver hid ?  Called with crypto_ses_lock held.
+ */
+static int
+crypto_ses_uses(u_int64_t sid, u_int32_t hid)
+{
+	struct crypto_vses *vs = crypto_vses_find(sid);
+
+	if (vs)
+		return CRYPTO_SESID2HID(vs->vs_sid[CRYPTO_VSES_SW]) == hid ||
+			CRYPTO_SESID2HID(vs->vs_sid[CRYPTO_VSES_HW]) == hid;
+	return CRYPTO_SESID2HID(sid) == hid;
+}
+
+/*
+ * The session cache.  Each session is kept along with the crid and
+ * cryptoini chain it was made from,  on a hash of those for
+ * crypto_newsession() to find,  and a hash of its id for
+ * crypto_freesession().  When the last user frees it,  it goes on the
+ * idle list rather than back to the driver,  until there are more than
+ * crypto_session_cache idle.
+ */
+#define CRYPTO_SES_HASH		64
+
+struct crypto_ses {
+	struct list_head	cs_hash;	/* (s) on crypto_ses_hash */
+	struct list_head	cs_byid;	/* (s) on crypto_ses_byid */
+	struct list_head	cs_idle;	/* (s) on crypto_ses_idle */
+	u_int64_t		cs_sid;
+	int			cs_refs;	/* (s) */
+	u_int32_t		cs_key;		/* jhash of cs_ini */
+	int			cs_len;
+	u_int8_t		cs_ini[0];	/* crid and cryptoini chain */
+};
+
+static struct list_head crypto_ses_hash[CRYPTO_SES_HASH];
+static struct list_head crypto_ses_byid[CRYPTO_SES_HASH];
+static LIST_HEAD(crypto_ses_idle);
+static int crypto_ses_nidle = 0;
+
+#define CRYPTO_SES_BYID(sid) \
+		(&crypto_ses_byid[((u_int32_t) (sid) ^ (u_int32_t) ((sid) >> 32)) \
+				% CRYPTO_SES_HASH])
+
+/*
+ * Can sessions made from cri be shared and reused ?  Not if the driver's
+ * session state moves on with each request,  as ARC4's keystream does in
+ * cryptosoft's session:  a second user would carry on from the first
+ * one's keystream,  or reuse it.
+ */
+static int
+crypto_ses_shareable(struct cryptoini *cri)
+{
+	struct cryptoini *c;
+
+	for (c = cri; c; c = c->cri_next)
+		if (c->cri_alg == CRYPTO_ARC4)
+			return 0;
+	return 1;
+}
+
+static struct crypto_ses *
+crypto_ses_alloc(struct cryptoini *cri, int crid)
+{
+	struct crypto_ses *ses;
+	struct cryptoini *c;
+	u_int8_t *p;
+	int len = sizeof(crid), klen;
+
+	for (c = cri; c; c = c->cri_next)
+		len += 3 * sizeof(int) + EALG_MAX_BLOCK_LEN + (c->cri_klen + 7) / 8;
+
+	ses = kmalloc(sizeof(*ses) + len, GFP_ATOMIC);
+	if (ses == NULL)
+		return NULL;
+	memset(ses, 0, sizeof(*ses));
+	INIT_LIST_HEAD(&ses->cs_hash);
+	INIT_LIST_HEAD(&ses->cs_byid);
+	INIT_LIST_HEAD(&ses->cs_idle);
+	ses->cs_len = len;
+
+	p = ses->cs_ini;
+	memcpy(p, &crid, sizeof(crid));
+	p += sizeof(crid);
+	for (c = cri; c; c = c->cri_next) {
+		memcpy(p, &c->cri_alg, sizeof(int));
+		p += sizeof(int);
+		memcpy(p, &c->cri_klen, sizeof(int));
+		p += sizeof(int);
+		memcpy(p, &c->cri_mlen, sizeof(int));
+		p += sizeof(int);
+		memcpy(p, c->cri_iv, EALG_MAX_BLOCK_LEN);
+		p += EALG_MAX_BLOCK_LEN;
+		klen = (c->cri_klen + 7) / 8;
+		if (klen)
+			memcpy(p, c->cri_key, klen);
+		p += klen;
+	}
+	ses->cs_key = jhash(ses->cs_ini, len, 0);
+	return ses;
+}
+
+static void
+crypto_ses_free(struct crypto_ses *ses)
+{
+	/* there are keys in there */
+	memset(ses->cs_ini, 0, ses->cs_len);
+	kfree(ses);
+}
+
+static void
+crypto_ses_unlink(struct crypto_ses *ses)
+{
+	list_del_init(&ses->cs_hash);
+	list_del_init(&ses->cs_byid);
+	if (!list_empty(&ses->cs_idle)) {
+		list_del_init(&ses->cs_idle);
+		crypto_ses_nidle--;
+	}
+}
+
+/*
+ * Hand idle sessions back to their drivers.
+ */
+static void
+crypto_ses_release(struct list_head *gone)
+{
+	struct crypto_ses *ses, *tmp;
+
+	list_for_each_entry_safe(ses, tmp, gone, cs_idle) {
+		list_del(&ses->cs_idle);
+		crypto_freesession_vses(ses->cs_sid);
+		crypto_ses_free(ses);
+	}
+}
+
+/*
+ * Driver hid is going,  give back its idle sessions and stop handing out
+ * the busy ones.
+ */
+static void
+crypto_ses_flush(u_int32_t hid)
+{
+	struct crypto_ses *ses, *tmp;
+	LIST_HEAD(gone);
+	int i;
+	unsigned long s_flags;
+
+	CRYPTO_SES_LOCK();
+	list_for_each_entry_safe(ses, tmp, &crypto_ses_idle, cs_idle) {
+		if (crypto_ses_uses(ses->cs_sid, hid)) {
+			crypto_ses_unlink(ses);
+			list_add(&ses->cs_idle, &gone);
+		}
+	}
+	for (i = 0; i < CRYPTO_SES_HASH; i++)
+		list_for_each_entry_safe(ses, tmp, &crypto_ses_hash[i], cs_hash)
+			if (crypto_ses_uses(ses->cs_sid, hid))
+				list_del_init(&ses->cs_hash);
+	CRYPTO_SES_UNLOCK();
+
+	crypto_ses_release(&gone);
+}
+
+/*
+ * Create a new session,  or share an existing one made from the same crid
+ * and cryptoini chain.  Stateful ones are always new and never cached.
+ */
+int
+crypto_newsession(u_int64_t *sid, struct cryptoini *cri, int crid)
+{
+	struct crypto_ses *ses, *nses;
+	struct list_head *head;
+	int err;
+	unsigned long s_flags;
+
+	if (crypto_session_cache <= 0 || !crypto_ses_shareable(cri) ||
+			(nses = crypto_ses_alloc(cri, crid)) == NULL)
+		return crypto_newsession_vses(sid, cri, crid);
+
+	head = &crypto_ses_hash[nses->cs_key % CRYPTO_SES_HASH];
+	CRYPTO_SES_LOCK();
+	list_for_each_entry(ses, head, cs_hash) {
+		if (ses->cs_key == nses->cs_key && ses->cs_len == nses->cs_len &&
+				memcmp(ses->cs_ini, nses->cs_ini, ses->cs_len) == 0) {
+			if (ses->cs_refs++ == 0) {
+				list_del_init(&ses->cs_idle);
+				crypto_ses_nidle--;
+			}
+			*sid = ses->cs_sid;
+			CRYPTO_SES_UNLOCK();
+			crypto_ses_free(nses);
+			return 0;
+		}
+	}
+	CRYPTO_SES_UNLOCK();
+
+	err = crypto_newsession_vses(sid, cri, crid);
+	if (err) {
+		crypto_ses_free(nses);
+		return err;
+	}
+
+	nses->cs_sid = *sid;
+	nses->cs_refs = 1;
+	CRYPTO_SES_LOCK();
+	list_add(&nses->cs_hash, head);
+	list_add(&nses->cs_byid, CRYPTO_SES_BYID(*sid));
+	CRYPTO_SES_UNLOCK();
+	return 0;
+}
+
+/*
+ * Done with a session,  the driver's state goes once nobody is using it
+ * and it has aged off the idle list.
+ */
+int
+crypto_freesession(u_int64_t sid)
+{
+	struct crypto_ses *ses, *found = NULL;
+	LIST_HEAD(gone);
+	unsigned long s_flags;
+
+	dprintk("%s()\n", __FUNCTION__);
+	CRYPTO_SES_LOCK();
+	list_for_each_entry(ses, CRYPTO_SES_BYID(sid), cs_byid) {
+		if (ses->cs_sid == sid) {
+			found = ses;
+			break;
+		}
+	}
+	if (found == NULL) {
+		CRYPTO_SES_UNLOCK();
+		return crypto_freesession_vses(sid);
+	}
+	if (--found->cs_refs > 0) {
+		CRYPTO_SES_UNLOCK();
+		return 0;
+	}
+
+	if (list_empty(&found->cs_hash)) {
+		/* its driver is going,  don't keep it */
+		crypto_ses_unlink(found);
+		list_add(&found->cs_idle, &gone);
+	} else {
+		list_add_tail(&found->cs_idle, &crypto_ses_idle);
+		crypto_ses_nidle++;
+	}
+	while (crypto_ses_nidle > 0 && crypto_ses_nidle > crypto_session_cache) {
+		ses = list_entry(crypto_ses_idle.next, struct crypto_ses, cs_idle);
+		crypto_ses_unlink(ses);
+		list_add(&ses->cs_idle, &gone);
+	}
+	CRYPTO_SES_UNLOCK();
+
+	crypto_ses_release(&gone);
+	return 0;
+}
+
 /*
  * Return an unused driver id.  Used by drivers prior to registering
  * support for the algorithms they handle.
@@ -752,6 +1434,8 @@ crypto_unregister_all(u_int32_t driverid)
 	unsigned long d_flags;
 
 	dprintk("%s()\n", __FUNCTION__);
+	crypto_ses_flush(driverid);
+
 	CRYPTO_DRIVER_LOCK();
 	cap = crypto_checkdriver(driverid);
 	if (cap != NULL) {
@@ -794,22 +1478,108 @@ crypto_unblock(u_int32_t driverid, int what)
 		err = EINVAL;
 	CRYPTO_Q_UNLOCK(); //DAVIDM should this be a driver lock
 
+	if (err == 0 && crypto_pcpu_queues && (what & CRYPTO_SYMQ)) {
+		struct crypto_cpuq *cq;
+		int cpu;
+
+		ocf_for_each_cpu(cpu) {
+			cq = &crypto_cpuqs[cpu];
+			CRYPTO_CPUQ_LOCK(cq);
+			cap = crypto_checkdriver(driverid);
+			clear_bit(cpu, cap->cc_cpu_qblocked);
+			clear_bit(cpu, cap->cc_cpu_unqblocked);
+			cq->cq_all_qblocked = 0;
+			wake_up_interruptible(&cq->cq_wait);
+			CRYPTO_CPUQ_UNLOCK(cq);
+		}
+	}
+
 	return err;
 }
 
 /*
- * Add a crypto request to a queue, to be processed by the kernel thread.
+ * crypto_dispatch_global() for crypto_pcpu_queues,  the same logic
+ * against the queue and blocked bits of the CPU we are running on.
  */
-int
-crypto_dispatch(struct cryptop *crp)
+static int
+crypto_dispatch_cpu(struct cryptop *crp)
 {
+	struct crypto_cpuq *cq;
 	struct cryptocap *cap;
-	int result = -1;
+	int cpu, hid, result = -1;
 	unsigned long q_flags;
 
-	dprintk("%s()\n", __FUNCTION__);
+	if (atomic_inc_return(&crypto_pcpu_q_cnt) > crypto_q_max) {
+		atomic_dec(&crypto_pcpu_q_cnt);
+		cryptostats.cs_drops++;
+		return ENOMEM;
+	}
 
-	cryptostats.cs_ops++;
+	/* make sure we are starting a fresh run on this crp. */
+	crp->crp_flags &= ~CRYPTO_F_DONE;
+	crp->crp_etype = 0;
+
+	/*
+	 * We only need a queue,  not to stay on this CPU;  if we migrate
+	 * the request simply ends up on the other CPU's queue.
+	 */
+	cpu = get_cpu();
+	put_cpu();
+	cq = &crypto_cpuqs[cpu];
+	hid = CRYPTO_SESID2HID(crp->crp_sid);
+
+	CRYPTO_CPUQ_LOCK(cq);
+	if ((crp->crp_flags & CRYPTO_F_BATCH) == 0) {
+		cap = crypto_checkdriver(hid);
+		/* Driver cannot disappear when there is an active session. */
+		KASSERT(cap != NULL, ("%s: Driver disappeared.", __func__));
+		if (!test_bit(cpu, cap->cc_cpu_qblocked)) {
+			cq->cq_all_qblocked = 0;
+			set_bit(cpu, crypto_drivers[hid].cc_cpu_unqblocked);
+			CRYPTO_CPUQ_UNLOCK(cq);
+			result = crypto_invoke(cap, crp, 0);
+			CRYPTO_CPUQ_LOCK(cq);
+			if (result == ERESTART)
+				if (test_bit(cpu, crypto_drivers[hid].cc_cpu_unqblocked))
+					set_bit(cpu, crypto_drivers[hid].cc_cpu_qblocked);
+			clear_bit(cpu, crypto_drivers[hid].cc_cpu_unqblocked);
+		}
+	}
+	if (result == ERESTART || result == -1) {
+		/*
+		 * We may have been moved off the CPU,  and it taken down,
+		 * while the queue was unlocked;  its requests have gone to
+		 * an online CPU,  so follow them.
+		 */
+		while (cq->cq_dead) {
+			CRYPTO_CPUQ_UNLOCK(cq);
+			cq = &crypto_cpuqs[cpumask_any(cpu_online_mask)];
+			CRYPTO_CPUQ_LOCK(cq);
+		}
+	}
+	if (result == ERESTART) {
+		/* As in crypto_dispatch_global(), retry from the front. */
+		list_add(&crp->crp_next, &cq->cq_q);
+		cryptostats.cs_blocks++;
+		result = 0;
+	} else if (result == -1) {
+		TAILQ_INSERT_TAIL(&cq->cq_q, crp, crp_next);
+		result = 0;
+	}
+	wake_up_interruptible(&cq->cq_wait);
+	CRYPTO_CPUQ_UNLOCK(cq);
+	return result;
+}
+
+/*
+ * crypto_dispatch() onto the global queue.
+ */
+static int
+crypto_dispatch_global(struct cryptop *crp)
+{
+	struct cryptocap *cap;
+	int result = -1;
+	unsigned long q_flags;
 
 	CRYPTO_Q_LOCK();
 	if (crypto_q_cnt >= crypto_q_max) {
@@ -866,6 +1636,35 @@ crypto_dispatch(struct cryptop *crp)
 	return result;
 }
 
+/*
+ * Add a crypto request to a queue, to be processed by the kernel thread.
+ */
+int
+crypto_dispatch(struct cryptop *crp)
+{
+	int result;
+
+	dprintk("%s()\n", __FUNCTION__);
+
+	cryptostats.cs_ops++;
+
+	if (CRYPTO_SESID2HID(crp->crp_sid) == CRYPTO_VSES_HID &&
+			(result = crypto_vses_route(crp)) != 0)
+		return result;
+
+	if (crypto_pcpu_queues)
+		result = crypto_dispatch_cpu(crp);
+	else
+		result = crypto_dispatch_global(crp);
+
+	/* a request we did not take goes back with the caller's session */
+	if (result != 0 && crp->crp_vsid) {
+		crp->crp_sid = crp->crp_vsid;
+		crp->crp_vsid = 0;
+	}
+	return result;
+}
+
 /*
  * Add an asymetric crypto request to a queue,
  * to be processed by the kernel thread.
@@ -1050,15 +1849,30 @@ crypto_invoke(struct cryptocap *cap, struct cryptop *crp, int hint)
 		 * XXX: What if there are more already queued requests for this
 		 *      session?
 		 */
-		crypto_freesession(crp->crp_sid);
-
 		for (crd = crp->crp_desc; crd->crd_next; crd = crd->crd_next)
 			crd->CRD_INI.cri_next = &(crd->crd_next->CRD_INI);
 
-		/* XXX propagate flags from initial session? */
-		if (crypto_newsession(&nid, &(crp->crp_desc->CRD_INI),
-		    CRYPTOCAP_F_HARDWARE | CRYPTOCAP_F_SOFTWARE) == 0)
-			crp->crp_sid = nid;
+		if (crp->crp_vsid) {
+			/*
+			 * Just the one half of a virtual session to replace,
+			 * and only once;  later requests for the old half
+			 * find it already gone and drop their new session.
+			 */
+			if (crypto_newsession_driver(&nid, &(crp->crp_desc->CRD_INI),
+			    CRYPTOCAP_F_HARDWARE | CRYPTOCAP_F_SOFTWARE) != 0)
+				nid = 0;
+			if (crypto_vses_migrate(crp->crp_vsid, crp->crp_sid, nid))
+				crypto_freesession_driver(crp->crp_sid);
+			else if (nid)
+				crypto_freesession_driver(nid);
+		} else {
+			crypto_freesession(crp->crp_sid);
+
+			/* XXX propagate flags from initial session? */
+			if (crypto_newsession(&nid, &(crp->crp_desc->CRD_INI),
+			    CRYPTOCAP_F_HARDWARE | CRYPTOCAP_F_SOFTWARE) == 0)
+				crp->crp_sid = nid;
+		}
 
 		crp->crp_etype = EAGAIN;
 		crypto_done(crp);
@@ -1067,10 +1881,44 @@ crypto_invoke(struct cryptocap *cap, struct cryptop *crp, int hint)
 		/*
 		 * Invoke the driver to process the request.
 		 */
+		crp->crp_tstart = crypto_route ? ktime_to_ns(ktime_get()) : 0;
 		return CRYPTODEV_PROCESS(cap->cc_dev, crp, hint);
 	}
 }
 
+static struct cryptop *
+crypto_pool_get(int num)
+{
+	struct crypto_bundle *cb = NULL;
+	struct crypto_pool *cp;
+	unsigned long p_flags;
+	int i;
+
+	if (num > CRYPTO_POOL_DESCS)
+		return NULL;
+
+	cp = &crypto_pools[get_cpu()];
+	CRYPTO_POOL_LOCK(cp);
+	if (!list_empty(&cp->cp_free)) {
+		cb = list_entry(cp->cp_free.next, struct crypto_bundle,
+				cb_crp.crp_next);
+		list_del(&cb->cb_crp.crp_next);
+	}
+	CRYPTO_POOL_UNLOCK(cp);
+	put_cpu();
+
+	if (cb == NULL)
+		return NULL;
+
+	memset(&cb->cb_crp, 0, sizeof(cb->cb_crp));
+	for (i = num - 1; i >= 0; i--) {
+		memset(&cb->cb_desc[i], 0, sizeof(cb->cb_desc[i]));
+		cb->cb_desc[i].crd_next = cb->cb_crp.crp_desc;
+		cb->cb_crp.crp_desc = &cb->cb_desc[i];
+	}
+	return &cb->cb_crp;
+}
+
 /*
  * Release a set of crypto descriptors.
  */
@@ -1078,6 +1926,8 @@ void
 crypto_freereq(struct cryptop *crp)
 {
 	struct cryptodesc *crd;
+	struct crypto_pool *cp;
+	unsigned long p_flags;
 
 	if (crp == NULL)
 		return;
@@ -1104,6 +1954,13 @@ crypto_freereq(struct cryptop *crp)
 	}
 #endif
 
+	if ((cp = CRYPTO_BUNDLE(crp)->cb_pool) != NULL) {
+		CRYPTO_POOL_LOCK(cp);
+		list_add(&crp->crp_next, &cp->cp_free);
+		CRYPTO_POOL_UNLOCK(cp);
+		return;
+	}
+
 	while ((crd = crp->crp_desc) != NULL) {
 		crp->crp_desc = crd->crd_next;
 		kmem_cache_free(cryptodesc_zone, crd);
@@ -1120,22 +1977,34 @@ crypto_getreq(int num)
 	struct cryptodesc *crd;
 	struct cryptop *crp;
 
+	crp = crypto_pool_get(num);
+	if (crp != NULL) {
+		cryptostats.cs_pool_hits++;
+		INIT_LIST_HEAD(&crp->crp_next);
+		init_waitqueue_head(&crp->crp_waitq);
+		return crp;
+	}
+
 	crp = kmem_cache_alloc(cryptop_zone, SLAB_ATOMIC);
 	if (crp != NULL) {
 		memset(crp, 0, sizeof(*crp));
+		CRYPTO_BUNDLE(crp)->cb_pool = NULL;
 		INIT_LIST_HEAD(&crp->crp_next);
 		init_waitqueue_head(&crp->crp_waitq);
 		while (num--) {
 			crd = kmem_cache_alloc(cryptodesc_zone, SLAB_ATOMIC);
 			if (crd == NULL) {
 				crypto_freereq(crp);
+				cryptostats.cs_pool_fails++;
 				return NULL;
 			}
 			memset(crd, 0, sizeof(*crd));
 			crd->crd_next = crp->crp_desc;
 			crp->crp_desc = crd;
 		}
-	}
+		cryptostats.cs_pool_misses++;
+	} else
+		cryptostats.cs_pool_fails++;
 	return crp;
 }
 
@@ -1146,18 +2015,34 @@ void
 crypto_done(struct cryptop *crp)
 {
 	unsigned long q_flags;
+	int sync;
 
 	dprintk("%s()\n", __FUNCTION__);
 	if ((crp->crp_flags & CRYPTO_F_DONE) == 0) {
 		crp->crp_flags |= CRYPTO_F_DONE;
-		CRYPTO_Q_LOCK();
-		crypto_q_cnt--;
-		CRYPTO_Q_UNLOCK();
+		if (crypto_pcpu_queues)
+			atomic_dec(&crypto_pcpu_q_cnt);
+		else {
+			CRYPTO_Q_LOCK();
+			crypto_q_cnt--;
+			CRYPTO_Q_UNLOCK();
+		}
 	} else
 		printk("crypto: crypto_done op already done, flags 0x%x",
 				crp->crp_flags);
 	if (crp->crp_etype != 0)
 		cryptostats.cs_errs++;
+	if (crp->crp_tstart) {
+		crypto_lat_update(crp);
+		crp->crp_tstart = 0;
+	}
+	/* the driver that did the work decides, not the virtual session */
+	sync = (CRYPTO_SESID2CAPS(crp->crp_sid) & CRYPTOCAP_F_SYNC) != 0;
+	/* the caller only knows about the virtual session */
+	if (crp->crp_vsid) {
+		crp->crp_sid = crp->crp_vsid;
+		crp->crp_vsid = 0;
+	}
 	/*
 	 * CBIMM means unconditionally do the callback immediately;
 	 * CBIFSYNC means do the callback immediately only if the
@@ -1166,14 +2051,27 @@ crypto_done(struct cryptop *crp)
 	 * used with the software crypto driver.
 	 */
 	if ((crp->crp_flags & CRYPTO_F_CBIMM) ||
-	    ((crp->crp_flags & CRYPTO_F_CBIFSYNC) &&
-	     (CRYPTO_SESID2CAPS(crp->crp_sid) & CRYPTOCAP_F_SYNC))) {
+	    ((crp->crp_flags & CRYPTO_F_CBIFSYNC) && sync)) {
 		/*
 		 * Do the callback directly.  This is ok when the
 		 * callback routine does very little (e.g. the
 		 * /dev/crypto callback method just does a wakeup).
 		 */
 		crp->crp_callback(crp);
+	} else if (crypto_pcpu_queues) {
+		struct crypto_cpuq *cq;
+		unsigned long r_flags;
+		/*
+		 * Queue the callback for this CPU's return thread.  Stay
+		 * on the CPU until it is queued so it cannot go down and
+		 * miss the request when its queue is moved.
+		 */
+		cq = &crypto_cpuqs[get_cpu()];
+		CRYPTO_CPURETQ_LOCK(cq);
+		TAILQ_INSERT_TAIL(&cq->cq_ret_q, crp, crp_next);
+		wake_up_interruptible(&cq->cq_ret_wait);
+		CRYPTO_CPURETQ_UNLOCK(cq);
+		put_cpu();
 	} else {
 		unsigned long r_flags;
 		/*
@@ -1534,6 +2432,226 @@ crypto_ret_proc(void *arg)
 }
 
 
+/*
+ * Per-CPU version of the symmetric half of crypto_proc(),  serving only
+ * the queue of the CPU it is bound to.
+ */
+static int
+crypto_cpu_proc(void *arg)
+{
+	int cpu = (int) (unsigned long) arg;
+	struct crypto_cpuq *cq = &crypto_cpuqs[cpu];
+	struct cryptop *crp, *submit;
+	struct cryptocap *cap;
+	u_int32_t hid;
+	int result, hint;
+	unsigned long q_flags;
+	int loopcount = 0;
+
+	set_current_state(TASK_INTERRUPTIBLE);
+
+	CRYPTO_CPUQ_LOCK(cq);
+	for (;;) {
+		cq->cq_all_qblocked = !list_empty(&cq->cq_q);
+
+		submit = NULL;
+		hint = 0;
+		list_for_each_entry(crp, &cq->cq_q, crp_next) {
+			hid = CRYPTO_SESID2HID(crp->crp_sid);
+			cap = crypto_checkdriver(hid);
+			KASSERT(cap != NULL, ("%s:%u Driver disappeared.",
+			    __func__, __LINE__));
+			if (cap == NULL || cap->cc_dev == NULL) {
+				/* Op needs to be migrated, process it. */
+				if (submit == NULL)
+					submit = crp;
+				break;
+			}
+			if (!test_bit(cpu, cap->cc_cpu_qblocked)) {
+				if (submit != NULL) {
+					if (CRYPTO_SESID2HID(submit->crp_sid) == hid)
+						hint = CRYPTO_HINT_MORE;
+					break;
+				} else {
+					submit = crp;
+					if ((submit->crp_flags & CRYPTO_F_BATCH) == 0)
+						break;
+					/* keep scanning for more are q'd */
+				}
+			}
+		}
+		if (submit != NULL) {
+			hid = CRYPTO_SESID2HID(submit->crp_sid);
+			cq->cq_all_qblocked = 0;
+			list_del(&submit->crp_next);
+			set_bit(cpu, crypto_drivers[hid].cc_cpu_unqblocked);
+			cap = crypto_checkdriver(hid);
+			CRYPTO_CPUQ_UNLOCK(cq);
+			KASSERT(cap != NULL, ("%s:%u Driver disappeared.",
+			    __func__, __LINE__));
+			result = crypto_invoke(cap, submit, hint);
+			CRYPTO_CPUQ_LOCK(cq);
+			if (result == ERESTART) {
+				/*
+				 * The driver ran out of resources,  block it on
+				 * this CPU unless crypto_unblock() got in while
+				 * we were unlocked,  and retry from the front.
+				 */
+				list_add(&submit->crp_next, &cq->cq_q);
+				cryptostats.cs_blocks++;
+				if (test_bit(cpu, crypto_drivers[hid].cc_cpu_unqblocked))
+					set_bit(cpu, crypto_drivers[hid].cc_cpu_qblocked);
+			}
+			clear_bit(cpu, crypto_drivers[hid].cc_cpu_unqblocked);
+		}
+
+		if (submit == NULL) {
+			dprintk("%s - sleeping (qe=%d qb=%d)\n", __FUNCTION__,
+					list_empty(&cq->cq_q), cq->cq_all_qblocked);
+			loopcount = 0;
+			CRYPTO_CPUQ_UNLOCK(cq);
+			wait_event_interruptible(cq->cq_wait,
+					!(list_empty(&cq->cq_q) || cq->cq_all_qblocked) ||
+					kthread_should_stop());
+			if (signal_pending (current)) {
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,0)
+				spin_lock_irq(&current->sigmask_lock);
+#endif
+				flush_signals(current);
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,0)
+				spin_unlock_irq(&current->sigmask_lock);
+#endif
+			}
+			CRYPTO_CPUQ_LOCK(cq);
+			dprintk("%s - awake\n", __FUNCTION__);
+			if (kthread_should_stop())
+				break;
+			cryptostats.cs_intrs++;
+		} else if (loopcount > crypto_max_loopcount) {
+			loopcount = 0;
+			CRYPTO_CPUQ_UNLOCK(cq);
+			schedule();
+			CRYPTO_CPUQ_LOCK(cq);
+		}
+		loopcount++;
+	}
+	CRYPTO_CPUQ_UNLOCK(cq);
+	return 0;
+}
+
+/*
+ * Per-CPU version of crypto_ret_proc() for symmetric ops.
+ */
+static int
+crypto_cpu_ret_proc(void *arg)
+{
+	int cpu = (int) (unsigned long) arg;
+	struct crypto_cpuq *cq = &crypto_cpuqs[cpu];
+	struct cryptop *crpt;
+	unsigned long r_flags;
+
+	set_current_state(TASK_INTERRUPTIBLE);
+
+	CRYPTO_CPURETQ_LOCK(cq);
+	for (;;) {
+		if (!list_empty(&cq->cq_ret_q)) {
+			crpt = list_entry(cq->cq_ret_q.next, typeof(*crpt), crp_next);
+			list_del(&crpt->crp_next);
+			CRYPTO_CPURETQ_UNLOCK(cq);
+			crpt->crp_callback(crpt);
+			CRYPTO_CPURETQ_LOCK(cq);
+		} else {
+			dprintk("%s - sleeping\n", __FUNCTION__);
+			CRYPTO_CPURETQ_UNLOCK(cq);
+			wait_event_interruptible(cq->cq_ret_wait,
+					!list_empty(&cq->cq_ret_q) ||
+					kthread_should_stop());
+			if (signal_pending (current)) {
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,0)
+				spin_lock_irq(&current->sigmask_lock);
+#endif
+				flush_signals(current);
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,0)
+				spin_unlock_irq(&current->sigmask_lock);
+#endif
+			}
+			CRYPTO_CPURETQ_LOCK(cq);
+			dprintk("%s - awake\n", __FUNCTION__);
+			if (kthread_should_stop()) {
+				dprintk("%s - EXITING!\n", __FUNCTION__);
+				break;
+			}
+			cryptostats.cs_rets++;
+		}
+	}
+	CRYPTO_CPURETQ_UNLOCK(cq);
+	return 0;
+}
+
+#ifdef CONFIG_HOTPLUG_CPU
+/*
+ * A CPU's queue threads are bound to it,  so once it is down anything
+ * still queued there would never be run.  Hand it to an online CPU.
+ */
+static void
+crypto_cpuq_move(int cpu)
+{
+	struct crypto_cpuq *from = &crypto_cpuqs[cpu], *to;
+	unsigned long q_flags, r_flags;
+	LIST_HEAD(q);
+	LIST_HEAD(ret_q);
+
+	CRYPTO_CPUQ_LOCK(from);
+	from->cq_dead = 1;
+	list_splice_init(&from->cq_q, &q);
+	CRYPTO_CPUQ_UNLOCK(from);
+
+	CRYPTO_CPURETQ_LOCK(from);
+	list_splice_init(&from->cq_ret_q, &ret_q);
+	CRYPTO_CPURETQ_UNLOCK(from);
+
+	to = &crypto_cpuqs[cpumask_any(cpu_online_mask)];
+
+	if (!list_empty(&q)) {
+		CRYPTO_CPUQ_LOCK(to);
+		list_splice_tail(&q, &to->cq_q);
+		wake_up_interruptible(&to->cq_wait);
+		CRYPTO_CPUQ_UNLOCK(to);
+	}
+	if (!list_empty(&ret_q)) {
+		CRYPTO_CPURETQ_LOCK(to);
+		list_splice_tail(&ret_q, &to->cq_ret_q);
+		wake_up_interruptible(&to->cq_ret_wait);
+		CRYPTO_CPURETQ_UNLOCK(to);
+	}
+}
+
+static int
+crypto_cpu_callback(struct notifier_block *nb, unsigned long action,
+		void *hcpu)
+{
+	int cpu = (int) (unsigned long) hcpu;
+	unsigned long q_flags;
+
+	switch (action & ~CPU_TASKS_FROZEN) {
+	case CPU_UP_PREPARE:
+		CRYPTO_CPUQ_LOCK(&crypto_cpuqs[cpu]);
+		crypto_cpuqs[cpu].cq_dead = 0;
+		CRYPTO_CPUQ_UNLOCK(&crypto_cpuqs[cpu]);
+		break;
+	case CPU_DEAD:
+		crypto_cpuq_move(cpu);
+		break;
+	}
+	return NOTIFY_OK;
+}
+
+static struct notifier_block crypto_cpu_notifier = {
+	.notifier_call = crypto_cpu_callback,
+};
+#endif
+
+
 #if 0 /* should put this into /proc or something */
 static void
 db_show_drivers(void)
@@ -1635,7 +2753,7 @@ DB_SHOW_COMMAND(kcrypto, db_show_kcrypto)
 static int
 crypto_init(void)
 {
-	int error;
+	int error, nglobal = 0, i;
 	unsigned long cpu;
 
 	dprintk("%s(%p)\n", __FUNCTION__, (void *) crypto_init);
@@ -1647,8 +2765,18 @@ crypto_init(void)
 	spin_lock_init(&crypto_drivers_lock);
 	spin_lock_init(&crypto_q_lock);
 	spin_lock_init(&crypto_ret_q_lock);
+	spin_lock_init(&crypto_ses_lock);
+	for (i = 0; i < CRYPTO_SES_HASH; i++) {
+		INIT_LIST_HEAD(&crypto_ses_hash[i]);
+		INIT_LIST_HEAD(&crypto_ses_byid[i]);
+	}
+	for (i = 0; i < CONFIG_NR_CPUS; i++) {
+		spin_lock_init(&crypto_pools[i].cp_lock);
+		INIT_LIST_HEAD(&crypto_pools[i].cp_free);
+	}
 
-	cryptop_zone = kmem_cache_create("cryptop", sizeof(struct cryptop),
+	cryptop_zone = kmem_cache_create("cryptop",
+				       offsetof(struct crypto_bundle, cb_desc),
 				       0, SLAB_HWCACHE_ALIGN, NULL
 #if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,23)
 				       , NULL
@@ -1679,11 +2807,75 @@ crypto_init(void)
 
 	memset(crypto_drivers, 0, crypto_drivers_num * sizeof(struct cryptocap));
 
+	if (crypto_pool_size > 0) {
+		ocf_for_each_cpu(cpu) {
+			struct crypto_pool *cp = &crypto_pools[cpu];
+
+			cp->cp_bundles = kmalloc(crypto_pool_size *
+					sizeof(struct crypto_bundle), GFP_KERNEL);
+			if (cp->cp_bundles == NULL) {
+				printk("crypto: crypto_init cannot setup request pool\n");
+				error = ENOMEM;
+				goto bad;
+			}
+			cp->cp_size = crypto_pool_size;
+			for (i = 0; i < cp->cp_size; i++) {
+				cp->cp_bundles[i].cb_pool = cp;
+				list_add_tail(&cp->cp_bundles[i].cb_crp.crp_next,
+						&cp->cp_free);
+			}
+		}
+	}
+
 	ocf_for_each_cpu(cpu) {
+		struct crypto_cpuq *cq = &crypto_cpuqs[cpu];
+
+		spin_lock_init(&cq->cq_lock);
+		spin_lock_init(&cq->cq_ret_lock);
+		INIT_LIST_HEAD(&cq->cq_q);
+		INIT_LIST_HEAD(&cq->cq_ret_q);
+		init_waitqueue_head(&cq->cq_wait);
+		init_waitqueue_head(&cq->cq_ret_wait);
+	}
+
+	ocf_for_each_cpu(cpu) {
+		if (crypto_pcpu_queues) {
+			struct crypto_cpuq *cq = &crypto_cpuqs[cpu];
+
+			cq->cq_proc = kthread_create(crypto_cpu_proc, (void *) cpu,
+									"ocf_q_%d", (int) cpu);
+			if (IS_ERR(cq->cq_proc)) {
+				error = PTR_ERR(cq->cq_proc);
+				cq->cq_proc = NULL;
+				printk("crypto: crypto_init cannot start crypto thread; error %d",
+					error);
+				goto bad;
+			}
+			kthread_bind(cq->cq_proc, cpu);
+			wake_up_process(cq->cq_proc);
+
+			cq->cq_ret_proc = kthread_create(crypto_cpu_ret_proc,
+						(void *) cpu, "ocf_qret_%d", (int) cpu);
+			if (IS_ERR(cq->cq_ret_proc)) {
+				error = PTR_ERR(cq->cq_ret_proc);
+				cq->cq_ret_proc = NULL;
+				printk("crypto: crypto_init cannot start cryptoret thread; error %d",
+					error);
+				goto bad;
+			}
+			kthread_bind(cq->cq_ret_proc, cpu);
+			wake_up_process(cq->cq_ret_proc);
+
+			/* the global threads only have asym work,  one pair will do */
+			if (nglobal)
+				continue;
+		}
+
 		cryptoproc[cpu] = kthread_create(crypto_proc, (void *) cpu,
 									"ocf_%d", (int) cpu);
 		if (IS_ERR(cryptoproc[cpu])) {
 			error = PTR_ERR(cryptoproc[cpu]);
+			cryptoproc[cpu] = NULL;
 			printk("crypto: crypto_init cannot start crypto thread; error %d",
 				error);
 			goto bad;
@@ -1695,14 +2887,21 @@ crypto_init(void)
 									"ocf_ret_%d", (int) cpu);
 		if (IS_ERR(cryptoretproc[cpu])) {
 			error = PTR_ERR(cryptoretproc[cpu]);
+			cryptoretproc[cpu] = NULL;
 			printk("crypto: crypto_init cannot start cryptoret thread; error %d",
 					error);
 			goto bad;
 		}
 		kthread_bind(cryptoretproc[cpu], cpu);
 		wake_up_process(cryptoretproc[cpu]);
+		nglobal++;
 	}
 
+#ifdef CONFIG_HOTPLUG_CPU
+	if (crypto_pcpu_queues)
+		register_hotcpu_notifier(&crypto_cpu_notifier);
+#endif
+
 	return 0;
 bad:
 	crypto_exit();
@@ -1717,12 +2916,23 @@ crypto_exit(void)
 
 	dprintk("%s()\n", __FUNCTION__);
 
+#ifdef CONFIG_HOTPLUG_CPU
+	if (crypto_pcpu_queues)
+		unregister_hotcpu_notifier(&crypto_cpu_notifier);
+#endif
+
 	/*
 	 * Terminate any crypto threads.
 	 */
 	ocf_for_each_cpu(cpu) {
-		kthread_stop(cryptoproc[cpu]);
-		kthread_stop(cryptoretproc[cpu]);
+		if (cryptoproc[cpu])
+			kthread_stop(cryptoproc[cpu]);
+		if (cryptoretproc[cpu])
+			kthread_stop(cryptoretproc[cpu]);
+		if (crypto_cpuqs[cpu].cq_proc)
+			kthread_stop(crypto_cpuqs[cpu].cq_proc);
+		if (crypto_cpuqs[cpu].cq_ret_proc)
+			kthread_stop(crypto_cpuqs[cpu].cq_ret_proc);
 	}
 
 	/* 
@@ -1730,6 +2940,13 @@ crypto_exit(void)
 	 */
 	if (crypto_drivers != NULL)
 		kfree(crypto_drivers);
+	if (crypto_vses != NULL)
+		kfree(crypto_vses);
+	ocf_for_each_cpu(cpu) {
+		if (crypto_pools[cpu].cp_bundles)
+			kfree(crypto_pools[cpu].cp_bundles);
+		crypto_pools[cpu].cp_bundles = NULL;
+	}
 
 	if (cryptodesc_zone != NULL)
 		kmem_cache_destroy(cryptodesc_zone);
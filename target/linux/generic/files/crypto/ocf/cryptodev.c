@@ -58,6 +58,9 @@ __FBSDID("$FreeBSD: src/sys/opencrypto/cryptodev.c,v 1.34 2007/05/09 19:37:02 gn
 #include <linux/file.h>
 #include <linux/mount.h>
 #include <linux/miscdevice.h>
+#include <linux/poll.h>
+#include <linux/mm.h>
+#include <linux/highmem.h>
 #include <asm/uaccess.h>
 
 #include <cryptodev.h>
@@ -70,6 +73,34 @@ int cryptodev_debug = 0;
 module_param(cryptodev_debug, int, 0644);
 MODULE_PARM_DESC(cryptodev_debug, "Enable cryptodev debug");
 
+/*
+ * Finished requests keep their bounce buffer and go back on a per-session
+ * free list for the next op on that session,  up to this many.
+ */
+static int cryptodev_cache = 16;
+module_param(cryptodev_cache, int, 0644);
+MODULE_PARM_DESC(cryptodev_cache,
+		"Requests and bounce buffers to keep per session");
+
+/*
+ * Limit on CRM_F_ASYNC requests per open descriptor that have not been
+ * collected with CIOCCRYPTPOLL.
+ */
+static int cryptodev_max_async = 256;
+module_param(cryptodev_max_async, int, 0644);
+MODULE_PARM_DESC(cryptodev_max_async,
+		"Maximum uncollected asynchronous requests per descriptor");
+
+/*
+ * Requests at least this big are done in place in the user's own pages
+ * rather than copied through a bounce buffer,  when the driver can take
+ * them.  Pinning pages costs more than copying a little data.
+ */
+static int cryptodev_zerocopy = 4096;
+module_param(cryptodev_zerocopy, int, 0644);
+MODULE_PARM_DESC(cryptodev_zerocopy,
+		"Smallest request to map rather than copy (0 to disable)");
+
 struct csession_info {
 	u_int16_t	blocksize;
 	u_int16_t	minkey, maxkey;
@@ -94,21 +125,59 @@ struct csession {
 
 	caddr_t		key;
 	int		keylen;
-	u_char		tmp_iv[EALG_MAX_BLOCK_LEN];
 
 	caddr_t		mackey;
 	int		mackeylen;
 
 	struct csession_info info;
 
-	struct iovec	iovec;
-	struct uio	uio;
+	struct fcrypt	*fcr;
+	struct list_head reqs;		/* (f) idle requests */
+	int		nreqs;		/* (f) # on reqs */
+	int		busy;		/* (f) # of requests in use */
+};
+
+/*
+ * A CRYPTO_MAX_DATA_LEN buffer that starts part way into a page can
+ * touch one page more than its length suggests.
+ */
+#define CSREQ_MAX_PAGES	((CRYPTO_MAX_DATA_LEN) / PAGE_SIZE + 2)
+
+/*
+ * One operation in flight,  with its bounce buffer or pinned user pages.
+ */
+struct csreq {
+	struct list_head	list;	/* (f) on cse->reqs or fcr->done */
+	struct csession	*cse;
+	struct cryptop	*crp;
+	struct crypt_op	cop;
+	caddr_t		uop;		/* user address of cop */
+	int		async;
 	int		error;
+
+	u_char		iv[EALG_MAX_BLOCK_LEN];
+	struct iovec	iovec[CSREQ_MAX_PAGES + 1];
+	struct uio	uio;
+	caddr_t		buf;
+	int		buflen;
+
+	struct page	*pages[CSREQ_MAX_PAGES];	/* zero-copy */
+	int		npages;
+	int		dirty;
+	u_char		mac[HASH_MAX_LEN];
 };
 
+/*
+ * (f) - protected by fcr->lock
+ */
 struct fcrypt {
 	struct list_head	csessions;
 	int		sesn;
+
+	spinlock_t	lock;
+	struct list_head done;		/* (f) async requests to collect */
+	int		async;		/* (f) # async requests not collected */
+	wait_queue_head_t waitq;	/* async completions */
 };
 
 static struct csession *csefind(struct fcrypt *, u_int);
@@ -119,6 +188,8 @@ static struct csession *csecreate(struct fcrypt *, u_int64_t,
 static int csefree(struct csession *);
 
 static	int cryptodev_op(struct csession *, struct crypt_op *);
+static	int cryptodev_multi(struct fcrypt *, struct crypt_mop *);
+static	int cryptodev_poll_results(struct fcrypt *, struct crypt_poll *);
 static	int cryptodev_key(struct crypt_kop *);
 static	int cryptodev_find(struct crypt_find_op *);
 
@@ -162,14 +233,191 @@ checkcrid(int crid)
 	return 0;
 }
 
+/*
+ * Get a request,  reusing one of the session's idle requests and its
+ * bounce buffer if there is one.
+ */
+static struct csreq *
+csreq_get(struct csession *cse)
+{
+	struct fcrypt *fcr = cse->fcr;
+	struct csreq *req = NULL;
+	unsigned long flags;
+
+	spin_lock_irqsave(&fcr->lock, flags);
+	if (!list_empty(&cse->reqs)) {
+		req = list_entry(cse->reqs.next, struct csreq, list);
+		list_del(&req->list);
+		cse->nreqs--;
+	}
+	cse->busy++;
+	spin_unlock_irqrestore(&fcr->lock, flags);
+
+	if (req == NULL) {
+		req = (struct csreq *) kmalloc(sizeof(*req), GFP_KERNEL);
+		if (req == NULL)
+			goto fail;
+		memset(req, 0, sizeof(*req));
+		INIT_LIST_HEAD(&req->list);
+		req->cse = cse;
+	}
+
+	req->crp = NULL;
+	req->uop = NULL;
+	req->async = 0;
+	req->error = 0;
+	return (req);
+
+fail:
+	spin_lock_irqsave(&fcr->lock, flags);
+	cse->busy--;
+	spin_unlock_irqrestore(&fcr->lock, flags);
+	return (NULL);
+}
+
+/*
+ * Make sure the request's bounce buffer has room for len bytes.
+ */
 static int
-cryptodev_op(struct csession *cse, struct crypt_op *cop)
+csreq_bounce(struct csreq *req, int len)
 {
-	struct cryptop *crp = NULL;
-	struct cryptodesc *crde = NULL, *crda = NULL;
-	int error = 0;
+	if (req->buflen >= len)
+		return (0);
+
+	if (req->buf)
+		kfree(req->buf);
+	req->buflen = 0;
+	req->buf = kmalloc(len, GFP_KERNEL);
+	if (req->buf == NULL) {
+		dprintk("%s: buf kmalloc(%d) failed\n", __FUNCTION__, len);
+		return (ENOMEM);
+	}
+	req->buflen = len;
+	return (0);
+}
 
-	dprintk("%s()\n", __FUNCTION__);
+/*
+ * Let go of any user pages pinned by csreq_map().
+ */
+static void
+csreq_unmap(struct csreq *req)
+{
+	int i;
+
+	for (i = 0; i < req->npages; i++) {
+		if (req->dirty) {
+			flush_dcache_page(req->pages[i]);
+			set_page_dirty_lock(req->pages[i]);
+		}
+		put_page(req->pages[i]);
+	}
+	req->npages = 0;
+	req->dirty = 0;
+}
+
+/*
+ * Point the uio straight at the user's pages instead of the bounce
+ * buffer.  The work is done in place,  so it is dst that gets pinned,
+ * src is copied over it by the caller if they differ.  Returns the
+ * number of iovecs set up,  or 0 if the request should be bounced:
+ * it is small,  the driver wants a single contiguous buffer,  there is
+ * no dst to cipher into,  src and dst partly overlap,  it isn't word
+ * aligned or it isn't all in lowmem where drivers can find it.
+ */
+static int
+csreq_map(struct csreq *req)
+{
+	struct csession *cse = req->cse;
+	struct crypt_op *cop = &req->cop;
+	unsigned long addr, off;
+	int i, n, len, rc, write;
+
+	if (cryptodev_zerocopy <= 0 || cop->len < cryptodev_zerocopy)
+		return (0);
+	if ((CRYPTO_SESID2CAPS(cse->sid) & CRYPTOCAP_F_IOVEC) == 0)
+		return (0);
+	if (cse->info.blocksize && cop->dst == NULL)
+		return (0);
+	if (((unsigned long) cop->src | (unsigned long) cop->dst) &
+			(sizeof(u_int32_t) - 1))
+		return (0);
+	if (cop->dst && cop->dst != cop->src && cop->src < cop->dst + cop->len &&
+			cop->dst < cop->src + cop->len)
+		return (0);
+
+	addr = (unsigned long) (cop->dst ? cop->dst : cop->src);
+	off = addr & ~PAGE_MASK;
+	n = (off + cop->len + PAGE_SIZE - 1) >> PAGE_SHIFT;
+	write = cop->dst != NULL;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,27)
+	rc = get_user_pages_fast(addr & PAGE_MASK, n, write, req->pages);
+#else
+	down_read(&current->mm->mmap_sem);
+	rc = get_user_pages(current, current->mm, addr & PAGE_MASK, n, write, 0,
+			req->pages, NULL);
+	up_read(&current->mm->mmap_sem);
+#endif
+	req->npages = rc > 0 ? rc : 0;
+	if (rc != n) {
+		dprintk("%s: pinned %d of %d pages\n", __FUNCTION__, rc, n);
+		goto bounce;
+	}
+
+	len = cop->len;
+	for (i = 0; i < n; i++) {
+		if (PageHighMem(req->pages[i]))
+			goto bounce;
+		/* the user may have written it through a different alias */
+		flush_dcache_page(req->pages[i]);
+		req->iovec[i].iov_base =
+				(caddr_t) page_address(req->pages[i]) + off;
+		req->iovec[i].iov_len = min_t(int, len, PAGE_SIZE - off);
+		len -= req->iovec[i].iov_len;
+		off = 0;
+	}
+	req->dirty = write;
+	return (n);
+
+bounce:
+	csreq_unmap(req);
+	return (0);
+}
+
+/*
+ * Finished with a request,  keep it for the next op if there is room.
+ */
+static void
+csreq_put(struct csreq *req)
+{
+	struct csession *cse = req->cse;
+	struct fcrypt *fcr = cse->fcr;
+	unsigned long flags;
+
+	if (req->crp) {
+		crypto_freereq(req->crp);
+		req->crp = NULL;
+	}
+	csreq_unmap(req);
+
+	spin_lock_irqsave(&fcr->lock, flags);
+	cse->busy--;
+	if (cse->nreqs < cryptodev_cache) {
+		list_add(&req->list, &cse->reqs);
+		cse->nreqs++;
+		req = NULL;
+	}
+	spin_unlock_irqrestore(&fcr->lock, flags);
+
+	if (req) {
+		kfree(req->buf);
+		kfree(req);
+	}
+}
+
+static int
+csreq_check(struct csession *cse, struct crypt_op *cop)
+{
 	if (cop->len > CRYPTO_MAX_DATA_LEN) {
 		dprintk("%s: %d > %d\n", __FUNCTION__, cop->len, CRYPTO_MAX_DATA_LEN);
 		return (E2BIG);
@@ -180,34 +428,30 @@ cryptodev_op(struct csession *cse, struct crypt_op *cop)
 				cop->len);
 		return (EINVAL);
 	}
+	return (0);
+}
 
-	cse->uio.uio_iov = &cse->iovec;
-	cse->uio.uio_iovcnt = 1;
-	cse->uio.uio_offset = 0;
-#if 0
-	cse->uio.uio_resid = cop->len;
-	cse->uio.uio_segflg = UIO_SYSSPACE;
-	cse->uio.uio_rw = UIO_WRITE;
-	cse->uio.uio_td = td;
-#endif
-	cse->uio.uio_iov[0].iov_len = cop->len;
-	if (cse->info.authsize)
-		cse->uio.uio_iov[0].iov_len += cse->info.authsize;
-	cse->uio.uio_iov[0].iov_base = kmalloc(cse->uio.uio_iov[0].iov_len,
-			GFP_KERNEL);
-
-	if (cse->uio.uio_iov[0].iov_base == NULL) {
-		dprintk("%s: iov_base kmalloc(%d) failed\n", __FUNCTION__,
-				(int)cse->uio.uio_iov[0].iov_len);
-		return (ENOMEM);
-	}
+/*
+ * Copy in the data for req->cop and hand it to the crypto core.
+ */
+static int
+csreq_dispatch(struct csreq *req)
+{
+	struct csession *cse = req->cse;
+	struct crypt_op *cop = &req->cop;
+	struct cryptop *crp;
+	struct cryptodesc *crde = NULL, *crda = NULL;
+	caddr_t src;
+	int i, n, error = 0;
+
+	dprintk("%s()\n", __FUNCTION__);
 
 	crp = crypto_getreq((cse->info.blocksize != 0) + (cse->info.authsize != 0));
 	if (crp == NULL) {
 		dprintk("%s: ENOMEM\n", __FUNCTION__);
-		error = ENOMEM;
-		goto bail;
+		return (ENOMEM);
 	}
+	req->crp = crp;
 
 	if (cse->info.authsize && cse->info.blocksize) {
 		if (cop->op == COP_ENCRYPT) {
@@ -223,15 +467,42 @@ cryptodev_op(struct csession *cse, struct crypt_op *cop)
 		crde = crp->crp_desc;
 	} else {
 		dprintk("%s: bad request\n", __FUNCTION__);
-		error = EINVAL;
-		goto bail;
+		return (EINVAL);
 	}
 
-	if ((error = copy_from_user(cse->uio.uio_iov[0].iov_base, cop->src,
-					cop->len))) {
-		dprintk("%s: bad copy\n", __FUNCTION__);
-		goto bail;
+	n = csreq_map(req);
+	if (n) {
+		if (cop->dst != cop->src) {
+			src = cop->src;
+			for (i = 0; i < n; i++) {
+				if (copy_from_user(req->iovec[i].iov_base, src,
+						req->iovec[i].iov_len)) {
+					dprintk("%s: bad copy\n", __FUNCTION__);
+					return (EFAULT);
+				}
+				src += req->iovec[i].iov_len;
+			}
+		}
+		/* MAC goes in its own segment after the user's data */
+		if (cse->info.authsize) {
+			req->iovec[n].iov_base = req->mac;
+			req->iovec[n].iov_len = cse->info.authsize;
+			n++;
+		}
+	} else {
+		if ((error = csreq_bounce(req, cop->len + cse->info.authsize)))
+			return (error);
+		req->iovec[0].iov_base = req->buf;
+		req->iovec[0].iov_len = cop->len + cse->info.authsize;
+		n = 1;
+		if (copy_from_user(req->buf, cop->src, cop->len)) {
+			dprintk("%s: bad copy\n", __FUNCTION__);
+			return (EFAULT);
+		}
 	}
+	req->uio.uio_iov = req->iovec;
+	req->uio.uio_iovcnt = n;
+	req->uio.uio_offset = 0;
 
 	if (crda) {
 		crda->crd_skip = 0;
@@ -256,31 +527,28 @@ cryptodev_op(struct csession *cse, struct crypt_op *cop)
 		crde->crd_klen = cse->keylen * 8;
 	}
 
-	crp->crp_ilen = cse->uio.uio_iov[0].iov_len;
+	crp->crp_ilen = cop->len + cse->info.authsize;
 	crp->crp_flags = CRYPTO_F_IOV | CRYPTO_F_CBIMM
 		       | (cop->flags & COP_F_BATCH);
-	crp->crp_buf = (caddr_t)&cse->uio;
+	crp->crp_buf = (caddr_t)&req->uio;
 	crp->crp_callback = (int (*) (struct cryptop *)) cryptodev_cb;
 	crp->crp_sid = cse->sid;
-	crp->crp_opaque = (void *)cse;
+	crp->crp_opaque = (void *)req;
 
 	if (cop->iv) {
 		if (crde == NULL) {
-			error = EINVAL;
 			dprintk("%s no crde\n", __FUNCTION__);
-			goto bail;
+			return (EINVAL);
 		}
 		if (cse->cipher == CRYPTO_ARC4) { /* XXX use flag? */
-			error = EINVAL;
 			dprintk("%s arc4 with IV\n", __FUNCTION__);
-			goto bail;
+			return (EINVAL);
 		}
-		if ((error = copy_from_user(cse->tmp_iv, cop->iv,
-						cse->info.blocksize))) {
+		if (copy_from_user(req->iv, cop->iv, cse->info.blocksize)) {
 			dprintk("%s bad iv copy\n", __FUNCTION__);
-			goto bail;
+			return (EFAULT);
 		}
-		memcpy(crde->crd_iv, cse->tmp_iv, cse->info.blocksize);
+		memcpy(crde->crd_iv, req->iv, cse->info.blocksize);
 		crde->crd_flags |= CRD_F_IV_EXPLICIT | CRD_F_IV_PRESENT;
 		crde->crd_skip = 0;
 	} else if (cse->cipher == CRYPTO_ARC4) { /* XXX use flag? */
@@ -292,9 +560,8 @@ cryptodev_op(struct csession *cse, struct crypt_op *cop)
 	}
 
 	if (cop->mac && crda == NULL) {
-		error = EINVAL;
 		dprintk("%s no crda\n", __FUNCTION__);
-		goto bail;
+		return (EINVAL);
 	}
 
 	/*
@@ -305,10 +572,16 @@ cryptodev_op(struct csession *cse, struct crypt_op *cop)
 	 * entry and the crypto_done callback into us.
 	 */
 	error = crypto_dispatch(crp);
-	if (error) {
+	if (error)
 		dprintk("%s error in crypto_dispatch\n", __FUNCTION__);
-		goto bail;
-	}
+	return (error);
+}
+
+static void
+csreq_wait(struct csreq *req)
+{
+	struct cryptop *crp = req->crp;
+	int error;
 
 	dprintk("%s about to WAIT\n", __FUNCTION__);
 	/*
@@ -329,40 +602,207 @@ cryptodev_op(struct csession *cse, struct crypt_op *cop)
 			error = 0;
 		}
 	} while ((crp->crp_flags & CRYPTO_F_DONE) == 0);
-	dprintk("%s finished WAITING error=%d\n", __FUNCTION__, error);
+	dprintk("%s finished WAITING\n", __FUNCTION__);
+}
+
+/*
+ * Copy the results of a completed request back out to the user.
+ */
+static int
+csreq_finish(struct csreq *req)
+{
+	struct csession *cse = req->cse;
+	struct crypt_op *cop = &req->cop;
+	struct cryptop *crp = req->crp;
+	caddr_t mac;
 
 	if (crp->crp_etype != 0) {
-		error = crp->crp_etype;
 		dprintk("%s error in crp processing\n", __FUNCTION__);
-		goto bail;
+		return (crp->crp_etype);
 	}
 
-	if (cse->error) {
-		error = cse->error;
+	if (req->error) {
 		dprintk("%s error in cse processing\n", __FUNCTION__);
-		goto bail;
+		return (req->error);
 	}
 
-	if (cop->dst && (error = copy_to_user(cop->dst,
-					cse->uio.uio_iov[0].iov_base, cop->len))) {
+	/* zero-copy requests already have their data in dst */
+	if (cop->dst && req->npages == 0 &&
+			copy_to_user(cop->dst, req->buf, cop->len)) {
 		dprintk("%s bad dst copy\n", __FUNCTION__);
-		goto bail;
+		return (EFAULT);
 	}
 
-	if (cop->mac &&
-			(error=copy_to_user(cop->mac,
-				(caddr_t)cse->uio.uio_iov[0].iov_base + cop->len,
-				cse->info.authsize))) {
+	mac = req->npages ? (caddr_t) req->mac : req->buf + cop->len;
+	if (cop->mac && copy_to_user(cop->mac, mac, cse->info.authsize)) {
 		dprintk("%s bad mac copy\n", __FUNCTION__);
-		goto bail;
+		return (EFAULT);
 	}
 
-bail:
-	if (crp)
-		crypto_freereq(crp);
-	if (cse->uio.uio_iov[0].iov_base)
-		kfree(cse->uio.uio_iov[0].iov_base);
+	return (0);
+}
+
+static int
+cryptodev_op(struct csession *cse, struct crypt_op *cop)
+{
+	struct csreq *req;
+	int error;
+
+	dprintk("%s()\n", __FUNCTION__);
+	if ((error = csreq_check(cse, cop)))
+		return (error);
+
+	req = csreq_get(cse);
+	if (req == NULL)
+		return (ENOMEM);
+	req->cop = *cop;
+
+	error = csreq_dispatch(req);
+	if (error == 0) {
+		csreq_wait(req);
+		error = csreq_finish(req);
+	}
+	csreq_put(req);
+
+	return (error);
+}
+
+/*
+ * CIOCCRYPTMULTI.  Everything is dispatched before we wait for any of
+ * it,  so a driver that batches (COP_F_BATCH) gets to see the lot.
+ */
+static int
+cryptodev_multi(struct fcrypt *fcr, struct crypt_mop *mop)
+{
+	struct csreq *reqs[CRYPTO_MAX_MULTI];
+	int errs[CRYPTO_MAX_MULTI];
+	struct csession *cse;
+	struct crypt_op cop;
+	struct crypt_res res;
+	struct csreq *req;
+	unsigned long flags;
+	int async = (mop->crm_flags & CRM_F_ASYNC) != 0;
+	int i, n = 0, error = 0;
+
+	dprintk("%s(count=%u flags=%x)\n", __FUNCTION__, mop->crm_count,
+			mop->crm_flags);
+	if (mop->crm_count > CRYPTO_MAX_MULTI)
+		return (E2BIG);
+
+	for (i = 0; i < mop->crm_count; i++) {
+		reqs[i] = NULL;
+		if (copy_from_user(&cop, &mop->crm_ops[i], sizeof(cop)))
+			errs[i] = EFAULT;
+		else if ((cse = csefind(fcr, cop.ses)) == NULL)
+			errs[i] = EINVAL;
+		else
+			errs[i] = csreq_check(cse, &cop);
+		if (errs[i])
+			continue;
+
+		if (async) {
+			spin_lock_irqsave(&fcr->lock, flags);
+			if (fcr->async >= cryptodev_max_async)
+				errs[i] = ENOBUFS;
+			else
+				fcr->async++;
+			spin_unlock_irqrestore(&fcr->lock, flags);
+			if (errs[i])
+				continue;
+		}
+
+		req = csreq_get(cse);
+		if (req == NULL)
+			errs[i] = ENOMEM;
+		else {
+			req->cop = cop;
+			req->uop = (caddr_t) &mop->crm_ops[i];
+			req->async = async;
+			errs[i] = csreq_dispatch(req);
+			if (errs[i])
+				csreq_put(req);
+			else if (!async)
+				reqs[i] = req;
+			/* else it is the callback's,  don't touch it */
+		}
+
+		if (errs[i] == 0)
+			n++;
+		else if (async) {
+			spin_lock_irqsave(&fcr->lock, flags);
+			fcr->async--;
+			spin_unlock_irqrestore(&fcr->lock, flags);
+		}
+	}
+
+	for (i = 0; i < mop->crm_count; i++) {
+		if (reqs[i]) {
+			csreq_wait(reqs[i]);
+			errs[i] = csreq_finish(reqs[i]);
+			csreq_put(reqs[i]);
+			if (errs[i])
+				n--;
+		}
+		res.cr_op = (caddr_t) &mop->crm_ops[i];
+		res.cr_error = errs[i];
+		if (copy_to_user(&mop->crm_res[i], &res, sizeof(res)))
+			error = EFAULT;
+	}
+
+	mop->crm_count = n;
+	return (error);
+}
+
+/*
+ * CIOCCRYPTPOLL,  collect finished CRM_F_ASYNC requests.
+ */
+static int
+cryptodev_poll_results(struct fcrypt *fcr, struct crypt_poll *pl)
+{
+	struct crypt_res res;
+	struct csreq *req;
+	unsigned long flags;
+	int n = 0, error = 0;
+	long rc = 0;
+
+	dprintk("%s(count=%u timeout=%d)\n", __FUNCTION__, pl->crpl_count,
+			pl->crpl_timeout);
+
+	/* nothing outstanding means nothing to wait for */
+	if (pl->crpl_timeout && fcr->async) {
+		if (pl->crpl_timeout < 0)
+			rc = wait_event_interruptible(fcr->waitq,
+					!list_empty(&fcr->done));
+		else
+			rc = wait_event_interruptible_timeout(fcr->waitq,
+					!list_empty(&fcr->done),
+					msecs_to_jiffies(pl->crpl_timeout));
+		if (rc < 0)
+			return (EINTR);
+	}
+
+	while (n < pl->crpl_count) {
+		spin_lock_irqsave(&fcr->lock, flags);
+		if (list_empty(&fcr->done)) {
+			spin_unlock_irqrestore(&fcr->lock, flags);
+			break;
+		}
+		req = list_entry(fcr->done.next, struct csreq, list);
+		list_del(&req->list);
+		fcr->async--;
+		spin_unlock_irqrestore(&fcr->lock, flags);
+
+		res.cr_op = req->uop;
+		res.cr_error = csreq_finish(req);
+		csreq_put(req);
+		if (copy_to_user(&pl->crpl_res[n], &res, sizeof(res))) {
+			error = EFAULT;
+			break;
+		}
+		n++;
+	}
 
+	pl->crpl_count = n;
 	return (error);
 }
 
@@ -370,7 +810,9 @@ static int
 cryptodev_cb(void *op)
 {
 	struct cryptop *crp = (struct cryptop *) op;
-	struct csession *cse = (struct csession *)crp->crp_opaque;
+	struct csreq *req = (struct csreq *)crp->crp_opaque;
+	struct fcrypt *fcr = req->cse->fcr;
+	unsigned long flags;
 	int error;
 
 	dprintk("%s()\n", __FUNCTION__);
@@ -387,8 +829,18 @@ cryptodev_cb(void *op)
 		return crypto_dispatch(crp);
 	}
 	if (error != 0 || (crp->crp_flags & CRYPTO_F_DONE)) {
-		cse->error = error;
-		wake_up_interruptible(&crp->crp_waitq);
+		req->error = error;
+		if (req->async) {
+			/*
+			 * wake up under the lock,  once it is on the done list
+			 * release may free fcr as soon as we let go.
+			 */
+			spin_lock_irqsave(&fcr->lock, flags);
+			list_add_tail(&req->list, &fcr->done);
+			wake_up(&fcr->waitq);
+			spin_unlock_irqrestore(&fcr->lock, flags);
+		} else
+			wake_up_interruptible(&crp->crp_waitq);
 	}
 	return (0);
 }
@@ -589,6 +1041,8 @@ csecreate(struct fcrypt *fcr, u_int64_t sid, struct cryptoini *crie,
 
 	INIT_LIST_HEAD(&cse->list);
 	init_waitqueue_head(&cse->waitq);
+	INIT_LIST_HEAD(&cse->reqs);
+	cse->fcr = fcr;
 
 	cse->key = crie->cri_key;
 	cse->keylen = crie->cri_klen/8;
@@ -605,9 +1059,15 @@ csecreate(struct fcrypt *fcr, u_int64_t sid, struct cryptoini *crie,
 static int
 csefree(struct csession *cse)
 {
+	struct csreq *req, *tmp;
 	int error;
 
 	dprintk("%s()\n", __FUNCTION__);
+	list_for_each_entry_safe(req, tmp, &cse->reqs, list) {
+		list_del(&req->list);
+		kfree(req->buf);
+		kfree(req);
+	}
 	error = crypto_freesession(cse->sid);
 	if (cse->key)
 		kfree(cse->key);
@@ -632,6 +1092,8 @@ cryptodev_ioctl(
 	struct crypt_op cop;
 	struct crypt_kop kop;
 	struct crypt_find_op fop;
+	struct crypt_mop mop;
+	struct crypt_poll pl;
 	u_int64_t sid;
 	u_int32_t ses = 0;
 	int feat, fd, error = 0, crid;
@@ -878,6 +1340,11 @@ bail:
 			dprintk("%s(CIOCFSESSION) - Fail %d\n", __FUNCTION__, error);
 			break;
 		}
+		if (cse->busy) {
+			error = EBUSY;
+			dprintk("%s(CIOCFSESSION) - requests in use\n", __FUNCTION__);
+			break;
+		}
 		csedelete(fcr, cse);
 		error = csefree(cse);
 		break;
@@ -901,6 +1368,32 @@ bail:
 			goto bail;
 		}
 		break;
+	case CIOCCRYPTMULTI:
+		dprintk("%s(CIOCCRYPTMULTI)\n", __FUNCTION__);
+		if (copy_from_user(&mop, (void*)arg, sizeof(mop))) {
+			dprintk("%s(CIOCCRYPTMULTI) - bad copy\n", __FUNCTION__);
+			error = EFAULT;
+			break;
+		}
+		error = cryptodev_multi(fcr, &mop);
+		if (copy_to_user((void*)arg, &mop, sizeof(mop))) {
+			dprintk("%s(CIOCCRYPTMULTI) - bad return copy\n", __FUNCTION__);
+			error = EFAULT;
+		}
+		break;
+	case CIOCCRYPTPOLL:
+		dprintk("%s(CIOCCRYPTPOLL)\n", __FUNCTION__);
+		if (copy_from_user(&pl, (void*)arg, sizeof(pl))) {
+			dprintk("%s(CIOCCRYPTPOLL) - bad copy\n", __FUNCTION__);
+			error = EFAULT;
+			break;
+		}
+		error = cryptodev_poll_results(fcr, &pl);
+		if (copy_to_user((void*)arg, &pl, sizeof(pl))) {
+			dprintk("%s(CIOCCRYPTPOLL) - bad return copy\n", __FUNCTION__);
+			error = EFAULT;
+		}
+		break;
 	case CIOCKEY:
 	case CIOCKEY2:
 		dprintk("%s(CIOCKEY)\n", __FUNCTION__);
@@ -996,15 +1489,37 @@ cryptodev_open(struct inode *inode, struct file *filp)
 	memset(fcr, 0, sizeof(*fcr));
 
 	INIT_LIST_HEAD(&fcr->csessions);
+	spin_lock_init(&fcr->lock);
+	INIT_LIST_HEAD(&fcr->done);
+	init_waitqueue_head(&fcr->waitq);
 	filp->private_data = fcr;
 	return(0);
 }
 
+/*
+ * true once every async request is on the done list
+ */
+static int
+cryptodev_all_done(struct fcrypt *fcr)
+{
+	struct list_head *l;
+	unsigned long flags;
+	int n = 0;
+
+	spin_lock_irqsave(&fcr->lock, flags);
+	list_for_each(l, &fcr->done)
+		n++;
+	n = (n == fcr->async);
+	spin_unlock_irqrestore(&fcr->lock, flags);
+	return (n);
+}
+
 static int
 cryptodev_release(struct inode *inode, struct file *filp)
 {
 	struct fcrypt *fcr = filp->private_data;
 	struct csession *cse, *tmp;
+	struct csreq *req, *rtmp;
 
 	dprintk("%s()\n", __FUNCTION__);
 	if (!filp) {
@@ -1012,6 +1527,16 @@ cryptodev_release(struct inode *inode, struct file *filp)
 		return(0);
 	}
 
+	/*
+	 * Async requests still with a driver have to finish before their
+	 * sessions can go,  then the uncollected results are dropped.
+	 */
+	wait_event(fcr->waitq, cryptodev_all_done(fcr));
+	list_for_each_entry_safe(req, rtmp, &fcr->done, list) {
+		list_del(&req->list);
+		csreq_put(req);
+	}
+
 	list_for_each_entry_safe(cse, tmp, &fcr->csessions, list) {
 		list_del(&cse->list);
 		(void)csefree(cse);
@@ -1021,10 +1546,20 @@ cryptodev_release(struct inode *inode, struct file *filp)
 	return(0);
 }
 
+static unsigned int
+cryptodev_poll(struct file *filp, struct poll_table_struct *wait)
+{
+	struct fcrypt *fcr = filp->private_data;
+
+	poll_wait(filp, &fcr->waitq, wait);
+	return list_empty(&fcr->done) ? 0 : (POLLIN | POLLRDNORM);
+}
+
 static struct file_operations cryptodev_fops = {
 	.owner = THIS_MODULE,
 	.open = cryptodev_open,
 	.release = cryptodev_release,
+	.poll = cryptodev_poll,
 #if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,36)
 	.ioctl = cryptodev_ioctl,
 #endif
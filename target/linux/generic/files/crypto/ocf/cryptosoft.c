@@ -50,6 +50,7 @@
 #include <linux/random.h>
 #include <linux/interrupt.h>
 #include <linux/spinlock.h>
+#include <linux/workqueue.h>
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,10)
 #include <linux/scatterlist.h>
 #endif
@@ -76,6 +77,7 @@ struct {
 #define SW_TYPE_ASYNC		0x8000
 
 #define SW_TYPE_INUSE		0x10000000
+#define SW_TYPE_KEYED		0x20000000	/* hmac key already in the tfm */
 
 /* We change some of the above if we have an async interface */
 
@@ -85,7 +87,11 @@ struct {
 #define SW_TYPE_AHASH		(SW_TYPE_HASH | SW_TYPE_ASYNC)
 #define SW_TYPE_AHMAC		(SW_TYPE_HMAC | SW_TYPE_ASYNC)
 
-#define SCATTERLIST_MAX 16
+/*
+ * Room for a CRYPTO_MAX_DATA_LEN user buffer mapped a page at a time by
+ * cryptodev,  plus its MAC.
+ */
+#define SCATTERLIST_MAX 20
 
 struct swcr_data {
 	struct work_struct  workq;
@@ -93,6 +99,7 @@ struct swcr_data {
 	int					sw_alg;
 	struct crypto_tfm	*sw_tfm;
 	spinlock_t			sw_tfm_lock;
+	struct list_head	sw_waiting;	/* swcr_req's waiting for INUSE */
 	union {
 		struct {
 			char *sw_key;
@@ -105,6 +112,7 @@ struct swcr_data {
 };
 
 struct swcr_req {
+	struct list_head	 list;
 	struct swcr_data	*sw_head;
 	struct swcr_data	*sw;
 	struct cryptop		*crp;
@@ -121,6 +129,38 @@ static kmem_cache_t *swcr_req_cache;
 static struct kmem_cache *swcr_req_cache;
 #endif
 
+#ifndef CONFIG_NR_CPUS
+#define CONFIG_NR_CPUS 1
+#endif
+
+/*
+ * With swcr_defer set,  swcr_process() only queues the request on the
+ * submitting CPU's list and the real work is done from our own per-CPU
+ * workqueue,  a batch of requests for the same session at a time.  That
+ * keeps the crypto out of softirq context,  spreads it over the CPUs
+ * that submitted it,  and lets the scheduler run other work between
+ * batches.  Without it requests are done inline as before.
+ *
+ * Either way a request that finds its hash tfm busy waits on the session's
+ * sw_waiting list,  and the request that releases the tfm hands it to the
+ * workqueue.  Nothing spins on the tfm.
+ */
+struct swcr_cpu {
+	spinlock_t			lock;
+	struct list_head	q;		/* swcr_req's waiting to run */
+	struct work_struct	work;
+} ____cacheline_aligned;
+
+static struct swcr_cpu swcr_cpus[CONFIG_NR_CPUS];
+static struct workqueue_struct *swcr_wq;
+
+/*
+ * Requests accepted but not yet completed.  Past swcr_max_inflight we
+ * return ERESTART and let OCF hold on to the work until we catch up.
+ */
+static atomic_t swcr_inflight = ATOMIC_INIT(0);
+static int swcr_blocked;
+
 #ifndef CRYPTO_TFM_MODE_CBC
 /*
  * As of linux-2.6.21 this is no longer defined, and presumably no longer
@@ -263,6 +303,21 @@ module_param(swcr_no_ablk, int, 0644);
 MODULE_PARM_DESC(swcr_no_ablk,
                 "Do not use async blk ciphers even if available");
 
+int swcr_defer = 0;
+module_param(swcr_defer, int, 0444);
+MODULE_PARM_DESC(swcr_defer,
+                "Process requests from a per-CPU workqueue rather than inline");
+
+int swcr_batch = 16;
+module_param(swcr_batch, int, 0644);
+MODULE_PARM_DESC(swcr_batch,
+                "Maximum requests for one session processed back to back");
+
+int swcr_max_inflight = 256;
+module_param(swcr_max_inflight, int, 0644);
+MODULE_PARM_DESC(swcr_max_inflight,
+                "Maximum requests in progress before pushing back (0 unlimited)");
+
 static struct swcr_data **swcr_sessions = NULL;
 static u_int32_t swcr_sesnum = 0;
 
@@ -320,7 +375,7 @@ execute_later(void (fn)(void *), void *arg)
 
 	w = (execute_later_t *) kmalloc(sizeof(execute_later_t), SLAB_ATOMIC);
 	if (w) {
-		memset(w, '\0', sizeof(w));
+		memset(w, '\0', sizeof(*w));
 		w->func = fn;
 		w->arg = arg;
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,20)
@@ -328,10 +383,95 @@ execute_later(void (fn)(void *), void *arg)
 #else
 		INIT_WORK(&w->wq, doing_it_now, w);
 #endif
-		schedule_work(&w->wq);
+		if (swcr_wq)
+			queue_work(swcr_wq, &w->wq);
+		else
+			schedule_work(&w->wq);
+	}
+}
+
+/*
+ * Run the requests queued on one CPU,  up to swcr_batch at a time for the
+ * session at the head of the queue,  in the order they arrived.
+ */
+static void
+swcr_cpu_run(struct swcr_cpu *sc)
+{
+	struct swcr_req *req, *tmp;
+	struct swcr_data *head;
+	unsigned long flags;
+	LIST_HEAD(batch);
+	int n;
+
+	for (;;) {
+		spin_lock_irqsave(&sc->lock, flags);
+		if (list_empty(&sc->q)) {
+			spin_unlock_irqrestore(&sc->lock, flags);
+			break;
+		}
+		head = list_entry(sc->q.next, struct swcr_req, list)->sw_head;
+		n = 0;
+		list_for_each_entry_safe(req, tmp, &sc->q, list) {
+			if (req->sw_head != head)
+				continue;
+			list_move_tail(&req->list, &batch);
+			if (++n >= swcr_batch)
+				break;
+		}
+		spin_unlock_irqrestore(&sc->lock, flags);
+
+		list_for_each_entry_safe(req, tmp, &batch, list) {
+			list_del(&req->list);
+			swcr_process_req(req);
+		}
+		cond_resched();
 	}
 }
 
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,20)
+static void
+swcr_cpu_work(struct work_struct *work)
+{
+	swcr_cpu_run(container_of(work, struct swcr_cpu, work));
+}
+#else
+static void
+swcr_cpu_work(void *arg)
+{
+	swcr_cpu_run((struct swcr_cpu *) arg);
+}
+#endif
+
+/*
+ * Queue a request for the workqueue on this CPU.
+ */
+static void
+swcr_defer_req(struct swcr_req *req)
+{
+	struct swcr_cpu *sc;
+	unsigned long flags;
+
+	sc = &swcr_cpus[get_cpu()];
+	spin_lock_irqsave(&sc->lock, flags);
+	list_add_tail(&req->list, &sc->q);
+	spin_unlock_irqrestore(&sc->lock, flags);
+	queue_work(swcr_wq, &sc->work);
+	put_cpu();
+}
+
+/*
+ * A request is finished with,  if we pushed back on OCF because too many
+ * were in progress,  let it know there is room again.
+ */
+static void
+swcr_inflight_done(void)
+{
+	atomic_dec(&swcr_inflight);
+	smp_mb();
+	if (swcr_blocked && xchg(&swcr_blocked, 0))
+		crypto_unblock(swcr_id, CRYPTO_SYMQ);
+}
+
 /*
  * Generate a new software session.
  */
@@ -418,6 +558,7 @@ swcr_newsession(device_t dev, u_int32_t *sid, struct cryptoini *cri)
 		(*swd)->sw_alg = cri->cri_alg;
 
 		spin_lock_init(&(*swd)->sw_tfm_lock);
+		INIT_LIST_HEAD(&(*swd)->sw_waiting);
 
 		/* Algorithm specific configuration */
 		switch (cri->cri_alg) {
@@ -624,10 +765,18 @@ static void swcr_process_req_complete(struct swcr_req *req)
 	dprintk("%s()\n", __FUNCTION__);
 
 	if (req->sw->sw_type & SW_TYPE_INUSE) {
+		struct swcr_req *next = NULL;
 		unsigned long flags;
 		spin_lock_irqsave(&req->sw->sw_tfm_lock, flags);
 		req->sw->sw_type &= ~SW_TYPE_INUSE;
+		if (!list_empty(&req->sw->sw_waiting)) {
+			next = list_entry(req->sw->sw_waiting.next, struct swcr_req, list);
+			list_del(&next->list);
+		}
 		spin_unlock_irqrestore(&req->sw->sw_tfm_lock, flags);
+		/* the first one waiting for the tfm can have another go */
+		if (next)
+			swcr_defer_req(next);
 	}
 
 	if (req->crp->crp_etype)
@@ -668,6 +817,7 @@ done:
 	dprintk("%s crypto_done %p\n", __FUNCTION__, req);
 	crypto_done(req->crp);
 	kmem_cache_free(swcr_req_cache, req);
+	swcr_inflight_done();
 }
 
 #if defined(HAVE_ABLKCIPHER) || defined(HAVE_AHASH)
@@ -733,8 +883,9 @@ static void swcr_process_req(struct swcr_req *req)
 		unsigned long flags;
 		spin_lock_irqsave(&sw->sw_tfm_lock, flags);
 		if (sw->sw_type & SW_TYPE_INUSE) {
+			/* park it until swcr_process_req_complete() frees the tfm */
+			list_add_tail(&req->list, &sw->sw_waiting);
 			spin_unlock_irqrestore(&sw->sw_tfm_lock, flags);
-			execute_later((void (*)(void *))swcr_process_req, (void *)req);
 			return;
 		}
 		sw->sw_type |= SW_TYPE_INUSE;
@@ -847,9 +998,11 @@ static void swcr_process_req(struct swcr_req *req)
 
 		memset(req->result, 0, sizeof(req->result));
 
-		if (sw->sw_type & SW_TYPE_AHMAC)
-			crypto_ahash_setkey(__crypto_ahash_cast(sw->sw_tfm),
-					sw->u.hmac.sw_key, sw->u.hmac.sw_klen);
+		/* the key never changes and only this session uses the tfm */
+		if ((sw->sw_type & (SW_TYPE_AHMAC|SW_TYPE_KEYED)) == SW_TYPE_AHMAC &&
+				crypto_ahash_setkey(__crypto_ahash_cast(sw->sw_tfm),
+					sw->u.hmac.sw_key, sw->u.hmac.sw_klen) == 0)
+			sw->sw_type |= SW_TYPE_KEYED;
 		ahash_request_set_crypt(req->crypto_req, req->sg, req->result, sg_len);
 		ret = crypto_ahash_digest(req->crypto_req);
 		switch (ret) {
@@ -1066,8 +1219,10 @@ static void swcr_process_req(struct swcr_req *req)
 			crypto_hmac(sw->sw_tfm, sw->u.hmac.sw_key, &sw->u.hmac.sw_klen,
 					req->sg, sg_num, result);
 #else
-			crypto_hash_setkey(desc.tfm, sw->u.hmac.sw_key,
-					sw->u.hmac.sw_klen);
+			if ((sw->sw_type & SW_TYPE_KEYED) == 0 &&
+					crypto_hash_setkey(desc.tfm, sw->u.hmac.sw_key,
+						sw->u.hmac.sw_klen) == 0)
+				sw->sw_type |= SW_TYPE_KEYED;
 			crypto_hash_digest(&desc, req->sg, sg_len, result);
 #endif /* LINUX_VERSION_CODE < KERNEL_VERSION(2,6,19) */
 			
@@ -1206,6 +1361,18 @@ swcr_process(device_t dev, struct cryptop *crp, int hint)
 		}
 	}
 
+	/*
+	 * too much on already,  OCF will retry after swcr_inflight_done()
+	 */
+	if (swcr_max_inflight > 0 &&
+			atomic_read(&swcr_inflight) >= swcr_max_inflight) {
+		swcr_blocked = 1;
+		smp_mb();
+		if (atomic_read(&swcr_inflight) >= swcr_max_inflight)
+			return ERESTART;
+		swcr_blocked = 0;
+	}
+
 	/*
 	 * setup a new request ready for queuing
 	 */
@@ -1221,7 +1388,11 @@ swcr_process(device_t dev, struct cryptop *crp, int hint)
 	req->crp = crp;
 	req->crd = crp->crp_desc;
 
-	swcr_process_req(req);
+	atomic_inc(&swcr_inflight);
+	if (swcr_defer)
+		swcr_defer_req(req);
+	else
+		swcr_process_req(req);
 	return 0;
 
 done:
@@ -1251,12 +1422,37 @@ cryptosoft_init(void)
 		return -ENOENT;
 	}
 
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,36)
+	swcr_wq = alloc_workqueue("cryptosoft", WQ_CPU_INTENSIVE | WQ_MEM_RECLAIM, 0);
+#else
+	swcr_wq = create_workqueue("cryptosoft");
+#endif
+	if (!swcr_wq) {
+		printk("cryptosoft: failed to create workqueue\n");
+		kmem_cache_destroy(swcr_req_cache);
+		return -ENOMEM;
+	}
+	for (i = 0; i < CONFIG_NR_CPUS; i++) {
+		spin_lock_init(&swcr_cpus[i].lock);
+		INIT_LIST_HEAD(&swcr_cpus[i].q);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,20)
+		INIT_WORK(&swcr_cpus[i].work, swcr_cpu_work);
+#else
+		INIT_WORK(&swcr_cpus[i].work, swcr_cpu_work, &swcr_cpus[i]);
+#endif
+	}
+
 	softc_device_init(&swcr_softc, "cryptosoft", 0, swcr_methods);
 
+	/* deferred requests complete after swcr_process() returns */
 	swcr_id = crypto_get_driverid(softc_get_device(&swcr_softc),
-			CRYPTOCAP_F_SOFTWARE | CRYPTOCAP_F_SYNC);
+			CRYPTOCAP_F_SOFTWARE | CRYPTOCAP_F_IOVEC |
+			(swcr_defer ? 0 : CRYPTOCAP_F_SYNC));
 	if (swcr_id < 0) {
 		printk("cryptosoft: Software crypto device cannot initialize!");
+		destroy_workqueue(swcr_wq);
+		swcr_wq = NULL;
+		kmem_cache_destroy(swcr_req_cache);
 		return -ENODEV;
 	}
 
@@ -1311,6 +1507,8 @@ cryptosoft_exit(void)
 	dprintk("%s()\n", __FUNCTION__);
 	crypto_unregister_all(swcr_id);
 	swcr_id = -1;
+	destroy_workqueue(swcr_wq);
+	swcr_wq = NULL;
 	kmem_cache_destroy(swcr_req_cache);
 }
 
@@ -42,6 +42,14 @@
 #include <linux/sched.h>
 #include <linux/spinlock.h>
 #include <linux/interrupt.h>
+#include <linux/jiffies.h>
+#include <linux/ktime.h>
+#include <linux/sort.h>
+#ifdef CONFIG_DEBUG_FS
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#endif
+#include <asm/div64.h>
 #include <cryptodev.h>
 
 #ifdef I_HAVE_AN_XSCALE_WITH_INTEL_SDK
@@ -99,6 +107,43 @@ static int request_cbimm = 1;
 module_param(request_cbimm, int, 0);
 MODULE_PARM_DESC(request_cbimm, "enable OCF immediate callback on completion");
 
+/*
+ * spread the requests over up to this many CPUs,  running once for each
+ * power of two so we can see how OCF scales (see crypto_pcpu_queues)
+ */
+static int request_cpus = 0;
+module_param(request_cpus, int, 0);
+MODULE_PARM_DESC(request_cpus, "measure scaling over up to this many CPUs");
+
+/*
+ * instead of the single AES/SHA1 run,  sweep every driver,  every algorithm
+ * it registered,  and each of suite_sizes and suite_depths.  The module then
+ * stays loaded so the results can be read from debugfs (ocf-bench/results)
+ */
+static int request_suite = 0;
+module_param(request_suite, int, 0);
+MODULE_PARM_DESC(request_suite, "run the driver/algorithm/size/depth matrix");
+
+#define SUITE_MAX	8
+
+static int suite_sizes[SUITE_MAX] = { 64, 512, 1488, 4096, 16384 };
+static int suite_nsizes = 5;
+module_param_array(suite_sizes, int, &suite_nsizes, 0);
+MODULE_PARM_DESC(suite_sizes, "request sizes for the suite");
+
+static int suite_depths[SUITE_MAX] = { 1, 4, 16, 64 };
+static int suite_ndepths = 4;
+module_param_array(suite_depths, int, &suite_ndepths, 0);
+MODULE_PARM_DESC(suite_depths, "outstanding requests for the suite");
+
+static int suite_msecs = 200;
+module_param(suite_msecs, int, 0);
+MODULE_PARM_DESC(suite_msecs, "run each suite test for at least this long");
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,27)
+#define schedule_work_on(cpu, work)	schedule_work(work)
+#endif
+
 /*
  * a structure for each request
  */
@@ -108,59 +153,134 @@ typedef struct  {
 	IX_MBUF mbuf;
 #endif
 	unsigned char *buffer;
+	int cpu;		/* submit on this CPU,  -1 for anywhere */
+	ktime_t start;		/* when it was dispatched */
 } request_t;
 
 static request_t *requests;
+static int requests_num;	/* allocated,  the deepest queue we run */
+static int buffer_size;		/* the largest request we run */
 
 static spinlock_t ocfbench_counter_lock;
 static int outstanding;
 static int total;
+static int errors;
+
+/*
+ * the latency of the last OCF_LAT_SAMPLES requests in a run,  in ns
+ */
+#define OCF_LAT_SAMPLES	4096
+static u32 *ocf_lat;
+static int ocf_nlat;
 
 /*************************************************************************/
 /*
  * OCF benchmark routines
  */
 
+/*
+ * enough to drive each algorithm,  keys are the first klen bits of ocf_key
+ */
+struct ocf_alg {
+	int alg;
+	char *name;
+	int klen;		/* in bits */
+	int blocksize;		/* 0 for a hash,  which appends its MAC */
+};
+
+static struct ocf_alg ocf_algs[] = {
+	{ CRYPTO_DES_CBC,        "des-cbc",        64,  8 },
+	{ CRYPTO_3DES_CBC,       "3des-cbc",       192, 8 },
+	{ CRYPTO_BLF_CBC,        "blowfish-cbc",   128, 8 },
+	{ CRYPTO_CAST_CBC,       "cast-cbc",       128, 8 },
+	{ CRYPTO_SKIPJACK_CBC,   "skipjack-cbc",   80,  8 },
+	{ CRYPTO_AES_CBC,        "aes-cbc",        192, 16 },
+	{ CRYPTO_CAMELLIA_CBC,   "camellia-cbc",   128, 16 },
+	{ CRYPTO_ARC4,           "arc4",           128, 1 },
+	{ CRYPTO_NULL_CBC,       "null-cbc",       0,   1 },
+	{ CRYPTO_MD5_HMAC,       "md5-hmac",       128, 0 },
+	{ CRYPTO_SHA1_HMAC,      "sha1-hmac",      160, 0 },
+	{ CRYPTO_RIPEMD160_HMAC, "ripemd160-hmac", 160, 0 },
+	{ CRYPTO_SHA2_256_HMAC,  "sha256-hmac",    256, 0 },
+	{ CRYPTO_SHA2_384_HMAC,  "sha384-hmac",    384, 0 },
+	{ CRYPTO_SHA2_512_HMAC,  "sha512-hmac",    512, 0 },
+	{ CRYPTO_NULL_HMAC,      "null-hmac",      0,   0 },
+	{ CRYPTO_MD5,            "md5",            0,   0 },
+	{ CRYPTO_SHA1,           "sha1",           0,   0 },
+	{ CRYPTO_SHA2_256,       "sha256",         0,   0 },
+	{ CRYPTO_SHA2_384,       "sha384",         0,   0 },
+	{ CRYPTO_SHA2_512,       "sha512",         0,   0 },
+	{ CRYPTO_RIPEMD160,      "ripemd160",      0,   0 },
+};
+
+#define OCF_NALGS	(sizeof(ocf_algs) / sizeof(ocf_algs[0]))
+
+static char ocf_key[] =
+	"0123456789abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ+/";
+
+/*
+ * the test currently running
+ */
 static uint64_t ocf_cryptoid;
+static struct ocf_alg *ocf_cipher, *ocf_mac;
+static int ocf_size;
+static unsigned long ocf_runtime;	/* in jiffies */
 static unsigned long jstart, jstop;
+static ktime_t kstart, kstop;
 
-static int ocf_init(void);
+static int ocf_init(struct ocf_alg *cipher, struct ocf_alg *mac, int crid);
 static int ocf_cb(struct cryptop *crp);
 static void ocf_request(void *arg);
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,20)
 static void ocf_request_wq(struct work_struct *work);
 #endif
 
+static struct ocf_alg *
+ocf_find_alg(int alg)
+{
+	int i;
+
+	for (i = 0; i < OCF_NALGS; i++)
+		if (ocf_algs[i].alg == alg)
+			return &ocf_algs[i];
+	return NULL;
+}
+
 static int
-ocf_init(void)
+ocf_init(struct ocf_alg *cipher, struct ocf_alg *mac, int crid)
 {
-	int error;
-	struct cryptoini crie, cria;
-	struct cryptodesc crda, crde;
+	struct cryptoini crie, cria, *cri = NULL;
 
 	memset(&crie, 0, sizeof(crie));
 	memset(&cria, 0, sizeof(cria));
-	memset(&crde, 0, sizeof(crde));
-	memset(&crda, 0, sizeof(crda));
 
-	cria.cri_alg  = CRYPTO_SHA1_HMAC;
-	cria.cri_klen = 20 * 8;
-	cria.cri_key  = "0123456789abcdefghij";
+	if (mac) {
+		cria.cri_alg  = mac->alg;
+		cria.cri_klen = mac->klen;
+		cria.cri_key  = ocf_key;
+		cri = &cria;
+	}
 
-	//crie.cri_alg  = CRYPTO_3DES_CBC;
-	crie.cri_alg  = CRYPTO_AES_CBC;
-	crie.cri_klen = 24 * 8;
-	crie.cri_key  = "0123456789abcdefghijklmn";
+	if (cipher) {
+		crie.cri_alg  = cipher->alg;
+		crie.cri_klen = cipher->klen;
+		crie.cri_key  = ocf_key;
+		crie.cri_next = cri;
+		cri = &crie;
+	}
 
-	crie.cri_next = &cria;
+	ocf_cipher = cipher;
+	ocf_mac = mac;
+	return crypto_newsession(&ocf_cryptoid, cri, crid);
+}
 
-	error = crypto_newsession(&ocf_cryptoid, &crie,
-				CRYPTOCAP_F_HARDWARE | CRYPTOCAP_F_SOFTWARE);
-	if (error) {
-		printk("crypto_newsession failed %d\n", error);
-		return -1;
-	}
-	return 0;
+static void
+ocf_schedule(request_t *r)
+{
+	if (r->cpu >= 0)
+		schedule_work_on(r->cpu, &r->work);
+	else
+		schedule_work(&r->work);
 }
 
 static int
@@ -168,23 +288,28 @@ ocf_cb(struct cryptop *crp)
 {
 	request_t *r = (request_t *) crp->crp_opaque;
 	unsigned long flags;
+	s64 ns = ktime_to_ns(ktime_sub(ktime_get(), r->start));
+	int etype = crp->crp_etype;
 
-	if (crp->crp_etype)
-		printk("Error in OCF processing: %d\n", crp->crp_etype);
 	crypto_freereq(crp);
 	crp = NULL;
 
-	/* do all requests  but take at least 1 second */
+	/* do all requests  but take at least ocf_runtime */
 	spin_lock_irqsave(&ocfbench_counter_lock, flags);
+	if (etype && errors++ == 0)
+		printk("Error in OCF processing: %d\n", etype);
+	if (ns > 0xffffffff)
+		ns = 0xffffffff;
+	ocf_lat[ocf_nlat++ % OCF_LAT_SAMPLES] = ns;
 	total++;
-	if (total > request_num && jstart + HZ < jiffies) {
+	if (total > request_num && time_after(jiffies, jstart + ocf_runtime)) {
 		outstanding--;
 		spin_unlock_irqrestore(&ocfbench_counter_lock, flags);
 		return 0;
 	}
 	spin_unlock_irqrestore(&ocfbench_counter_lock, flags);
 
-	schedule_work(&r->work);
+	ocf_schedule(r);
 	return 0;
 }
 
@@ -193,10 +318,11 @@ static void
 ocf_request(void *arg)
 {
 	request_t *r = arg;
-	struct cryptop *crp = crypto_getreq(2);
-	struct cryptodesc *crde, *crda;
+	struct cryptop *crp;
+	struct cryptodesc *crd;
 	unsigned long flags;
 
+	crp = crypto_getreq((ocf_cipher != NULL) + (ocf_mac != NULL));
 	if (!crp) {
 		spin_lock_irqsave(&ocfbench_counter_lock, flags);
 		outstanding--;
@@ -204,27 +330,29 @@ ocf_request(void *arg)
 		return;
 	}
 
-	crde = crp->crp_desc;
-	crda = crde->crd_next;
-
-	crda->crd_skip = 0;
-	crda->crd_flags = 0;
-	crda->crd_len = request_size;
-	crda->crd_inject = request_size;
-	crda->crd_alg = CRYPTO_SHA1_HMAC;
-	crda->crd_key = "0123456789abcdefghij";
-	crda->crd_klen = 20 * 8;
-
-	crde->crd_skip = 0;
-	crde->crd_flags = CRD_F_IV_EXPLICIT | CRD_F_ENCRYPT;
-	crde->crd_len = request_size;
-	crde->crd_inject = request_size;
-	//crde->crd_alg = CRYPTO_3DES_CBC;
-	crde->crd_alg = CRYPTO_AES_CBC;
-	crde->crd_key = "0123456789abcdefghijklmn";
-	crde->crd_klen = 24 * 8;
-
-	crp->crp_ilen = request_size + 64;
+	crd = crp->crp_desc;
+	if (ocf_cipher) {
+		crd->crd_skip = 0;
+		crd->crd_flags = CRD_F_IV_EXPLICIT | CRD_F_ENCRYPT;
+		crd->crd_len = ocf_size;
+		crd->crd_inject = ocf_size;
+		crd->crd_alg = ocf_cipher->alg;
+		crd->crd_key = ocf_key;
+		crd->crd_klen = ocf_cipher->klen;
+		crd = crd->crd_next;
+	}
+
+	if (ocf_mac) {
+		crd->crd_skip = 0;
+		crd->crd_flags = 0;
+		crd->crd_len = ocf_size;
+		crd->crd_inject = ocf_size;
+		crd->crd_alg = ocf_mac->alg;
+		crd->crd_key = ocf_key;
+		crd->crd_klen = ocf_mac->klen;
+	}
+
+	crp->crp_ilen = ocf_size + 64;
 	crp->crp_flags = 0;
 	if (request_batch)
 		crp->crp_flags |= CRYPTO_F_BATCH;
@@ -234,7 +362,15 @@ ocf_request(void *arg)
 	crp->crp_callback = ocf_cb;
 	crp->crp_sid = ocf_cryptoid;
 	crp->crp_opaque = (caddr_t) r;
-	crypto_dispatch(crp);
+	r->start = ktime_get();
+	if (crypto_dispatch(crp) != 0) {
+		/* not queued,  so no callback is coming */
+		crypto_freereq(crp);
+		spin_lock_irqsave(&ocfbench_counter_lock, flags);
+		errors++;
+		outstanding--;
+		spin_unlock_irqrestore(&ocfbench_counter_lock, flags);
+	}
 }
 
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,20)
@@ -252,6 +388,243 @@ ocf_done(void)
 	crypto_freesession(ocf_cryptoid);
 }
 
+static void
+ocf_free_requests(void)
+{
+	int i;
+
+	for (i = 0; i < requests_num; i++)
+		kfree(requests[i].buffer);
+	kfree(requests);
+	kfree(ocf_lat);
+}
+
+/*
+ * the n'th online CPU
+ */
+static int
+ocf_cpu(int n)
+{
+	int cpu;
+
+	for_each_online_cpu(cpu)
+		if (n-- == 0)
+			return cpu;
+	return -1;
+}
+
+/*
+ * Mbps * 1000 for the last run
+ */
+static unsigned long
+ocf_mbps(void)
+{
+	u64 bits = (u64) total * ocf_size * 8 * 1000;
+	u64 usecs = ktime_to_ns(ktime_sub(kstop, kstart));
+
+	do_div(usecs, 1000);
+	if (usecs == 0 || usecs > 0xffffffff)
+		return 0;
+	do_div(bits, (u32) usecs);
+	return (unsigned long) bits;
+}
+
+static int
+ocf_lat_cmp(const void *a, const void *b)
+{
+	u32 x = *(const u32 *) a, y = *(const u32 *) b;
+
+	return x < y ? -1 : x > y;
+}
+
+/*
+ * latency percentile pct of the last run in ns
+ */
+static u32
+ocf_lat_pct(int pct)
+{
+	int n = ocf_nlat < OCF_LAT_SAMPLES ? ocf_nlat : OCF_LAT_SAMPLES;
+
+	return n ? ocf_lat[((n - 1) * pct) / 100] : 0;
+}
+
+/*
+ * one OCF run of depth requests spread over ncpus CPUs,
+ * or submitted from wherever they complete if ncpus is 0
+ */
+static unsigned long
+ocf_run(int ncpus, int depth)
+{
+	unsigned long flags;
+	int i, n;
+
+	total = outstanding = errors = ocf_nlat = 0;
+	jstart = jiffies;
+	kstart = ktime_get();
+	for (i = 0; i < depth; i++) {
+		requests[i].cpu = ncpus ? ocf_cpu(i % ncpus) : -1;
+		spin_lock_irqsave(&ocfbench_counter_lock, flags);
+		outstanding++;
+		spin_unlock_irqrestore(&ocfbench_counter_lock, flags);
+		if (ncpus)
+			ocf_schedule(&requests[i]);
+		else
+			ocf_request(&requests[i]);
+	}
+	while (outstanding > 0)
+		schedule();
+	kstop = ktime_get();
+	jstop = jiffies;
+
+	n = ocf_nlat < OCF_LAT_SAMPLES ? ocf_nlat : OCF_LAT_SAMPLES;
+	sort(ocf_lat, n, sizeof(ocf_lat[0]), ocf_lat_cmp, NULL);
+	return ocf_mbps();
+}
+
+/*************************************************************************/
+/*
+ * the suite,  for comparing drivers against each other and cryptosoft
+ */
+
+struct ocf_result {
+	struct list_head list;
+	char driver[16];
+	struct ocf_alg *alg;
+	int size;
+	int depth;
+	int requests;
+	int errors;
+	unsigned long mbps;	/* * 1000 */
+	u32 p50, p99;		/* ns */
+};
+
+static LIST_HEAD(ocf_results);
+
+#ifdef CONFIG_DEBUG_FS
+static struct dentry *ocf_debugfs;
+
+static int
+ocf_results_show(struct seq_file *m, void *v)
+{
+	struct ocf_result *res;
+
+	seq_printf(m, "driver alg size depth requests errors "
+			"kbps p50_ns p99_ns\n");
+	list_for_each_entry(res, &ocf_results, list)
+		seq_printf(m, "%s %s %d %d %d %d %lu %u %u\n",
+				res->driver, res->alg->name, res->size, res->depth,
+				res->requests, res->errors, res->mbps,
+				res->p50, res->p99);
+	return 0;
+}
+
+static int
+ocf_results_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, ocf_results_show, NULL);
+}
+
+static const struct file_operations ocf_results_fops = {
+	.owner   = THIS_MODULE,
+	.open    = ocf_results_open,
+	.read    = seq_read,
+	.llseek  = seq_lseek,
+	.release = single_release,
+};
+#endif
+
+/*
+ * every size and depth for one algorithm on one driver
+ */
+static void
+ocf_suite_alg(int hid, const char *driver, struct ocf_alg *alg)
+{
+	struct ocf_result *res;
+	int s, d, depth;
+
+	if (ocf_init(alg->blocksize ? alg : NULL, alg->blocksize ? NULL : alg,
+			hid) != 0)
+		return;		/* not registered by this driver */
+
+	for (s = 0; s < suite_nsizes; s++) {
+		ocf_size = suite_sizes[s];
+		if (ocf_size <= 0 || ocf_size > buffer_size ||
+				(alg->blocksize && ocf_size % alg->blocksize))
+			continue;
+		for (d = 0; d < suite_ndepths; d++) {
+			depth = suite_depths[d];
+			if (depth <= 0 || depth > requests_num)
+				continue;
+			res = kmalloc(sizeof(*res), GFP_KERNEL);
+			if (!res)
+				goto out;
+			memset(res, 0, sizeof(*res));
+			strncpy(res->driver, driver, sizeof(res->driver) - 1);
+			res->alg = alg;
+			res->size = ocf_size;
+			res->depth = depth;
+			res->mbps = ocf_run(0, res->depth);
+			res->requests = total;
+			res->errors = errors;
+			res->p50 = ocf_lat_pct(50);
+			res->p99 = ocf_lat_pct(99);
+			list_add_tail(&res->list, &ocf_results);
+			printk("OCF: %s %s %d bytes depth %d: %d.%03d Mbps, "
+					"p50 %u ns, p99 %u ns%s\n",
+					driver, alg->name, res->size, depth,
+					((int)res->mbps) / 1000, ((int)res->mbps) % 1000,
+					res->p50, res->p99,
+					res->errors ? " (errors)" : "");
+		}
+	}
+out:
+	crypto_freesession(ocf_cryptoid);
+}
+
+/*
+ * driver ids are handed out from 0,  the suite looks at this many
+ */
+#define OCF_MAX_DRIVERS	32
+
+static void
+ocf_suite(void)
+{
+	device_t dev;
+	const char *name;
+	int hid, i;
+
+	ocf_runtime = msecs_to_jiffies(suite_msecs);
+	for (hid = 0; hid < OCF_MAX_DRIVERS; hid++) {
+		dev = crypto_find_device_byhid(hid);
+		if (dev == NULL)
+			continue;
+		name = device_get_nameunit(dev);
+		for (i = 0; i < OCF_NALGS; i++)
+			ocf_suite_alg(hid, name, &ocf_algs[i]);
+	}
+
+#ifdef CONFIG_DEBUG_FS
+	ocf_debugfs = debugfs_create_dir("ocf-bench", NULL);
+	if (ocf_debugfs)
+		debugfs_create_file("results", S_IRUGO, ocf_debugfs, NULL,
+				&ocf_results_fops);
+#endif
+}
+
+static void
+ocf_suite_done(void)
+{
+	struct ocf_result *res, *tmp;
+
+#ifdef CONFIG_DEBUG_FS
+	debugfs_remove_recursive(ocf_debugfs);
+#endif
+	list_for_each_entry_safe(res, tmp, &ocf_results, list) {
+		list_del(&res->list);
+		kfree(res);
+	}
+}
+
 /*************************************************************************/
 #ifdef BENCH_IXP_ACCESS_LIB
 /*************************************************************************/
@@ -405,61 +778,93 @@ ixp_done(void)
 int
 ocfbench_init(void)
 {
-	int i;
-	unsigned long mbps;
+	int i, ncpus;
+	unsigned long mbps, mbps1 = 0, speedup;
+#ifdef BENCH_IXP_ACCESS_LIB
 	unsigned long flags;
+#endif
 
 	printk("Crypto Speed tests\n");
 
-	requests = kmalloc(sizeof(request_t) * request_q_len, GFP_KERNEL);
-	if (!requests) {
+	requests_num = request_q_len;
+	buffer_size = request_size;
+	if (request_suite) {
+		for (i = 0; i < suite_ndepths; i++)
+			if (suite_depths[i] > requests_num)
+				requests_num = suite_depths[i];
+		for (i = 0; i < suite_nsizes; i++)
+			if (suite_sizes[i] > buffer_size &&
+					suite_sizes[i] <= CRYPTO_MAX_DATA_LEN)
+				buffer_size = suite_sizes[i];
+	}
+
+	ocf_lat = kmalloc(sizeof(u32) * OCF_LAT_SAMPLES, GFP_KERNEL);
+	requests = kmalloc(sizeof(request_t) * requests_num, GFP_KERNEL);
+	if (!requests || !ocf_lat) {
 		printk("malloc failed\n");
 		return -EINVAL;
 	}
 
-	for (i = 0; i < request_q_len; i++) {
+	for (i = 0; i < requests_num; i++) {
 		/* +64 for return data */
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,20)
 		INIT_WORK(&requests[i].work, ocf_request_wq);
 #else
 		INIT_WORK(&requests[i].work, ocf_request, &requests[i]);
 #endif
-		requests[i].buffer = kmalloc(request_size + 128, GFP_DMA);
+		requests[i].buffer = kmalloc(buffer_size + 128, GFP_DMA);
 		if (!requests[i].buffer) {
 			printk("malloc failed\n");
 			return -EINVAL;
 		}
-		memset(requests[i].buffer, '0' + i, request_size + 128);
+		memset(requests[i].buffer, '0' + i, buffer_size + 128);
+	}
+
+	spin_lock_init(&ocfbench_counter_lock);
+
+	if (request_suite) {
+		printk("OCF: running the suite ...\n");
+		ocf_suite();
+		ocf_free_requests();
+		return 0; /* stay loaded for the results in debugfs */
 	}
 
 	/*
 	 * OCF benchmark
 	 */
 	printk("OCF: testing ...\n");
-	if (ocf_init() == -1)
+	ocf_size = request_size;
+	ocf_runtime = HZ;
+	if (ocf_init(ocf_find_alg(CRYPTO_AES_CBC),
+			ocf_find_alg(CRYPTO_SHA1_HMAC),
+			CRYPTOCAP_F_HARDWARE | CRYPTOCAP_F_SOFTWARE) != 0) {
+		printk("crypto_newsession failed\n");
 		return -EINVAL;
-
-	spin_lock_init(&ocfbench_counter_lock);
-	total = outstanding = 0;
-	jstart = jiffies;
-	for (i = 0; i < request_q_len; i++) {
-		spin_lock_irqsave(&ocfbench_counter_lock, flags);
-		outstanding++;
-		spin_unlock_irqrestore(&ocfbench_counter_lock, flags);
-		ocf_request(&requests[i]);
 	}
-	while (outstanding > 0)
-		schedule();
-	jstop = jiffies;
 
-	mbps = 0;
-	if (jstop > jstart) {
-		mbps = (unsigned long) total * (unsigned long) request_size * 8;
-		mbps /= ((jstop - jstart) * 1000) / HZ;
-	}
-	printk("OCF: %d requests of %d bytes in %d jiffies (%d.%03d Mbps)\n",
+	mbps = ocf_run(0, request_q_len);
+	printk("OCF: %d requests of %d bytes in %d jiffies (%d.%03d Mbps, "
+			"p50 %u ns, p99 %u ns)\n",
 			total, request_size, (int)(jstop - jstart),
-			((int)mbps) / 1000, ((int)mbps) % 1000);
+			((int)mbps) / 1000, ((int)mbps) % 1000,
+			ocf_lat_pct(50), ocf_lat_pct(99));
+
+	if (request_cpus > num_online_cpus())
+		request_cpus = num_online_cpus();
+	for (ncpus = 1; request_cpus > 0; ncpus *= 2) {
+		if (ncpus > request_cpus)
+			ncpus = request_cpus;
+		mbps = ocf_run(ncpus, request_q_len);
+		if (ncpus == 1)
+			mbps1 = mbps;
+		speedup = mbps1 ? mbps * 100 / mbps1 : 0;
+		printk("OCF: %d cpus: %d requests in %d jiffies (%d.%03d Mbps, "
+				"%d.%02dx)\n", ncpus, total, (int)(jstop - jstart),
+				((int)mbps) / 1000, ((int)mbps) % 1000,
+				((int)speedup) / 100, ((int)speedup) % 100);
+		if (ncpus == request_cpus)
+			break;
+	}
 	ocf_done();
 
 #ifdef BENCH_IXP_ACCESS_LIB
@@ -496,14 +901,13 @@ ocfbench_init(void)
 	ixp_done();
 #endif /* BENCH_IXP_ACCESS_LIB */
 
-	for (i = 0; i < request_q_len; i++)
-		kfree(requests[i].buffer);
-	kfree(requests);
+	ocf_free_requests();
 	return -EINVAL; /* always fail to load so it can be re-run quickly ;-) */
 }
 
 static void __exit ocfbench_exit(void)
 {
+	ocf_suite_done();
 }
 
 module_init(ocfbench_init);
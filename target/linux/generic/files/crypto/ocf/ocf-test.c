@@ -0,0 +1,724 @@
+/*
+ * A loadable module that checks OCF drivers from kernel space.  Every
+ * driver (or just test_driver) is run against a set of known answers,
+ * then against cryptosoft with random keys,  data and lengths,  and is
+ * finally timed at a range of request sizes.
+ *
+ * ocf-bench is the tool for queue depths and CPUs,  this one does one
+ * request at a time so a failure points at a single request.
+ *
+ * LICENSE TERMS
+ *
+ * The free distribution and use of this software in both source and binary
+ * form is allowed (with or without changes) provided that:
+ *
+ *   1. distributions of this source code include the above copyright
+ *      notice, this list of conditions and the following disclaimer;
+ *
+ *   2. distributions in binary form include the above copyright
+ *      notice, this list of conditions and the following disclaimer
+ *      in the documentation and/or other associated materials;
+ *
+ *   3. the copyright holder's name is not used to endorse products
+ *      built using this software without specific written permission.
+ *
+ * ALTERNATIVELY, provided that this notice is retained in full, this product
+ * may be distributed under the terms of the GNU General Public License (GPL),
+ * in which case the provisions of the GPL apply INSTEAD OF those given above.
+ *
+ * DISCLAIMER
+ *
+ * This software is provided 'as is' with no explicit or implied warranties
+ * in respect of its properties, including, but not limited to, correctness
+ * and/or fitness for purpose.
+ */
+
+
+#include <linux/version.h>
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,38) && !defined(AUTOCONF_INCLUDED)
+#include <linux/config.h>
+#endif
+#include <linux/module.h>
+#include <linux/init.h>
+#include <linux/slab.h>
+#include <linux/sched.h>
+#include <linux/completion.h>
+#include <linux/random.h>
+#include <linux/jiffies.h>
+#include <linux/ktime.h>
+#include <asm/div64.h>
+#include <cryptodev.h>
+
+/*
+ * the driver to test,  every driver but cryptosoft if not given
+ */
+static char *test_driver = NULL;
+module_param(test_driver, charp, 0);
+MODULE_PARM_DESC(test_driver, "Only test this driver (name or nameunit)");
+
+/*
+ * drivers that do no crypto (ocfnull) can still be run through the
+ * dispatch path with the comparisons turned off
+ */
+static int test_verify = 1;
+module_param(test_verify, int, 0);
+MODULE_PARM_DESC(test_verify, "Compare results (0 to only check completion)");
+
+static int test_random = 64;
+module_param(test_random, int, 0);
+MODULE_PARM_DESC(test_random, "Random requests per algorithm checked against cryptosoft");
+
+static unsigned int test_seed = 0;
+module_param(test_seed, uint, 0);
+MODULE_PARM_DESC(test_seed, "Seed for the random requests (0 picks one)");
+
+static int test_maxlen = 4096;
+module_param(test_maxlen, int, 0);
+MODULE_PARM_DESC(test_maxlen, "Largest random request");
+
+#define TEST_MAX	8
+static int test_sizes[TEST_MAX] = { 16, 64, 512, 1488, 4096 };
+static int test_nsizes = 5;
+module_param_array(test_sizes, int, &test_nsizes, 0);
+MODULE_PARM_DESC(test_sizes, "request sizes to time");
+
+static int test_msecs = 100;
+module_param(test_msecs, int, 0);
+MODULE_PARM_DESC(test_msecs, "time each size for at least this long (0 to skip)");
+
+/*
+ * a request the driver has not finished by now is reported and leaked
+ */
+#define TEST_TIMEOUT	(5 * HZ)
+
+/*
+ * driver ids are handed out from 0,  we look at this many
+ */
+#define TEST_MAX_DRIVERS	32
+
+/*************************************************************************/
+/*
+ * the algorithms and the known answers
+ */
+
+struct test_alg {
+	int alg;
+	char *name;
+	int klen;		/* in bytes,  0 for no key */
+	int blocksize;		/* 0 for a hash */
+	int maclen;		/* bytes of MAC a hash appends */
+};
+
+static struct test_alg test_algs[] = {
+	{ CRYPTO_DES_CBC,        "des-cbc",        8,  8,  0 },
+	{ CRYPTO_3DES_CBC,       "3des-cbc",       24, 8,  0 },
+	{ CRYPTO_BLF_CBC,        "blowfish-cbc",   16, 8,  0 },
+	{ CRYPTO_CAST_CBC,       "cast-cbc",       16, 8,  0 },
+	{ CRYPTO_AES_CBC,        "aes-cbc",        16, 16, 0 },
+	{ CRYPTO_CAMELLIA_CBC,   "camellia-cbc",   16, 16, 0 },
+	{ CRYPTO_MD5_HMAC,       "md5-hmac",       16, 0,  MD5_HASH_LEN },
+	{ CRYPTO_SHA1_HMAC,      "sha1-hmac",      20, 0,  SHA1_HASH_LEN },
+	{ CRYPTO_SHA2_256_HMAC,  "sha256-hmac",    32, 0,  SHA2_256_HASH_LEN },
+	{ CRYPTO_MD5,            "md5",            0,  0,  MD5_HASH_LEN },
+	{ CRYPTO_SHA1,           "sha1",           0,  0,  SHA1_HASH_LEN },
+	{ CRYPTO_SHA2_256,       "sha256",         0,  0,  SHA2_256_HASH_LEN },
+};
+
+#define TEST_NALGS	(sizeof(test_algs) / sizeof(test_algs[0]))
+
+/*
+ * the cipher + HMAC pairs IPsec uses,  run as one request
+ */
+static struct {
+	int cipher, mac;
+} test_pairs[] = {
+	{ CRYPTO_AES_CBC,  CRYPTO_SHA1_HMAC },
+	{ CRYPTO_3DES_CBC, CRYPTO_SHA1_HMAC },
+	{ CRYPTO_3DES_CBC, CRYPTO_MD5_HMAC },
+};
+
+#define TEST_NPAIRS	(sizeof(test_pairs) / sizeof(test_pairs[0]))
+
+/*
+ * FIPS 81,  RFC 3602 case 1,  RFC 1321/FIPS 180 "abc" and RFC 2202/4231
+ * case 1.  The 3DES answer is from openssl with the SP 800-67 keys.
+ */
+struct test_kat {
+	int alg;
+	const char *key;
+	int klen;		/* in bytes,  the test vector's own */
+	const char *iv;
+	const char *in;
+	const char *out;
+	int len;
+};
+
+static struct test_kat test_kats[] = {
+	{ CRYPTO_DES_CBC,
+	  "\x01\x23\x45\x67\x89\xab\xcd\xef", 8,
+	  "\x12\x34\x56\x78\x90\xab\xcd\xef",
+	  "Now is the time for all ",
+	  "\xe5\xc7\xcd\xde\x87\x2b\xf2\x7c\x43\xe9\x34\x00\x8c\x38\x9c\x0f"
+	  "\x68\x37\x88\x49\x9a\x7c\x05\xf6", 24 },
+	{ CRYPTO_3DES_CBC,
+	  "\x01\x23\x45\x67\x89\xab\xcd\xef\x23\x45\x67\x89\xab\xcd\xef\x01"
+	  "\x45\x67\x89\xab\xcd\xef\x01\x23", 24,
+	  "\x12\x34\x56\x78\x90\xab\xcd\xef",
+	  "The quick brown fox jump",
+	  "\x5b\xa5\x23\xa5\x9a\x51\x09\x71\x0d\xa0\x64\x00\xf0\x58\x19\x2a"
+	  "\x74\x3d\xc4\xdf\x1c\x59\x26\x55", 24 },
+	{ CRYPTO_AES_CBC,
+	  "\x06\xa9\x21\x40\x36\xb8\xa1\x5b\x51\x2e\x03\xd5\x34\x12\x00\x06", 16,
+	  "\x3d\xaf\xba\x42\x9d\x9e\xb4\x30\xb4\x22\xda\x80\x2c\x9f\xac\x41",
+	  "Single block msg",
+	  "\xe3\x53\x77\x9c\x10\x79\xae\xb8\x27\x08\x94\x2d\xbe\x77\x18\x1a",
+	  16 },
+	{ CRYPTO_MD5_HMAC,
+	  "\x0b\x0b\x0b\x0b\x0b\x0b\x0b\x0b\x0b\x0b\x0b\x0b\x0b\x0b\x0b\x0b", 16,
+	  NULL,
+	  "Hi There",
+	  "\x92\x94\x72\x7a\x36\x38\xbb\x1c\x13\xf4\x8e\xf8\x15\x8b\xfc\x9d",
+	  8 },
+	{ CRYPTO_SHA1_HMAC,
+	  "\x0b\x0b\x0b\x0b\x0b\x0b\x0b\x0b\x0b\x0b\x0b\x0b\x0b\x0b\x0b\x0b"
+	  "\x0b\x0b\x0b\x0b", 20,
+	  NULL,
+	  "Hi There",
+	  "\xb6\x17\x31\x86\x55\x05\x72\x64\xe2\x8b\xc0\xb6\xfb\x37\x8c\x8e"
+	  "\xf1\x46\xbe\x00", 8 },
+	{ CRYPTO_SHA2_256_HMAC,		/* RFC 4231 test case 1 */
+	  "\x0b\x0b\x0b\x0b\x0b\x0b\x0b\x0b\x0b\x0b\x0b\x0b\x0b\x0b\x0b\x0b"
+	  "\x0b\x0b\x0b\x0b", 20,
+	  NULL,
+	  "Hi There",
+	  "\xb0\x34\x4c\x61\xd8\xdb\x38\x53\x5c\xa8\xaf\xce\xaf\x0b\xf1\x2b"
+	  "\x88\x1d\xc2\x00\xc9\x83\x3d\xa7\x26\xe9\x37\x6c\x2e\x32\xcf\xf7",
+	  8 },
+	{ CRYPTO_MD5, NULL, 0, NULL, "abc",
+	  "\x90\x01\x50\x98\x3c\xd2\x4f\xb0\xd6\x96\x3f\x7d\x28\xe1\x7f\x72",
+	  3 },
+	{ CRYPTO_SHA1, NULL, 0, NULL, "abc",
+	  "\xa9\x99\x3e\x36\x47\x06\x81\x6a\xba\x3e\x25\x71\x78\x50\xc2\x6c"
+	  "\x9c\xd0\xd8\x9d", 3 },
+	{ CRYPTO_SHA2_256, NULL, 0, NULL, "abc",
+	  "\xba\x78\x16\xbf\x8f\x01\xcf\xea\x41\x41\x40\xde\x5d\xae\x22\x23"
+	  "\xb0\x03\x61\xa3\x96\x17\x7a\x9c\xb4\x10\xff\x61\xf2\x00\x15\xad",
+	  3 },
+};
+
+#define TEST_NKATS	(sizeof(test_kats) / sizeof(test_kats[0]))
+
+/*
+ * the KAT sessions want a key as long as the 3DES one,  the random ones
+ * as long as the longest HMAC key
+ */
+#define TEST_KEY_MAX	32
+#define TEST_IV_MAX	EALG_MAX_BLOCK_LEN
+
+static int test_pass, test_fail, test_skip;
+static int test_timedout;	/* a driver may still write to the buffers */
+
+/*
+ * one buffer for the driver under test and one for cryptosoft,
+ * each with room for a MAC after the data
+ */
+static unsigned char *test_buf, *test_ref;
+
+static struct test_alg *
+test_find_alg(int alg)
+{
+	int i;
+
+	for (i = 0; i < TEST_NALGS; i++)
+		if (test_algs[i].alg == alg)
+			return &test_algs[i];
+	return NULL;
+}
+
+/*
+ * xorshift,  so a failing run can be repeated with test_seed
+ */
+static u32 test_state;
+
+static u32
+test_rand(void)
+{
+	u32 x = test_state;
+
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	return test_state = x;
+}
+
+static void
+test_fill(void *buf, int len)
+{
+	unsigned char *p = buf;
+
+	while (len-- > 0)
+		*p++ = test_rand();
+}
+
+static void
+test_dump(const char *what, const unsigned char *p, int len)
+{
+	char line[16 * 3 + 1];
+	int i, j;
+
+	for (i = 0; i < len; i += 16) {
+		for (j = 0; j < 16 && i + j < len; j++)
+			sprintf(line + j * 3, " %02x", p[i + j]);
+		printk("OCF-TEST:   %s %04x:%s\n", what, i, line);
+	}
+}
+
+/*************************************************************************/
+/*
+ * running one request and waiting for it
+ */
+
+struct test_wait {
+	struct completion done;
+	int calls;
+};
+
+static int
+test_cb(struct cryptop *crp)
+{
+	struct test_wait *w = (struct test_wait *) crp->crp_opaque;
+
+	w->calls++;
+	complete(&w->done);
+	return 0;
+}
+
+static int
+test_newsession(u_int64_t *sid, struct test_alg *cipher, struct test_alg *mac,
+		const char *ckey, const char *mkey, int crid)
+{
+	struct cryptoini crie, cria, *cri = NULL;
+
+	memset(&crie, 0, sizeof(crie));
+	memset(&cria, 0, sizeof(cria));
+
+	if (mac) {
+		cria.cri_alg  = mac->alg;
+		cria.cri_klen = mkey ? mac->klen * 8 : 0;
+		cria.cri_key  = (caddr_t) mkey;
+		cri = &cria;
+	}
+
+	if (cipher) {
+		crie.cri_alg  = cipher->alg;
+		crie.cri_klen = cipher->klen * 8;
+		crie.cri_key  = (caddr_t) ckey;
+		crie.cri_next = cri;
+		cri = &crie;
+	}
+
+	return crypto_newsession(sid, cri, crid);
+}
+
+/*
+ * len bytes of buf through the session.  Encryption ciphers then MACs,
+ * decryption MACs then deciphers,  the MAC lands right after the data.
+ */
+static int
+test_request(u_int64_t *sid, struct test_alg *cipher, struct test_alg *mac,
+		const char *ckey, const char *mkey, const char *iv, int encrypt,
+		unsigned char *buf, int len)
+{
+	struct cryptop *crp;
+	struct cryptodesc *crd, *crde = NULL, *crda = NULL;
+	struct test_wait *w;
+	int err;
+
+	crp = crypto_getreq((cipher != NULL) + (mac != NULL));
+	if (!crp)
+		return ENOMEM;
+	/* the driver may still have it after a timeout,  so not on the stack */
+	w = kmalloc(sizeof(*w), GFP_KERNEL);
+	if (!w) {
+		crypto_freereq(crp);
+		return ENOMEM;
+	}
+
+	crd = crp->crp_desc;
+	if (cipher && (encrypt || !mac)) {
+		crde = crd;
+		crd = crd->crd_next;
+	}
+	if (mac) {
+		crda = crd;
+		crd = crd->crd_next;
+	}
+	if (cipher && !crde)
+		crde = crd;
+
+	if (crde) {
+		crde->crd_skip = 0;
+		crde->crd_len = len;
+		crde->crd_inject = 0;
+		crde->crd_flags = CRD_F_IV_EXPLICIT | CRD_F_IV_PRESENT;
+		if (encrypt)
+			crde->crd_flags |= CRD_F_ENCRYPT;
+		memcpy(crde->crd_iv, iv, cipher->blocksize);
+		crde->crd_alg = cipher->alg;
+		crde->crd_key = (caddr_t) ckey;
+		crde->crd_klen = cipher->klen * 8;
+	}
+
+	if (crda) {
+		crda->crd_skip = 0;
+		crda->crd_len = len;
+		crda->crd_inject = len;
+		crda->crd_flags = 0;
+		crda->crd_alg = mac->alg;
+		crda->crd_key = (caddr_t) mkey;
+		crda->crd_klen = mkey ? mac->klen * 8 : 0;
+	}
+
+	crp->crp_ilen = len + HASH_MAX_LEN;
+	crp->crp_flags = CRYPTO_F_CBIMM;
+	crp->crp_buf = (caddr_t) buf;
+	crp->crp_callback = test_cb;
+	crp->crp_opaque = (caddr_t) w;
+	crp->crp_sid = *sid;
+
+	for (;;) {
+		init_completion(&w->done);
+		w->calls = 0;
+		err = crypto_dispatch(crp);
+		if (err) {
+			/* not queued,  so no callback is coming */
+			crypto_freereq(crp);
+			kfree(w);
+			return err;
+		}
+		if (wait_for_completion_timeout(&w->done, TEST_TIMEOUT) == 0) {
+			test_timedout = 1;
+			return ETIMEDOUT;
+		}
+		if (crp->crp_etype != EAGAIN)
+			break;
+		/* the session moved,  resubmit on the new one */
+		*sid = crp->crp_sid;
+	}
+
+	err = crp->crp_etype;
+	if (err == 0 && (w->calls != 1 || !(crp->crp_flags & CRYPTO_F_DONE)))
+		err = EIO;
+	crypto_freereq(crp);
+	kfree(w);
+	return err;
+}
+
+static void
+test_result(const char *driver, const char *what, int err)
+{
+	if (err == 0) {
+		test_pass++;
+		return;
+	}
+	test_fail++;
+	printk("OCF-TEST: %s %s failed (%d)\n", driver, what, err);
+}
+
+/*************************************************************************/
+/*
+ * known answers
+ */
+
+static void
+test_kat(int hid, const char *driver, struct test_kat *kat)
+{
+	struct test_alg kalg = *test_find_alg(kat->alg);
+	struct test_alg *alg = &kalg;
+	struct test_alg *cipher = alg->blocksize ? alg : NULL;
+	struct test_alg *mac = alg->blocksize ? NULL : alg;
+	unsigned char *want;
+	u_int64_t sid;
+	int err, outlen;
+
+	/* the vector's key,  which need not be the algorithm's usual length */
+	kalg.klen = kat->klen;
+
+	if (test_newsession(&sid, cipher, mac, kat->key, kat->key, hid) != 0) {
+		test_skip++;
+		return;		/* not registered by this driver */
+	}
+
+	memset(test_buf, 0, kat->len + HASH_MAX_LEN);
+	memcpy(test_buf, kat->in, kat->len);
+	err = test_request(&sid, cipher, mac, kat->key, kat->key, kat->iv, 1,
+			test_buf, kat->len);
+	if (err == 0 && test_verify) {
+		want = cipher ? test_buf : test_buf + kat->len;
+		outlen = cipher ? kat->len : alg->maclen;
+		if (memcmp(want, kat->out, outlen) != 0) {
+			printk("OCF-TEST: %s %s known answer wrong\n", driver, alg->name);
+			test_dump("got ", want, outlen);
+			test_dump("want", kat->out, outlen);
+			err = EBADMSG;
+		}
+	}
+	test_result(driver, alg->name, err);
+
+	/* and back again */
+	if (err == 0 && cipher) {
+		memcpy(test_buf, kat->out, kat->len);
+		err = test_request(&sid, cipher, mac, kat->key, kat->key, kat->iv, 0,
+				test_buf, kat->len);
+		if (err == 0 && test_verify &&
+				memcmp(test_buf, kat->in, kat->len) != 0) {
+			printk("OCF-TEST: %s %s known answer decrypt wrong\n", driver,
+					alg->name);
+			test_dump("got ", test_buf, kat->len);
+			err = EBADMSG;
+		}
+		test_result(driver, alg->name, err);
+	}
+
+	crypto_freesession(sid);
+}
+
+/*************************************************************************/
+/*
+ * random requests against cryptosoft
+ */
+
+static int
+test_compare(const char *driver, const char *name, int i, int encrypt, int len,
+		int maclen)
+{
+	int off;
+
+	for (off = 0; off < len + maclen; off++)
+		if (test_buf[off] != test_ref[off])
+			break;
+	if (off == len + maclen)
+		return 0;
+
+	printk("OCF-TEST: %s %s differs from cryptosoft at %s byte %d "
+			"(request %d, %s %d bytes, seed %u)\n", driver, name,
+			off < len ? "data" : "MAC", off < len ? off : off - len,
+			i, encrypt ? "encrypt" : "decrypt", len, test_seed);
+	off &= ~15;
+	test_dump("got ", test_buf + off, min(len + maclen - off, 32));
+	test_dump("want", test_ref + off, min(len + maclen - off, 32));
+	return EBADMSG;
+}
+
+static void
+test_random_alg(int hid, int ref, const char *driver, struct test_alg *cipher,
+		struct test_alg *mac)
+{
+	char ckey[TEST_KEY_MAX], mkey[TEST_KEY_MAX], iv[TEST_IV_MAX];
+	char name[32];
+	u_int64_t sid, rsid;
+	int i, len, encrypt, maclen = mac ? mac->maclen : 0;
+	int err = 0;
+
+	snprintf(name, sizeof(name), "%s%s%s", cipher ? cipher->name : "",
+			cipher && mac ? "+" : "", mac ? mac->name : "");
+
+	for (i = 0; i < test_random && err == 0; i++) {
+		len = 1 + test_rand() % test_maxlen;
+		if (cipher)
+			len = roundup(len, cipher->blocksize);
+		encrypt = test_rand() & 1;
+		test_fill(ckey, sizeof(ckey));
+		test_fill(mkey, sizeof(mkey));
+		test_fill(iv, sizeof(iv));
+
+		if (test_newsession(&sid, cipher, mac, ckey, mkey, hid) != 0) {
+			if (i == 0) {
+				test_skip++;
+				return;	/* not registered by this driver */
+			}
+			err = EINVAL;
+			break;
+		}
+		if (test_newsession(&rsid, cipher, mac, ckey, mkey, ref) != 0) {
+			crypto_freesession(sid);
+			if (i == 0) {
+				test_skip++;
+				return;	/* nor by cryptosoft,  nothing to compare */
+			}
+			err = EINVAL;
+			break;
+		}
+
+		test_fill(test_buf, len);
+		memset(test_buf + len, 0, HASH_MAX_LEN);
+		memcpy(test_ref, test_buf, len + HASH_MAX_LEN);
+
+		err = test_request(&sid, cipher, mac, ckey, mkey, iv, encrypt,
+				test_buf, len);
+		if (err == 0)
+			err = test_request(&rsid, cipher, mac, ckey, mkey, iv, encrypt,
+					test_ref, len);
+		if (err == 0 && test_verify)
+			err = test_compare(driver, name, i, encrypt, len, maclen);
+
+		crypto_freesession(rsid);
+		crypto_freesession(sid);
+	}
+
+	test_result(driver, name, err);
+}
+
+/*************************************************************************/
+/*
+ * one request at a time at each size
+ */
+
+static void
+test_speed(int hid, const char *driver, struct test_alg *cipher,
+		struct test_alg *mac)
+{
+	char key[TEST_KEY_MAX], iv[TEST_IV_MAX];
+	u_int64_t sid;
+	unsigned long jend;
+	ktime_t start;
+	u64 bits, usecs;
+	int s, size, n, err = 0;
+
+	if (test_msecs <= 0)
+		return;
+
+	test_fill(key, sizeof(key));
+	test_fill(iv, sizeof(iv));
+	if (test_newsession(&sid, cipher, mac, key, key, hid) != 0)
+		return;
+
+	for (s = 0; s < test_nsizes && err == 0; s++) {
+		size = test_sizes[s];
+		if (size <= 0 || size > test_maxlen ||
+				(cipher && size % cipher->blocksize))
+			continue;
+
+		memset(test_buf, 0, size + HASH_MAX_LEN);
+		n = 0;
+		start = ktime_get();
+		jend = jiffies + msecs_to_jiffies(test_msecs);
+		do {
+			err = test_request(&sid, cipher, mac, key, key, iv, 1,
+					test_buf, size);
+			n++;
+		} while (err == 0 && time_before(jiffies, jend));
+		if (err)
+			break;
+
+		bits = (u64) n * size * 8 * 1000;
+		usecs = ktime_to_ns(ktime_sub(ktime_get(), start));
+		do_div(usecs, 1000);
+		if (usecs == 0 || usecs > 0xffffffff)
+			continue;
+		do_div(bits, (u32) usecs);
+		printk("OCF-TEST: %s %s %d bytes: %d requests, %d.%03d Mbps\n",
+				driver, cipher ? cipher->name : mac->name, size, n,
+				((int) bits) / 1000, ((int) bits) % 1000);
+	}
+
+	crypto_freesession(sid);
+}
+
+/*************************************************************************/
+
+static void
+test_one_driver(int hid, int ref)
+{
+	device_t dev = crypto_find_device_byhid(hid);
+	const char *driver;
+	struct test_alg *alg;
+	int i;
+
+	if (dev == NULL)
+		return;
+	driver = device_get_nameunit(dev);
+	printk("OCF-TEST: testing %s ...\n", driver);
+
+	for (i = 0; i < TEST_NKATS; i++)
+		test_kat(hid, driver, &test_kats[i]);
+
+	if (ref >= 0 && ref != hid) {
+		for (i = 0; i < TEST_NALGS; i++) {
+			alg = &test_algs[i];
+			test_random_alg(hid, ref, driver, alg->blocksize ? alg : NULL,
+					alg->blocksize ? NULL : alg);
+		}
+		for (i = 0; i < TEST_NPAIRS; i++)
+			test_random_alg(hid, ref, driver,
+					test_find_alg(test_pairs[i].cipher),
+					test_find_alg(test_pairs[i].mac));
+	}
+
+	for (i = 0; i < TEST_NALGS; i++) {
+		alg = &test_algs[i];
+		test_speed(hid, driver, alg->blocksize ? alg : NULL,
+				alg->blocksize ? NULL : alg);
+	}
+}
+
+static int
+ocftest_init(void)
+{
+	int hid, ref;
+
+	if (test_maxlen <= 0 || test_maxlen > CRYPTO_MAX_DATA_LEN - HASH_MAX_LEN) {
+		printk("OCF-TEST: test_maxlen out of range\n");
+		return -EINVAL;
+	}
+
+	test_buf = kmalloc(test_maxlen + 2 * HASH_MAX_LEN, GFP_KERNEL | GFP_DMA);
+	test_ref = kmalloc(test_maxlen + 2 * HASH_MAX_LEN, GFP_KERNEL | GFP_DMA);
+	if (!test_buf || !test_ref) {
+		printk("malloc failed\n");
+		kfree(test_buf);
+		kfree(test_ref);
+		return -ENOMEM;
+	}
+
+	while (test_seed == 0)
+		get_random_bytes(&test_seed, sizeof(test_seed));
+	test_state = test_seed;
+	test_pass = test_fail = test_skip = test_timedout = 0;
+
+	ref = crypto_find_driver("cryptosoft");
+	if (ref < 0)
+		printk("OCF-TEST: cryptosoft not loaded,  no random tests\n");
+	printk("OCF-TEST: seed %u\n", test_seed);
+
+	if (test_driver) {
+		hid = crypto_find_driver(test_driver);
+		if (hid < 0)
+			printk("OCF-TEST: no driver %s\n", test_driver);
+		else
+			test_one_driver(hid, ref);
+	} else {
+		for (hid = 0; hid < TEST_MAX_DRIVERS; hid++)
+			if (hid != ref)
+				test_one_driver(hid, ref);
+	}
+
+	printk("OCF-TEST: %d passed, %d failed, %d not supported\n",
+			test_pass, test_fail, test_skip);
+
+	if (!test_timedout) {
+		kfree(test_buf);
+		kfree(test_ref);
+	}
+	return -EINVAL; /* always fail to load so it can be re-run quickly ;-) */
+}
+
+static void __exit ocftest_exit(void)
+{
+}
+
+module_init(ocftest_init);
+module_exit(ocftest_exit);
+
+MODULE_LICENSE("Dual BSD/GPL");
+MODULE_DESCRIPTION("Known answer and cryptosoft comparison tests for OCF drivers");
@@ -4,6 +4,11 @@
  * zero cost encryption,  of course you will need to run it at both ends
  * since it does no crypto at all.
  *
+ * It can also pretend to be a hardware engine: requests are held for a
+ * fixed latency plus a per-byte cost,  one after the other,  and it
+ * pushes back (ERESTART) when more than null_qlen are outstanding.  Good
+ * for exercising the OCF queueing without an accelerator.
+ *
  * Written by David McCullough <david_mccullough@mcafee.com>
  * Copyright (C) 2006-2010 David McCullough 
  *
@@ -45,6 +50,12 @@
 #include <linux/wait.h>
 #include <linux/crypto.h>
 #include <linux/interrupt.h>
+#include <linux/spinlock.h>
+#include <linux/ktime.h>
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,28)
+#include <linux/hrtimer.h>
+#define NULL_SIMULATE 1
+#endif
 
 #include <cryptodev.h>
 #include <uio.h>
@@ -61,6 +72,39 @@ int ocfnull_debug = 0;
 module_param(ocfnull_debug, int, 0644);
 MODULE_PARM_DESC(ocfnull_debug, "Enable debug");
 
+static int null_qlen = 0;
+module_param(null_qlen, int, 0644);
+MODULE_PARM_DESC(null_qlen, "Requests the fake engine holds before pushing back (0 no limit)");
+
+static int null_latency = 0;
+module_param(null_latency, int, 0644);
+MODULE_PARM_DESC(null_latency, "Fake engine completion latency in usecs");
+
+static int null_ns_per_byte = 0;
+module_param(null_ns_per_byte, int, 0644);
+MODULE_PARM_DESC(null_ns_per_byte, "Fake engine processing cost in ns per byte");
+
+#ifdef NULL_SIMULATE
+/*
+ * the fake engine.  Requests finish in the order they went in,  each one
+ * null_ns_per_byte * crp_ilen after the one before it and null_latency
+ * after that.
+ */
+struct null_req {
+	struct list_head list;
+	struct cryptop *crp;
+	s64 due;		/* ns */
+};
+
+static spinlock_t null_lock;
+static LIST_HEAD(null_q);
+static struct hrtimer null_timer;
+static s64 null_engine_free;	/* when the engine has caught up,  ns */
+static int null_inflight;
+static int null_blocked;
+static int null_armed;
+#endif
+
 /*
  * dummy device structure
  */
@@ -116,6 +160,110 @@ null_freesession(device_t arg, u_int64_t tid)
 }
 
 
+#ifdef NULL_SIMULATE
+/*
+ * finish everything that is due,  and wait for the next one
+ */
+static enum hrtimer_restart
+null_timer_fn(struct hrtimer *timer)
+{
+	struct null_req *nr, *tmp;
+	LIST_HEAD(done);
+	unsigned long flags;
+	s64 now = ktime_to_ns(ktime_get());
+	int restart = HRTIMER_NORESTART, unblock = 0;
+
+	spin_lock_irqsave(&null_lock, flags);
+	list_for_each_entry_safe(nr, tmp, &null_q, list) {
+		if (nr->due > now)
+			break;
+		list_move_tail(&nr->list, &done);
+		null_inflight--;
+	}
+	if (!list_empty(&null_q)) {
+		nr = list_first_entry(&null_q, struct null_req, list);
+		hrtimer_set_expires(timer, ns_to_ktime(nr->due));
+		restart = HRTIMER_RESTART;
+	} else
+		null_armed = 0;
+	if (null_blocked && !list_empty(&done)) {
+		null_blocked = 0;
+		unblock = 1;
+	}
+	spin_unlock_irqrestore(&null_lock, flags);
+
+	list_for_each_entry_safe(nr, tmp, &done, list) {
+		crypto_done(nr->crp);
+		kfree(nr);
+	}
+	if (unblock)
+		crypto_unblock(null_id, CRYPTO_SYMQ);
+	return restart;
+}
+
+/*
+ * hand a request to the fake engine,  ERESTART if it is full
+ */
+static int
+null_queue(struct cryptop *crp)
+{
+	struct null_req *nr;
+	unsigned long flags;
+	s64 now, start;
+
+	nr = kmalloc(sizeof(*nr), GFP_ATOMIC);
+	if (nr == NULL) {
+		crp->crp_etype = ENOMEM;
+		crypto_done(crp);
+		return 0;
+	}
+	nr->crp = crp;
+
+	spin_lock_irqsave(&null_lock, flags);
+	if (null_qlen > 0 && null_inflight >= null_qlen) {
+		null_blocked = 1;
+		spin_unlock_irqrestore(&null_lock, flags);
+		kfree(nr);
+		return ERESTART;
+	}
+	now = ktime_to_ns(ktime_get());
+	start = null_engine_free > now ? null_engine_free : now;
+	null_engine_free = start + (s64) null_ns_per_byte * crp->crp_ilen;
+	nr->due = null_engine_free + (s64) null_latency * 1000;
+	list_add_tail(&nr->list, &null_q);
+	null_inflight++;
+	if (!null_armed) {
+		null_armed = 1;
+		hrtimer_start(&null_timer, ns_to_ktime(nr->due), HRTIMER_MODE_ABS);
+	}
+	spin_unlock_irqrestore(&null_lock, flags);
+	return 0;
+}
+
+/*
+ * complete whatever the fake engine still holds
+ */
+static void
+null_flush(void)
+{
+	struct null_req *nr, *tmp;
+	LIST_HEAD(done);
+	unsigned long flags;
+
+	hrtimer_cancel(&null_timer);
+	spin_lock_irqsave(&null_lock, flags);
+	list_splice_init(&null_q, &done);
+	null_inflight = 0;
+	null_armed = 0;
+	spin_unlock_irqrestore(&null_lock, flags);
+
+	list_for_each_entry_safe(nr, tmp, &done, list) {
+		crypto_done(nr->crp);
+		kfree(nr);
+	}
+}
+#endif
+
 /*
  * Process a request.
  */
@@ -151,6 +299,11 @@ null_process(device_t arg, struct cryptop *crp, int hint)
 		goto done;
 	}
 
+#ifdef NULL_SIMULATE
+	if (null_qlen > 0 || null_latency > 0 || null_ns_per_byte > 0)
+		return null_queue(crp);
+#endif
+
 done:
 	crypto_done(crp);
 	return 0;
@@ -169,6 +322,15 @@ null_init(void)
 	memset(&nulldev, 0, sizeof(nulldev));
 	softc_device_init(&nulldev, "ocfnull", 0, null_methods);
 
+#ifdef NULL_SIMULATE
+	spin_lock_init(&null_lock);
+	hrtimer_init(&null_timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+	null_timer.function = null_timer_fn;
+#else
+	if (null_qlen > 0 || null_latency > 0 || null_ns_per_byte > 0)
+		printk("ocfnull: no engine simulation on this kernel\n");
+#endif
+
 	null_id = crypto_get_driverid(softc_get_device(&nulldev),
 				CRYPTOCAP_F_HARDWARE);
 	if (null_id < 0)
@@ -192,8 +354,13 @@ static void
 null_exit(void)
 {
 	dprintk("%s()\n", __FUNCTION__);
+	/* no new requests once we are gone,  then finish the queued ones */
 	crypto_unregister_all(null_id);
 	null_id = -1;
+#ifdef NULL_SIMULATE
+	null_flush();
+	hrtimer_cancel(&null_timer);
+#endif
 }
 
 module_init(null_init);
@@ -16,18 +16,326 @@
 #include <linux/init.h>
 #include <linux/kernel.h>
 #include <linux/magic.h>
+#include <linux/mutex.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
 #include <linux/mtd/mtd.h>
 #include <linux/mtd/partitions.h>
 #include <linux/byteorder/generic.h>
 
 #include "mtdsplit.h"
 
+#define JFFS2_ROOTFS_MAGIC	0x19852003
+
+/* bit 0 is reserved for the rootfs matcher, bit 31 flags scanned blocks */
+#define MTDSPLIT_ROOTFS_BIT	0
+#define MTDSPLIT_MAX_MATCHERS	31
+#define MTDSPLIT_BLOCK_SCANNED	BIT(31)
+
 struct squashfs_super_block {
 	__le32 s_magic;
 	__le32 pad0[9];
 	__le64 bytes_used;
 };
 
+struct mtdsplit_block {
+	u32 mask;
+	u32 squashfs_len;
+};
+
+/*
+ * Result of scanning one partition. The scan is keyed by the underlying
+ * flash chip and the absolute offset of the partition, so that the rootfs
+ * split can reuse what the firmware split found in its parent.
+ */
+struct mtdsplit_scan {
+	struct list_head list;
+	struct mtd_info *master;
+	uint64_t base;
+	uint64_t size;
+	uint32_t erasesize;
+	u32 mask;
+	size_t header_len;
+	unsigned int nr_blocks;
+	struct mtdsplit_block *blocks;
+	bool transient;
+};
+
+static LIST_HEAD(mtdsplit_matchers);
+static LIST_HEAD(mtdsplit_scans);
+static DEFINE_MUTEX(mtdsplit_lock);
+static u32 mtdsplit_matcher_mask = BIT(MTDSPLIT_ROOTFS_BIT);
+static size_t mtdsplit_header_len = sizeof(struct squashfs_super_block);
+static unsigned int mtdsplit_next_bit = MTDSPLIT_ROOTFS_BIT + 1;
+static bool mtdsplit_cache_enabled = true;
+
+int mtdsplit_register_matcher(struct mtdsplit_matcher *matcher)
+{
+	int ret = 0;
+
+	mutex_lock(&mtdsplit_lock);
+
+	if (mtdsplit_next_bit >= MTDSPLIT_MAX_MATCHERS) {
+		pr_err("too many header matchers, \"%s\" not registered\n",
+		       matcher->name);
+		ret = -ENOSPC;
+		goto out;
+	}
+
+	matcher->bit = mtdsplit_next_bit++;
+	list_add_tail(&matcher->list, &mtdsplit_matchers);
+
+	mtdsplit_matcher_mask |= BIT(matcher->bit);
+	mtdsplit_header_len = max(mtdsplit_header_len, matcher->header_len);
+
+out:
+	mutex_unlock(&mtdsplit_lock);
+	return ret;
+}
+EXPORT_SYMBOL_GPL(mtdsplit_register_matcher);
+
+static void mtdsplit_scan_free(struct mtdsplit_scan *scan)
+{
+	vfree(scan->blocks);
+	kfree(scan);
+}
+
+static struct mtdsplit_scan *mtdsplit_scan_get(struct mtd_info *mtd)
+{
+	struct mtd_info *master = mtdpart_get_master(mtd);
+	uint64_t base = mtdpart_get_offset(mtd);
+	struct mtdsplit_scan *scan;
+
+	if (mtdsplit_cache_enabled) {
+		list_for_each_entry(scan, &mtdsplit_scans, list) {
+			if (scan->master != master || scan->base != base ||
+			    scan->size != mtd->size ||
+			    scan->erasesize != mtd->erasesize)
+				continue;
+
+			/* a matcher registered after the scan started */
+			if (scan->mask != mtdsplit_matcher_mask) {
+				memset(scan->blocks, 0,
+				       scan->nr_blocks * sizeof(*scan->blocks));
+				scan->mask = mtdsplit_matcher_mask;
+				scan->header_len = mtdsplit_header_len;
+			}
+
+			return scan;
+		}
+	}
+
+	scan = kzalloc(sizeof(*scan), GFP_KERNEL);
+	if (!scan)
+		return NULL;
+
+	scan->master = master;
+	scan->base = base;
+	scan->size = mtd->size;
+	scan->erasesize = mtd->erasesize;
+	scan->mask = mtdsplit_matcher_mask;
+	scan->header_len = mtdsplit_header_len;
+	scan->nr_blocks = mtd_div_by_eb(mtd_roundup_to_eb(mtd->size, mtd), mtd);
+	scan->blocks = vzalloc(scan->nr_blocks * sizeof(*scan->blocks));
+	if (!scan->blocks) {
+		kfree(scan);
+		return NULL;
+	}
+
+	if (mtdsplit_cache_enabled)
+		list_add_tail(&scan->list, &mtdsplit_scans);
+	else
+		scan->transient = true;
+
+	return scan;
+}
+
+static void mtdsplit_scan_put(struct mtdsplit_scan *scan)
+{
+	if (scan->transient)
+		mtdsplit_scan_free(scan);
+}
+
+/*
+ * Read the header of an erase block once and run every registered matcher
+ * on it. Returns the mask of matchers that recognized the block.
+ */
+static u32 mtdsplit_scan_block(struct mtd_info *mtd,
+			       struct mtdsplit_scan *scan,
+			       size_t offset)
+{
+	struct mtdsplit_block *block;
+	struct mtdsplit_matcher *matcher;
+	struct squashfs_super_block *sb;
+	unsigned int index;
+	size_t len, retlen;
+	u_char *buf;
+	int err;
+
+	index = mtd_div_by_eb(offset, mtd);
+	if (index >= scan->nr_blocks)
+		return 0;
+
+	block = &scan->blocks[index];
+	if (block->mask & MTDSPLIT_BLOCK_SCANNED)
+		return block->mask;
+
+	block->mask = MTDSPLIT_BLOCK_SCANNED;
+
+	if (mtd_can_have_bb(mtd) && mtd_block_isbad(mtd, offset) > 0)
+		return block->mask;
+
+	len = min_t(uint64_t, scan->header_len, mtd->size - offset);
+	buf = kmalloc(scan->header_len, GFP_KERNEL);
+	if (!buf)
+		goto out_unscanned;
+
+	err = mtd_read(mtd, offset, len, &retlen, buf);
+	if ((err && !mtd_is_bitflip(err)) || retlen != len) {
+		pr_debug("read error in \"%s\" at offset %llx\n",
+			 mtd->name, (unsigned long long) offset);
+		kfree(buf);
+		return block->mask;
+	}
+
+	/* short reads at the end of the device never match */
+	memset(buf + len, 0xff, scan->header_len - len);
+
+	sb = (struct squashfs_super_block *) buf;
+	if (le32_to_cpu(sb->s_magic) == SQUASHFS_MAGIC) {
+		block->mask |= BIT(MTDSPLIT_ROOTFS_BIT);
+		block->squashfs_len = min_t(uint64_t,
+					    le64_to_cpu(sb->bytes_used),
+					    U32_MAX);
+	} else if (*(u32 *) buf == JFFS2_ROOTFS_MAGIC) {
+		block->mask |= BIT(MTDSPLIT_ROOTFS_BIT);
+	}
+
+	list_for_each_entry(matcher, &mtdsplit_matchers, list)
+		if (matcher->match(buf, scan->header_len) >= 0)
+			block->mask |= BIT(matcher->bit);
+
+	kfree(buf);
+	return block->mask;
+
+out_unscanned:
+	block->mask = 0;
+	return 0;
+}
+
+static int mtdsplit_find_from(struct mtd_info *mtd,
+			      unsigned int bit,
+			      size_t from,
+			      size_t limit,
+			      size_t *ret_offset)
+{
+	struct mtdsplit_scan *scan;
+	size_t offset;
+	int ret = -ENODEV;
+
+	mutex_lock(&mtdsplit_lock);
+
+	scan = mtdsplit_scan_get(mtd);
+	if (!scan) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	for (offset = mtd_roundup_to_eb(from, mtd); offset < limit;
+	     offset += mtd->erasesize) {
+		if (!(mtdsplit_scan_block(mtd, scan, offset) & BIT(bit)))
+			continue;
+
+		*ret_offset = offset;
+		ret = 0;
+		break;
+	}
+
+	mtdsplit_scan_put(scan);
+
+out:
+	mutex_unlock(&mtdsplit_lock);
+	return ret;
+}
+
+static bool mtdsplit_match_at(struct mtd_info *mtd,
+			      struct mtdsplit_matcher *matcher,
+			      size_t offset)
+{
+	size_t retlen;
+	u_char *buf;
+	bool match = false;
+	int err;
+
+	if (offset + matcher->header_len > mtd->size)
+		return false;
+
+	buf = kmalloc(matcher->header_len, GFP_KERNEL);
+	if (!buf)
+		return false;
+
+	err = mtd_read(mtd, offset, matcher->header_len, &retlen, buf);
+	if ((!err || mtd_is_bitflip(err)) && retlen == matcher->header_len)
+		match = matcher->match(buf, matcher->header_len) >= 0;
+
+	kfree(buf);
+	return match;
+}
+
+int mtd_find_header_from(struct mtd_info *mtd,
+			 struct mtdsplit_matcher *matcher,
+			 size_t from,
+			 size_t limit,
+			 size_t *ret_offset)
+{
+	if (from >= limit)
+		return -ENODEV;
+
+	if (mtd_mod_by_eb(from, mtd) && mtdsplit_match_at(mtd, matcher, from)) {
+		*ret_offset = from;
+		return 0;
+	}
+
+	return mtdsplit_find_from(mtd, matcher->bit, from, limit, ret_offset);
+}
+EXPORT_SYMBOL_GPL(mtd_find_header_from);
+
+static int mtdsplit_cached_squashfs_len(struct mtd_info *mtd, size_t offset,
+					size_t *squashfs_len)
+{
+	struct mtd_info *master = mtdpart_get_master(mtd);
+	uint64_t abs = mtdpart_get_offset(mtd) + offset;
+	struct mtdsplit_scan *scan;
+	struct mtdsplit_block *block;
+	int ret = -ENOENT;
+
+	mutex_lock(&mtdsplit_lock);
+
+	list_for_each_entry(scan, &mtdsplit_scans, list) {
+		uint64_t rel;
+
+		if (scan->master != master || abs < scan->base ||
+		    abs >= scan->base + scan->size)
+			continue;
+
+		rel = abs - scan->base;
+		if (do_div(rel, scan->erasesize))
+			continue;
+
+		block = &scan->blocks[rel];
+		if (!(block->mask & MTDSPLIT_BLOCK_SCANNED) ||
+		    !block->squashfs_len)
+			continue;
+
+		*squashfs_len = block->squashfs_len;
+		ret = 0;
+		break;
+	}
+
+	mutex_unlock(&mtdsplit_lock);
+	return ret;
+}
+
 int mtd_get_squashfs_len(struct mtd_info *master,
 			 size_t offset,
 			 size_t *squashfs_len)
@@ -36,6 +344,9 @@ int mtd_get_squashfs_len(struct mtd_info *master,
 	size_t retlen;
 	int err;
 
+	if (!mtdsplit_cached_squashfs_len(master, offset, &retlen))
+		goto check_size;
+
 	err = mtd_read(master, offset, sizeof(sb), &retlen, (void *)&sb);
 	if (err || (retlen != sizeof(sb))) {
 		pr_alert("error occured while reading from \"%s\"\n",
@@ -54,6 +365,7 @@ int mtd_get_squashfs_len(struct mtd_info *master,
 		return -ENODEV;
 	}
 
+check_size:
 	if (offset + retlen > master->size) {
 		pr_alert("squashfs has invalid size in \"%s\"\n",
 			 master->name);
@@ -65,17 +377,22 @@ int mtd_get_squashfs_len(struct mtd_info *master,
 }
 EXPORT_SYMBOL_GPL(mtd_get_squashfs_len);
 
-static ssize_t mtd_next_eb(struct mtd_info *mtd, size_t offset)
-{
-	return mtd_rounddown_to_eb(offset, mtd) + mtd->erasesize;
-}
-
 int mtd_check_rootfs_magic(struct mtd_info *mtd, size_t offset)
 {
 	u32 magic;
 	size_t retlen;
 	int ret;
 
+	/*
+	 * The block scan only remembers matches, it skips blocks it could
+	 * not read.  Anything but a match is read again below, so read
+	 * errors reach the caller as before.
+	 */
+	if (!mtd_mod_by_eb(offset, mtd) &&
+	    !mtdsplit_find_from(mtd, MTDSPLIT_ROOTFS_BIT, offset, offset + 1,
+				&retlen))
+		return 0;
+
 	ret = mtd_read(mtd, offset, sizeof(magic), &retlen,
 		       (unsigned char *) &magic);
 	if (ret)
@@ -85,7 +402,7 @@ int mtd_check_rootfs_magic(struct mtd_info *mtd, size_t offset)
 		return -EIO;
 
 	if (le32_to_cpu(magic) != SQUASHFS_MAGIC &&
-	    magic != 0x19852003)
+	    magic != JFFS2_ROOTFS_MAGIC)
 		return -EINVAL;
 
 	return 0;
@@ -97,20 +414,38 @@ int mtd_find_rootfs_from(struct mtd_info *mtd,
 			 size_t limit,
 			 size_t *ret_offset)
 {
-	size_t offset;
-	int err;
-
-	for (offset = from; offset < limit;
-	     offset = mtd_next_eb(mtd, offset)) {
-		err = mtd_check_rootfs_magic(mtd, offset);
-		if (err)
-			continue;
+	if (from >= limit)
+		return -ENODEV;
 
-		*ret_offset = offset;
+	if (mtd_mod_by_eb(from, mtd) && !mtd_check_rootfs_magic(mtd, from)) {
+		*ret_offset = from;
 		return 0;
 	}
 
-	return -ENODEV;
+	return mtdsplit_find_from(mtd, MTDSPLIT_ROOTFS_BIT, from, limit,
+				  ret_offset);
 }
 EXPORT_SYMBOL_GPL(mtd_find_rootfs_from);
 
+/*
+ * Partitions are only split while the flash drivers probe during boot;
+ * drop the scan results afterwards and scan from scratch for devices
+ * that show up later, since their contents may have been rewritten.
+ */
+static int __init mtdsplit_scan_cache_drop(void)
+{
+	struct mtdsplit_scan *scan, *tmp;
+
+	mutex_lock(&mtdsplit_lock);
+
+	mtdsplit_cache_enabled = false;
+	list_for_each_entry_safe(scan, tmp, &mtdsplit_scans, list) {
+		list_del(&scan->list);
+		mtdsplit_scan_free(scan);
+	}
+
+	mutex_unlock(&mtdsplit_lock);
+
+	return 0;
+}
+late_initcall_sync(mtdsplit_scan_cache_drop);
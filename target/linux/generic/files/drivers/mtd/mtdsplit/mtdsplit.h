@@ -18,7 +18,29 @@
 
 #define ROOTFS_SPLIT_NAME	"rootfs_data"
 
+/*
+ * A matcher recognizes a firmware header at the start of an erase block.
+ * All registered matchers are run on the same header buffer while the
+ * partition is scanned, so every erase block is read only once no matter
+ * how many parsers look for their magic.
+ */
+struct mtdsplit_matcher {
+	struct list_head list;
+	const char *name;
+	size_t header_len;
+	ssize_t (*match)(u_char *buf, size_t len);
+	unsigned int bit;
+};
+
 #ifdef CONFIG_MTD_SPLIT
+int mtdsplit_register_matcher(struct mtdsplit_matcher *matcher);
+
+int mtd_find_header_from(struct mtd_info *mtd,
+			 struct mtdsplit_matcher *matcher,
+			 size_t from,
+			 size_t limit,
+			 size_t *ret_offset);
+
 int mtd_get_squashfs_len(struct mtd_info *master,
 			 size_t offset,
 			 size_t *squashfs_len);
@@ -31,6 +53,20 @@ int mtd_find_rootfs_from(struct mtd_info *mtd,
 			 size_t *ret_offset);
 
 #else
+static inline int mtdsplit_register_matcher(struct mtdsplit_matcher *matcher)
+{
+	return -ENODEV;
+}
+
+static inline int mtd_find_header_from(struct mtd_info *mtd,
+				       struct mtdsplit_matcher *matcher,
+				       size_t from,
+				       size_t limit,
+				       size_t *ret_offset)
+{
+	return -ENODEV;
+}
+
 static inline int mtd_get_squashfs_len(struct mtd_info *master,
 				       size_t offset,
 				       size_t *squashfs_len)
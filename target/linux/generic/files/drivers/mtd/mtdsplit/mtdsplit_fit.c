@@ -44,6 +44,23 @@ struct fdt_header {
 	uint32_t size_dt_struct;	 /* size of the structure block */
 };
 
+static ssize_t fit_match(u_char *buf, size_t len)
+{
+	struct fdt_header *hdr = (struct fdt_header *) buf;
+
+	/* Check the magic - see if this is a FIT image */
+	if (be32_to_cpu(hdr->magic) != OF_DT_HEADER)
+		return -EINVAL;
+
+	return 0;
+}
+
+static struct mtdsplit_matcher fit_matcher = {
+	.name = "fit",
+	.header_len = sizeof(struct fdt_header),
+	.match = fit_match,
+};
+
 static int
 mtdsplit_fit_parse(struct mtd_info *mtd, struct mtd_partition **pparts,
 	           struct mtd_part_parser_data *data)
@@ -59,28 +76,22 @@ mtdsplit_fit_parse(struct mtd_info *mtd, struct mtd_partition **pparts,
 	hdr_len = sizeof(struct fdt_header);
 
 	/* Parse the MTD device & search for the FIT image location */
-	for(offset = 0; offset < mtd->size; offset += mtd->erasesize) {
-		ret = mtd_read(mtd, 0, hdr_len, &retlen, (void*) &hdr);
-		if (ret) {
-			pr_err("read error in \"%s\" at offset 0x%llx\n",
-			       mtd->name, (unsigned long long) offset);
-			return ret;
-		}
-
-		if (retlen != hdr_len) {
-			pr_err("short read in \"%s\"\n", mtd->name);
-			return -EIO;
-		}
-
-		/* Check the magic - see if this is a FIT image */
-		if (be32_to_cpu(hdr.magic) != OF_DT_HEADER) {
-			pr_debug("no valid FIT image found in \"%s\" at offset %llx\n",
-				 mtd->name, (unsigned long long) offset);
-			continue;
-		}
-
-		/* We found a FIT image. Let's keep going */
-		break;
+	ret = mtd_find_header_from(mtd, &fit_matcher, 0, mtd->size, &offset);
+	if (ret) {
+		pr_debug("no valid FIT image found in \"%s\"\n", mtd->name);
+		return -ENODEV;
+	}
+
+	ret = mtd_read(mtd, offset, hdr_len, &retlen, (void*) &hdr);
+	if (ret) {
+		pr_err("read error in \"%s\" at offset 0x%llx\n",
+		       mtd->name, (unsigned long long) offset);
+		return ret;
+	}
+
+	if (retlen != hdr_len) {
+		pr_err("short read in \"%s\"\n", mtd->name);
+		return -EIO;
 	}
 
 	fit_offset = offset;
@@ -132,6 +143,8 @@ static struct mtd_part_parser uimage_parser = {
 
 static int __init mtdsplit_fit_init(void)
 {
+	mtdsplit_register_matcher(&fit_matcher);
+
 	register_mtd_parser(&uimage_parser);
 
 	return 0;
@@ -54,6 +54,22 @@ read_trx_header(struct mtd_info *mtd, size_t offset,
 	return 0;
 }
 
+static ssize_t trx_match(u_char *buf, size_t len)
+{
+	struct trx_header *hdr = (struct trx_header *) buf;
+
+	if (hdr->magic != cpu_to_le32(TRX_MAGIC))
+		return -EINVAL;
+
+	return 0;
+}
+
+static struct mtdsplit_matcher trx_matcher = {
+	.name = "trx",
+	.header_len = sizeof(struct trx_header),
+	.match = trx_match,
+};
+
 static int
 mtdsplit_parse_trx(struct mtd_info *master,
 		   struct mtd_partition **pparts,
@@ -78,15 +94,14 @@ mtdsplit_parse_trx(struct mtd_info *master,
 	for (offset = 0; offset < master->size; offset += master->erasesize) {
 		trx_size = 0;
 
-		ret = read_trx_header(master, offset, &hdr);
+		ret = mtd_find_header_from(master, &trx_matcher, offset,
+					   master->size, &offset);
 		if (ret)
-			continue;
+			break;
 
-		if (hdr.magic != cpu_to_le32(TRX_MAGIC)) {
-			pr_debug("no valid trx header found in \"%s\" at offset %llx\n",
-				 master->name, (unsigned long long) offset);
+		ret = read_trx_header(master, offset, &hdr);
+		if (ret)
 			continue;
-		}
 
 		trx_size = le32_to_cpu(hdr.len);
 		if ((offset + trx_size) > master->size) {
@@ -139,6 +154,8 @@ static struct mtd_part_parser trx_parser = {
 
 static int __init mtdsplit_trx_init(void)
 {
+	mtdsplit_register_matcher(&trx_matcher);
+
 	register_mtd_parser(&trx_parser);
 
 	return 0;
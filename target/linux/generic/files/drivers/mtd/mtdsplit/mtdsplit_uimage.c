@@ -77,13 +77,13 @@ read_uimage_header(struct mtd_info *mtd, size_t offset, u_char *buf,
 /**
  * __mtdsplit_parse_uimage - scan partition and create kernel + rootfs parts
  *
- * @find_header: function to call for a block of data that will return offset
- *      of a valid uImage header if found
+ * @matcher: header matcher whose match function will return offset of a
+ *      valid uImage header within a block of data if found
  */
 static int __mtdsplit_parse_uimage(struct mtd_info *master,
 				   struct mtd_partition **pparts,
 				   struct mtd_part_parser_data *data,
-				   ssize_t (*find_header)(u_char *buf, size_t len))
+				   struct mtdsplit_matcher *matcher)
 {
 	struct mtd_partition *parts;
 	u_char *buf;
@@ -113,11 +113,16 @@ static int __mtdsplit_parse_uimage(struct mtd_info *master,
 
 		uimage_size = 0;
 
+		ret = mtd_find_header_from(master, matcher, offset,
+					   master->size, &offset);
+		if (ret)
+			break;
+
 		ret = read_uimage_header(master, offset, buf, MAX_HEADER_LEN);
 		if (ret)
 			continue;
 
-		ret = find_header(buf, MAX_HEADER_LEN);
+		ret = matcher->match(buf, MAX_HEADER_LEN);
 		if (ret < 0) {
 			pr_debug("no valid uImage found in \"%s\" at offset %llx\n",
 				 master->name, (unsigned long long) offset);
@@ -228,13 +233,19 @@ static ssize_t uimage_verify_default(u_char *buf, size_t len)
 	return 0;
 }
 
+static struct mtdsplit_matcher uimage_generic_matcher = {
+	.name = "uimage-generic",
+	.header_len = sizeof(struct uimage_header),
+	.match = uimage_verify_default,
+};
+
 static int
 mtdsplit_uimage_parse_generic(struct mtd_info *master,
 			      struct mtd_partition **pparts,
 			      struct mtd_part_parser_data *data)
 {
 	return __mtdsplit_parse_uimage(master, pparts, data,
-				      uimage_verify_default);
+				       &uimage_generic_matcher);
 }
 
 static struct mtd_part_parser uimage_generic_parser = {
@@ -281,13 +292,19 @@ static ssize_t uimage_verify_wndr3700(u_char *buf, size_t len)
 	return 0;
 }
 
+static struct mtdsplit_matcher uimage_netgear_matcher = {
+	.name = "uimage-netgear",
+	.header_len = sizeof(struct uimage_header),
+	.match = uimage_verify_wndr3700,
+};
+
 static int
 mtdsplit_uimage_parse_netgear(struct mtd_info *master,
 			      struct mtd_partition **pparts,
 			      struct mtd_part_parser_data *data)
 {
 	return __mtdsplit_parse_uimage(master, pparts, data,
-				      uimage_verify_wndr3700);
+				       &uimage_netgear_matcher);
 }
 
 static struct mtd_part_parser uimage_netgear_parser = {
@@ -329,13 +346,19 @@ static ssize_t uimage_find_edimax(u_char *buf, size_t len)
 	return FW_EDIMAX_OFFSET;
 }
 
+static struct mtdsplit_matcher uimage_edimax_matcher = {
+	.name = "uimage-edimax",
+	.header_len = MAX_HEADER_LEN,
+	.match = uimage_find_edimax,
+};
+
 static int
 mtdsplit_uimage_parse_edimax(struct mtd_info *master,
 			      struct mtd_partition **pparts,
 			      struct mtd_part_parser_data *data)
 {
 	return __mtdsplit_parse_uimage(master, pparts, data,
-				       uimage_find_edimax);
+				       &uimage_edimax_matcher);
 }
 
 static struct mtd_part_parser uimage_edimax_parser = {
@@ -351,6 +374,10 @@ static struct mtd_part_parser uimage_edimax_parser = {
 
 static int __init mtdsplit_uimage_init(void)
 {
+	mtdsplit_register_matcher(&uimage_generic_matcher);
+	mtdsplit_register_matcher(&uimage_netgear_matcher);
+	mtdsplit_register_matcher(&uimage_edimax_matcher);
+
 	register_mtd_parser(&uimage_generic_parser);
 	register_mtd_parser(&uimage_netgear_parser);
 	register_mtd_parser(&uimage_edimax_parser);
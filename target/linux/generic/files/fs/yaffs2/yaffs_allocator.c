@@ -17,193 +17,211 @@
 #include "yportenv.h"
 
 /*
- * Each entry in yaffs_tnode_list and yaffs_obj_list hold blocks
- * of approx 100 objects that are themn allocated singly.
- * This is basically a simplified slab allocator.
+ * Tnodes and objects are handed out from page sized arenas, each holding
+ * as many items as fit after a small header. Free items are linked
+ * through their first word. The arena an item belongs to is found by
+ * masking its address, so that freeing an item can tell when its arena
+ * has become empty and give the page back.
  *
  * We don't use the Linux slab allocator because slab does not allow
  * us to dump all the objects in one hit when we do a umount and tear
- * down  all the tnodes and objects. slab requires that we first free
- * the individual objects.
+ * down all the tnodes and objects. slab requires that we first free
+ * the individual objects. Arenas are just pages, so that is easy.
  *
- * Once yaffs has been mainlined I shall try to motivate for a change
- * to slab to provide the extra features we need here.
+ * Some empty arenas are kept back so that freeing and reallocating
+ * around the boundary of an arena doesn't hit the page allocator every
+ * time: YAFFS_SPARE_ARENAS, or a sixteenth of the pool if that is more.
+ * yaffs_trim_raw_tnodes_and_objs() gives those back too, under memory
+ * pressure.
  */
 
-struct yaffs_tnode_list {
-	struct yaffs_tnode_list *next;
-	struct yaffs_tnode *tnodes;
+#define YAFFS_SPARE_ARENAS	4
+#define YAFFS_SPARE_ARENAS_SHIFT 4
+
+struct yaffs_arena {
+	struct list_head list;	/* On its pool's partial, full or empty list */
+	void *free;
+	int n_free;
 };
 
-struct yaffs_obj_list {
-	struct yaffs_obj_list *next;
-	struct yaffs_obj *objects;
+struct yaffs_arena_pool {
+	int item_size;
+	int per_arena;
+	u32 *n_arenas;		/* Device accounting for this pool */
+	struct list_head partial;
+	struct list_head full;
+	struct list_head empty;
+	int n_empty;
 };
 
 struct yaffs_allocator {
-	int n_tnodes_created;
-	struct yaffs_tnode *free_tnodes;
-	int n_free_tnodes;
-	struct yaffs_tnode_list *alloc_tnode_list;
-
-	int n_obj_created;
-	struct list_head free_objs;
-	int n_free_objects;
-
-	struct yaffs_obj_list *allocated_obj_list;
+	struct yaffs_arena_pool tnodes;
+	struct yaffs_arena_pool objs;
 };
 
-static void yaffs_deinit_raw_tnodes(struct yaffs_dev *dev)
-{
-	struct yaffs_allocator *allocator =
-	    (struct yaffs_allocator *)dev->allocator;
-	struct yaffs_tnode_list *tmp;
+#define YAFFS_ARENA_HDR_SIZE	ALIGN(sizeof(struct yaffs_arena), 8)
 
-	if (!allocator) {
-		BUG();
-		return;
-	}
-
-	while (allocator->alloc_tnode_list) {
-		tmp = allocator->alloc_tnode_list->next;
-
-		kfree(allocator->alloc_tnode_list->tnodes);
-		kfree(allocator->alloc_tnode_list);
-		allocator->alloc_tnode_list = tmp;
-	}
+static struct yaffs_arena *yaffs_item_to_arena(void *item)
+{
+	return (struct yaffs_arena *)((unsigned long)item & PAGE_MASK);
+}
 
-	allocator->free_tnodes = NULL;
-	allocator->n_free_tnodes = 0;
-	allocator->n_tnodes_created = 0;
+static void yaffs_init_pool(struct yaffs_arena_pool *pool, int item_size,
+			    u32 *n_arenas)
+{
+	pool->item_size = item_size;
+	pool->per_arena = (PAGE_SIZE - YAFFS_ARENA_HDR_SIZE) / item_size;
+	pool->n_arenas = n_arenas;
+	INIT_LIST_HEAD(&pool->partial);
+	INIT_LIST_HEAD(&pool->full);
+	INIT_LIST_HEAD(&pool->empty);
+	pool->n_empty = 0;
 }
 
-static void yaffs_init_raw_tnodes(struct yaffs_dev *dev)
+static void yaffs_release_arena(struct yaffs_dev *dev,
+				struct yaffs_arena_pool *pool,
+				struct yaffs_arena *arena)
 {
-	struct yaffs_allocator *allocator = dev->allocator;
+	list_del(&arena->list);
+	free_page((unsigned long)arena);
+	(*pool->n_arenas)--;
+	dev->n_arenas_released++;
+}
 
-	if (!allocator) {
-		BUG();
-		return;
+static void yaffs_deinit_pool(struct yaffs_dev *dev,
+			      struct yaffs_arena_pool *pool)
+{
+	struct list_head *lists[] = { &pool->partial, &pool->full,
+				      &pool->empty };
+	struct yaffs_arena *arena;
+	unsigned i;
+
+	for (i = 0; i < ARRAY_SIZE(lists); i++) {
+		while (!list_empty(lists[i])) {
+			arena = list_entry(lists[i]->next,
+					   struct yaffs_arena, list);
+			list_del(&arena->list);
+			free_page((unsigned long)arena);
+		}
 	}
-
-	allocator->alloc_tnode_list = NULL;
-	allocator->free_tnodes = NULL;
-	allocator->n_free_tnodes = 0;
-	allocator->n_tnodes_created = 0;
+	pool->n_empty = 0;
+	*pool->n_arenas = 0;
 }
 
-static int yaffs_create_tnodes(struct yaffs_dev *dev, int n_tnodes)
+static struct yaffs_arena *yaffs_new_arena(struct yaffs_dev *dev,
+					   struct yaffs_arena_pool *pool)
 {
-	struct yaffs_allocator *allocator =
-	    (struct yaffs_allocator *)dev->allocator;
+	struct yaffs_arena *arena;
+	u8 *item;
 	int i;
-	struct yaffs_tnode *new_tnodes;
-	u8 *mem;
-	struct yaffs_tnode *curr;
-	struct yaffs_tnode *next;
-	struct yaffs_tnode_list *tnl;
 
-	if (!allocator) {
-		BUG();
-		return YAFFS_FAIL;
-	}
-
-	if (n_tnodes < 1)
-		return YAFFS_OK;
-
-	/* make these things */
-	new_tnodes = kmalloc(n_tnodes * dev->tnode_size, GFP_NOFS);
-	mem = (u8 *) new_tnodes;
-
-	if (!new_tnodes) {
+	arena = (struct yaffs_arena *)__get_free_page(GFP_NOFS);
+	if (!arena) {
 		yaffs_trace(YAFFS_TRACE_ERROR,
-			"yaffs: Could not allocate Tnodes");
-		return YAFFS_FAIL;
+			"yaffs: Could not allocate an arena");
+		return NULL;
 	}
 
-	/* New hookup for wide tnodes */
-	for (i = 0; i < n_tnodes - 1; i++) {
-		curr = (struct yaffs_tnode *)&mem[i * dev->tnode_size];
-		next = (struct yaffs_tnode *)&mem[(i + 1) * dev->tnode_size];
-		curr->internal[0] = next;
+	item = (u8 *)arena + YAFFS_ARENA_HDR_SIZE;
+	arena->free = NULL;
+	for (i = pool->per_arena - 1; i >= 0; i--) {
+		*(void **)&item[i * pool->item_size] = arena->free;
+		arena->free = &item[i * pool->item_size];
 	}
+	arena->n_free = pool->per_arena;
+	list_add(&arena->list, &pool->partial);
 
-	curr = (struct yaffs_tnode *)&mem[(n_tnodes - 1) * dev->tnode_size];
-	curr->internal[0] = allocator->free_tnodes;
-	allocator->free_tnodes = (struct yaffs_tnode *)mem;
+	(*pool->n_arenas)++;
+	if (dev->n_tnode_arenas + dev->n_obj_arenas > dev->n_arenas_peak)
+		dev->n_arenas_peak = dev->n_tnode_arenas + dev->n_obj_arenas;
 
-	allocator->n_free_tnodes += n_tnodes;
-	allocator->n_tnodes_created += n_tnodes;
+	yaffs_trace(YAFFS_TRACE_ALLOCATE, "Arena added");
+	return arena;
+}
 
-	/* Now add this bunch of tnodes to a list for freeing up.
-	 * NB If we can't add this to the management list it isn't fatal
-	 * but it just means we can't free this bunch of tnodes later.
-	 */
-	tnl = kmalloc(sizeof(struct yaffs_tnode_list), GFP_NOFS);
-	if (!tnl) {
-		yaffs_trace(YAFFS_TRACE_ERROR,
-			"Could not add tnodes to management list");
-		return YAFFS_FAIL;
+static void *yaffs_pool_alloc(struct yaffs_dev *dev,
+			      struct yaffs_arena_pool *pool)
+{
+	struct yaffs_arena *arena;
+	void *item;
+
+	if (!list_empty(&pool->partial)) {
+		arena = list_entry(pool->partial.next,
+				   struct yaffs_arena, list);
+	} else if (!list_empty(&pool->empty)) {
+		arena = list_entry(pool->empty.next,
+				   struct yaffs_arena, list);
+		list_move(&arena->list, &pool->partial);
+		pool->n_empty--;
 	} else {
-		tnl->tnodes = new_tnodes;
-		tnl->next = allocator->alloc_tnode_list;
-		allocator->alloc_tnode_list = tnl;
+		arena = yaffs_new_arena(dev, pool);
+		if (!arena)
+			return NULL;
 	}
 
-	yaffs_trace(YAFFS_TRACE_ALLOCATE, "Tnodes added");
+	item = arena->free;
+	arena->free = *(void **)item;
+	arena->n_free--;
+	if (!arena->n_free)
+		list_move(&arena->list, &pool->full);
 
-	return YAFFS_OK;
+	return item;
 }
 
-struct yaffs_tnode *yaffs_alloc_raw_tnode(struct yaffs_dev *dev)
+static void yaffs_pool_free(struct yaffs_dev *dev,
+			    struct yaffs_arena_pool *pool, void *item)
 {
-	struct yaffs_allocator *allocator =
-	    (struct yaffs_allocator *)dev->allocator;
-	struct yaffs_tnode *tn = NULL;
-
-	if (!allocator) {
-		BUG();
-		return NULL;
+	struct yaffs_arena *arena = yaffs_item_to_arena(item);
+	int spare;
+
+	*(void **)item = arena->free;
+	arena->free = item;
+	arena->n_free++;
+
+	if (arena->n_free == 1) {
+		/* Was full. Use it after the partial ones already in use. */
+		list_move_tail(&arena->list, &pool->partial);
+	} else if (arena->n_free == pool->per_arena) {
+		spare = max_t(int, YAFFS_SPARE_ARENAS,
+			      *pool->n_arenas >> YAFFS_SPARE_ARENAS_SHIFT);
+		if (pool->n_empty < spare) {
+			list_move(&arena->list, &pool->empty);
+			pool->n_empty++;
+		} else {
+			yaffs_release_arena(dev, pool, arena);
+		}
 	}
+}
 
-	/* If there are none left make more */
-	if (!allocator->free_tnodes)
-		yaffs_create_tnodes(dev, YAFFS_ALLOCATION_NTNODES);
-
-	if (allocator->free_tnodes) {
-		tn = allocator->free_tnodes;
-		allocator->free_tnodes = allocator->free_tnodes->internal[0];
-		allocator->n_free_tnodes--;
+static int yaffs_trim_pool(struct yaffs_dev *dev,
+			   struct yaffs_arena_pool *pool, int max)
+{
+	int n = 0;
+
+	while (n < max && !list_empty(&pool->empty)) {
+		yaffs_release_arena(dev, pool,
+				    list_entry(pool->empty.next,
+					       struct yaffs_arena, list));
+		pool->n_empty--;
+		n++;
 	}
-
-	return tn;
+	return n;
 }
 
-/* FreeTnode frees up a tnode and puts it back on the free list */
-void yaffs_free_raw_tnode(struct yaffs_dev *dev, struct yaffs_tnode *tn)
+struct yaffs_tnode *yaffs_alloc_raw_tnode(struct yaffs_dev *dev)
 {
 	struct yaffs_allocator *allocator = dev->allocator;
 
 	if (!allocator) {
 		BUG();
-		return;
+		return NULL;
 	}
 
-	if (tn) {
-		tn->internal[0] = allocator->free_tnodes;
-		allocator->free_tnodes = tn;
-		allocator->n_free_tnodes++;
-	}
-	dev->checkpoint_blocks_required = 0;	/* force recalculation */
+	return yaffs_pool_alloc(dev, &allocator->tnodes);
 }
 
-/*--------------- yaffs_obj alloaction ------------------------
- *
- * Free yaffs_objs are stored in a list using obj->siblings.
- * The blocks of allocated objects are stored in a linked list.
- */
-
-static void yaffs_init_raw_objs(struct yaffs_dev *dev)
+/* FreeTnode frees up a tnode and puts it back in its arena */
+void yaffs_free_raw_tnode(struct yaffs_dev *dev, struct yaffs_tnode *tn)
 {
 	struct yaffs_allocator *allocator = dev->allocator;
 
@@ -212,129 +230,76 @@ static void yaffs_init_raw_objs(struct yaffs_dev *dev)
 		return;
 	}
 
-	allocator->allocated_obj_list = NULL;
-	INIT_LIST_HEAD(&allocator->free_objs);
-	allocator->n_free_objects = 0;
+	if (tn)
+		yaffs_pool_free(dev, &allocator->tnodes, tn);
+	dev->checkpoint_blocks_required = 0;	/* force recalculation */
 }
 
-static void yaffs_deinit_raw_objs(struct yaffs_dev *dev)
+struct yaffs_obj *yaffs_alloc_raw_obj(struct yaffs_dev *dev)
 {
 	struct yaffs_allocator *allocator = dev->allocator;
-	struct yaffs_obj_list *tmp;
 
 	if (!allocator) {
 		BUG();
-		return;
-	}
-
-	while (allocator->allocated_obj_list) {
-		tmp = allocator->allocated_obj_list->next;
-		kfree(allocator->allocated_obj_list->objects);
-		kfree(allocator->allocated_obj_list);
-		allocator->allocated_obj_list = tmp;
+		return NULL;
 	}
 
-	INIT_LIST_HEAD(&allocator->free_objs);
-	allocator->n_free_objects = 0;
-	allocator->n_obj_created = 0;
+	return yaffs_pool_alloc(dev, &allocator->objs);
 }
 
-static int yaffs_create_free_objs(struct yaffs_dev *dev, int n_obj)
+void yaffs_free_raw_obj(struct yaffs_dev *dev, struct yaffs_obj *obj)
 {
 	struct yaffs_allocator *allocator = dev->allocator;
-	int i;
-	struct yaffs_obj *new_objs;
-	struct yaffs_obj_list *list;
 
 	if (!allocator) {
 		BUG();
-		return YAFFS_FAIL;
-	}
-
-	if (n_obj < 1)
-		return YAFFS_OK;
-
-	/* make these things */
-	new_objs = kmalloc(n_obj * sizeof(struct yaffs_obj), GFP_NOFS);
-	list = kmalloc(sizeof(struct yaffs_obj_list), GFP_NOFS);
-
-	if (!new_objs || !list) {
-		kfree(new_objs);
-		new_objs = NULL;
-		kfree(list);
-		list = NULL;
-		yaffs_trace(YAFFS_TRACE_ALLOCATE,
-			"Could not allocate more objects");
-		return YAFFS_FAIL;
+		return;
 	}
 
-	/* Hook them into the free list */
-	for (i = 0; i < n_obj; i++)
-		list_add(&new_objs[i].siblings, &allocator->free_objs);
-
-	allocator->n_free_objects += n_obj;
-	allocator->n_obj_created += n_obj;
-
-	/* Now add this bunch of Objects to a list for freeing up. */
-
-	list->objects = new_objs;
-	list->next = allocator->allocated_obj_list;
-	allocator->allocated_obj_list = list;
-
-	return YAFFS_OK;
+	yaffs_pool_free(dev, &allocator->objs, obj);
 }
 
-struct yaffs_obj *yaffs_alloc_raw_obj(struct yaffs_dev *dev)
+/*
+ * Give back up to max spare arenas, returning how many went. Called with
+ * the device locked.
+ */
+int yaffs_trim_raw_tnodes_and_objs(struct yaffs_dev *dev, int max)
 {
-	struct yaffs_obj *obj = NULL;
-	struct list_head *lh;
 	struct yaffs_allocator *allocator = dev->allocator;
+	int n;
 
-	if (!allocator) {
-		BUG();
-		return obj;
-	}
-
-	/* If there are none left make more */
-	if (list_empty(&allocator->free_objs))
-		yaffs_create_free_objs(dev, YAFFS_ALLOCATION_NOBJECTS);
-
-	if (!list_empty(&allocator->free_objs)) {
-		lh = allocator->free_objs.next;
-		obj = list_entry(lh, struct yaffs_obj, siblings);
-		list_del_init(lh);
-		allocator->n_free_objects--;
-	}
+	if (!allocator)
+		return 0;
 
-	return obj;
+	n = yaffs_trim_pool(dev, &allocator->tnodes, max);
+	n += yaffs_trim_pool(dev, &allocator->objs, max - n);
+	dev->n_arenas_trimmed += n;
+	return n;
 }
 
-void yaffs_free_raw_obj(struct yaffs_dev *dev, struct yaffs_obj *obj)
+/* How many arenas a trim could give back right now */
+int yaffs_n_spare_raw_arenas(struct yaffs_dev *dev)
 {
-
 	struct yaffs_allocator *allocator = dev->allocator;
 
-	if (!allocator) {
-		BUG();
-		return;
-	}
+	if (!allocator)
+		return 0;
 
-	/* Link into the free list. */
-	list_add(&obj->siblings, &allocator->free_objs);
-	allocator->n_free_objects++;
+	return allocator->tnodes.n_empty + allocator->objs.n_empty;
 }
 
 void yaffs_deinit_raw_tnodes_and_objs(struct yaffs_dev *dev)
 {
+	struct yaffs_allocator *allocator = dev->allocator;
 
-	if (!dev->allocator) {
+	if (!allocator) {
 		BUG();
 		return;
 	}
 
-	yaffs_deinit_raw_tnodes(dev);
-	yaffs_deinit_raw_objs(dev);
-	kfree(dev->allocator);
+	yaffs_deinit_pool(dev, &allocator->tnodes);
+	yaffs_deinit_pool(dev, &allocator->objs);
+	kfree(allocator);
 	dev->allocator = NULL;
 }
 
@@ -350,8 +315,9 @@ void yaffs_init_raw_tnodes_and_objs(struct yaffs_dev *dev)
 	allocator = kmalloc(sizeof(struct yaffs_allocator), GFP_NOFS);
 	if (allocator) {
 		dev->allocator = allocator;
-		yaffs_init_raw_tnodes(dev);
-		yaffs_init_raw_objs(dev);
+		yaffs_init_pool(&allocator->tnodes, dev->tnode_size,
+				&dev->n_tnode_arenas);
+		yaffs_init_pool(&allocator->objs, sizeof(struct yaffs_obj),
+				&dev->n_obj_arenas);
 	}
 }
-
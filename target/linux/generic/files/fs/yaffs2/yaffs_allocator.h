@@ -27,4 +27,7 @@ void yaffs_free_raw_tnode(struct yaffs_dev *dev, struct yaffs_tnode *tn);
 struct yaffs_obj *yaffs_alloc_raw_obj(struct yaffs_dev *dev);
 void yaffs_free_raw_obj(struct yaffs_dev *dev, struct yaffs_obj *obj);
 
+int yaffs_trim_raw_tnodes_and_objs(struct yaffs_dev *dev, int max);
+int yaffs_n_spare_raw_arenas(struct yaffs_dev *dev);
+
 #endif
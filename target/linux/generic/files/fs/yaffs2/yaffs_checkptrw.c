@@ -105,10 +105,19 @@ static int yaffs_checkpt_erase(struct yaffs_dev *dev)
 	}
 
 	dev->blocks_in_checkpt = 0;
+	dev->checkpt_appendable = 0;
+	dev->checkpt_sections = 0;
 
 	return 1;
 }
 
+/* A checkpoint block list of 1 checkpoint block per 16 block is
+ * (hopefully) going to be way more than we need */
+int yaffs2_checkpt_max_blocks(struct yaffs_dev *dev)
+{
+	return (dev->internal_end_block - dev->internal_start_block) / 16 + 2;
+}
+
 static void yaffs2_checkpt_find_erased_block(struct yaffs_dev *dev)
 {
 	int i;
@@ -215,6 +224,7 @@ int yaffs2_checkpt_open(struct yaffs_dev *dev, int writing)
 	if (!dev->checkpt_buffer)
 		return 0;
 
+	dev->checkpt_prior_blocks = 0;
 	dev->checkpt_page_seq = 0;
 	dev->checkpt_byte_count = 0;
 	dev->checkpt_sum = 0;
@@ -232,11 +242,10 @@ int yaffs2_checkpt_open(struct yaffs_dev *dev, int writing)
 	/* Opening for a read */
 	/* Set to a value that will kick off a read */
 	dev->checkpt_byte_offs = dev->data_bytes_per_chunk;
-	/* A checkpoint block list of 1 checkpoint block per 16 block is
-	 * (hopefully) going to be way more than we need */
 	dev->blocks_in_checkpt = 0;
-	dev->checkpt_max_blocks =
-	    (dev->internal_end_block - dev->internal_start_block) / 16 + 2;
+	dev->checkpt_appendable = 0;
+	dev->checkpt_sections = 0;
+	dev->checkpt_max_blocks = yaffs2_checkpt_max_blocks(dev);
 	dev->checkpt_block_list =
 	    kmalloc(sizeof(int) * dev->checkpt_max_blocks, GFP_NOFS);
 
@@ -249,6 +258,36 @@ int yaffs2_checkpt_open(struct yaffs_dev *dev, int writing)
 	return 1;
 }
 
+/* Reopen the stream we last wrote and carry on where it stopped: same
+ * page sequence, running checksum and block. Blocks the stream already
+ * holds stay accounted for; only newly allocated ones are charged on
+ * close.
+ */
+int yaffs2_checkpt_open_append(struct yaffs_dev *dev)
+{
+	if (!dev->checkpt_appendable ||
+	    !dev->tagger.write_chunk_tags_fn ||
+	    !dev->tagger.read_chunk_tags_fn ||
+	    !dev->drv.drv_erase_fn ||
+	    !dev->drv.drv_mark_bad_fn)
+		return 0;
+
+	if (!dev->checkpt_buffer)
+		dev->checkpt_buffer =
+		    kmalloc(dev->param.total_bytes_per_chunk, GFP_NOFS);
+	if (!dev->checkpt_buffer)
+		return 0;
+
+	dev->checkpt_open_write = 1;
+	dev->checkpt_prior_blocks = dev->blocks_in_checkpt;
+	dev->checkpt_byte_count = 0;
+
+	memset(dev->checkpt_buffer, 0, dev->data_bytes_per_chunk);
+	yaffs2_checkpt_init_chunk_hdr(dev);
+
+	return 1;
+}
+
 int yaffs2_get_checkpt_sum(struct yaffs_dev *dev, u32 * sum)
 {
 	u32 composite_sum;
@@ -262,6 +301,7 @@ static int yaffs2_checkpt_flush_buffer(struct yaffs_dev *dev)
 {
 	int chunk;
 	int offset_chunk;
+	int result;
 	struct yaffs_ext_tags tags;
 
 	if (dev->checkpt_cur_block < 0) {
@@ -299,8 +339,8 @@ static int yaffs2_checkpt_flush_buffer(struct yaffs_dev *dev)
 
 	dev->n_page_writes++;
 
-	dev->tagger.write_chunk_tags_fn(dev, offset_chunk,
-				       dev->checkpt_buffer, &tags);
+	result = dev->tagger.write_chunk_tags_fn(dev, offset_chunk,
+						 dev->checkpt_buffer, &tags);
 	dev->checkpt_page_seq++;
 	dev->checkpt_cur_chunk++;
 	if (dev->checkpt_cur_chunk >= dev->param.chunks_per_block) {
@@ -311,6 +351,25 @@ static int yaffs2_checkpt_flush_buffer(struct yaffs_dev *dev)
 
 	yaffs2_checkpt_init_chunk_hdr(dev);
 
+	return (result == YAFFS_OK) ? 1 : 0;
+}
+
+/* Sections start on a fresh chunk so that a later append never has to
+ * rewrite a page. Flush the partial chunk, or skip the rest of it when
+ * reading.
+ */
+int yaffs2_checkpt_end_section(struct yaffs_dev *dev)
+{
+	if (!dev->checkpt_buffer)
+		return 0;
+
+	if (!dev->checkpt_open_write) {
+		dev->checkpt_byte_offs = dev->data_bytes_per_chunk;
+		return 1;
+	}
+
+	if (dev->checkpt_byte_offs > sizeof(struct yaffs_checkpt_chunk_hdr))
+		return yaffs2_checkpt_flush_buffer(dev);
 
 	return 1;
 }
@@ -423,11 +482,11 @@ int yaffs2_checkpt_rd(struct yaffs_dev *dev, void *data, int n_bytes)
 int yaffs_checkpt_close(struct yaffs_dev *dev)
 {
 	int i;
+	int new_blocks;
+	int ok = 1;
 
 	if (dev->checkpt_open_write) {
-		if (dev->checkpt_byte_offs !=
-			sizeof(sizeof(struct yaffs_checkpt_chunk_hdr)))
-			yaffs2_checkpt_flush_buffer(dev);
+		ok = yaffs2_checkpt_end_section(dev);
 	} else if (dev->checkpt_block_list) {
 		for (i = 0;
 		     i < dev->blocks_in_checkpt &&
@@ -445,9 +504,10 @@ int yaffs_checkpt_close(struct yaffs_dev *dev)
 		dev->checkpt_block_list = NULL;
 	}
 
-	dev->n_free_chunks -=
-		dev->blocks_in_checkpt * dev->param.chunks_per_block;
-	dev->n_erased_blocks -= dev->blocks_in_checkpt;
+	new_blocks = dev->blocks_in_checkpt - dev->checkpt_prior_blocks;
+	dev->n_free_chunks -= new_blocks * dev->param.chunks_per_block;
+	dev->n_erased_blocks -= new_blocks;
+	dev->checkpt_prior_blocks = 0;
 
 	yaffs_trace(YAFFS_TRACE_CHECKPOINT, "checkpoint byte count %d",
 		dev->checkpt_byte_count);
@@ -456,7 +516,7 @@ int yaffs_checkpt_close(struct yaffs_dev *dev)
 		/* free the buffer */
 		kfree(dev->checkpt_buffer);
 		dev->checkpt_buffer = NULL;
-		return 1;
+		return ok;
 	} else {
 		return 0;
 	}
@@ -20,6 +20,12 @@
 
 int yaffs2_checkpt_open(struct yaffs_dev *dev, int writing);
 
+int yaffs2_checkpt_open_append(struct yaffs_dev *dev);
+
+int yaffs2_checkpt_end_section(struct yaffs_dev *dev);
+
+int yaffs2_checkpt_max_blocks(struct yaffs_dev *dev);
+
 int yaffs2_checkpt_wr(struct yaffs_dev *dev, const void *data, int n_bytes);
 
 int yaffs2_checkpt_rd(struct yaffs_dev *dev, void *data, int n_bytes);
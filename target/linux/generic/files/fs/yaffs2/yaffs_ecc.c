@@ -68,25 +68,99 @@ static const unsigned char column_parity_table[] = {
 };
 
 
-/* Calculate the ECC for a 256-byte block of data */
-void yaffs_ecc_calc(const unsigned char *data, unsigned char *ecc)
+/*
+ * The column parities are linear in the data byte (each is the parity of
+ * some of its bits), so the xor of the table entries of all 256 bytes is
+ * the table entry of the xor of all the bytes. The line parity is the
+ * xor of the offsets of the bytes with odd parity, which is what the
+ * byte loop below works out the slow way.
+ */
+static unsigned char yaffs_byte_parity(unsigned char b)
+{
+	return column_parity_table[b] & 0x01;
+}
+
+/*
+ * Work out the column parity and line parities a word at a time. The high
+ * bits of a byte's offset are the word's index, so they come from the
+ * parity of each word; the low bits from the xor of all the words.
+ */
+static void yaffs_ecc_parities_words(const unsigned long *words,
+				     unsigned char *col_parity,
+				     unsigned char *line_parity)
+{
+	const unsigned int n_words = 256 / sizeof(unsigned long);
+	const unsigned int word_shift = ilog2(sizeof(unsigned long));
+	unsigned long all = 0;
+	unsigned long w;
+	unsigned char lp = 0;
+	unsigned char b = 0;
+	unsigned char low = 0;
+	unsigned char bytes[sizeof(unsigned long)];
+	unsigned int i;
+
+	for (i = 0; i < n_words; i++) {
+		w = words[i];
+		all ^= w;
+#if BITS_PER_LONG > 32
+		w ^= w >> 32;
+#endif
+		w ^= w >> 16;
+		w ^= w >> 8;
+		lp ^= i & (0 - yaffs_byte_parity(w & 0xff));
+	}
+
+	memcpy(bytes, &all, sizeof(all));
+	for (i = 0; i < sizeof(unsigned long); i++) {
+		b ^= bytes[i];
+		if (yaffs_byte_parity(bytes[i]))
+			low ^= i;
+	}
+
+	*col_parity = column_parity_table[b];
+	*line_parity = (lp << word_shift) | low;
+}
+
+static void yaffs_ecc_parities_bytes(const unsigned char *data,
+				     unsigned char *col_parity,
+				     unsigned char *line_parity)
 {
 	unsigned int i;
-	unsigned char col_parity = 0;
-	unsigned char line_parity = 0;
-	unsigned char line_parity_prime = 0;
-	unsigned char t;
 	unsigned char b;
 
+	*col_parity = 0;
+	*line_parity = 0;
 	for (i = 0; i < 256; i++) {
 		b = column_parity_table[*data++];
-		col_parity ^= b;
+		*col_parity ^= b;
 
-		if (b & 0x01) {	/* odd number of bits in the byte */
-			line_parity ^= i;
-			line_parity_prime ^= ~i;
-		}
+		if (b & 0x01)	/* odd number of bits in the byte */
+			*line_parity ^= i;
 	}
+}
+
+/* Calculate the ECC for a 256-byte block of data */
+void yaffs_ecc_calc(const unsigned char *data, unsigned char *ecc)
+{
+	unsigned char col_parity;
+	unsigned char line_parity;
+	unsigned char line_parity_prime;
+	unsigned char t;
+
+	if (IS_ALIGNED((unsigned long)data, sizeof(unsigned long)))
+		yaffs_ecc_parities_words((const unsigned long *)data,
+					 &col_parity, &line_parity);
+	else
+		yaffs_ecc_parities_bytes(data, &col_parity, &line_parity);
+
+	/*
+	 * The primes are the xor of the complemented offsets, which only
+	 * differs from line_parity if an odd number of bytes had odd
+	 * parity, ie if the whole block does.
+	 */
+	line_parity_prime = line_parity;
+	if (col_parity & 0x01)
+		line_parity_prime ^= 0xff;
 
 	ecc[2] = (~col_parity) | 0x03;
 
@@ -0,0 +1,308 @@
+/*
+ * YAFFS: Yet Another Flash File System. A NAND-flash specific file system.
+ *
+ * Copyright (C) 2002-2011 Aleph One Ltd.
+ *   for Toby Churchill Ltd and Brightstar Engineering
+ *
+ * Created by Charles Manning <charles@aleph1.co.uk>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+/*
+ * The gc candidate index tracks the blocks that are full but have some
+ * discarded pages, ie. the blocks that the garbage collector may pick.
+ *
+ * All of these blocks are kept in a min-heap ordered by sequence number,
+ * which gives the oldest dirty block for yaffs2.
+ *
+ * They are also put on one of chunks_per_block lists, picked by the number
+ * of pages still in use, so the dirtiest blocks are found without scanning
+ * the block array. yaffs2 blocks with a shrink header are left off these
+ * lists: yaffs_block_ok_for_gc() only lets them go once they are the oldest
+ * dirty block, so the heap is the only place they can be picked from.
+ *
+ * The lists are circular and linked by array index. Entries 0..n_blocks-1
+ * are the blocks and entries n_blocks.. are the list heads.
+ *
+ * The index is filled in once the scan or checkpoint restore has set up the
+ * block info. From then on yaffs_gc_index_update() has to be called whenever
+ * a block's state, pages_in_use or soft_del_pages changes.
+ */
+
+#include "yaffs_gcindex.h"
+#include "yaffs_getblockinfo.h"
+#include "yaffs_yaffs2.h"
+#include "yaffs_trace.h"
+
+static inline u32 yaffs_gc_n_blocks(struct yaffs_dev *dev)
+{
+	return dev->internal_end_block - dev->internal_start_block + 1;
+}
+
+static inline u32 yaffs_gc_head(struct yaffs_dev *dev, int pages_used)
+{
+	return yaffs_gc_n_blocks(dev) + pages_used;
+}
+
+/* Is this block a gc candidate? If so, return the number of pages in use. */
+static int yaffs_gc_pages_used(struct yaffs_dev *dev,
+			       struct yaffs_block_info *bi)
+{
+	int pages_used = bi->pages_in_use - bi->soft_del_pages;
+
+	if (bi->block_state != YAFFS_BLOCK_STATE_FULL ||
+	    pages_used < 0 || pages_used >= dev->param.chunks_per_block)
+		return -1;
+	return pages_used;
+}
+
+static void yaffs_gc_link_del(struct yaffs_gc_link *links, u32 i)
+{
+	links[links[i].prev].next = links[i].next;
+	links[links[i].next].prev = links[i].prev;
+	links[i].next = i;
+	links[i].prev = i;
+}
+
+static void yaffs_gc_link_add_tail(struct yaffs_gc_link *links, u32 head,
+				   u32 i)
+{
+	links[i].next = head;
+	links[i].prev = links[head].prev;
+	links[links[head].prev].next = i;
+	links[head].prev = i;
+}
+
+/*
+ * Heap of block indexes, ordered by sequence number.
+ * The slots are 1-based so that heap_pos 0 can mean "not in the heap".
+ */
+static inline u32 yaffs_gc_seq(struct yaffs_dev *dev, u32 i)
+{
+	return dev->block_info[i].seq_number;
+}
+
+static void yaffs_gc_heap_set(struct yaffs_dev *dev, u32 pos, u32 i)
+{
+	dev->gc_heap[pos] = i;
+	dev->gc_links[i].heap_pos = pos;
+}
+
+static void yaffs_gc_heap_up(struct yaffs_dev *dev, u32 pos)
+{
+	u32 i = dev->gc_heap[pos];
+	u32 seq = yaffs_gc_seq(dev, i);
+
+	while (pos > 1 && yaffs_gc_seq(dev, dev->gc_heap[pos / 2]) > seq) {
+		yaffs_gc_heap_set(dev, pos, dev->gc_heap[pos / 2]);
+		pos /= 2;
+	}
+	yaffs_gc_heap_set(dev, pos, i);
+}
+
+static void yaffs_gc_heap_down(struct yaffs_dev *dev, u32 pos)
+{
+	u32 i = dev->gc_heap[pos];
+	u32 seq = yaffs_gc_seq(dev, i);
+	u32 child;
+
+	while ((child = pos * 2) <= dev->gc_heap_size) {
+		if (child < dev->gc_heap_size &&
+		    yaffs_gc_seq(dev, dev->gc_heap[child + 1]) <
+		    yaffs_gc_seq(dev, dev->gc_heap[child]))
+			child++;
+		if (yaffs_gc_seq(dev, dev->gc_heap[child]) >= seq)
+			break;
+		yaffs_gc_heap_set(dev, pos, dev->gc_heap[child]);
+		pos = child;
+	}
+	yaffs_gc_heap_set(dev, pos, i);
+}
+
+static void yaffs_gc_heap_add(struct yaffs_dev *dev, u32 i)
+{
+	dev->gc_heap_size++;
+	yaffs_gc_heap_set(dev, dev->gc_heap_size, i);
+	yaffs_gc_heap_up(dev, dev->gc_heap_size);
+}
+
+static void yaffs_gc_heap_del(struct yaffs_dev *dev, u32 i)
+{
+	u32 pos = dev->gc_links[i].heap_pos;
+	u32 last = dev->gc_heap[dev->gc_heap_size];
+
+	dev->gc_links[i].heap_pos = 0;
+	dev->gc_heap_size--;
+	if (pos > dev->gc_heap_size)
+		return;
+
+	yaffs_gc_heap_set(dev, pos, last);
+	yaffs_gc_heap_up(dev, pos);
+	yaffs_gc_heap_down(dev, dev->gc_links[last].heap_pos);
+}
+
+int yaffs_gc_index_init(struct yaffs_dev *dev)
+{
+	u32 n_blocks = yaffs_gc_n_blocks(dev);
+	u32 n_links = n_blocks + dev->param.chunks_per_block;
+	u32 bytes = n_links * sizeof(struct yaffs_gc_link) +
+		    (n_blocks + 1) * sizeof(u32);
+
+	dev->gc_index_ready = 0;
+	dev->gc_heap_size = 0;
+
+	/* If the first allocation strategy fails, thry the alternate one */
+	dev->gc_links = kmalloc(bytes, GFP_NOFS);
+	if (!dev->gc_links) {
+		dev->gc_links = vmalloc(bytes);
+		dev->gc_links_alt = 1;
+	} else {
+		dev->gc_links_alt = 0;
+	}
+
+	if (!dev->gc_links) {
+		dev->gc_heap = NULL;
+		return YAFFS_FAIL;
+	}
+
+	dev->gc_heap = (u32 *) (dev->gc_links + n_links);
+	return YAFFS_OK;
+}
+
+void yaffs_gc_index_deinit(struct yaffs_dev *dev)
+{
+	if (dev->gc_links_alt && dev->gc_links)
+		vfree(dev->gc_links);
+	else
+		kfree(dev->gc_links);
+	dev->gc_links = NULL;
+	dev->gc_heap = NULL;
+	dev->gc_links_alt = 0;
+	dev->gc_index_ready = 0;
+}
+
+/* Refill the index from the block info. Called after scanning. */
+void yaffs_gc_index_rebuild(struct yaffs_dev *dev)
+{
+	u32 n_blocks = yaffs_gc_n_blocks(dev);
+	u32 i;
+
+	dev->gc_index_ready = 0;
+	if (!dev->gc_links)
+		return;
+
+	for (i = 0; i < n_blocks + dev->param.chunks_per_block; i++) {
+		dev->gc_links[i].next = i;
+		dev->gc_links[i].prev = i;
+		dev->gc_links[i].heap_pos = 0;
+	}
+	dev->gc_heap_size = 0;
+	dev->gc_index_ready = 1;
+
+	dev->has_pending_prioritised_gc = 0;
+	for (i = 0; i < n_blocks; i++) {
+		yaffs_gc_index_update(dev, i + dev->internal_start_block);
+		if (dev->block_info[i].gc_prioritise)
+			dev->has_pending_prioritised_gc = 1;
+	}
+}
+
+void yaffs_gc_index_update(struct yaffs_dev *dev, int block_no)
+{
+	struct yaffs_gc_link *links = dev->gc_links;
+	u32 i = block_no - dev->internal_start_block;
+	struct yaffs_block_info *bi;
+	int pages_used;
+
+	if (!dev->gc_index_ready)
+		return;
+
+	bi = &dev->block_info[i];
+	pages_used = yaffs_gc_pages_used(dev, bi);
+
+	if (links[i].next != i)
+		yaffs_gc_link_del(links, i);
+	if (pages_used >= 0 && !(dev->param.is_yaffs2 && bi->has_shrink_hdr))
+		yaffs_gc_link_add_tail(links, yaffs_gc_head(dev, pages_used),
+				       i);
+
+	if (pages_used < 0 && links[i].heap_pos)
+		yaffs_gc_heap_del(dev, i);
+	else if (pages_used >= 0 && !links[i].heap_pos)
+		yaffs_gc_heap_add(dev, i);
+}
+
+/*
+ * Find the dirtiest block that is ok to gc and has at most max_pages_used
+ * pages in use. Returns the block number, or 0 if there is none.
+ */
+int yaffs_gc_index_find(struct yaffs_dev *dev, int max_pages_used,
+			int *pages_used)
+{
+	struct yaffs_gc_link *links = dev->gc_links;
+	struct yaffs_block_info *bi;
+	int selected = 0;
+	u32 head;
+	u32 i;
+	u32 next;
+	int used;
+	int b;
+
+	if (max_pages_used >= dev->param.chunks_per_block)
+		max_pages_used = dev->param.chunks_per_block - 1;
+
+	/* A shrink header block can only go when it is the oldest */
+	if (dev->param.is_yaffs2)
+		selected = yaffs_gc_index_oldest(dev);
+	if (selected) {
+		bi = yaffs_get_block_info(dev, selected);
+		used = yaffs_gc_pages_used(dev, bi);
+		if (bi->has_shrink_hdr && used <= max_pages_used &&
+		    yaffs_block_ok_for_gc(dev, bi)) {
+			*pages_used = used;
+			max_pages_used = used - 1;
+		} else {
+			selected = 0;
+		}
+	}
+
+	for (b = 0; b <= max_pages_used; b++) {
+		head = yaffs_gc_head(dev, b);
+		for (i = links[head].next; i != head; i = next) {
+			next = links[i].next;
+			bi = &dev->block_info[i];
+			used = yaffs_gc_pages_used(dev, bi);
+			if (used == b) {
+				if (!yaffs_block_ok_for_gc(dev, bi))
+					continue;
+				*pages_used = used;
+				return i + dev->internal_start_block;
+			}
+
+			/* Missed an update somewhere, refile it */
+			yaffs_trace(YAFFS_TRACE_ERROR,
+				"gc index: block %d filed under %d pages, has %d",
+				i + dev->internal_start_block, b, used);
+			yaffs_gc_index_update(dev,
+					      i + dev->internal_start_block);
+		}
+	}
+	return selected;
+}
+
+/* The oldest (lowest sequence number) dirty full block, or 0 if none. */
+int yaffs_gc_index_oldest(struct yaffs_dev *dev)
+{
+	u32 i;
+
+	while (dev->gc_heap_size > 0) {
+		i = dev->gc_heap[1];
+		if (yaffs_gc_pages_used(dev, &dev->block_info[i]) >= 0)
+			return i + dev->internal_start_block;
+		yaffs_gc_index_update(dev, i + dev->internal_start_block);
+	}
+	return 0;
+}
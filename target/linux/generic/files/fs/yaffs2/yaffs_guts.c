@@ -29,6 +29,8 @@
 #include "yaffs_allocator.h"
 #include "yaffs_attribs.h"
 #include "yaffs_summary.h"
+#include "yaffs_nameidx.h"
+#include "yaffs_gcindex.h"
 
 /* Note YAFFS_GC_GOOD_ENOUGH must be <= YAFFS_GC_PASSIVE_THRESHOLD */
 #define YAFFS_GC_GOOD_ENOUGH 2
@@ -44,6 +46,8 @@ static int yaffs_wr_data_obj(struct yaffs_obj *in, int inode_chunk,
 static void yaffs_fix_null_name(struct yaffs_obj *obj, YCHAR *name,
 				int buffer_size);
 
+static void yaffs_deinit_obj_buckets(struct yaffs_dev *dev);
+
 /* Function to calculate chunk and offset */
 
 void yaffs_addr_to_chunk(struct yaffs_dev *dev, loff_t addr,
@@ -253,14 +257,21 @@ static void yaffs_handle_chunk_wr_error(struct yaffs_dev *dev, int nand_chunk,
  */
 
 /*
- *  Simple hash function. Needs to have a reasonable spread
+ * Find the bucket that an object id hashes to.
+ * While the table is being resized, ids whose old bucket has not been
+ * moved across yet are still found in the old table.
  */
 
-static inline int yaffs_hash_fn(int n)
+static inline struct yaffs_obj_bucket *yaffs_obj_bucket_for(
+						struct yaffs_dev *dev, u32 n)
 {
-	if (n < 0)
-		n = -n;
-	return n % YAFFS_NOBJECT_BUCKETS;
+	if (dev->obj_bucket_old) {
+		u32 old = n & dev->obj_bucket_old_mask;
+
+		if (old >= dev->obj_rehash_pos)
+			return &dev->obj_bucket_old[old];
+	}
+	return &dev->obj_bucket[n & dev->obj_bucket_mask];
 }
 
 /*
@@ -284,7 +295,26 @@ struct yaffs_obj *yaffs_lost_n_found(struct yaffs_dev *dev)
 
 int yaffs_check_ff(u8 *buffer, int n_bytes)
 {
-	/* Horrible, slow implementation */
+	const unsigned long *words;
+
+	while (n_bytes > 0 &&
+	       !IS_ALIGNED((unsigned long)buffer, sizeof(unsigned long))) {
+		if (*buffer != 0xff)
+			return 0;
+		buffer++;
+		n_bytes--;
+	}
+
+	/* The bulk of it a word at a time */
+	words = (const unsigned long *)buffer;
+	while (n_bytes >= (int)sizeof(unsigned long)) {
+		if (*words != ~0UL)
+			return 0;
+		words++;
+		n_bytes -= sizeof(unsigned long);
+	}
+
+	buffer = (u8 *)words;
 	while (n_bytes--) {
 		if (*buffer != 0xff)
 			return 0;
@@ -347,6 +377,9 @@ int yaffs_check_alloc_available(struct yaffs_dev *dev, int n_chunks)
 	int reserved_blocks = dev->param.n_reserved_blocks;
 	int checkpt_blocks;
 
+	if (dev->param.is_yaffs2)
+		yaffs2_checkpt_release_stale(dev);
+
 	checkpt_blocks = yaffs_calc_checkpt_blocks_required(dev);
 
 	reserved_chunks =
@@ -438,6 +471,7 @@ static int yaffs_alloc_chunk(struct yaffs_dev *dev, int use_reserver,
 		/* If the block is full set the state to full */
 		if (dev->alloc_page >= dev->param.chunks_per_block) {
 			bi->block_state = YAFFS_BLOCK_STATE_FULL;
+			yaffs_gc_index_update(dev, dev->alloc_block);
 			dev->alloc_block = -1;
 		}
 
@@ -478,6 +512,7 @@ void yaffs_skip_rest_of_block(struct yaffs_dev *dev)
 		bi = yaffs_get_block_info(dev, dev->alloc_block);
 		if (bi->block_state == YAFFS_BLOCK_STATE_ALLOCATING) {
 			bi->block_state = YAFFS_BLOCK_STATE_FULL;
+			yaffs_gc_index_update(dev, dev->alloc_block);
 			dev->alloc_block = -1;
 		}
 	}
@@ -625,6 +660,7 @@ static void yaffs_retire_block(struct yaffs_dev *dev, int flash_block)
 	bi->block_state = YAFFS_BLOCK_STATE_DEAD;
 	bi->gc_prioritise = 0;
 	bi->needs_retiring = 0;
+	yaffs_gc_index_update(dev, flash_block);
 
 	dev->n_retired_blocks++;
 }
@@ -665,6 +701,7 @@ void yaffs_set_obj_name(struct yaffs_obj *obj, const YCHAR * name)
 	}
 
 	obj->sum = yaffs_calc_name_sum(name);
+	yaffs_name_index_update(obj);
 }
 
 void yaffs_set_obj_name_from_oh(struct yaffs_obj *obj,
@@ -720,6 +757,8 @@ static void yaffs_free_tnode(struct yaffs_dev *dev, struct yaffs_tnode *tn)
 
 static void yaffs_deinit_tnodes_and_objs(struct yaffs_dev *dev)
 {
+	yaffs_name_index_deinit(dev);
+	yaffs_deinit_obj_buckets(dev);
 	yaffs_deinit_raw_tnodes_and_objs(dev);
 	dev->n_obj = 0;
 	dev->n_tnodes = 0;
@@ -943,6 +982,98 @@ struct yaffs_tnode *yaffs_add_find_tnode_0(struct yaffs_dev *dev,
 	return tn;
 }
 
+static void yaffs_free_tnode_tree(struct yaffs_dev *dev,
+				  struct yaffs_tnode *tn, u32 level)
+{
+	int i;
+
+	if (level > 0) {
+		for (i = 0; i < YAFFS_NTNODES_INTERNAL; i++) {
+			if (tn->internal[i])
+				yaffs_free_tnode_tree(dev, tn->internal[i],
+						      level - 1);
+		}
+	}
+	yaffs_free_tnode(dev, tn);
+}
+
+static void yaffs_unmap_worker(struct yaffs_dev *dev, struct yaffs_tnode *tn,
+			       u32 level, u32 chunk_offset,
+			       u32 first, u32 last)
+{
+	int i;
+	u32 shift;
+	u64 lo;
+	u64 hi;
+
+	if (level > 0) {
+		shift = YAFFS_TNODES_LEVEL0_BITS +
+			(level - 1) * YAFFS_TNODES_INTERNAL_BITS;
+		for (i = 0; i < YAFFS_NTNODES_INTERNAL; i++) {
+			if (!tn->internal[i])
+				continue;
+			lo = ((u64)(chunk_offset << YAFFS_TNODES_INTERNAL_BITS)
+			      + i) << shift;
+			hi = lo + (((u64)1) << shift) - 1;
+			if (hi < first || lo > last)
+				continue;
+			if (lo >= first && hi <= last) {
+				yaffs_free_tnode_tree(dev, tn->internal[i],
+						      level - 1);
+				tn->internal[i] = NULL;
+			} else {
+				yaffs_unmap_worker(dev, tn->internal[i],
+					level - 1,
+					(chunk_offset <<
+					 YAFFS_TNODES_INTERNAL_BITS) + i,
+					first, last);
+			}
+		}
+		return;
+	}
+
+	for (i = 0; i < YAFFS_NTNODES_LEVEL0; i++) {
+		lo = ((u64)chunk_offset << YAFFS_TNODES_LEVEL0_BITS) + i;
+		if (lo >= first && lo <= last)
+			yaffs_load_tnode_0(dev, tn, i, 0);
+	}
+}
+
+/* Forget where chunks first..last of a file live without deleting the
+ * chunks themselves. Used when replaying a checkpoint delta over an older
+ * copy of the file's tnode tree.
+ */
+void yaffs_file_unmap_chunks(struct yaffs_obj *obj, u32 first, u32 last)
+{
+	struct yaffs_file_var *file_struct = &obj->variant.file_variant;
+
+	if (obj->variant_type != YAFFS_OBJECT_TYPE_FILE || !file_struct->top)
+		return;
+
+	yaffs_unmap_worker(obj->my_dev, file_struct->top,
+			   file_struct->top_level, 0, first, last);
+}
+
+/* Checkpoint delta tracking: note that an object's checkpoint record, or
+ * the mapping of some of its chunks, no longer matches the last checkpoint.
+ */
+static void yaffs_checkpt_obj_changed(struct yaffs_obj *obj)
+{
+	obj->checkpt_dirty = 1;
+}
+
+static void yaffs_checkpt_chunks_changed(struct yaffs_obj *obj,
+					 u32 first, u32 last)
+{
+	struct yaffs_file_var *file_struct = &obj->variant.file_variant;
+
+	obj->checkpt_dirty = 1;
+	if (first < file_struct->checkpt_lo)
+		file_struct->checkpt_lo = first;
+	if (last > file_struct->checkpt_hi)
+		file_struct->checkpt_hi = last;
+}
+
 static int yaffs_tags_match(const struct yaffs_ext_tags *tags, int obj_id,
 			    int chunk_obj)
 {
@@ -1033,8 +1164,10 @@ static int yaffs_find_del_file_chunk(struct yaffs_obj *in, int inode_chunk,
 					      inode_chunk);
 
 	/* Delete the entry in the filestructure (if found) */
-	if (ret_val != -1)
+	if (ret_val != -1) {
 		yaffs_load_tnode_0(dev, tn, inode_chunk, 0);
+		yaffs_checkpt_chunks_changed(in, inode_chunk, inode_chunk);
+	}
 
 	return ret_val;
 }
@@ -1168,6 +1301,7 @@ int yaffs_put_chunk_in_file(struct yaffs_obj *in, int inode_chunk,
 		in->n_data_chunks++;
 
 	yaffs_load_tnode_0(dev, tn, inode_chunk, nand_chunk);
+	yaffs_checkpt_chunks_changed(in, inode_chunk, inode_chunk);
 
 	return YAFFS_OK;
 }
@@ -1184,6 +1318,7 @@ static void yaffs_soft_del_chunk(struct yaffs_dev *dev, int chunk)
 	if (the_block) {
 		the_block->soft_del_pages++;
 		dev->n_free_chunks++;
+		yaffs_gc_index_update(dev, block_no);
 		yaffs2_update_oldest_dirty_seq(dev, block_no, the_block);
 	}
 }
@@ -1255,8 +1390,10 @@ static void yaffs_remove_obj_from_dir(struct yaffs_obj *obj)
 	if (dev && dev->param.remove_obj_fn)
 		dev->param.remove_obj_fn(obj);
 
+	yaffs_name_index_del(obj);
 	list_del_init(&obj->siblings);
 	obj->parent = NULL;
+	yaffs_checkpt_obj_changed(obj);
 
 	yaffs_verify_dir(parent);
 }
@@ -1289,6 +1426,8 @@ void yaffs_add_obj_to_dir(struct yaffs_obj *directory, struct yaffs_obj *obj)
 	/* Now add it */
 	list_add(&obj->siblings, &directory->variant.dir_variant.children);
 	obj->parent = directory;
+	yaffs_checkpt_obj_changed(obj);
+	yaffs_name_index_add(obj);
 
 	if (directory == obj->my_dev->unlinked_dir
 	    || directory == obj->my_dev->del_dir) {
@@ -1357,19 +1496,94 @@ static int yaffs_change_obj_name(struct yaffs_obj *obj,
  *   In Linux, the page cache provides read buffering and the short op cache
  *   provides write buffering.
  *
- *   There are a small number (~10) of cache chunks per device so that we don't
- *   need a very intelligent search.
+ *   Entries in use are hashed on (object, chunk_id) for lookups and on the
+ *   object alone so that flushing or invalidating a file only visits that
+ *   file's chunks. An LRU list orders them for replacement, so none of the
+ *   cache operations have to scan the whole cache and it can be sized to
+ *   hundreds of chunks.
  */
 
+static inline struct list_head *yaffs_cache_chain(struct yaffs_dev *dev,
+						  const struct yaffs_obj *obj,
+						  int chunk_id)
+{
+	u32 h = obj->obj_id * 0x9e3779b1 + (u32)chunk_id;
+
+	return &dev->cache_hash[(h ^ (h >> 16)) & dev->cache_hash_mask];
+}
+
+static inline struct list_head *yaffs_cache_obj_chain(struct yaffs_dev *dev,
+						const struct yaffs_obj *obj)
+{
+	return &dev->cache_obj_hash[obj->obj_id & dev->cache_hash_mask];
+}
+
+static void yaffs_cache_set_dirty(struct yaffs_dev *dev,
+				  struct yaffs_cache *cache, int dirty)
+{
+	if (cache->dirty && !dirty)
+		dev->n_dirty_caches--;
+	else if (!cache->dirty && dirty)
+		dev->n_dirty_caches++;
+	cache->dirty = dirty;
+}
+
+/* Bind a free cache entry to a chunk and make it the most recently used. */
+static void yaffs_cache_assign(struct yaffs_cache *cache,
+			       struct yaffs_obj *obj, int chunk_id)
+{
+	struct yaffs_dev *dev = obj->my_dev;
+
+	cache->object = obj;
+	cache->chunk_id = chunk_id;
+	cache->dirty = 0;
+	cache->locked = 0;
+	cache->n_bytes = 0;
+	list_add(&cache->hash_link, yaffs_cache_chain(dev, obj, chunk_id));
+	list_add(&cache->obj_link, yaffs_cache_obj_chain(dev, obj));
+	list_move(&cache->lru, &dev->cache_lru);
+}
+
+/* Unbind a cache entry, dropping its data, and put it on the free list. */
+static void yaffs_cache_release(struct yaffs_dev *dev,
+				struct yaffs_cache *cache)
+{
+	if (!cache->object)
+		return;
+	yaffs_cache_set_dirty(dev, cache, 0);
+	cache->object = NULL;
+	list_del_init(&cache->hash_link);
+	list_del_init(&cache->obj_link);
+	list_move(&cache->lru, &dev->cache_free);
+}
+
+static struct yaffs_cache *yaffs_lookup_chunk_cache(const struct yaffs_obj *obj,
+						    int chunk_id)
+{
+	struct yaffs_dev *dev = obj->my_dev;
+	struct list_head *chain = yaffs_cache_chain(dev, obj, chunk_id);
+	struct list_head *i;
+	struct yaffs_cache *cache;
+
+	list_for_each(i, chain) {
+		cache = list_entry(i, struct yaffs_cache, hash_link);
+		if (cache->object == obj && cache->chunk_id == chunk_id)
+			return cache;
+	}
+	return NULL;
+}
+
 static int yaffs_obj_cache_dirty(struct yaffs_obj *obj)
 {
 	struct yaffs_dev *dev = obj->my_dev;
-	int i;
+	struct list_head *i;
 	struct yaffs_cache *cache;
-	int n_caches = obj->my_dev->param.n_caches;
 
-	for (i = 0; i < n_caches; i++) {
-		cache = &dev->cache[i];
+	if (dev->param.n_caches < 1 || !dev->n_dirty_caches)
+		return 0;
+
+	list_for_each(i, yaffs_cache_obj_chain(dev, obj)) {
+		cache = list_entry(i, struct yaffs_cache, obj_link);
 		if (cache->object == obj && cache->dirty)
 			return 1;
 	}
@@ -1377,45 +1591,51 @@ static int yaffs_obj_cache_dirty(struct yaffs_obj *obj)
 	return 0;
 }
 
+static int yaffs_cache_chunk_cmp(const void *a, const void *b)
+{
+	const struct yaffs_cache *ca = *(const struct yaffs_cache **)a;
+	const struct yaffs_cache *cb = *(const struct yaffs_cache **)b;
+
+	return ca->chunk_id - cb->chunk_id;
+}
+
 static void yaffs_flush_file_cache(struct yaffs_obj *obj)
 {
 	struct yaffs_dev *dev = obj->my_dev;
-	int lowest = -99;	/* Stop compiler whining. */
-	int i;
+	struct list_head *i;
 	struct yaffs_cache *cache;
-	int chunk_written = 0;
-	int n_caches = obj->my_dev->param.n_caches;
+	int chunk_written = 1;
+	int n = 0;
+	int j;
 
-	if (n_caches < 1)
+	if (dev->param.n_caches < 1 || !dev->n_dirty_caches)
 		return;
-	do {
-		cache = NULL;
-
-		/* Find the lowest dirty chunk for this object */
-		for (i = 0; i < n_caches; i++) {
-			if (dev->cache[i].object == obj &&
-			    dev->cache[i].dirty) {
-				if (!cache ||
-				    dev->cache[i].chunk_id < lowest) {
-					cache = &dev->cache[i];
-					lowest = cache->chunk_id;
-				}
-			}
-		}
 
-		if (cache && !cache->locked) {
-			/* Write it out and free it up */
-			chunk_written =
-			    yaffs_wr_data_obj(cache->object,
-					      cache->chunk_id,
-					      cache->data,
-					      cache->n_bytes, 1);
-			cache->dirty = 0;
-			cache->object = NULL;
-		}
-	} while (cache && chunk_written > 0);
+	/* Gather the dirty chunks for this object and write them out
+	 * lowest chunk first.
+	 */
+	list_for_each(i, yaffs_cache_obj_chain(dev, obj)) {
+		cache = list_entry(i, struct yaffs_cache, obj_link);
+		if (cache->object == obj && cache->dirty && !cache->locked)
+			dev->cache_flush[n++] = cache;
+	}
 
-	if (cache)
+	if (n > 1)
+		sort(dev->cache_flush, n, sizeof(struct yaffs_cache *),
+		     yaffs_cache_chunk_cmp, NULL);
+
+	for (j = 0; j < n && chunk_written > 0; j++) {
+		/* Write it out and free it up */
+		cache = dev->cache_flush[j];
+		chunk_written =
+		    yaffs_wr_data_obj(cache->object,
+				      cache->chunk_id,
+				      cache->data,
+				      cache->n_bytes, 1);
+		yaffs_cache_release(dev, cache);
+	}
+
+	if (chunk_written <= 0)
 		/* Hoosterman, disk full while writing cache out. */
 		yaffs_trace(YAFFS_TRACE_ERROR,
 			"yaffs tragedy: no space during cache write");
@@ -1429,90 +1649,65 @@ static void yaffs_flush_file_cache(struct yaffs_obj *obj)
 void yaffs_flush_whole_cache(struct yaffs_dev *dev)
 {
 	struct yaffs_obj *obj;
-	int n_caches = dev->param.n_caches;
-	int i;
+	struct list_head *i;
+	struct yaffs_cache *cache;
+
+	if (dev->param.n_caches < 1)
+		return;
 
 	/* Find a dirty object in the cache and flush it...
 	 * until there are no further dirty objects.
 	 */
 	do {
 		obj = NULL;
-		for (i = 0; i < n_caches && !obj; i++) {
-			if (dev->cache[i].object && dev->cache[i].dirty)
-				obj = dev->cache[i].object;
+		list_for_each(i, &dev->cache_lru) {
+			cache = list_entry(i, struct yaffs_cache, lru);
+			if (cache->dirty && !cache->locked) {
+				obj = cache->object;
+				break;
+			}
 		}
 		if (obj)
 			yaffs_flush_file_cache(obj);
-	} while (obj);
-
+	} while (obj && dev->n_dirty_caches);
 }
 
 /* Grab us a cache chunk for use.
  * First look for an empty one.
- * Then look for the least recently used non-dirty one.
- * Then look for the least recently used dirty one...., flush and look again.
+ * Then take the least recently used one. If that is dirty, flush its
+ * object and take one of the entries that frees up.
+ * Returns NULL if nothing could be freed up without losing data.
  */
-static struct yaffs_cache *yaffs_grab_chunk_worker(struct yaffs_dev *dev)
-{
-	int i;
-
-	if (dev->param.n_caches > 0) {
-		for (i = 0; i < dev->param.n_caches; i++) {
-			if (!dev->cache[i].object)
-				return &dev->cache[i];
-		}
-	}
-	return NULL;
-}
-
 static struct yaffs_cache *yaffs_grab_chunk_cache(struct yaffs_dev *dev)
 {
-	struct yaffs_cache *cache;
-	struct yaffs_obj *the_obj;
-	int usage;
-	int i;
-	int pushout;
+	struct yaffs_cache *cache = NULL;
+	struct list_head *i;
 
 	if (dev->param.n_caches < 1)
 		return NULL;
 
-	/* Try find a non-dirty one... */
-
-	cache = yaffs_grab_chunk_worker(dev);
-
-	if (!cache) {
-		/* They were all dirty, find the LRU object and flush
-		 * its cache, then  find again.
-		 * NB what's here is not very accurate,
-		 * we actually flush the object with the LRU chunk.
-		 */
-
-		/* With locking we can't assume we can use entry zero,
-		 * Set the_obj to a valid pointer for Coverity. */
-		the_obj = dev->cache[0].object;
-		usage = -1;
-		cache = NULL;
-		pushout = -1;
-
-		for (i = 0; i < dev->param.n_caches; i++) {
-			if (dev->cache[i].object &&
-			    !dev->cache[i].locked &&
-			    (dev->cache[i].last_use < usage ||
-			    !cache)) {
-				usage = dev->cache[i].last_use;
-				the_obj = dev->cache[i].object;
-				cache = &dev->cache[i];
-				pushout = i;
-			}
+	if (list_empty(&dev->cache_free)) {
+		list_for_each_prev(i, &dev->cache_lru) {
+			cache = list_entry(i, struct yaffs_cache, lru);
+			if (!cache->locked)
+				break;
+			cache = NULL;
 		}
 
-		if (!cache || cache->dirty) {
-			/* Flush and try again */
-			yaffs_flush_file_cache(the_obj);
-			cache = yaffs_grab_chunk_worker(dev);
+		if (!cache)
+			return NULL;
+
+		dev->cache_evictions++;
+		if (cache->dirty) {
+			yaffs_flush_file_cache(cache->object);
+			/* Still dirty, the flush failed. Keep the data. */
+			if (cache->object && cache->dirty)
+				return NULL;
 		}
+		yaffs_cache_release(dev, cache);
 	}
-	return cache;
+
+	return list_entry(dev->cache_free.next, struct yaffs_cache, lru);
 }
 
 /* Find a cached chunk */
@@ -1520,44 +1715,31 @@ static struct yaffs_cache *yaffs_find_chunk_cache(const struct yaffs_obj *obj,
 						  int chunk_id)
 {
 	struct yaffs_dev *dev = obj->my_dev;
-	int i;
+	struct yaffs_cache *cache;
 
 	if (dev->param.n_caches < 1)
 		return NULL;
 
-	for (i = 0; i < dev->param.n_caches; i++) {
-		if (dev->cache[i].object == obj &&
-		    dev->cache[i].chunk_id == chunk_id) {
-			dev->cache_hits++;
+	cache = yaffs_lookup_chunk_cache(obj, chunk_id);
+	if (cache)
+		dev->cache_hits++;
+	else
+		dev->cache_misses++;
 
-			return &dev->cache[i];
-		}
-	}
-	return NULL;
+	return cache;
 }
 
-/* Mark the chunk for the least recently used algorithym */
+/* Mark the chunk as most recently used */
 static void yaffs_use_cache(struct yaffs_dev *dev, struct yaffs_cache *cache,
 			    int is_write)
 {
-	int i;
-
 	if (dev->param.n_caches < 1)
 		return;
 
-	if (dev->cache_last_use < 0 ||
-		dev->cache_last_use > 100000000) {
-		/* Reset the cache usages */
-		for (i = 1; i < dev->param.n_caches; i++)
-			dev->cache[i].last_use = 0;
-
-		dev->cache_last_use = 0;
-	}
-	dev->cache_last_use++;
-	cache->last_use = dev->cache_last_use;
+	list_move(&cache->lru, &dev->cache_lru);
 
 	if (is_write)
-		cache->dirty = 1;
+		yaffs_cache_set_dirty(dev, cache, 1);
 }
 
 /* Invalidate a single cache page.
@@ -1566,13 +1748,14 @@ static void yaffs_use_cache(struct yaffs_dev *dev, struct yaffs_cache *cache,
  */
 static void yaffs_invalidate_chunk_cache(struct yaffs_obj *object, int chunk_id)
 {
+	struct yaffs_dev *dev = object->my_dev;
 	struct yaffs_cache *cache;
 
-	if (object->my_dev->param.n_caches > 0) {
-		cache = yaffs_find_chunk_cache(object, chunk_id);
+	if (dev->param.n_caches > 0) {
+		cache = yaffs_lookup_chunk_cache(object, chunk_id);
 
 		if (cache)
-			cache->object = NULL;
+			yaffs_cache_release(dev, cache);
 	}
 }
 
@@ -1581,28 +1764,100 @@ static void yaffs_invalidate_chunk_cache(struct yaffs_obj *object, int chunk_id)
  */
 static void yaffs_invalidate_whole_cache(struct yaffs_obj *in)
 {
-	int i;
 	struct yaffs_dev *dev = in->my_dev;
+	struct list_head *i;
+	struct list_head *n;
+	struct yaffs_cache *cache;
 
 	if (dev->param.n_caches > 0) {
 		/* Invalidate it. */
+		list_for_each_safe(i, n, yaffs_cache_obj_chain(dev, in)) {
+			cache = list_entry(i, struct yaffs_cache, obj_link);
+			if (cache->object == in)
+				yaffs_cache_release(dev, cache);
+		}
+	}
+}
+
+static int yaffs_init_cache(struct yaffs_dev *dev)
+{
+	int i;
+	u32 n_buckets = 1;
+
+	if (dev->param.n_caches > YAFFS_MAX_SHORT_OP_CACHES)
+		dev->param.n_caches = YAFFS_MAX_SHORT_OP_CACHES;
+
+	while (n_buckets < dev->param.n_caches)
+		n_buckets <<= 1;
+
+	INIT_LIST_HEAD(&dev->cache_lru);
+	INIT_LIST_HEAD(&dev->cache_free);
+	dev->cache_hash_mask = n_buckets - 1;
+	dev->n_dirty_caches = 0;
+
+	dev->cache = kmalloc(dev->param.n_caches * sizeof(struct yaffs_cache),
+			     GFP_NOFS);
+	if (!dev->cache)
+		return 0;
+
+	/* Zeroed first so yaffs_deinit_cache() can unwind a partial init */
+	memset(dev->cache, 0, dev->param.n_caches * sizeof(struct yaffs_cache));
+
+	dev->cache_hash = kmalloc(2 * n_buckets * sizeof(struct list_head),
+				  GFP_NOFS);
+	dev->cache_flush =
+	    kmalloc(dev->param.n_caches * sizeof(struct yaffs_cache *),
+		    GFP_NOFS);
+	if (!dev->cache_hash || !dev->cache_flush)
+		return 0;
+
+	dev->cache_obj_hash = dev->cache_hash + n_buckets;
+	for (i = 0; i < 2 * n_buckets; i++)
+		INIT_LIST_HEAD(&dev->cache_hash[i]);
+
+	for (i = 0; i < dev->param.n_caches; i++) {
+		struct yaffs_cache *cache = &dev->cache[i];
+
+		INIT_LIST_HEAD(&cache->hash_link);
+		INIT_LIST_HEAD(&cache->obj_link);
+		list_add_tail(&cache->lru, &dev->cache_free);
+		cache->data =
+		    kmalloc(dev->param.total_bytes_per_chunk, GFP_NOFS);
+		if (!cache->data)
+			return 0;
+	}
+
+	return 1;
+}
+
+static void yaffs_deinit_cache(struct yaffs_dev *dev)
+{
+	int i;
+
+	if (dev->cache) {
 		for (i = 0; i < dev->param.n_caches; i++) {
-			if (dev->cache[i].object == in)
-				dev->cache[i].object = NULL;
+			kfree(dev->cache[i].data);
+			dev->cache[i].data = NULL;
 		}
 	}
+
+	kfree(dev->cache);
+	dev->cache = NULL;
+	kfree(dev->cache_hash);
+	dev->cache_hash = NULL;
+	dev->cache_obj_hash = NULL;
+	kfree(dev->cache_flush);
+	dev->cache_flush = NULL;
 }
 
 static void yaffs_unhash_obj(struct yaffs_obj *obj)
 {
-	int bucket;
 	struct yaffs_dev *dev = obj->my_dev;
 
 	/* If it is still linked into the bucket list, free from the list */
 	if (!list_empty(&obj->hash_link)) {
 		list_del_init(&obj->hash_link);
-		bucket = yaffs_hash_fn(obj->obj_id);
-		dev->obj_bucket[bucket].count--;
+		yaffs_obj_bucket_for(dev, obj->obj_id)->count--;
 	}
 }
 
@@ -1623,6 +1878,8 @@ static void yaffs_free_obj(struct yaffs_obj *obj)
 	if (!list_empty(&obj->siblings))
 		BUG();
 
+	yaffs2_checkpt_obj_freed(obj);
+
 	if (obj->my_inode) {
 		/* We're still hooked up to a cached inode.
 		 * Don't delete now, but mark for later deletion
@@ -1633,6 +1890,9 @@ static void yaffs_free_obj(struct yaffs_obj *obj)
 
 	yaffs_unhash_obj(obj);
 
+	if (obj->variant_type == YAFFS_OBJECT_TYPE_DIRECTORY)
+		yaffs_name_index_free(obj);
+
 	yaffs_free_raw_obj(dev, obj);
 	dev->n_obj--;
 	dev->checkpoint_blocks_required = 0;	/* force recalculation */
@@ -1644,6 +1904,53 @@ void yaffs_handle_defered_free(struct yaffs_obj *obj)
 		yaffs_free_obj(obj);
 }
 
+/* Drop an object from RAM without touching flash. Used when a checkpoint
+ * delta says the object is gone: the chunks it owned are already
+ * accounted for in the restored block info.
+ * Hard links that still point at it are moved to hard_list so that
+ * yaffs_link_fixup() can resolve them again.
+ */
+void yaffs_forget_obj(struct yaffs_obj *obj, struct list_head *hard_list)
+{
+	struct yaffs_dev *dev = obj->my_dev;
+	struct yaffs_file_var *file_struct;
+	struct list_head *lh;
+	struct list_head *n;
+
+	switch (obj->variant_type) {
+	case YAFFS_OBJECT_TYPE_FILE:
+		file_struct = &obj->variant.file_variant;
+		if (file_struct->top)
+			yaffs_free_tnode_tree(dev, file_struct->top,
+					      file_struct->top_level);
+		file_struct->top = NULL;
+		break;
+	case YAFFS_OBJECT_TYPE_DIRECTORY:
+		list_for_each_safe(lh, n,
+				   &obj->variant.dir_variant.children)
+			yaffs_remove_obj_from_dir(list_entry(lh,
+							     struct yaffs_obj,
+							     siblings));
+		break;
+	case YAFFS_OBJECT_TYPE_SYMLINK:
+		kfree(obj->variant.symlink_variant.alias);
+		obj->variant.symlink_variant.alias = NULL;
+		break;
+	default:
+		break;
+	}
+
+	if (obj->variant_type == YAFFS_OBJECT_TYPE_HARDLINK)
+		list_del_init(&obj->hard_links);
+	else
+		list_for_each_safe(lh, n, &obj->hard_links)
+			list_move(lh, hard_list);
+
+	if (obj->parent)
+		yaffs_remove_obj_from_dir(obj);
+	yaffs_free_obj(obj);
+}
+
 static int yaffs_generic_obj_del(struct yaffs_obj *in)
 {
 	/* Iinvalidate the file's data in the cache, without flushing. */
@@ -1686,6 +1993,7 @@ static void yaffs_soft_del_file(struct yaffs_obj *obj)
 				      obj->variant.
 				      file_variant.top_level, 0);
 		obj->soft_del = 1;
+		yaffs_checkpt_chunks_changed(obj, 0, ~0);
 	}
 }
 
@@ -1812,12 +2120,14 @@ static struct yaffs_obj *yaffs_alloc_empty_obj(struct yaffs_dev *dev)
 	INIT_LIST_HEAD(&(obj->hard_links));
 	INIT_LIST_HEAD(&(obj->hash_link));
 	INIT_LIST_HEAD(&obj->siblings);
+	INIT_LIST_HEAD(&obj->name_link);
 
 	/* Now make the directory sane */
 	if (dev->root_dir) {
 		obj->parent = dev->root_dir;
 		list_add(&(obj->siblings),
 			 &dev->root_dir->variant.dir_variant.children);
+		yaffs_name_index_add(obj);
 	}
 
 	/* Add it to the lost and found directory.
@@ -1834,6 +2144,150 @@ static struct yaffs_obj *yaffs_alloc_empty_obj(struct yaffs_dev *dev)
 	return obj;
 }
 
+static struct yaffs_obj_bucket *yaffs_alloc_obj_buckets(u32 n_buckets,
+							int *alt)
+{
+	struct yaffs_obj_bucket *buckets;
+	u32 i;
+
+	/* If the first allocation strategy fails, thry the alternate one */
+	buckets = kmalloc(n_buckets * sizeof(struct yaffs_obj_bucket),
+			  GFP_NOFS | __GFP_NOWARN);
+	*alt = 0;
+	if (!buckets) {
+		buckets = vmalloc(n_buckets * sizeof(struct yaffs_obj_bucket));
+		*alt = 1;
+	}
+	if (!buckets)
+		return NULL;
+
+	for (i = 0; i < n_buckets; i++) {
+		INIT_LIST_HEAD(&buckets[i].list);
+		buckets[i].count = 0;
+	}
+	return buckets;
+}
+
+static void yaffs_free_obj_buckets(struct yaffs_dev *dev,
+				   struct yaffs_obj_bucket *buckets, int alt)
+{
+	if (!buckets || buckets == dev->obj_bucket_base)
+		return;
+	if (alt)
+		vfree(buckets);
+	else
+		kfree(buckets);
+}
+
+/* Start moving the objects into a bigger table. This only swaps the tables
+ * over, the objects are moved by yaffs_obj_rehash_step().
+ */
+static void yaffs_grow_obj_buckets(struct yaffs_dev *dev)
+{
+	u32 n_buckets = (dev->obj_bucket_mask + 1) * YAFFS_OBJECT_BUCKET_GROWTH;
+	struct yaffs_obj_bucket *buckets;
+	int alt;
+
+	if (dev->obj_bucket_old || n_buckets > YAFFS_MAX_OBJECT_BUCKETS)
+		return;
+
+	buckets = yaffs_alloc_obj_buckets(n_buckets, &alt);
+	if (!buckets)
+		return;
+
+	yaffs_trace(YAFFS_TRACE_ALLOCATE,
+		"Growing object hash from %u to %u buckets for %d objects",
+		dev->obj_bucket_mask + 1, n_buckets, dev->n_obj);
+
+	dev->obj_bucket_old = dev->obj_bucket;
+	dev->obj_bucket_old_mask = dev->obj_bucket_mask;
+	dev->obj_bucket_old_alt = dev->obj_bucket_alt;
+	dev->obj_rehash_pos = 0;
+	dev->obj_bucket = buckets;
+	dev->obj_bucket_mask = n_buckets - 1;
+	dev->obj_bucket_alt = alt;
+}
+
+/* Move up to n_buckets of the old table's buckets into the new table. */
+void yaffs_obj_rehash_step(struct yaffs_dev *dev, int n_buckets)
+{
+	struct yaffs_obj_bucket *old;
+	struct yaffs_obj_bucket *bucket;
+	struct yaffs_obj *obj;
+	struct list_head *i;
+	struct list_head *n;
+
+	while (dev->obj_bucket_old && n_buckets-- > 0) {
+		old = &dev->obj_bucket_old[dev->obj_rehash_pos];
+
+		list_for_each_safe(i, n, &old->list) {
+			obj = list_entry(i, struct yaffs_obj, hash_link);
+			bucket =
+			    &dev->obj_bucket[obj->obj_id & dev->obj_bucket_mask];
+			list_move(i, &bucket->list);
+			bucket->count++;
+		}
+		old->count = 0;
+
+		dev->obj_rehash_pos++;
+		if (dev->obj_rehash_pos > dev->obj_bucket_old_mask) {
+			yaffs_free_obj_buckets(dev, dev->obj_bucket_old,
+					       dev->obj_bucket_old_alt);
+			dev->obj_bucket_old = NULL;
+			dev->obj_bucket_old_alt = 0;
+			dev->obj_rehash_pos = 0;
+		}
+	}
+}
+
+/* Bucket iteration that covers both tables while a resize is under way.
+ * Bucket i is in the current table for i below its size, else in the old
+ * table.
+ */
+u32 yaffs_n_obj_buckets(struct yaffs_dev *dev)
+{
+	u32 n = dev->obj_bucket_mask + 1;
+
+	if (dev->obj_bucket_old)
+		n += dev->obj_bucket_old_mask + 1;
+	return n;
+}
+
+struct list_head *yaffs_obj_bucket_list(struct yaffs_dev *dev, u32 i)
+{
+	if (i <= dev->obj_bucket_mask)
+		return &dev->obj_bucket[i].list;
+	return &dev->obj_bucket_old[i - dev->obj_bucket_mask - 1].list;
+}
+
+static void yaffs_init_obj_buckets(struct yaffs_dev *dev)
+{
+	int i;
+
+	for (i = 0; i < YAFFS_NOBJECT_BUCKETS; i++) {
+		INIT_LIST_HEAD(&dev->obj_bucket_base[i].list);
+		dev->obj_bucket_base[i].count = 0;
+	}
+	dev->obj_bucket = dev->obj_bucket_base;
+	dev->obj_bucket_mask = YAFFS_NOBJECT_BUCKETS - 1;
+	dev->obj_bucket_alt = 0;
+	dev->obj_bucket_old = NULL;
+	dev->obj_bucket_old_alt = 0;
+	dev->obj_rehash_pos = 0;
+	dev->bucket_finder = 0;
+}
+
+static void yaffs_deinit_obj_buckets(struct yaffs_dev *dev)
+{
+	yaffs_free_obj_buckets(dev, dev->obj_bucket_old,
+			       dev->obj_bucket_old_alt);
+	yaffs_free_obj_buckets(dev, dev->obj_bucket, dev->obj_bucket_alt);
+	dev->obj_bucket_old = NULL;
+	dev->obj_bucket = dev->obj_bucket_base;
+	dev->obj_bucket_mask = YAFFS_NOBJECT_BUCKETS - 1;
+	dev->obj_bucket_alt = 0;
+}
+
 static int yaffs_find_nice_bucket(struct yaffs_dev *dev)
 {
 	int i;
@@ -1846,7 +2300,7 @@ static int yaffs_find_nice_bucket(struct yaffs_dev *dev)
 
 	for (i = 0; i < 10 && lowest > 4; i++) {
 		dev->bucket_finder++;
-		dev->bucket_finder %= YAFFS_NOBJECT_BUCKETS;
+		dev->bucket_finder &= dev->obj_bucket_mask;
 		if (dev->obj_bucket[dev->bucket_finder].count < lowest) {
 			lowest = dev->obj_bucket[dev->bucket_finder].count;
 			l = dev->bucket_finder;
@@ -1856,49 +2310,64 @@ static int yaffs_find_nice_bucket(struct yaffs_dev *dev)
 	return l;
 }
 
-static int yaffs_new_obj_id(struct yaffs_dev *dev)
+static int yaffs_obj_id_in_use(struct yaffs_dev *dev, u32 n)
 {
-	int bucket = yaffs_find_nice_bucket(dev);
-	int found = 0;
 	struct list_head *i;
-	u32 n = (u32) bucket;
+
+	list_for_each(i, &yaffs_obj_bucket_for(dev, n)->list) {
+		if (list_entry(i, struct yaffs_obj, hash_link)->obj_id == n)
+			return 1;
+	}
+	return 0;
+}
+
+static int yaffs_new_obj_id(struct yaffs_dev *dev)
+{
+	u32 n = (u32) yaffs_find_nice_bucket(dev);
 
 	/* Now find an object value that has not already been taken
-	 * by scanning the list.
+	 * by scanning the list. The ids have to fit in the tags.
 	 */
 
-	while (!found) {
-		found = 1;
-		n += YAFFS_NOBJECT_BUCKETS;
-		if (1 || dev->obj_bucket[bucket].count > 0) {
-			list_for_each(i, &dev->obj_bucket[bucket].list) {
-				/* If there is already one in the list */
-				if (i && list_entry(i, struct yaffs_obj,
-						    hash_link)->obj_id == n) {
-					found = 0;
-				}
-			}
-		}
+	do {
+		n += dev->obj_bucket_mask + 1;
+	} while (n <= YAFFS_MAX_OBJECT_ID && yaffs_obj_id_in_use(dev, n));
+
+	if (n <= YAFFS_MAX_OBJECT_ID)
+		return n;
+
+	/* That bucket's ids are all taken, fall back to any free one. */
+	for (n = YAFFS_NOBJECT_BUCKETS; n <= YAFFS_MAX_OBJECT_ID; n++) {
+		if (!yaffs_obj_id_in_use(dev, n))
+			return n;
 	}
-	return n;
+
+	yaffs_trace(YAFFS_TRACE_ERROR, "yaffs: out of object ids");
+	return -1;
 }
 
 static void yaffs_hash_obj(struct yaffs_obj *in)
 {
-	int bucket = yaffs_hash_fn(in->obj_id);
 	struct yaffs_dev *dev = in->my_dev;
+	struct yaffs_obj_bucket *bucket;
+
+	/* Keep a resize moving along, then see if we need to start one. */
+	yaffs_obj_rehash_step(dev, 1);
+	if (dev->n_obj >
+	    YAFFS_OBJECT_BUCKET_LOAD * (int)(dev->obj_bucket_mask + 1))
+		yaffs_grow_obj_buckets(dev);
 
-	list_add(&in->hash_link, &dev->obj_bucket[bucket].list);
-	dev->obj_bucket[bucket].count++;
+	bucket = yaffs_obj_bucket_for(dev, in->obj_id);
+	list_add(&in->hash_link, &bucket->list);
+	bucket->count++;
 }
 
 struct yaffs_obj *yaffs_find_by_number(struct yaffs_dev *dev, u32 number)
 {
-	int bucket = yaffs_hash_fn(number);
 	struct list_head *i;
 	struct yaffs_obj *in;
 
-	list_for_each(i, &dev->obj_bucket[bucket].list) {
+	list_for_each(i, &yaffs_obj_bucket_for(dev, number)->list) {
 		/* Look if it is in the list */
 		in = list_entry(i, struct yaffs_obj, hash_link);
 		if (in->obj_id == number) {
@@ -1918,8 +2387,11 @@ static struct yaffs_obj *yaffs_new_obj(struct yaffs_dev *dev, int number,
 	struct yaffs_obj *the_obj = NULL;
 	struct yaffs_tnode *tn = NULL;
 
-	if (number < 0)
+	if (number < 0) {
 		number = yaffs_new_obj_id(dev);
+		if (number < 0)
+			return NULL;
+	}
 
 	if (type == YAFFS_OBJECT_TYPE_FILE) {
 		tn = yaffs_get_tnode(dev);
@@ -1997,11 +2469,8 @@ static void yaffs_init_tnodes_and_objs(struct yaffs_dev *dev)
 	dev->n_obj = 0;
 	dev->n_tnodes = 0;
 	yaffs_init_raw_tnodes_and_objs(dev);
-
-	for (i = 0; i < YAFFS_NOBJECT_BUCKETS; i++) {
-		INIT_LIST_HEAD(&dev->obj_bucket[i].list);
-		dev->obj_bucket[i].count = 0;
-	}
+	yaffs_name_index_init(dev);
+	yaffs_init_obj_buckets(dev);
 }
 
 struct yaffs_obj *yaffs_find_or_create_by_number(struct yaffs_dev *dev,
@@ -2254,6 +2723,8 @@ static void yaffs_deinit_blocks(struct yaffs_dev *dev)
 		kfree(dev->chunk_bits);
 	dev->chunk_bits_alt = 0;
 	dev->chunk_bits = NULL;
+
+	yaffs_gc_index_deinit(dev);
 }
 
 static int yaffs_init_blocks(struct yaffs_dev *dev)
@@ -2295,6 +2766,11 @@ static int yaffs_init_blocks(struct yaffs_dev *dev)
 
 	memset(dev->block_info, 0, n_blocks * sizeof(struct yaffs_block_info));
 	memset(dev->chunk_bits, 0, dev->chunk_bit_stride * n_blocks);
+
+	/* Without the gc index we fall back to scanning the blocks */
+	if (!yaffs_gc_index_init(dev))
+		yaffs_trace(YAFFS_TRACE_ALWAYS,
+			"yaffs: could not allocate gc index");
 	return YAFFS_OK;
 
 alloc_error:
@@ -2321,6 +2797,7 @@ void yaffs_block_became_dirty(struct yaffs_dev *dev, int block_no)
 	yaffs2_clear_oldest_dirty_seq(dev, bi);
 
 	bi->block_state = YAFFS_BLOCK_STATE_DIRTY;
+	yaffs_gc_index_update(dev, block_no);
 
 	/* If this is the block being garbage collected then stop gc'ing */
 	if (block_no == dev->gc_block)
@@ -2454,6 +2931,7 @@ static inline int yaffs_gc_process_chunk(struct yaffs_dev *dev,
 		bi->soft_del_pages--;
 
 		object->n_data_chunks--;
+		yaffs_checkpt_obj_changed(object);
 		if (object->n_data_chunks <= 0) {
 			/* remeber to clean up obj */
 			dev->gc_cleanup_list[dev->n_clean_ups] = tags.obj_id;
@@ -2514,6 +2992,7 @@ static inline int yaffs_gc_process_chunk(struct yaffs_dev *dev,
 				/* It's a header */
 				object->hdr_chunk = new_chunk;
 				object->serial = tags.serial_number;
+				yaffs_checkpt_obj_changed(object);
 			} else {
 				/* It's a data chunk */
 				yaffs_put_chunk_in_file(object, tags.chunk_id,
@@ -2546,8 +3025,10 @@ static int yaffs_gc_block(struct yaffs_dev *dev, int block, int whole_block)
 
 	/*yaffs_verify_free_chunks(dev); */
 
-	if (bi->block_state == YAFFS_BLOCK_STATE_FULL)
+	if (bi->block_state == YAFFS_BLOCK_STATE_FULL) {
 		bi->block_state = YAFFS_BLOCK_STATE_COLLECTING;
+		yaffs_gc_index_update(dev, block);
+	}
 
 	bi->has_shrink_hdr = 0;	/* clear the flag so that the block can erase */
 
@@ -2593,6 +3074,7 @@ static int yaffs_gc_block(struct yaffs_dev *dev, int block, int whole_block)
 		 * because checkpointing does not restore gc.
 		 */
 		bi->block_state = YAFFS_BLOCK_STATE_FULL;
+		yaffs_gc_index_update(dev, block);
 	} else {
 		/* The gc completed. */
 		/* Do any required cleanups */
@@ -2627,6 +3109,41 @@ static int yaffs_gc_block(struct yaffs_dev *dev, int block, int whole_block)
 	return ret_val;
 }
 
+/* Look through the next few blocks for a dirtier gc candidate.
+ * Used when there is no gc index.
+ */
+static void yaffs_scan_gc_candidates(struct yaffs_dev *dev, int iterations)
+{
+	struct yaffs_block_info *bi;
+	int pages_used;
+	int i;
+
+	for (i = 0;
+	     i < iterations &&
+	     (dev->gc_dirtiest < 1 ||
+	      dev->gc_pages_in_use > YAFFS_GC_GOOD_ENOUGH);
+	     i++) {
+		dev->gc_block_finder++;
+		if (dev->gc_block_finder < dev->internal_start_block ||
+		    dev->gc_block_finder > dev->internal_end_block)
+			dev->gc_block_finder =
+			    dev->internal_start_block;
+
+		bi = yaffs_get_block_info(dev, dev->gc_block_finder);
+
+		pages_used = bi->pages_in_use - bi->soft_del_pages;
+
+		if (bi->block_state == YAFFS_BLOCK_STATE_FULL &&
+		    pages_used < dev->param.chunks_per_block &&
+		    (dev->gc_dirtiest < 1 ||
+		     pages_used < dev->gc_pages_in_use) &&
+		    yaffs_block_ok_for_gc(dev, bi)) {
+			dev->gc_dirtiest = dev->gc_block_finder;
+			dev->gc_pages_in_use = pages_used;
+		}
+	}
+}
+
 /*
  * find_gc_block() selects the dirtiest block (or close enough)
  * for garbage collection.
@@ -2710,29 +3227,12 @@ static unsigned yaffs_find_gc_block(struct yaffs_dev *dev,
 				iterations = 100;
 		}
 
-		for (i = 0;
-		     i < iterations &&
-		     (dev->gc_dirtiest < 1 ||
-		      dev->gc_pages_in_use > YAFFS_GC_GOOD_ENOUGH);
-		     i++) {
-			dev->gc_block_finder++;
-			if (dev->gc_block_finder < dev->internal_start_block ||
-			    dev->gc_block_finder > dev->internal_end_block)
-				dev->gc_block_finder =
-				    dev->internal_start_block;
-
-			bi = yaffs_get_block_info(dev, dev->gc_block_finder);
-
-			pages_used = bi->pages_in_use - bi->soft_del_pages;
-
-			if (bi->block_state == YAFFS_BLOCK_STATE_FULL &&
-			    pages_used < dev->param.chunks_per_block &&
-			    (dev->gc_dirtiest < 1 ||
-			     pages_used < dev->gc_pages_in_use) &&
-			    yaffs_block_ok_for_gc(dev, bi)) {
-				dev->gc_dirtiest = dev->gc_block_finder;
-				dev->gc_pages_in_use = pages_used;
-			}
+		if (dev->gc_index_ready) {
+			dev->gc_dirtiest =
+			    yaffs_gc_index_find(dev, threshold, &pages_used);
+			dev->gc_pages_in_use = dev->gc_dirtiest ? pages_used : 0;
+		} else {
+			yaffs_scan_gc_candidates(dev, iterations);
 		}
 
 		if (dev->gc_dirtiest > 0 && dev->gc_pages_in_use <= threshold)
@@ -2820,6 +3320,9 @@ static int yaffs_check_gc(struct yaffs_dev *dev, int background)
 	do {
 		max_tries++;
 
+		if (dev->param.is_yaffs2)
+			yaffs2_checkpt_release_stale(dev);
+
 		checkpt_block_adjust = yaffs_calc_checkpt_blocks_required(dev);
 
 		min_erased =
@@ -2900,6 +3403,7 @@ int yaffs_bg_gc(struct yaffs_dev *dev, unsigned urgency)
 	yaffs_trace(YAFFS_TRACE_BACKGROUND, "Background gc %u", urgency);
 
 	yaffs_check_gc(dev, 1);
+	yaffs_obj_rehash_step(dev, YAFFS_OBJECT_REHASH_STEP);
 	return erased_chunks > dev->n_free_chunks / 2;
 }
 
@@ -2971,6 +3475,7 @@ void yaffs_chunk_del(struct yaffs_dev *dev, int chunk_id, int mark_flash,
 		dev->n_free_chunks++;
 		yaffs_clear_chunk_bit(dev, block, page);
 		bi->pages_in_use--;
+		yaffs_gc_index_update(dev, block);
 
 		if (bi->pages_in_use == 0 &&
 		    !bi->has_shrink_hdr &&
@@ -3389,9 +3894,12 @@ int yaffs_update_oh(struct yaffs_obj *in, const YCHAR *name, int force,
 		return new_chunk_id;
 
 	in->hdr_chunk = new_chunk_id;
+	yaffs_checkpt_obj_changed(in);
 
 	if (prev_chunk_id > 0)
 		yaffs_chunk_del(dev, prev_chunk_id, 1, __LINE__);
+	else
+		yaffs_name_index_update(in);	/* long names become hashable */
 
 	if (!yaffs_obj_cache_dirty(in))
 		in->dirty = 0;
@@ -3399,10 +3907,11 @@ int yaffs_update_oh(struct yaffs_obj *in, const YCHAR *name, int force,
 	/* If this was a shrink, then mark the block
 	 * that the chunk lives on */
 	if (is_shrink) {
-		bi = yaffs_get_block_info(in->my_dev,
-					  new_chunk_id /
-					  in->my_dev->param.chunks_per_block);
+		int block = new_chunk_id / in->my_dev->param.chunks_per_block;
+
+		bi = yaffs_get_block_info(in->my_dev, block);
 		bi->has_shrink_hdr = 1;
+		yaffs_gc_index_update(in->my_dev, block);
 	}
 
 
@@ -3451,23 +3960,19 @@ int yaffs_file_rd(struct yaffs_obj *in, u8 * buffer, loff_t offset, int n_bytes)
 		 */
 		if (cache || n_copy != dev->data_bytes_per_chunk ||
 		    dev->param.inband_tags) {
-			if (dev->param.n_caches > 0) {
-
-				/* If we can't find the data in the cache,
-				 * then load it up. */
+			/* If we can't find the data in the cache,
+			 * then load it up, if an entry can be had. */
 
-				if (!cache) {
-					cache =
-					    yaffs_grab_chunk_cache(in->my_dev);
-					cache->object = in;
-					cache->chunk_id = chunk;
-					cache->dirty = 0;
-					cache->locked = 0;
+			if (!cache && dev->param.n_caches > 0) {
+				cache = yaffs_grab_chunk_cache(in->my_dev);
+				if (cache) {
+					yaffs_cache_assign(cache, in, chunk);
 					yaffs_rd_data_obj(in, chunk,
 							  cache->data);
-					cache->n_bytes = 0;
 				}
+			}
 
+			if (cache) {
 				yaffs_use_cache(dev, cache, 0);
 
 				cache->locked = 1;
@@ -3498,6 +4003,69 @@ int yaffs_file_rd(struct yaffs_obj *in, u8 * buffer, loff_t offset, int n_bytes)
 	return n_done;
 }
 
+/*
+ * Reading whole chunks of file data without the device lock.
+ *
+ * yaffs_file_rd_begin() is called locked with a chunk aligned offset.
+ * If the chunk is cached, a hole, or the device can't be read unlocked
+ * the data is read there and then and 0 is returned. Otherwise it
+ * returns the nand chunk holding the data and the caller drops the lock
+ * and reads it with yaffs_rd_chunk_nolock_nand().
+ *
+ * yaffs_file_rd_end() is then called locked again. The data is good if
+ * no block was erased in the meantime (so the nand chunk can't have been
+ * rewritten) and the chunk still maps to the same place and isn't
+ * sitting newer in the cache. If not, the chunk is read again locked.
+ * Returns 1 if the unlocked read was used, 0 if it had to be redone.
+ */
+int yaffs_file_rd_begin(struct yaffs_obj *in, u8 *buffer, loff_t offset,
+			u32 *erasures)
+{
+	struct yaffs_dev *dev = in->my_dev;
+	int chunk;
+	u32 start;
+	int nand_chunk;
+
+	yaffs_addr_to_chunk(dev, offset, &chunk, &start);
+	chunk++;
+
+	if (start || !dev->param.is_yaffs2 || dev->param.inband_tags ||
+	    yaffs_find_chunk_cache(in, chunk)) {
+		yaffs_file_rd(in, buffer, offset, dev->data_bytes_per_chunk);
+		return 0;
+	}
+
+	nand_chunk = yaffs_find_chunk_in_file(in, chunk, NULL);
+	if (nand_chunk < 0) {
+		memset(buffer, 0, dev->data_bytes_per_chunk);
+		return 0;
+	}
+
+	*erasures = dev->n_erasures;
+	return nand_chunk;
+}
+
+int yaffs_file_rd_end(struct yaffs_obj *in, u8 *buffer, loff_t offset,
+		      int nand_chunk, u32 erasures, int read_ok)
+{
+	struct yaffs_dev *dev = in->my_dev;
+	int chunk;
+	u32 start;
+
+	yaffs_addr_to_chunk(dev, offset, &chunk, &start);
+	chunk++;
+
+	if (read_ok && erasures == dev->n_erasures &&
+	    !yaffs_find_chunk_cache(in, chunk) &&
+	    yaffs_find_chunk_in_file(in, chunk, NULL) == nand_chunk) {
+		dev->n_page_reads++;
+		return 1;
+	}
+
+	yaffs_file_rd(in, buffer, offset, dev->data_bytes_per_chunk);
+	return 0;
+}
+
 int yaffs_do_file_wr(struct yaffs_obj *in, const u8 *buffer, loff_t offset,
 		     int n_bytes, int write_through)
 {
@@ -3585,12 +4153,12 @@ int yaffs_do_file_wr(struct yaffs_obj *in, const u8 *buffer, loff_t offset,
 				if (!cache &&
 				    yaffs_check_alloc_available(dev, 1)) {
 					cache = yaffs_grab_chunk_cache(dev);
-					cache->object = in;
-					cache->chunk_id = chunk;
-					cache->dirty = 0;
-					cache->locked = 0;
-					yaffs_rd_data_obj(in, chunk,
-							  cache->data);
+					if (cache) {
+						yaffs_cache_assign(cache, in,
+								   chunk);
+						yaffs_rd_data_obj(in, chunk,
+								  cache->data);
+					}
 				} else if (cache &&
 					   !cache->dirty &&
 					   !yaffs_check_alloc_available(dev,
@@ -3619,7 +4187,8 @@ int yaffs_do_file_wr(struct yaffs_obj *in, const u8 *buffer, loff_t offset,
 						     cache->chunk_id,
 						     cache->data,
 						     cache->n_bytes, 1);
-						cache->dirty = 0;
+						yaffs_cache_set_dirty(dev,
+								      cache, 0);
 					}
 				} else {
 					chunk_written = -1;	/* fail write */
@@ -3664,8 +4233,10 @@ int yaffs_do_file_wr(struct yaffs_obj *in, const u8 *buffer, loff_t offset,
 
 	/* Update file object */
 
-	if ((start_write + n_done) > in->variant.file_variant.file_size)
+	if ((start_write + n_done) > in->variant.file_variant.file_size) {
 		in->variant.file_variant.file_size = (start_write + n_done);
+		yaffs_checkpt_obj_changed(in);
+	}
 
 	in->dirty = 1;
 	return n_done;
@@ -3756,6 +4327,7 @@ void yaffs_resize_file_down(struct yaffs_obj *obj, loff_t new_size)
 	}
 
 	obj->variant.file_variant.file_size = new_size;
+	yaffs_checkpt_obj_changed(obj);
 
 	yaffs_prune_tree(dev, &obj->variant.file_variant);
 }
@@ -3779,6 +4351,7 @@ int yaffs_resize_file(struct yaffs_obj *in, loff_t new_size)
 	if (new_size > old_size) {
 		yaffs2_handle_hole(in, new_size);
 		in->variant.file_variant.file_size = new_size;
+		yaffs_checkpt_obj_changed(in);
 	} else {
 		/* new_size < old_size */
 		yaffs_resize_file_down(in, new_size);
@@ -3837,6 +4410,7 @@ static int yaffs_unlink_file_if_needed(struct yaffs_obj *in)
 			"yaffs: immediate deletion of file %d",
 			in->obj_id);
 		in->deleted = 1;
+		yaffs_checkpt_obj_changed(in);
 		in->my_dev->n_deleted_files++;
 		if (dev->param.disable_soft_del || dev->param.is_yaffs2)
 			yaffs_resize_file(in, 0);
@@ -3869,6 +4443,7 @@ static int yaffs_del_file(struct yaffs_obj *in)
 
 		if (ret_val == YAFFS_OK && in->unlinked && !in->deleted) {
 			in->deleted = 1;
+			yaffs_checkpt_obj_changed(in);
 			deleted = 1;
 			in->my_dev->n_deleted_files++;
 			yaffs_soft_del_file(in);
@@ -4246,8 +4821,8 @@ static void yaffs_fix_hanging_objs(struct yaffs_dev *dev)
 	 * Make sure it is rooted.
 	 */
 
-	for (i = 0; i < YAFFS_NOBJECT_BUCKETS; i++) {
-		list_for_each_safe(lh, n, &dev->obj_bucket[i].list) {
+	for (i = 0; i < yaffs_n_obj_buckets(dev); i++) {
+		list_for_each_safe(lh, n, yaffs_obj_bucket_list(dev, i)) {
 			obj = list_entry(lh, struct yaffs_obj, hash_link);
 			parent = obj->parent;
 
@@ -4318,13 +4893,71 @@ static void yaffs_empty_l_n_f(struct yaffs_dev *dev)
 }
 
 
+static int yaffs_obj_name_matches(struct yaffs_obj *l, const YCHAR *name,
+				  int sum, YCHAR *buffer)
+{
+	/* Special case for lost-n-found */
+	if (l->obj_id == YAFFS_OBJECTID_LOSTNFOUND)
+		return !strcmp(name, YAFFS_LOSTNFOUND_NAME);
+
+	if (l->sum == sum || l->hdr_chunk <= 0) {
+		/* LostnFound chunk called Objxxx
+		 * Do a real check
+		 */
+		yaffs_get_obj_name(l, buffer, YAFFS_MAX_NAME_LENGTH + 1);
+		if (!strncmp(name, buffer, YAFFS_MAX_NAME_LENGTH))
+			return 1;
+	}
+	return 0;
+}
+
+/* Get the name index of a directory, building it if the directory is big */
+static struct yaffs_name_index *yaffs_get_name_index(struct yaffs_obj *dir)
+{
+	struct yaffs_dev *dev = dir->my_dev;
+	struct yaffs_name_index *index = dir->variant.dir_variant.name_index;
+	struct list_head *i;
+	struct list_head *n;
+	int n_children = 0;
+
+	if (index)
+		return index;
+
+	/* Duplicate names are allowed in these, so keep them linear */
+	if (dev->param.disable_name_index ||
+	    dir == dev->unlinked_dir || dir == dev->del_dir)
+		return NULL;
+
+	list_for_each(i, &dir->variant.dir_variant.children) {
+		if (++n_children >= YAFFS_NAME_INDEX_MIN_CHILDREN)
+			break;
+	}
+	if (n_children < YAFFS_NAME_INDEX_MIN_CHILDREN)
+		return NULL;
+
+	index = yaffs_name_index_build(dir);
+	if (!index)
+		return NULL;
+
+	/* Loading the details moves lazy loaded children to their buckets.
+	 * That can grow the index, so go back to the directory for it.
+	 */
+	list_for_each_safe(i, n, &dir->variant.dir_variant.children)
+		yaffs_check_obj_details_loaded(list_entry(i, struct yaffs_obj,
+							  siblings));
+
+	return dir->variant.dir_variant.name_index;
+}
+
 struct yaffs_obj *yaffs_find_by_name(struct yaffs_obj *directory,
 				     const YCHAR *name)
 {
 	int sum;
 	struct list_head *i;
+	struct list_head *n;
 	YCHAR buffer[YAFFS_MAX_NAME_LENGTH + 1];
 	struct yaffs_obj *l;
+	struct yaffs_name_index *index;
 
 	if (!name)
 		return NULL;
@@ -4345,6 +4978,37 @@ struct yaffs_obj *yaffs_find_by_name(struct yaffs_obj *directory,
 
 	sum = yaffs_calc_name_sum(name);
 
+	index = yaffs_get_name_index(directory);
+	if (index) {
+		list_for_each(i, yaffs_name_index_chain(index, sum)) {
+			l = list_entry(i, struct yaffs_obj, name_link);
+
+			if (l->parent != directory)
+				BUG();
+
+			if (l->sum == sum &&
+			    yaffs_obj_name_matches(l, name, sum, buffer))
+				return l;
+		}
+
+		/* Loading details may move an object off this list */
+		list_for_each_safe(i, n, &index->unhashed) {
+			l = list_entry(i, struct yaffs_obj, name_link);
+
+			if (l->parent != directory)
+				BUG();
+
+			yaffs_check_obj_details_loaded(l);
+			if (yaffs_obj_name_matches(l, name, sum, buffer))
+				return l;
+
+			/* The index was regrown under us, start again */
+			if (index != directory->variant.dir_variant.name_index)
+				return yaffs_find_by_name(directory, name);
+		}
+		return NULL;
+	}
+
 	list_for_each(i, &directory->variant.dir_variant.children) {
 		l = list_entry(i, struct yaffs_obj, siblings);
 
@@ -4353,19 +5017,8 @@ struct yaffs_obj *yaffs_find_by_name(struct yaffs_obj *directory,
 
 		yaffs_check_obj_details_loaded(l);
 
-		/* Special case for lost-n-found */
-		if (l->obj_id == YAFFS_OBJECTID_LOSTNFOUND) {
-			if (!strcmp(name, YAFFS_LOSTNFOUND_NAME))
-				return l;
-		} else if (l->sum == sum || l->hdr_chunk <= 0) {
-			/* LostnFound chunk called Objxxx
-			 * Do a real check
-			 */
-			yaffs_get_obj_name(l, buffer,
-				YAFFS_MAX_NAME_LENGTH + 1);
-			if (!strncmp(name, buffer, YAFFS_MAX_NAME_LENGTH))
-				return l;
-		}
+		if (yaffs_obj_name_matches(l, name, sum, buffer))
+			return l;
 	}
 	return NULL;
 }
@@ -4793,8 +5446,8 @@ int yaffs_guts_initialise(struct yaffs_dev *dev)
 	dev->n_deleted_files = 0;
 	dev->n_bg_deletions = 0;
 	dev->n_unlinked_files = 0;
-	dev->n_ecc_fixed = 0;
-	dev->n_ecc_unfixed = 0;
+	atomic_set(&dev->n_ecc_fixed, 0);
+	atomic_set(&dev->n_ecc_unfixed, 0);
 	dev->n_tags_ecc_fixed = 0;
 	dev->n_tags_ecc_unfixed = 0;
 	dev->n_erase_failures = 0;
@@ -4811,38 +5464,22 @@ int yaffs_guts_initialise(struct yaffs_dev *dev)
 		init_failed = 1;
 
 	dev->cache = NULL;
+	dev->cache_hash = NULL;
+	dev->cache_flush = NULL;
 	dev->gc_cleanup_list = NULL;
-
-	if (!init_failed && dev->param.n_caches > 0) {
-		int i;
-		void *buf;
-		int cache_bytes =
-		    dev->param.n_caches * sizeof(struct yaffs_cache);
-
-		if (dev->param.n_caches > YAFFS_MAX_SHORT_OP_CACHES)
-			dev->param.n_caches = YAFFS_MAX_SHORT_OP_CACHES;
-
-		dev->cache = kmalloc(cache_bytes, GFP_NOFS);
-
-		buf = (u8 *) dev->cache;
-
-		if (dev->cache)
-			memset(dev->cache, 0, cache_bytes);
-
-		for (i = 0; i < dev->param.n_caches && buf; i++) {
-			dev->cache[i].object = NULL;
-			dev->cache[i].last_use = 0;
-			dev->cache[i].dirty = 0;
-			dev->cache[i].data = buf =
-			    kmalloc(dev->param.total_bytes_per_chunk, GFP_NOFS);
-		}
-		if (!buf)
-			init_failed = 1;
-
-		dev->cache_last_use = 0;
-	}
+	dev->checkpt_removed = NULL;
+	dev->n_checkpt_removed = 0;
+	dev->checkpt_removed_overflow = 0;
+	dev->checkpt_appendable = 0;
+	dev->checkpt_sections = 0;
+
+	if (!init_failed && dev->param.n_caches > 0 &&
+	    !yaffs_init_cache(dev))
+		init_failed = 1;
 
 	dev->cache_hits = 0;
+	dev->cache_misses = 0;
+	dev->cache_evictions = 0;
 
 	if (!init_failed) {
 		dev->gc_cleanup_list =
@@ -4910,6 +5547,9 @@ int yaffs_guts_initialise(struct yaffs_dev *dev)
 			init_failed = 1;
 		}
 
+		if (!init_failed)
+			yaffs_gc_index_rebuild(dev);
+
 		yaffs_strip_deleted_objs(dev);
 		yaffs_fix_hanging_objs(dev);
 		if (dev->param.empty_lost_n_found)
@@ -4955,18 +5595,12 @@ void yaffs_deinitialise(struct yaffs_dev *dev)
 		yaffs_deinit_tnodes_and_objs(dev);
 		yaffs_summary_deinit(dev);
 
-		if (dev->param.n_caches > 0 && dev->cache) {
-
-			for (i = 0; i < dev->param.n_caches; i++) {
-				kfree(dev->cache[i].data);
-				dev->cache[i].data = NULL;
-			}
-
-			kfree(dev->cache);
-			dev->cache = NULL;
-		}
+		if (dev->param.n_caches > 0)
+			yaffs_deinit_cache(dev);
 
 		kfree(dev->gc_cleanup_list);
+		kfree(dev->checkpt_removed);
+		dev->checkpt_removed = NULL;
 
 		for (i = 0; i < YAFFS_N_TEMP_BUFFERS; i++)
 			kfree(dev->temp_buffer[i].buffer);
@@ -5006,21 +5640,13 @@ int yaffs_get_n_free_chunks(struct yaffs_dev *dev)
 {
 	/* This is what we report to the outside world */
 	int n_free;
-	int n_dirty_caches;
 	int blocks_for_checkpt;
-	int i;
 
 	n_free = dev->n_free_chunks;
 	n_free += dev->n_deleted_files;
 
-	/* Now count and subtract the number of dirty chunks in the cache. */
-
-	for (n_dirty_caches = 0, i = 0; i < dev->param.n_caches; i++) {
-		if (dev->cache[i].dirty)
-			n_dirty_caches++;
-	}
-
-	n_free -= n_dirty_caches;
+	/* Now subtract the number of dirty chunks in the cache. */
+	n_free -= dev->n_dirty_caches;
 
 	n_free -=
 	    ((dev->param.n_reserved_blocks + 1) * dev->param.chunks_per_block);
@@ -72,14 +72,36 @@
 #define YAFFS_ALLOCATION_NTNODES	100
 #define YAFFS_ALLOCATION_NLINKS		100
 
+/* The object hash table starts at YAFFS_NOBJECT_BUCKETS buckets and grows
+ * by YAFFS_OBJECT_BUCKET_GROWTH once the average chain gets longer than
+ * YAFFS_OBJECT_BUCKET_LOAD. Objects are moved into the new table a few
+ * buckets at a time.
+ */
 #define YAFFS_NOBJECT_BUCKETS		256
+#define YAFFS_MAX_OBJECT_BUCKETS	16384
+#define YAFFS_OBJECT_BUCKET_LOAD	4
+#define YAFFS_OBJECT_BUCKET_GROWTH	4
+#define YAFFS_OBJECT_REHASH_STEP	64
+
+/* Directories with at least this many children get a name index */
+#define YAFFS_NAME_INDEX_MIN_CHILDREN	32
+#define YAFFS_NAME_INDEX_MAX_BUCKETS	4096
+#define YAFFS_NAME_INDEX_MAX_BYTES	(64 * 1024)
 
 #define YAFFS_OBJECT_SPACE		0x40000
 #define YAFFS_MAX_OBJECT_ID		(YAFFS_OBJECT_SPACE - 1)
 
 /* Binary data version stamps */
 #define YAFFS_SUMMARY_VERSION		1
-#define YAFFS_CHECKPOINT_VERSION	7
+#define YAFFS_CHECKPOINT_VERSION	8
+
+/* A checkpoint is a full section followed by up to
+ * YAFFS_CHECKPOINT_MAX_SECTIONS - 1 delta or stale sections appended to
+ * the same stream. Objects freed between two deltas are listed by id; if
+ * more than YAFFS_CHECKPOINT_MAX_REMOVED go the next checkpoint is full.
+ */
+#define YAFFS_CHECKPOINT_MAX_SECTIONS	32
+#define YAFFS_CHECKPOINT_MAX_REMOVED	512
 
 #ifdef CONFIG_YAFFS_UNICODE
 #define YAFFS_MAX_NAME_LENGTH		127
@@ -104,7 +126,7 @@
 #define YAFFS_OBJECTID_CHECKPOINT_DATA	0x20
 #define YAFFS_SEQUENCE_CHECKPOINT_DATA	0x21
 
-#define YAFFS_MAX_SHORT_OP_CACHES	20
+#define YAFFS_MAX_SHORT_OP_CACHES	1024
 
 #define YAFFS_N_TEMP_BUFFERS		6
 
@@ -127,11 +149,16 @@
 /* Special sequence number for bad block that failed to be marked bad */
 #define YAFFS_SEQUENCE_BAD_BLOCK	0xffff0000
 
-/* ChunkCache is used for short read/write operations.*/
+/* ChunkCache is used for short read/write operations.
+ * Entries in use are hashed on (object, chunk_id) and on object alone, and
+ * sit on the device LRU list. Unused entries sit on the free list.
+ */
 struct yaffs_cache {
 	struct yaffs_obj *object;
 	int chunk_id;
-	int last_use;
+	struct list_head hash_link;	/* Chain keyed by (object, chunk_id) */
+	struct list_head obj_link;	/* Chain keyed by object */
+	struct list_head lru;		/* LRU list or free list */
 	int dirty;
 	int n_bytes;		/* Only valid if the cache is dirty */
 	int locked;		/* Can't push out or flush while locked. */
@@ -374,11 +401,16 @@ struct yaffs_file_var {
 	loff_t shrink_size;
 	int top_level;
 	struct yaffs_tnode *top;
+	u32 checkpt_lo;		/* Chunks remapped since the last checkpoint, */
+	u32 checkpt_hi;		/* empty if checkpt_lo > checkpt_hi */
 };
 
+struct yaffs_name_index;
+
 struct yaffs_dir_var {
 	struct list_head children;	/* list of child links */
 	struct list_head dirty;	/* Entry for list of dirty directories */
+	struct yaffs_name_index *name_index;	/* Hashed children, if any */
 };
 
 struct yaffs_symlink_var {
@@ -429,6 +461,9 @@ struct yaffs_obj {
 	u8 has_xattr:1;		/* This object has xattribs.
 				 * Only valid if xattr_known. */
 
+	u8 checkpt_written:1;	/* Recorded in the current checkpoint stream */
+	u8 checkpt_dirty:1;	/* Changed since it was last recorded */
+
 	u8 serial;		/* serial number of chunk in NAND.*/
 	u16 sum;		/* sum of the name to speed searching */
 
@@ -442,6 +477,7 @@ struct yaffs_obj {
 	/* also used for linking up the free list */
 	struct yaffs_obj *parent;
 	struct list_head siblings;
+	struct list_head name_link;	/* entry in parent's name index */
 
 	/* Where's my object header in NAND? */
 	int hdr_chunk;
@@ -476,6 +512,8 @@ struct yaffs_obj {
 
 };
 
+struct yaffs_gc_link;
+
 struct yaffs_obj_bucket {
 	struct list_head list;
 	int count;
@@ -555,6 +593,9 @@ struct yaffs_param {
 	/* Checkpoint control. Can be set before or after initialisation */
 	u8 skip_checkpt_rd;
 	u8 skip_checkpt_wr;
+	u8 disable_checkpt_deltas;	/* Always write full checkpoints */
+	u32 checkpt_interval;	/* Seconds between background checkpoints.
+				 * 0 = only checkpoint on sync/unmount. */
 
 	int enable_xattr;	/* Enable xattribs */
 
@@ -594,6 +635,10 @@ struct yaffs_param {
 	int disable_summary;
 	int disable_bad_block_marking;
 
+	int disable_name_index;	/* Always search directories linearly */
+	u32 name_index_max_bytes;	/* Memory cap for directory name
+					 * indexes. 0 = default. */
+
 };
 
 struct yaffs_driver {
@@ -604,6 +649,15 @@ struct yaffs_driver {
 				   u8 *data, int data_len,
 				   u8 *oob, int oob_len,
 				   enum yaffs_ecc_result *ecc_result);
+	/* Optional: read only the tags bytes of n_chunks consecutive
+	 * chunks in one go, oob_len bytes per chunk packed back to back.
+	 * ecc_result covers the whole run: corrected bitflips still
+	 * succeed with YAFFS_ECC_RESULT_FIXED, anything worse fails and
+	 * the caller narrows it down a chunk at a time.
+	 */
+	int (*drv_read_oob_fn) (struct yaffs_dev *dev, int nand_chunk,
+				int n_chunks, u8 *oob, int oob_len,
+				enum yaffs_ecc_result *ecc_result);
 	int (*drv_erase_fn) (struct yaffs_dev *dev, int block_no);
 	int (*drv_mark_bad_fn) (struct yaffs_dev *dev, int block_no);
 	int (*drv_check_bad_fn) (struct yaffs_dev *dev, int block_no);
@@ -618,6 +672,10 @@ struct yaffs_tags_handler {
 	int (*read_chunk_tags_fn) (struct yaffs_dev *dev,
 				   int nand_chunk, u8 *data,
 				   struct yaffs_ext_tags *tags);
+	/* Optional: read the tags of n_chunks consecutive chunks. */
+	int (*read_chunk_tags_range_fn) (struct yaffs_dev *dev,
+					 int nand_chunk, int n_chunks,
+					 struct yaffs_ext_tags *tags);
 
 	int (*query_block_fn) (struct yaffs_dev *dev, int block_no,
 			       enum yaffs_block_state *state,
@@ -681,6 +739,14 @@ struct yaffs_dev {
 	int checkpt_max_blocks;
 	u32 checkpt_sum;
 	u32 checkpt_xor;
+	int checkpt_prior_blocks;	/* Blocks already in an appended stream */
+	int checkpt_appendable;	/* Stream was written by us and may grow */
+	int checkpt_sections;	/* Sections in the stream so far */
+
+	/* Objects freed since the last checkpoint section */
+	u32 *checkpt_removed;
+	u32 n_checkpt_removed;
+	int checkpt_removed_overflow;
 
 	int checkpoint_blocks_required;	/* Number of blocks needed to store
 					 * current checkpoint set */
@@ -703,12 +769,29 @@ struct yaffs_dev {
 	void *allocator;
 	int n_obj;
 	int n_tnodes;
+	u32 n_tnode_arenas;	/* Pages held by the tnode/object allocator */
+	u32 n_obj_arenas;
+	u32 n_arenas_peak;
+	u32 n_arenas_released;
+	u32 n_arenas_trimmed;
 
 	int n_hardlinks;
 
-	struct yaffs_obj_bucket obj_bucket[YAFFS_NOBJECT_BUCKETS];
+	struct yaffs_obj_bucket obj_bucket_base[YAFFS_NOBJECT_BUCKETS];
+	struct yaffs_obj_bucket *obj_bucket;
+	u32 obj_bucket_mask;
+	struct yaffs_obj_bucket *obj_bucket_old; /* Set while rehashing */
+	u32 obj_bucket_old_mask;
+	u32 obj_rehash_pos;	/* Old buckets below this have been moved */
+	unsigned obj_bucket_alt:1;	/* allocated using alternative alloc */
+	unsigned obj_bucket_old_alt:1;
 	u32 bucket_finder;
 
+	/* Directory name indexes */
+	struct list_head name_indexes;
+	u32 name_index_bytes;
+	u32 n_name_indexes;
+
 	int n_free_chunks;
 
 	/* Garbage collection control */
@@ -727,6 +810,13 @@ struct yaffs_dev {
 	unsigned gc_skip;
 	struct yaffs_summary_tags *gc_sum_tags;
 
+	/* GC candidate index, see yaffs_gcindex.c */
+	struct yaffs_gc_link *gc_links;
+	u32 *gc_heap;
+	u32 gc_heap_size;
+	unsigned gc_links_alt:1;	/* allocated using alternative alloc */
+	unsigned gc_index_ready:1;
+
 	/* Special directories */
 	struct yaffs_obj *root_dir;
 	struct yaffs_obj *lost_n_found;
@@ -735,7 +825,13 @@ struct yaffs_dev {
 	int doing_buffered_block_rewrite;
 
 	struct yaffs_cache *cache;
-	int cache_last_use;
+	struct list_head *cache_hash;
+	struct list_head *cache_obj_hash;
+	u32 cache_hash_mask;
+	struct list_head cache_lru;	/* Most recently used first */
+	struct list_head cache_free;
+	struct yaffs_cache **cache_flush; /* Scratch for ordered flushes */
+	u32 n_dirty_caches;
 
 	/* Stuff for background deletion and unlinked files. */
 	struct yaffs_obj *unlinked_dir;	/* Directory where unlinked and deleted
@@ -786,16 +882,30 @@ struct yaffs_dev {
 	u32 bg_gcs;
 	u32 n_retried_writes;
 	u32 n_retired_blocks;
-	u32 n_ecc_fixed;
-	u32 n_ecc_unfixed;
+	/* Also bumped by reads done without the gross lock */
+	atomic_t n_ecc_fixed;
+	atomic_t n_ecc_unfixed;
 	u32 n_tags_ecc_fixed;
 	u32 n_tags_ecc_unfixed;
 	u32 n_deletions;
 	u32 n_unmarked_deletions;
 	u32 refresh_count;
 	u32 cache_hits;
+	u32 cache_misses;
+	u32 cache_evictions;
 	u32 tags_used;
 	u32 summary_used;
+	u32 tags_range_reads;	/* Blocks whose tags were read in one go */
+
+	/* Time spent in each phase of the last yaffs2 mount scan (ms) */
+	u32 scan_query_ms;
+	u32 scan_sort_ms;
+	u32 scan_blocks_ms;
+	u32 scan_fixup_ms;
+
+	u32 checkpt_full_writes;
+	u32 checkpt_delta_writes;
+	u32 checkpt_stale_marks;
 
 };
 
@@ -819,11 +929,18 @@ struct yaffs_checkpt_dev {
 
 };
 
+enum yaffs_checkpt_section {
+	YAFFS_CHECKPT_SECTION_FULL = 1,	/* Complete image */
+	YAFFS_CHECKPT_SECTION_DELTA,	/* Changes since the previous section */
+	YAFFS_CHECKPT_SECTION_STALE	/* Flash changed after previous section */
+};
+
 struct yaffs_checkpt_validity {
 	int struct_type;
 	u32 magic;
 	u32 version;
 	u32 head;
+	u32 section;
 };
 
 struct yaffs_shadow_fixer {
@@ -864,6 +981,10 @@ int yaffs_get_obj_link_count(struct yaffs_obj *obj);
 /* File operations */
 int yaffs_file_rd(struct yaffs_obj *obj, u8 * buffer, loff_t offset,
 		  int n_bytes);
+int yaffs_file_rd_begin(struct yaffs_obj *in, u8 *buffer, loff_t offset,
+			u32 *erasures);
+int yaffs_file_rd_end(struct yaffs_obj *in, u8 *buffer, loff_t offset,
+		      int nand_chunk, u32 erasures, int read_ok);
 int yaffs_wr_file(struct yaffs_obj *obj, const u8 * buffer, loff_t offset,
 		  int n_bytes, int write_trhrough);
 int yaffs_resize_file(struct yaffs_obj *obj, loff_t new_size);
@@ -886,6 +1007,9 @@ struct yaffs_obj *yaffs_create_dir(struct yaffs_obj *parent, const YCHAR *name,
 struct yaffs_obj *yaffs_find_by_name(struct yaffs_obj *the_dir,
 				     const YCHAR *name);
 struct yaffs_obj *yaffs_find_by_number(struct yaffs_dev *dev, u32 number);
+u32 yaffs_n_obj_buckets(struct yaffs_dev *dev);
+struct list_head *yaffs_obj_bucket_list(struct yaffs_dev *dev, u32 i);
+void yaffs_obj_rehash_step(struct yaffs_dev *dev, int n_buckets);
 
 /* Link operations */
 struct yaffs_obj *yaffs_link_obj(struct yaffs_obj *parent, const YCHAR *name,
@@ -961,6 +1085,8 @@ struct yaffs_tnode *yaffs_add_find_tnode_0(struct yaffs_dev *dev,
 					   struct yaffs_file_var *file_struct,
 					   u32 chunk_id,
 					   struct yaffs_tnode *passed_tn);
+void yaffs_file_unmap_chunks(struct yaffs_obj *obj, u32 first, u32 last);
+void yaffs_forget_obj(struct yaffs_obj *obj, struct list_head *hard_list);
 
 int yaffs_do_file_wr(struct yaffs_obj *in, const u8 *buffer, loff_t offset,
 		     int n_bytes, int write_trhrough);
@@ -25,6 +25,22 @@ struct yaffs_linux_context {
 	struct task_struct *bg_thread;	/* Background thread for this device */
 	int bg_running;
 	struct mutex gross_lock;	/* Gross locking mutex*/
+	ktime_t lock_taken;
+	/* gross_lock statistics, updated with the lock held except for
+	 * bg_lock_skips which only the background thread touches.
+	 */
+	u32 lock_acquires;
+	u32 lock_contended;
+	u64 lock_wait_us;
+	u32 lock_wait_max_us;
+	u32 lock_hold_max_us;
+	u32 bg_lock_skips;
+	u32 unlocked_reads;
+	u32 unlocked_read_retries;
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(3, 0, 0))
+	struct shrinker shrinker;	/* Trims the tnode/object allocator */
+	int shrinker_registered;
+#endif
 	u8 *spare_buffer;	/* For mtdif2 use. Don't know the buffer size
 				 * at compile time so we have to allocate it.
 				 */
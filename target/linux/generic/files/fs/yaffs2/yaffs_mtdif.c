@@ -153,13 +153,13 @@ static int yaffs_mtd_read(struct yaffs_dev *dev, int nand_chunk,
 		/* MTD's ECC fixed the data */
 		if(ecc_result)
 			*ecc_result = YAFFS_ECC_RESULT_FIXED;
-		dev->n_ecc_fixed++;
+		atomic_inc(&dev->n_ecc_fixed);
 		break;
 
 	case -EBADMSG:
 	default:
 		/* MTD's ECC could not fix the data */
-		dev->n_ecc_unfixed++;
+		atomic_inc(&dev->n_ecc_unfixed);
 		if(ecc_result)
 			*ecc_result = YAFFS_ECC_RESULT_UNFIXED;
 		return YAFFS_FAIL;
@@ -168,6 +168,77 @@ static int yaffs_mtd_read(struct yaffs_dev *dev, int nand_chunk,
 	return YAFFS_OK;
 }
 
+static int yaffs_mtd_read_oob(struct yaffs_dev *dev, int nand_chunk,
+			      int n_chunks, u8 *oob, int oob_len,
+			      enum yaffs_ecc_result *ecc_result)
+{
+	struct mtd_info *mtd = yaffs_dev_to_mtd(dev);
+	loff_t addr;
+	struct mtd_oob_ops ops;
+	u8 *buf = oob;
+	int retval;
+	int i;
+
+	*ecc_result = YAFFS_ECC_RESULT_UNFIXED;
+
+	if (oob_len > mtd->oobavail)
+		return YAFFS_FAIL;
+
+	/* Auto-placed oob comes back oobavail bytes per page, so bounce
+	 * it if the caller wants the tags packed more tightly.
+	 */
+	if (oob_len < mtd->oobavail) {
+		buf = kmalloc(n_chunks * mtd->oobavail, GFP_NOFS);
+		if (!buf)
+			return YAFFS_FAIL;
+	}
+
+	addr = ((loff_t) nand_chunk) * dev->param.total_bytes_per_chunk;
+	memset(&ops, 0, sizeof(ops));
+	ops.mode = MTD_OPS_AUTO_OOB;
+	ops.ooblen = n_chunks * mtd->oobavail;
+	ops.oobbuf = buf;
+
+#if (MTD_VERSION_CODE < MTD_VERSION(2, 6, 20))
+	ops.len = ops.ooblen;
+#endif
+	retval = mtd_read_oob(mtd, addr, &ops);
+	if ((!retval || retval == -EUCLEAN) && ops.oobretlen != ops.ooblen)
+		retval = -EIO;
+
+	switch (retval) {
+	case 0:
+		*ecc_result = YAFFS_ECC_RESULT_NO_ERROR;
+		break;
+
+	case -EUCLEAN:
+		/* MTD's ECC fixed the data, it doesn't say in which page */
+		*ecc_result = YAFFS_ECC_RESULT_FIXED;
+		atomic_inc(&dev->n_ecc_fixed);
+		retval = 0;
+		break;
+
+	default:
+		/* Not counted here, the caller reads the run again
+		 * a chunk at a time to find the bad one.
+		 */
+		yaffs_trace(YAFFS_TRACE_MTD,
+			"read_oob of %d chunks failed, chunk %d, mtd error %d",
+			n_chunks, nand_chunk, retval);
+		break;
+	}
+
+	if (buf != oob) {
+		if (!retval)
+			for (i = 0; i < n_chunks; i++)
+				memcpy(oob + i * oob_len,
+				       buf + i * mtd->oobavail, oob_len);
+		kfree(buf);
+	}
+
+	return retval ? YAFFS_FAIL : YAFFS_OK;
+}
+
 static 	int yaffs_mtd_erase(struct yaffs_dev *dev, int block_no)
 {
 	struct mtd_info *mtd = yaffs_dev_to_mtd(dev);
@@ -238,6 +309,7 @@ void yaffs_mtd_drv_install(struct yaffs_dev *dev)
 
 	drv->drv_write_chunk_fn = yaffs_mtd_write;
 	drv->drv_read_chunk_fn = yaffs_mtd_read;
+	drv->drv_read_oob_fn = yaffs_mtd_read_oob;
 	drv->drv_erase_fn = yaffs_mtd_erase;
 	drv->drv_mark_bad_fn = yaffs_mtd_mark_bad;
 	drv->drv_check_bad_fn = yaffs_mtd_check_bad;
@@ -0,0 +1,250 @@
+/*
+ * YAFFS: Yet Another Flash File System. A NAND-flash specific file system.
+ *
+ * Copyright (C) 2002-2011 Aleph One Ltd.
+ *   for Toby Churchill Ltd and Brightstar Engineering
+ *
+ * Created by Charles Manning <charles@aleph1.co.uk>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+/*
+ * A name index hashes the children of a large directory by their name sum so
+ * that yaffs_find_by_name only has to look at the children with a matching
+ * sum. Indexes are built on the first lookup in a directory and kept up to
+ * date as objects are added, removed and renamed. The total size of the
+ * indexes is capped per device; directories that do not fit are searched
+ * linearly as before.
+ *
+ * The sum of an object is only trustworthy once its name is known. Lazy
+ * loaded objects, objects whose long name has not been written yet and
+ * lost+found live on the unhashed list, which every lookup checks in full.
+ */
+
+#include "yaffs_nameidx.h"
+#include "yaffs_trace.h"
+
+static u32 yaffs_name_index_size(u32 n_buckets)
+{
+	return sizeof(struct yaffs_name_index) +
+	    n_buckets * sizeof(struct list_head);
+}
+
+static u32 yaffs_name_index_max_bytes(struct yaffs_dev *dev)
+{
+	if (dev->param.name_index_max_bytes)
+		return dev->param.name_index_max_bytes;
+	return YAFFS_NAME_INDEX_MAX_BYTES;
+}
+
+static struct yaffs_name_index *yaffs_name_index_alloc(struct yaffs_dev *dev,
+						       u32 n_buckets)
+{
+	struct yaffs_name_index *index;
+	u32 size = yaffs_name_index_size(n_buckets);
+	u32 i;
+
+	if (dev->name_index_bytes + size > yaffs_name_index_max_bytes(dev))
+		return NULL;
+
+	index = kmalloc(size, GFP_NOFS);
+	if (!index)
+		return NULL;
+
+	index->n_buckets = n_buckets;
+	index->n_entries = 0;
+	INIT_LIST_HEAD(&index->unhashed);
+	for (i = 0; i < n_buckets; i++)
+		INIT_LIST_HEAD(&index->bucket[i]);
+
+	dev->name_index_bytes += size;
+	return index;
+}
+
+static void yaffs_name_index_release(struct yaffs_dev *dev,
+				     struct yaffs_name_index *index)
+{
+	dev->name_index_bytes -= yaffs_name_index_size(index->n_buckets);
+	kfree(index);
+}
+
+static int yaffs_name_is_hashed(struct yaffs_obj *obj)
+{
+	if (obj->lazy_loaded || obj->obj_id == YAFFS_OBJECTID_LOSTNFOUND)
+		return 0;
+
+	return obj->hdr_chunk > 0 || obj->short_name[0];
+}
+
+static void yaffs_name_index_insert(struct yaffs_name_index *index,
+				    struct yaffs_obj *obj)
+{
+	if (yaffs_name_is_hashed(obj))
+		list_add(&obj->name_link,
+			 yaffs_name_index_chain(index, obj->sum));
+	else
+		list_add(&obj->name_link, &index->unhashed);
+	index->n_entries++;
+}
+
+/* Double the number of buckets once the chains get long. Best effort. */
+static void yaffs_name_index_grow(struct yaffs_obj *dir)
+{
+	struct yaffs_dev *dev = dir->my_dev;
+	struct yaffs_name_index *index = dir->variant.dir_variant.name_index;
+	struct yaffs_name_index *new_index;
+	struct yaffs_obj *obj;
+	u32 i;
+
+	if (index->n_buckets >= YAFFS_NAME_INDEX_MAX_BUCKETS)
+		return;
+
+	new_index = yaffs_name_index_alloc(dev, index->n_buckets * 2);
+	if (!new_index)
+		return;
+
+	for (i = 0; i < index->n_buckets; i++) {
+		while (!list_empty(&index->bucket[i])) {
+			obj = list_entry(index->bucket[i].next,
+					 struct yaffs_obj, name_link);
+			list_del(&obj->name_link);
+			list_add(&obj->name_link,
+				 yaffs_name_index_chain(new_index, obj->sum));
+		}
+	}
+	list_splice_init(&index->unhashed, &new_index->unhashed);
+	new_index->n_entries = index->n_entries;
+
+	list_add(&new_index->list, &dev->name_indexes);
+	list_del(&index->list);
+	yaffs_name_index_release(dev, index);
+
+	dir->variant.dir_variant.name_index = new_index;
+}
+
+struct yaffs_name_index *yaffs_name_index_build(struct yaffs_obj *dir)
+{
+	struct yaffs_dev *dev = dir->my_dev;
+	struct yaffs_name_index *index;
+	struct list_head *i;
+	u32 n_children = 0;
+	u32 n_buckets = 16;
+
+	list_for_each(i, &dir->variant.dir_variant.children)
+		n_children++;
+
+	while (n_buckets < n_children / 4 &&
+	       n_buckets < YAFFS_NAME_INDEX_MAX_BUCKETS)
+		n_buckets *= 2;
+
+	index = yaffs_name_index_alloc(dev, n_buckets);
+	if (!index) {
+		yaffs_trace(YAFFS_TRACE_OS,
+			"no name index for directory %d (%u children)",
+			dir->obj_id, n_children);
+		return NULL;
+	}
+
+	list_for_each(i, &dir->variant.dir_variant.children)
+		yaffs_name_index_insert(index,
+			list_entry(i, struct yaffs_obj, siblings));
+
+	list_add(&index->list, &dev->name_indexes);
+	dev->n_name_indexes++;
+	dir->variant.dir_variant.name_index = index;
+
+	return index;
+}
+
+void yaffs_name_index_free(struct yaffs_obj *dir)
+{
+	struct yaffs_name_index *index = dir->variant.dir_variant.name_index;
+	struct yaffs_obj *obj;
+	u32 i;
+
+	if (!index)
+		return;
+
+	for (i = 0; i < index->n_buckets; i++) {
+		while (!list_empty(&index->bucket[i])) {
+			obj = list_entry(index->bucket[i].next,
+					 struct yaffs_obj, name_link);
+			list_del_init(&obj->name_link);
+		}
+	}
+	while (!list_empty(&index->unhashed)) {
+		obj = list_entry(index->unhashed.next,
+				 struct yaffs_obj, name_link);
+		list_del_init(&obj->name_link);
+	}
+
+	list_del(&index->list);
+	dir->my_dev->n_name_indexes--;
+	yaffs_name_index_release(dir->my_dev, index);
+	dir->variant.dir_variant.name_index = NULL;
+}
+
+void yaffs_name_index_add(struct yaffs_obj *obj)
+{
+	struct yaffs_obj *dir = obj->parent;
+	struct yaffs_name_index *index;
+
+	if (!dir || dir->variant_type != YAFFS_OBJECT_TYPE_DIRECTORY)
+		return;
+
+	index = dir->variant.dir_variant.name_index;
+	if (!index || !list_empty(&obj->name_link))
+		return;
+
+	yaffs_name_index_insert(index, obj);
+
+	if (index->n_entries > index->n_buckets * 4)
+		yaffs_name_index_grow(dir);
+}
+
+void yaffs_name_index_del(struct yaffs_obj *obj)
+{
+	struct yaffs_obj *dir = obj->parent;
+
+	if (list_empty(&obj->name_link))
+		return;
+
+	list_del_init(&obj->name_link);
+	if (dir && dir->variant_type == YAFFS_OBJECT_TYPE_DIRECTORY &&
+	    dir->variant.dir_variant.name_index)
+		dir->variant.dir_variant.name_index->n_entries--;
+}
+
+/* Rehash an object after its name, header or load state changed */
+void yaffs_name_index_update(struct yaffs_obj *obj)
+{
+	yaffs_name_index_del(obj);
+	yaffs_name_index_add(obj);
+}
+
+void yaffs_name_index_init(struct yaffs_dev *dev)
+{
+	INIT_LIST_HEAD(&dev->name_indexes);
+	dev->name_index_bytes = 0;
+	dev->n_name_indexes = 0;
+}
+
+/*
+ * Objects are freed in bulk when the device goes away, so the indexes are
+ * found through the device rather than through their directories.
+ */
+void yaffs_name_index_deinit(struct yaffs_dev *dev)
+{
+	struct yaffs_name_index *index;
+
+	while (!list_empty(&dev->name_indexes)) {
+		index = list_entry(dev->name_indexes.next,
+				   struct yaffs_name_index, list);
+		list_del(&index->list);
+		yaffs_name_index_release(dev, index);
+	}
+	dev->n_name_indexes = 0;
+}
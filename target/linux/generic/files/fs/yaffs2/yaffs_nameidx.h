@@ -0,0 +1,49 @@
+/*
+ * YAFFS: Yet another Flash File System . A NAND-flash specific file system.
+ *
+ * Copyright (C) 2002-2011 Aleph One Ltd.
+ *   for Toby Churchill Ltd and Brightstar Engineering
+ *
+ * Created by Charles Manning <charles@aleph1.co.uk>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License version 2.1 as
+ * published by the Free Software Foundation.
+ *
+ * Note: Only YAFFS headers are LGPL, YAFFS C code is covered by GPL.
+ */
+
+/*
+ * Directory name indexes
+ */
+
+#ifndef __YAFFS_NAMEIDX_H__
+#define __YAFFS_NAMEIDX_H__
+
+#include "yaffs_guts.h"
+
+struct yaffs_name_index {
+	struct list_head list;		/* device's list of indexes */
+	u32 n_buckets;			/* power of 2 */
+	u32 n_entries;
+	struct list_head unhashed;	/* children without a usable sum */
+	struct list_head bucket[0];	/* children hashed by name sum */
+};
+
+void yaffs_name_index_init(struct yaffs_dev *dev);
+void yaffs_name_index_deinit(struct yaffs_dev *dev);
+
+struct yaffs_name_index *yaffs_name_index_build(struct yaffs_obj *dir);
+void yaffs_name_index_free(struct yaffs_obj *dir);
+
+void yaffs_name_index_add(struct yaffs_obj *obj);
+void yaffs_name_index_del(struct yaffs_obj *obj);
+void yaffs_name_index_update(struct yaffs_obj *obj);
+
+static inline struct list_head *
+yaffs_name_index_chain(struct yaffs_name_index *index, u16 sum)
+{
+	return &index->bucket[sum & (index->n_buckets - 1)];
+}
+
+#endif
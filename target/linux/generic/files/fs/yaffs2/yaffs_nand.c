@@ -47,6 +47,64 @@ int yaffs_rd_chunk_tags_nand(struct yaffs_dev *dev, int nand_chunk,
 	return result;
 }
 
+/*
+ * Read a chunk's data for a caller that doesn't hold the device lock.
+ * Only the driver and the caller's buffer get touched, so nothing is
+ * done about ECC trouble here: YAFFS_FAIL tells the caller to read the
+ * chunk again with the lock held and let yaffs_rd_chunk_tags_nand()
+ * deal with the block.
+ */
+int yaffs_rd_chunk_nolock_nand(struct yaffs_dev *dev, int nand_chunk,
+			       u8 *buffer)
+{
+	struct yaffs_ext_tags tags;
+	int result;
+
+	result = dev->tagger.read_chunk_tags_fn(dev,
+					apply_chunk_offset(dev, nand_chunk),
+					buffer, &tags);
+	if (result != YAFFS_OK ||
+	    tags.ecc_result > YAFFS_ECC_RESULT_NO_ERROR)
+		return YAFFS_FAIL;
+	return YAFFS_OK;
+}
+
+/*
+ * Read the tags of n_chunks consecutive chunks, in as few driver calls
+ * as the tagger manages. ECC trouble is reported per chunk in the tags
+ * and handled here like yaffs_rd_chunk_tags_nand() does. Returns
+ * YAFFS_FAIL only if the tagger or driver can't read ranges; callers
+ * then read the chunks one at a time.
+ */
+int yaffs_rd_chunk_tags_range_nand(struct yaffs_dev *dev, int nand_chunk,
+				   int n_chunks, struct yaffs_ext_tags *tags)
+{
+	int result;
+	int flash_chunk = apply_chunk_offset(dev, nand_chunk);
+	int i;
+
+	if (!dev->tagger.read_chunk_tags_range_fn)
+		return YAFFS_FAIL;
+
+	result = dev->tagger.read_chunk_tags_range_fn(dev, flash_chunk,
+						      n_chunks, tags);
+	if (result != YAFFS_OK)
+		return result;
+
+	dev->n_page_reads += n_chunks;
+
+	for (i = 0; i < n_chunks; i++) {
+		if (tags[i].ecc_result > YAFFS_ECC_RESULT_NO_ERROR) {
+			struct yaffs_block_info *bi;
+			bi = yaffs_get_block_info(dev,
+						  (nand_chunk + i) /
+						  dev->param.chunks_per_block);
+			yaffs_handle_chunk_error(dev, bi);
+		}
+	}
+	return result;
+}
+
 int yaffs_wr_chunk_tags_nand(struct yaffs_dev *dev,
 				int nand_chunk,
 				const u8 *buffer, struct yaffs_ext_tags *tags)
@@ -177,24 +177,24 @@ static int yaffs_rd_chunk_nand(struct yaffs_dev *dev,
 		yaffs_trace(YAFFS_TRACE_ERROR,
 			"**>>yaffs ecc error fix performed on chunk %d:0",
 			nand_chunk);
-		dev->n_ecc_fixed++;
+		atomic_inc(&dev->n_ecc_fixed);
 	} else if (ecc_result1 < 0) {
 		yaffs_trace(YAFFS_TRACE_ERROR,
 			"**>>yaffs ecc error unfixed on chunk %d:0",
 			nand_chunk);
-		dev->n_ecc_unfixed++;
+		atomic_inc(&dev->n_ecc_unfixed);
 	}
 
 	if (ecc_result2 > 0) {
 		yaffs_trace(YAFFS_TRACE_ERROR,
 			"**>>yaffs ecc error fix performed on chunk %d:1",
 			nand_chunk);
-		dev->n_ecc_fixed++;
+		atomic_inc(&dev->n_ecc_fixed);
 	} else if (ecc_result2 < 0) {
 		yaffs_trace(YAFFS_TRACE_ERROR,
 			"**>>yaffs ecc error unfixed on chunk %d:1",
 			nand_chunk);
-		dev->n_ecc_unfixed++;
+		atomic_inc(&dev->n_ecc_unfixed);
 	}
 
 	if (ecc_result1 || ecc_result2) {
@@ -45,6 +45,8 @@ static int yaffs_tags_marshall_write(struct yaffs_dev *dev,
 							data_bytes_per_chunk);
 		yaffs_pack_tags2_tags_only(pt2tp, tags);
 	} else {
+		/* The ECC struct has padding; don't write stack garbage */
+		memset(&pt, 0, sizeof(pt));
 		yaffs_pack_tags2(&pt, tags, !dev->param.no_tags_ecc);
 	}
 
@@ -115,13 +117,13 @@ static int yaffs_tags_marshall_read(struct yaffs_dev *dev,
 
 	if (tags && ecc_result == YAFFS_ECC_RESULT_UNFIXED) {
 		tags->ecc_result = YAFFS_ECC_RESULT_UNFIXED;
-		dev->n_ecc_unfixed++;
+		atomic_inc(&dev->n_ecc_unfixed);
 	}
 
 	if (tags && ecc_result == -YAFFS_ECC_RESULT_FIXED) {
 		if (tags->ecc_result <= YAFFS_ECC_RESULT_NO_ERROR)
 			tags->ecc_result = YAFFS_ECC_RESULT_FIXED;
-		dev->n_ecc_fixed++;
+		atomic_inc(&dev->n_ecc_fixed);
 	}
 
 	if (ecc_result < YAFFS_ECC_RESULT_UNFIXED)
@@ -130,6 +132,78 @@ static int yaffs_tags_marshall_read(struct yaffs_dev *dev,
 		return YAFFS_FAIL;
 }
 
+static int yaffs_tags_marshall_read_range(struct yaffs_dev *dev,
+					  int nand_chunk, int n_chunks,
+					  struct yaffs_ext_tags *tags)
+{
+	int retval = YAFFS_OK;
+	enum yaffs_ecc_result ecc_result;
+	u8 *buffer;
+	int per_read;
+	int this_read;
+	int i;
+
+	struct yaffs_packed_tags2 pt;
+
+	int packed_tags_size =
+	    dev->param.no_tags_ecc ? sizeof(pt.t) : sizeof(pt);
+	void *packed_tags_ptr =
+	    dev->param.no_tags_ecc ? (void *)&pt.t : (void *)&pt;
+
+	yaffs_trace(YAFFS_TRACE_MTD,
+		"yaffs_tags_marshall_read_range chunk %d n %d tags %p",
+		nand_chunk, n_chunks, tags);
+
+	if (dev->param.inband_tags || !dev->drv.drv_read_oob_fn)
+		return YAFFS_FAIL;
+
+	/* Read as many chunks' tags at a time as fit in a temp buffer. */
+	buffer = yaffs_get_temp_buffer(dev);
+	per_read = dev->data_bytes_per_chunk / packed_tags_size;
+
+	while (n_chunks > 0) {
+		this_read = min(n_chunks, per_read);
+		retval = dev->drv.drv_read_oob_fn(dev, nand_chunk, this_read,
+						  buffer, packed_tags_size,
+						  &ecc_result);
+		if (retval != YAFFS_OK && this_read > 1) {
+			/* Something in the run is bad, find it. */
+			this_read = 1;
+			retval = dev->drv.drv_read_oob_fn(dev, nand_chunk, 1,
+						buffer, packed_tags_size,
+						&ecc_result);
+		}
+
+		if (retval != YAFFS_OK) {
+			/* Let the full chunk read sort out the error */
+			yaffs_tags_marshall_read(dev, nand_chunk, NULL, tags);
+			tags++;
+		} else {
+			for (i = 0; i < this_read; i++) {
+				memcpy(packed_tags_ptr,
+				       buffer + i * packed_tags_size,
+				       packed_tags_size);
+				yaffs_unpack_tags2(tags + i, &pt,
+						   !dev->param.no_tags_ecc);
+			}
+			/* MTD can't say which page it corrected, so the
+			 * strike goes to the first chunk of the run. It
+			 * lands on the same block either way.
+			 */
+			if (ecc_result == YAFFS_ECC_RESULT_FIXED &&
+			    tags->ecc_result <= YAFFS_ECC_RESULT_NO_ERROR)
+				tags->ecc_result = YAFFS_ECC_RESULT_FIXED;
+			tags += this_read;
+		}
+		nand_chunk += this_read;
+		n_chunks -= this_read;
+	}
+
+	yaffs_release_temp_buffer(dev, buffer);
+
+	return YAFFS_OK;
+}
+
 static int yaffs_tags_marshall_query_block(struct yaffs_dev *dev, int block_no,
 			       enum yaffs_block_state *state,
 			       u32 *seq_number)
@@ -190,6 +264,12 @@ void yaffs_tags_marshall_install(struct yaffs_dev *dev)
 	if (!dev->tagger.read_chunk_tags_fn)
 		dev->tagger.read_chunk_tags_fn = yaffs_tags_marshall_read;
 
+	/* Only pair the range reader with our own chunk reader. */
+	if (!dev->tagger.read_chunk_tags_range_fn &&
+	    dev->tagger.read_chunk_tags_fn == yaffs_tags_marshall_read)
+		dev->tagger.read_chunk_tags_range_fn =
+			yaffs_tags_marshall_read_range;
+
 	if (!dev->tagger.query_block_fn)
 		dev->tagger.query_block_fn = yaffs_tags_marshall_query_block;
 
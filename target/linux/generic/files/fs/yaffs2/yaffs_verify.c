@@ -415,8 +415,8 @@ void yaffs_verify_objects(struct yaffs_dev *dev)
 
 	/* Iterate through the objects in each hash entry */
 
-	for (i = 0; i < YAFFS_NOBJECT_BUCKETS; i++) {
-		list_for_each(lh, &dev->obj_bucket[i].list) {
+	for (i = 0; i < yaffs_n_obj_buckets(dev); i++) {
+		list_for_each(lh, yaffs_obj_bucket_list(dev, i)) {
 			obj = list_entry(lh, struct yaffs_obj, hash_link);
 			yaffs_verify_obj(obj);
 		}
@@ -176,6 +176,8 @@ static uint32_t YCALCBLOCKS(uint64_t partition_size, uint32_t block_size)
 #include "yaffs_linux.h"
 
 #include "yaffs_mtdif.h"
+#include "yaffs_nand.h"
+#include "yaffs_allocator.h"
 #include "yaffs_packedtags2.h"
 #include "yaffs_getblockinfo.h"
 
@@ -189,6 +191,7 @@ unsigned int yaffs_auto_checkpoint = 1;
 unsigned int yaffs_gc_control = 1;
 unsigned int yaffs_bg_enable = 1;
 unsigned int yaffs_auto_select = 1;
+unsigned int yaffs_unlocked_reads = 1;
 /* Module Parameters */
 #if (LINUX_VERSION_CODE > KERNEL_VERSION(2, 5, 0))
 module_param(yaffs_trace_mask, uint, 0644);
@@ -196,11 +199,13 @@ module_param(yaffs_wr_attempts, uint, 0644);
 module_param(yaffs_auto_checkpoint, uint, 0644);
 module_param(yaffs_gc_control, uint, 0644);
 module_param(yaffs_bg_enable, uint, 0644);
+module_param(yaffs_unlocked_reads, uint, 0644);
 #else
 MODULE_PARM(yaffs_trace_mask, "i");
 MODULE_PARM(yaffs_wr_attempts, "i");
 MODULE_PARM(yaffs_auto_checkpoint, "i");
 MODULE_PARM(yaffs_gc_control, "i");
+MODULE_PARM(yaffs_unlocked_reads, "i");
 #endif
 
 #if (LINUX_VERSION_CODE < KERNEL_VERSION(2, 6, 25))
@@ -245,17 +250,109 @@ static void yaffs_fill_inode_from_obj(struct inode *inode,
 				      struct yaffs_obj *obj);
 
 
+/*
+ * The gross lock covers everything in yaffs_guts: the allocator, gc,
+ * the short op cache, tnodes and the checkpoint. File data is read
+ * outside it where possible, see yaffs_rd_page_data().
+ */
+static void yaffs_gross_locked(struct yaffs_linux_context *lc,
+			       ktime_t wait_start)
+{
+	u32 wait;
+
+	lc->lock_taken = ktime_get();
+	lc->lock_acquires++;
+	if (ktime_to_ns(wait_start)) {
+		wait = ktime_to_us(ktime_sub(lc->lock_taken, wait_start));
+		lc->lock_contended++;
+		lc->lock_wait_us += wait;
+		if (wait > lc->lock_wait_max_us)
+			lc->lock_wait_max_us = wait;
+	}
+}
+
 static void yaffs_gross_lock(struct yaffs_dev *dev)
 {
+	struct yaffs_linux_context *lc = yaffs_dev_to_lc(dev);
+	ktime_t wait_start = ktime_set(0, 0);
+
 	yaffs_trace(YAFFS_TRACE_LOCK, "yaffs locking %p", current);
-	mutex_lock(&(yaffs_dev_to_lc(dev)->gross_lock));
+	if (!mutex_trylock(&lc->gross_lock)) {
+		wait_start = ktime_get();
+		mutex_lock(&lc->gross_lock);
+	}
+	yaffs_gross_locked(lc, wait_start);
 	yaffs_trace(YAFFS_TRACE_LOCK, "yaffs locked %p", current);
 }
 
+/* For the background thread, which would rather come back later. */
+static int yaffs_gross_trylock(struct yaffs_dev *dev)
+{
+	struct yaffs_linux_context *lc = yaffs_dev_to_lc(dev);
+
+	if (!mutex_trylock(&lc->gross_lock)) {
+		lc->bg_lock_skips++;
+		return 0;
+	}
+	yaffs_gross_locked(lc, ktime_set(0, 0));
+	return 1;
+}
+
 static void yaffs_gross_unlock(struct yaffs_dev *dev)
 {
+	struct yaffs_linux_context *lc = yaffs_dev_to_lc(dev);
+	u32 hold;
+
+	hold = ktime_to_us(ktime_sub(ktime_get(), lc->lock_taken));
+	if (hold > lc->lock_hold_max_us)
+		lc->lock_hold_max_us = hold;
+
 	yaffs_trace(YAFFS_TRACE_LOCK, "yaffs unlocking %p", current);
-	mutex_unlock(&(yaffs_dev_to_lc(dev)->gross_lock));
+	mutex_unlock(&lc->gross_lock);
+}
+
+/*
+ * Read a page of file data, doing the flash reads without the gross
+ * lock so that other files (and gc) can get on with things meanwhile.
+ * Only whole chunks of yaffs2 data that are not in the cache are read
+ * this way; the page lock keeps this page's writers out, and
+ * yaffs_file_rd_end() catches anything that moved the data underneath.
+ */
+static int yaffs_rd_page_data(struct yaffs_obj *obj, u8 *pg_buf, loff_t pos)
+{
+	struct yaffs_dev *dev = obj->my_dev;
+	struct yaffs_linux_context *lc = yaffs_dev_to_lc(dev);
+	int bytes = dev->data_bytes_per_chunk;
+	int nand_chunk;
+	int read_ok;
+	u32 erasures;
+	int i;
+
+	if (!yaffs_unlocked_reads || PAGE_CACHE_SIZE % bytes) {
+		yaffs_gross_lock(dev);
+		yaffs_file_rd(obj, pg_buf, pos, PAGE_CACHE_SIZE);
+		yaffs_gross_unlock(dev);
+		return 0;
+	}
+
+	for (i = 0; i < PAGE_CACHE_SIZE; i += bytes) {
+		yaffs_gross_lock(dev);
+		nand_chunk = yaffs_file_rd_begin(obj, pg_buf + i, pos + i,
+						 &erasures);
+		if (nand_chunk > 0) {
+			yaffs_gross_unlock(dev);
+			read_ok = (yaffs_rd_chunk_nolock_nand(dev, nand_chunk,
+						pg_buf + i) == YAFFS_OK);
+			yaffs_gross_lock(dev);
+			if (yaffs_file_rd_end(obj, pg_buf + i, pos + i,
+					      nand_chunk, erasures, read_ok))
+				lc->unlocked_reads++;
+			else
+				lc->unlocked_read_retries++;
+		}
+		yaffs_gross_unlock(dev);
+	}
+	return 0;
 }
 
 
@@ -288,14 +385,7 @@ static int yaffs_readpage_nolock(struct file *f, struct page *pg)
 	pg_buf = kmap(pg);
 	/* FIXME: Can kmap fail? */
 
-	yaffs_gross_lock(dev);
-
-	ret = yaffs_file_rd(obj, pg_buf, pos, PAGE_CACHE_SIZE);
-
-	yaffs_gross_unlock(dev);
-
-	if (ret >= 0)
-		ret = 0;
+	ret = yaffs_rd_page_data(obj, pg_buf, pos);
 
 	if (ret) {
 		ClearPageUptodate(pg);
@@ -1945,8 +2035,10 @@ static int yaffs_bg_thread_fn(void *data)
 	unsigned long now = jiffies;
 	unsigned long next_dir_update = now;
 	unsigned long next_gc = now;
+	unsigned long next_checkpt = now;
 	unsigned long expires;
 	unsigned int urgency;
+	u32 page_writes = dev->n_page_writes;
 
 	int gc_result;
 	struct timer_list timer;
@@ -1967,7 +2059,11 @@ static int yaffs_bg_thread_fn(void *data)
 		if (try_to_freeze())
 			continue;
 #endif
-		yaffs_gross_lock(dev);
+		if (!yaffs_gross_trylock(dev)) {
+			/* Someone is using the device, so stay out of the way */
+			msleep(20);
+			continue;
+		}
 
 		now = jiffies;
 
@@ -1994,11 +2090,39 @@ static int yaffs_bg_thread_fn(void *data)
 				next_gc = next_dir_update;
                         }
 		}
+
+		/*
+		 * Periodic checkpoint, taken once nobody else has written
+		 * since our last pass so that it does not get in the way.
+		 * A delta skips unchanged objects and tnodes, but still
+		 * rewrites all the block info and chunk bits every time.
+		 * Inodes are left for the next sync: the checkpoint records
+		 * what is in RAM so nothing depends on them being written.
+		 */
+		if (dev->param.checkpt_interval && yaffs_bg_enable &&
+		    time_after(now, next_checkpt)) {
+			if (!dev->is_checkpointed &&
+			    dev->n_page_writes == page_writes &&
+			    !yaffs_bg_gc_urgency(dev)) {
+				yaffs_update_dirty_dirs(dev);
+				yaffs_flush_whole_cache(dev);
+				yaffs_checkpoint_save(dev);
+				next_checkpt = now +
+				    dev->param.checkpt_interval * HZ;
+			} else if (dev->is_checkpointed) {
+				next_checkpt = now +
+				    dev->param.checkpt_interval * HZ;
+			}
+		}
+		page_writes = dev->n_page_writes;
 		yaffs_gross_unlock(dev);
 #if 1
 		expires = next_dir_update;
 		if (time_before(next_gc, expires))
 			expires = next_gc;
+		if (dev->param.checkpt_interval &&
+		    time_before(next_checkpt, expires))
+			expires = next_checkpt;
 		if (time_before(expires, now))
 			expires = now + HZ;
 
@@ -2068,6 +2192,83 @@ static void yaffs_bg_stop(struct yaffs_dev *dev)
 }
 #endif
 
+/*
+ * Under memory pressure give back the spare arenas the tnode and object
+ * allocator keeps. Reclaim can come from under yaffs itself, so the lock
+ * is only ever tried for.
+ */
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(3, 12, 0))
+static unsigned long yaffs_shrink_count(struct shrinker *shrink,
+					struct shrink_control *sc)
+{
+	struct yaffs_linux_context *lc =
+	    container_of(shrink, struct yaffs_linux_context, shrinker);
+
+	return yaffs_n_spare_raw_arenas(lc->dev);
+}
+
+static unsigned long yaffs_shrink_scan(struct shrinker *shrink,
+				       struct shrink_control *sc)
+{
+	struct yaffs_linux_context *lc =
+	    container_of(shrink, struct yaffs_linux_context, shrinker);
+	unsigned long freed;
+
+	if (!mutex_trylock(&lc->gross_lock))
+		return SHRINK_STOP;
+	yaffs_gross_locked(lc, ktime_set(0, 0));
+	freed = yaffs_trim_raw_tnodes_and_objs(lc->dev, sc->nr_to_scan);
+	yaffs_gross_unlock(lc->dev);
+
+	return freed;
+}
+
+static void yaffs_shrinker_start(struct yaffs_linux_context *lc)
+{
+	lc->shrinker.count_objects = yaffs_shrink_count;
+	lc->shrinker.scan_objects = yaffs_shrink_scan;
+	lc->shrinker.seeks = DEFAULT_SEEKS;
+	lc->shrinker_registered = !register_shrinker(&lc->shrinker);
+}
+#elif (LINUX_VERSION_CODE >= KERNEL_VERSION(3, 0, 0))
+static int yaffs_shrink(struct shrinker *shrink, struct shrink_control *sc)
+{
+	struct yaffs_linux_context *lc =
+	    container_of(shrink, struct yaffs_linux_context, shrinker);
+
+	if (sc->nr_to_scan) {
+		if (!mutex_trylock(&lc->gross_lock))
+			return -1;
+		yaffs_gross_locked(lc, ktime_set(0, 0));
+		yaffs_trim_raw_tnodes_and_objs(lc->dev, sc->nr_to_scan);
+		yaffs_gross_unlock(lc->dev);
+	}
+
+	return yaffs_n_spare_raw_arenas(lc->dev);
+}
+
+static void yaffs_shrinker_start(struct yaffs_linux_context *lc)
+{
+	lc->shrinker.shrink = yaffs_shrink;
+	lc->shrinker.seeks = DEFAULT_SEEKS;
+	register_shrinker(&lc->shrinker);
+	lc->shrinker_registered = 1;
+}
+#else
+static void yaffs_shrinker_start(struct yaffs_linux_context *lc)
+{
+}
+#endif
+
+static void yaffs_shrinker_stop(struct yaffs_linux_context *lc)
+{
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(3, 0, 0))
+	if (lc->shrinker_registered)
+		unregister_shrinker(&lc->shrinker);
+	lc->shrinker_registered = 0;
+#endif
+}
+
 
 static void yaffs_flush_inodes(struct super_block *sb)
 {
@@ -2115,6 +2316,8 @@ static void yaffs_put_super(struct super_block *sb)
 	yaffs_trace(YAFFS_TRACE_OS | YAFFS_TRACE_BACKGROUND,
 		"yaffs background thread shut down");
 
+	yaffs_shrinker_stop(yaffs_dev_to_lc(dev));
+
 	yaffs_gross_lock(dev);
 
 	yaffs_flush_super(sb, 1);
@@ -2501,6 +2704,7 @@ struct yaffs_options {
 	int skip_checkpoint_read;
 	int skip_checkpoint_write;
 	int no_cache;
+	int n_caches;
 	int tags_ecc_on;
 	int tags_ecc_overridden;
 	int lazy_loading_enabled;
@@ -2508,6 +2712,9 @@ struct yaffs_options {
 	int empty_lost_and_found;
 	int empty_lost_and_found_overridden;
 	int disable_summary;
+	int no_name_index;
+	int no_checkpoint_delta;
+	int checkpoint_interval;
 };
 
 #define MAX_OPT_LEN 30
@@ -2559,6 +2766,11 @@ static int yaffs_parse_options(struct yaffs_options *options,
 			options->empty_lost_and_found_overridden = 1;
 		} else if (!strcmp(cur_opt, "no-cache")) {
 			options->no_cache = 1;
+		} else if (!strncmp(cur_opt, "cache-chunks=", 13)) {
+			options->n_caches =
+			    simple_strtoul(cur_opt + 13, NULL, 0);
+		} else if (!strcmp(cur_opt, "no-name-index")) {
+			options->no_name_index = 1;
 		} else if (!strcmp(cur_opt, "no-checkpoint-read")) {
 			options->skip_checkpoint_read = 1;
 		} else if (!strcmp(cur_opt, "no-checkpoint-write")) {
@@ -2566,6 +2778,11 @@ static int yaffs_parse_options(struct yaffs_options *options,
 		} else if (!strcmp(cur_opt, "no-checkpoint")) {
 			options->skip_checkpoint_read = 1;
 			options->skip_checkpoint_write = 1;
+		} else if (!strcmp(cur_opt, "no-checkpoint-delta")) {
+			options->no_checkpoint_delta = 1;
+		} else if (!strncmp(cur_opt, "checkpoint-interval=", 20)) {
+			options->checkpoint_interval =
+			    simple_strtoul(cur_opt + 20, NULL, 0);
 		} else {
 			printk(KERN_INFO "yaffs: Bad mount option \"%s\"\n",
 			       cur_opt);
@@ -2768,6 +2985,9 @@ static struct super_block *yaffs_internal_read_super(int yaffs_version,
 	param->empty_lost_n_found = 1;
 	param->refresh_period = 500;
 	param->disable_summary = options.disable_summary;
+	param->disable_name_index = options.no_name_index;
+	if (!options.no_cache && options.n_caches > 0)
+		param->n_caches = options.n_caches;
 
 
 #ifdef CONFIG_YAFFS_DISABLE_BAD_BLOCK_MARKING
@@ -2813,6 +3033,8 @@ static struct super_block *yaffs_internal_read_super(int yaffs_version,
 
 	param->skip_checkpt_rd = options.skip_checkpoint_read;
 	param->skip_checkpt_wr = options.skip_checkpoint_write;
+	param->disable_checkpt_deltas = options.no_checkpoint_delta;
+	param->checkpt_interval = options.checkpoint_interval;
 
 	mutex_lock(&yaffs_context_lock);
 	/* Get a mount id */
@@ -2876,6 +3098,7 @@ static struct super_block *yaffs_internal_read_super(int yaffs_version,
 		return NULL;
 
 	sb->s_root = root;
+	yaffs_shrinker_start(context);
 	if(!dev->is_checkpointed)
 		yaffs_set_super_dirty(dev);
 
@@ -3038,6 +3261,23 @@ static char *yaffs_dump_dev_part0(char *buf, struct yaffs_dev *dev)
 	return buf;
 }
 
+static int yaffs_dump_lock_stats(char *buf, struct yaffs_linux_context *lc)
+{
+	char *p = buf;
+
+	p += sprintf(p, "lock_acquires........ %u\n", lc->lock_acquires);
+	p += sprintf(p, "lock_contended....... %u\n", lc->lock_contended);
+	p += sprintf(p, "lock_wait_us......... %llu\n",
+		     (unsigned long long)lc->lock_wait_us);
+	p += sprintf(p, "lock_wait_max_us..... %u\n", lc->lock_wait_max_us);
+	p += sprintf(p, "lock_hold_max_us..... %u\n", lc->lock_hold_max_us);
+	p += sprintf(p, "bg_lock_skips........ %u\n", lc->bg_lock_skips);
+	p += sprintf(p, "unlocked_reads....... %u\n", lc->unlocked_reads);
+	p += sprintf(p, "unlocked_rd_retries.. %u\n",
+		     lc->unlocked_read_retries);
+	return p - buf;
+}
+
 static char *yaffs_dump_dev_part1(char *buf, struct yaffs_dev *dev)
 {
 	buf += sprintf(buf, "max file size....... %lld\n",
@@ -3049,9 +3289,26 @@ static char *yaffs_dump_dev_part1(char *buf, struct yaffs_dev *dev)
 	buf += sprintf(buf, "n_erased_blocks...... %d\n", dev->n_erased_blocks);
 	buf += sprintf(buf, "blocks_in_checkpt.... %d\n",
 				dev->blocks_in_checkpt);
+	buf += sprintf(buf, "checkpt_sections..... %d\n",
+				dev->checkpt_sections);
 	buf += sprintf(buf, "\n");
 	buf += sprintf(buf, "n_tnodes............. %d\n", dev->n_tnodes);
 	buf += sprintf(buf, "n_obj................ %d\n", dev->n_obj);
+	buf += sprintf(buf, "tnode_arenas......... %u\n", dev->n_tnode_arenas);
+	buf += sprintf(buf, "obj_arenas........... %u\n", dev->n_obj_arenas);
+	buf += sprintf(buf, "arena_bytes.......... %lu\n",
+		       (dev->n_tnode_arenas + dev->n_obj_arenas) * PAGE_SIZE);
+	buf += sprintf(buf, "arena_peak_bytes..... %lu\n",
+		       dev->n_arenas_peak * PAGE_SIZE);
+	buf += sprintf(buf, "arenas_released...... %u\n",
+		       dev->n_arenas_released);
+	buf += sprintf(buf, "arenas_trimmed....... %u\n",
+		       dev->n_arenas_trimmed);
+	buf += sprintf(buf, "obj_buckets.......... %u\n",
+		       dev->obj_bucket_mask + 1);
+	buf += sprintf(buf, "n_name_indexes....... %u\n", dev->n_name_indexes);
+	buf += sprintf(buf, "name_index_bytes..... %u\n",
+		       dev->name_index_bytes);
 	buf += sprintf(buf, "n_free_chunks........ %d\n", dev->n_free_chunks);
 	buf += sprintf(buf, "\n");
 	buf += sprintf(buf, "n_page_writes........ %u\n", dev->n_page_writes);
@@ -3069,13 +3326,19 @@ static char *yaffs_dump_dev_part1(char *buf, struct yaffs_dev *dev)
 				dev->n_retried_writes);
 	buf += sprintf(buf, "n_retired_blocks..... %u\n",
 				dev->n_retired_blocks);
-	buf += sprintf(buf, "n_ecc_fixed.......... %u\n", dev->n_ecc_fixed);
-	buf += sprintf(buf, "n_ecc_unfixed........ %u\n", dev->n_ecc_unfixed);
+	buf += sprintf(buf, "n_ecc_fixed.......... %u\n",
+				(u32) atomic_read(&dev->n_ecc_fixed));
+	buf += sprintf(buf, "n_ecc_unfixed........ %u\n",
+				(u32) atomic_read(&dev->n_ecc_unfixed));
 	buf += sprintf(buf, "n_tags_ecc_fixed..... %u\n",
 				dev->n_tags_ecc_fixed);
 	buf += sprintf(buf, "n_tags_ecc_unfixed... %u\n",
 				dev->n_tags_ecc_unfixed);
 	buf += sprintf(buf, "cache_hits........... %u\n", dev->cache_hits);
+	buf += sprintf(buf, "cache_misses......... %u\n", dev->cache_misses);
+	buf += sprintf(buf, "cache_evictions...... %u\n",
+		       dev->cache_evictions);
+	buf += sprintf(buf, "n_dirty_caches....... %u\n", dev->n_dirty_caches);
 	buf += sprintf(buf, "n_deleted_files...... %u\n", dev->n_deleted_files);
 	buf += sprintf(buf, "n_unlinked_files..... %u\n",
 				dev->n_unlinked_files);
@@ -3083,6 +3346,19 @@ static char *yaffs_dump_dev_part1(char *buf, struct yaffs_dev *dev)
 	buf += sprintf(buf, "n_bg_deletions....... %u\n", dev->n_bg_deletions);
 	buf += sprintf(buf, "tags_used............ %u\n", dev->tags_used);
 	buf += sprintf(buf, "summary_used......... %u\n", dev->summary_used);
+	buf += sprintf(buf, "tags_range_reads..... %u\n",
+		       dev->tags_range_reads);
+	buf += sprintf(buf, "scan_query_ms........ %u\n", dev->scan_query_ms);
+	buf += sprintf(buf, "scan_sort_ms......... %u\n", dev->scan_sort_ms);
+	buf += sprintf(buf, "scan_blocks_ms....... %u\n", dev->scan_blocks_ms);
+	buf += sprintf(buf, "scan_fixup_ms........ %u\n", dev->scan_fixup_ms);
+	buf += sprintf(buf, "checkpt_full_writes.. %u\n",
+		       dev->checkpt_full_writes);
+	buf += sprintf(buf, "checkpt_delta_writes. %u\n",
+		       dev->checkpt_delta_writes);
+	buf += sprintf(buf, "checkpt_stale_marks.. %u\n",
+		       dev->checkpt_stale_marks);
+	buf += yaffs_dump_lock_stats(buf, yaffs_dev_to_lc(dev));
 
 	return buf;
 }
@@ -21,6 +21,7 @@
 #include "yaffs_verify.h"
 #include "yaffs_attribs.h"
 #include "yaffs_summary.h"
+#include "yaffs_gcindex.h"
 
 /*
  * Checkpoints are really no benefit on very small partitions.
@@ -51,16 +52,23 @@ void yaffs_calc_oldest_dirty_seq(struct yaffs_dev *dev)
 
 	/* Find the oldest dirty sequence number. */
 	seq = dev->seq_number + 1;
-	b = dev->block_info;
-	for (i = dev->internal_start_block; i <= dev->internal_end_block; i++) {
-		if (b->block_state == YAFFS_BLOCK_STATE_FULL &&
-		    (b->pages_in_use - b->soft_del_pages) <
-		    dev->param.chunks_per_block &&
-		    b->seq_number < seq) {
-			seq = b->seq_number;
-			block_no = i;
+	if (dev->gc_index_ready) {
+		block_no = yaffs_gc_index_oldest(dev);
+		if (block_no)
+			seq = yaffs_get_block_info(dev, block_no)->seq_number;
+	} else {
+		b = dev->block_info;
+		for (i = dev->internal_start_block;
+		     i <= dev->internal_end_block; i++) {
+			if (b->block_state == YAFFS_BLOCK_STATE_FULL &&
+			    (b->pages_in_use - b->soft_del_pages) <
+			    dev->param.chunks_per_block &&
+			    b->seq_number < seq) {
+				seq = b->seq_number;
+				block_no = i;
+			}
+			b++;
 		}
-		b++;
 	}
 
 	if (block_no) {
@@ -248,7 +256,8 @@ int yaffs_calc_checkpt_blocks_required(struct yaffs_dev *dev)
 
 /*--------------------- Checkpointing --------------------*/
 
-static int yaffs2_wr_checkpt_validity_marker(struct yaffs_dev *dev, int head)
+static int yaffs2_wr_checkpt_validity_marker(struct yaffs_dev *dev, int head,
+					     u32 section)
 {
 	struct yaffs_checkpt_validity cp;
 
@@ -258,11 +267,22 @@ static int yaffs2_wr_checkpt_validity_marker(struct yaffs_dev *dev, int head)
 	cp.magic = YAFFS_MAGIC;
 	cp.version = YAFFS_CHECKPOINT_VERSION;
 	cp.head = (head) ? 1 : 0;
+	cp.section = section;
 
 	return (yaffs2_checkpt_wr(dev, &cp, sizeof(cp)) == sizeof(cp)) ? 1 : 0;
 }
 
-static int yaffs2_rd_checkpt_validity_marker(struct yaffs_dev *dev, int head)
+static int yaffs2_checkpt_validity_ok(struct yaffs_checkpt_validity *cp,
+				      int head)
+{
+	return (cp->struct_type == sizeof(*cp)) &&
+	    (cp->magic == YAFFS_MAGIC) &&
+	    (cp->version == YAFFS_CHECKPOINT_VERSION) &&
+	    (cp->head == ((head) ? 1 : 0));
+}
+
+static int yaffs2_rd_checkpt_validity_marker(struct yaffs_dev *dev, int head,
+					     u32 section)
 {
 	struct yaffs_checkpt_validity cp;
 	int ok;
@@ -270,20 +290,42 @@ static int yaffs2_rd_checkpt_validity_marker(struct yaffs_dev *dev, int head)
 	ok = (yaffs2_checkpt_rd(dev, &cp, sizeof(cp)) == sizeof(cp));
 
 	if (ok)
-		ok = (cp.struct_type == sizeof(cp)) &&
-		    (cp.magic == YAFFS_MAGIC) &&
-		    (cp.version == YAFFS_CHECKPOINT_VERSION) &&
-		    (cp.head == ((head) ? 1 : 0));
+		ok = yaffs2_checkpt_validity_ok(&cp, head) &&
+		    cp.section == section;
 	return ok ? 1 : 0;
 }
 
+/* Read the head marker of the next section.
+ * Returns 1 with the section type, 0 if the stream ends cleanly here or
+ * -1 if there is something there that is not a section head.
+ */
+static int yaffs2_rd_checkpt_section_head(struct yaffs_dev *dev, u32 *section)
+{
+	struct yaffs_checkpt_validity cp;
+	int n_bytes;
+
+	n_bytes = yaffs2_checkpt_rd(dev, &cp, sizeof(cp));
+	if (n_bytes == 0)
+		return 0;
+
+	if (n_bytes != sizeof(cp) || !yaffs2_checkpt_validity_ok(&cp, 1))
+		return -1;
+
+	*section = cp.section;
+	return 1;
+}
+
 static void yaffs2_dev_to_checkpt_dev(struct yaffs_checkpt_dev *cp,
 				      struct yaffs_dev *dev)
 {
-	cp->n_erased_blocks = dev->n_erased_blocks;
+	/* Record the counts as if the stream held no blocks yet. The reader
+	 * charges every checkpoint block it finds when it closes the stream.
+	 */
+	cp->n_erased_blocks = dev->n_erased_blocks + dev->checkpt_prior_blocks;
 	cp->alloc_block = dev->alloc_block;
 	cp->alloc_page = dev->alloc_page;
-	cp->n_free_chunks = dev->n_free_chunks;
+	cp->n_free_chunks = dev->n_free_chunks +
+	    dev->checkpt_prior_blocks * dev->param.chunks_per_block;
 
 	cp->n_deleted_files = dev->n_deleted_files;
 	cp->n_unlinked_files = dev->n_unlinked_files;
@@ -444,25 +486,35 @@ static int yaffs2_checkpt_obj_to_obj(struct yaffs_obj *obj,
 
 static int yaffs2_checkpt_tnode_worker(struct yaffs_obj *in,
 				       struct yaffs_tnode *tn, u32 level,
-				       int chunk_offset)
+				       int chunk_offset, u32 first, u32 last)
 {
 	int i;
 	struct yaffs_dev *dev = in->my_dev;
 	int ok = 1;
 	u32 base_offset;
+	u32 shift;
+	u64 lo;
 
 	if (!tn)
 		return 1;
 
 	if (level > 0) {
+		/* Only descend into subtrees covering chunks first..last */
+		shift = YAFFS_TNODES_LEVEL0_BITS +
+			(level - 1) * YAFFS_TNODES_INTERNAL_BITS;
 		for (i = 0; i < YAFFS_NTNODES_INTERNAL && ok; i++) {
 			if (!tn->internal[i])
 				continue;
+			lo = ((u64)(chunk_offset << YAFFS_TNODES_INTERNAL_BITS)
+			      + i) << shift;
+			if (lo > last || lo + (((u64)1) << shift) <= first)
+				continue;
 			ok = yaffs2_checkpt_tnode_worker(in,
 				 tn->internal[i],
 				 level - 1,
 				 (chunk_offset <<
-				  YAFFS_TNODES_INTERNAL_BITS) + i);
+				  YAFFS_TNODES_INTERNAL_BITS) + i,
+				 first, last);
 		}
 		return ok;
 	}
@@ -478,18 +530,37 @@ static int yaffs2_checkpt_tnode_worker(struct yaffs_obj *in,
 	return ok;
 }
 
-static int yaffs2_wr_checkpt_tnodes(struct yaffs_obj *obj)
+/* Dump the level 0 tnodes of a file. In a delta only the part of the
+ * tree that changed since the object was last recorded is written,
+ * preceded by the range of chunks the reader should drop first.
+ */
+static int yaffs2_wr_checkpt_tnodes(struct yaffs_obj *obj, int delta)
 {
 	u32 end_marker = ~0;
+	u32 range[2];
 	int ok = 1;
+	struct yaffs_dev *dev = obj->my_dev;
+	struct yaffs_file_var *file_struct = &obj->variant.file_variant;
 
 	if (obj->variant_type != YAFFS_OBJECT_TYPE_FILE)
 		return ok;
 
-	ok = yaffs2_checkpt_tnode_worker(obj,
-					 obj->variant.file_variant.top,
-					 obj->variant.file_variant.
-					 top_level, 0);
+	range[0] = 0;
+	range[1] = ~0;
+	if (delta && obj->checkpt_written) {
+		range[0] = file_struct->checkpt_lo;
+		range[1] = file_struct->checkpt_hi;
+	}
+
+	if (delta)
+		ok = (yaffs2_checkpt_wr(dev, range, sizeof(range)) ==
+			sizeof(range));
+
+	if (ok && range[0] <= range[1])
+		ok = yaffs2_checkpt_tnode_worker(obj,
+						 file_struct->top,
+						 file_struct->top_level, 0,
+						 range[0], range[1]);
 	if (ok)
 		ok = (yaffs2_checkpt_wr(obj->my_dev, &end_marker,
 				sizeof(end_marker)) == sizeof(end_marker));
@@ -497,17 +568,27 @@ static int yaffs2_wr_checkpt_tnodes(struct yaffs_obj *obj)
 	return ok ? 1 : 0;
 }
 
-static int yaffs2_rd_checkpt_tnodes(struct yaffs_obj *obj)
+static int yaffs2_rd_checkpt_tnodes(struct yaffs_obj *obj, int delta)
 {
-	u32 base_chunk;
+	u32 base_chunk = ~0;
+	u32 range[2];
 	int ok = 1;
 	struct yaffs_dev *dev = obj->my_dev;
 	struct yaffs_file_var *file_stuct_ptr = &obj->variant.file_variant;
 	struct yaffs_tnode *tn;
 	int nread = 0;
 
-	ok = (yaffs2_checkpt_rd(dev, &base_chunk, sizeof(base_chunk)) ==
-	      sizeof(base_chunk));
+	if (delta) {
+		ok = (yaffs2_checkpt_rd(dev, range, sizeof(range)) ==
+		      sizeof(range));
+		if (ok && range[0] <= range[1])
+			yaffs_file_unmap_chunks(obj, range[0], range[1]);
+	}
+
+	if (ok)
+		ok = (yaffs2_checkpt_rd(dev, &base_chunk,
+					sizeof(base_chunk)) ==
+		      sizeof(base_chunk));
 
 	while (ok && (~base_chunk)) {
 		nread++;
@@ -538,7 +619,50 @@ static int yaffs2_rd_checkpt_tnodes(struct yaffs_obj *obj)
 	return ok ? 1 : 0;
 }
 
-static int yaffs2_wr_checkpt_objs(struct yaffs_dev *dev)
+static int yaffs2_wr_checkpt_removed(struct yaffs_dev *dev)
+{
+	u32 n_removed = dev->n_checkpt_removed;
+	u32 n_bytes = n_removed * sizeof(u32);
+	int ok;
+
+	ok = (yaffs2_checkpt_wr(dev, &n_removed, sizeof(n_removed)) ==
+		sizeof(n_removed));
+	if (ok && n_bytes)
+		ok = (yaffs2_checkpt_wr(dev, dev->checkpt_removed, n_bytes) ==
+			n_bytes);
+
+	return ok ? 1 : 0;
+}
+
+static int yaffs2_rd_checkpt_removed(struct yaffs_dev *dev,
+				     struct list_head *hard_list)
+{
+	u32 n_removed;
+	u32 obj_id;
+	u32 i;
+	struct yaffs_obj *obj;
+	int ok;
+
+	ok = (yaffs2_checkpt_rd(dev, &n_removed, sizeof(n_removed)) ==
+		sizeof(n_removed));
+	if (ok && n_removed > YAFFS_CHECKPOINT_MAX_REMOVED)
+		ok = 0;
+
+	for (i = 0; ok && i < n_removed; i++) {
+		ok = (yaffs2_checkpt_rd(dev, &obj_id, sizeof(obj_id)) ==
+			sizeof(obj_id));
+		obj = ok ? yaffs_find_by_number(dev, obj_id) : NULL;
+		if (obj && !obj->fake)
+			yaffs_forget_obj(obj, hard_list);
+	}
+
+	yaffs_trace(YAFFS_TRACE_CHECKPOINT,
+		"Checkpoint read %d removed objects ok %d", n_removed, ok);
+
+	return ok ? 1 : 0;
+}
+
+static int yaffs2_wr_checkpt_objs(struct yaffs_dev *dev, int delta)
 {
 	struct yaffs_obj *obj;
 	struct yaffs_checkpt_obj cp;
@@ -546,30 +670,42 @@ static int yaffs2_wr_checkpt_objs(struct yaffs_dev *dev)
 	int ok = 1;
 	struct list_head *lh;
 
+	/* A delta starts with the objects that have gone since the
+	 * previous section.
+	 */
+	if (delta)
+		ok = yaffs2_wr_checkpt_removed(dev);
+
 	/* Iterate through the objects in each hash entry,
 	 * dumping them to the checkpointing stream.
 	 */
 
-	for (i = 0; ok && i < YAFFS_NOBJECT_BUCKETS; i++) {
-		list_for_each(lh, &dev->obj_bucket[i].list) {
+	for (i = 0; ok && i < yaffs_n_obj_buckets(dev); i++) {
+		list_for_each(lh, yaffs_obj_bucket_list(dev, i)) {
 			obj = list_entry(lh, struct yaffs_obj, hash_link);
-			if (!obj->defered_free) {
-				yaffs2_obj_checkpt_obj(&cp, obj);
-				cp.struct_type = sizeof(cp);
-
-				yaffs_trace(YAFFS_TRACE_CHECKPOINT,
-					"Checkpoint write object %d parent %d type %d chunk %d obj addr %p",
-					cp.obj_id, cp.parent_id,
-					cp.variant_type, cp.hdr_chunk, obj);
-
-				ok = (yaffs2_checkpt_wr(dev, &cp,
-						sizeof(cp)) == sizeof(cp));
-
-				if (ok &&
-					obj->variant_type ==
-					YAFFS_OBJECT_TYPE_FILE)
-					ok = yaffs2_wr_checkpt_tnodes(obj);
-			}
+			if (obj->defered_free)
+				continue;
+			if (delta && obj->checkpt_written &&
+			    !obj->checkpt_dirty)
+				continue;
+
+			yaffs2_obj_checkpt_obj(&cp, obj);
+			cp.struct_type = sizeof(cp);
+
+			yaffs_trace(YAFFS_TRACE_CHECKPOINT,
+				"Checkpoint write object %d parent %d type %d chunk %d obj addr %p",
+				cp.obj_id, cp.parent_id,
+				cp.variant_type, cp.hdr_chunk, obj);
+
+			ok = (yaffs2_checkpt_wr(dev, &cp,
+					sizeof(cp)) == sizeof(cp));
+
+			if (ok &&
+				obj->variant_type ==
+				YAFFS_OBJECT_TYPE_FILE)
+				ok = yaffs2_wr_checkpt_tnodes(obj, delta);
+			if (!ok)
+				break;
 		}
 	}
 
@@ -583,7 +719,7 @@ static int yaffs2_wr_checkpt_objs(struct yaffs_dev *dev)
 	return ok ? 1 : 0;
 }
 
-static int yaffs2_rd_checkpt_objs(struct yaffs_dev *dev)
+static int yaffs2_rd_checkpt_objs(struct yaffs_dev *dev, int delta)
 {
 	struct yaffs_obj *obj;
 	struct yaffs_checkpt_obj cp;
@@ -591,6 +727,8 @@ static int yaffs2_rd_checkpt_objs(struct yaffs_dev *dev)
 	int done = 0;
 	LIST_HEAD(hard_list);
 
+	if (delta)
+		ok = yaffs2_rd_checkpt_removed(dev, &hard_list);
 
 	while (ok && !done) {
 		ok = (yaffs2_checkpt_rd(dev, &cp, sizeof(cp)) == sizeof(cp));
@@ -618,9 +756,14 @@ static int yaffs2_rd_checkpt_objs(struct yaffs_dev *dev)
 					break;
 				if (obj->variant_type ==
 					YAFFS_OBJECT_TYPE_FILE) {
-					ok = yaffs2_rd_checkpt_tnodes(obj);
+					ok = yaffs2_rd_checkpt_tnodes(obj,
+								      delta);
 				} else if (obj->variant_type ==
 					YAFFS_OBJECT_TYPE_HARDLINK) {
+					/* A delta may re-point a link that
+					 * is already hooked up.
+					 */
+					list_del_init(&obj->hard_links);
 					list_add(&obj->hard_links, &hard_list);
 				}
 			} else {
@@ -671,57 +814,257 @@ static int yaffs2_rd_checkpt_sum(struct yaffs_dev *dev)
 	return 1;
 }
 
-static int yaffs2_wr_checkpt_data(struct yaffs_dev *dev)
+/* Called when an object leaves RAM. If the checkpoint stream knows
+ * about it, the next delta has to say that it is gone.
+ */
+void yaffs2_checkpt_obj_freed(struct yaffs_obj *obj)
 {
-	int ok = 1;
+	struct yaffs_dev *dev = obj->my_dev;
 
-	if (!yaffs2_checkpt_required(dev)) {
-		yaffs_trace(YAFFS_TRACE_CHECKPOINT,
-			"skipping checkpoint write");
-		ok = 0;
+	if (!obj->checkpt_written)
+		return;
+
+	obj->checkpt_written = 0;
+	if (dev->checkpt_removed &&
+	    dev->n_checkpt_removed < YAFFS_CHECKPOINT_MAX_REMOVED)
+		dev->checkpt_removed[dev->n_checkpt_removed++] = obj->obj_id;
+	else
+		dev->checkpt_removed_overflow = 1;
+}
+
+/* Everything in RAM is now in the checkpoint stream. */
+static void yaffs2_checkpt_mark_clean(struct yaffs_dev *dev)
+{
+	struct yaffs_obj *obj;
+	struct list_head *lh;
+	int i;
+
+	for (i = 0; i < yaffs_n_obj_buckets(dev); i++) {
+		list_for_each(lh, yaffs_obj_bucket_list(dev, i)) {
+			obj = list_entry(lh, struct yaffs_obj, hash_link);
+			if (obj->defered_free)
+				continue;
+			obj->checkpt_written = 1;
+			obj->checkpt_dirty = 0;
+			if (obj->variant_type == YAFFS_OBJECT_TYPE_FILE) {
+				obj->variant.file_variant.checkpt_lo = ~0;
+				obj->variant.file_variant.checkpt_hi = 0;
+			}
+		}
 	}
 
-	if (ok)
-		ok = yaffs2_checkpt_open(dev, 1);
+	if (!dev->checkpt_removed)
+		dev->checkpt_removed =
+		    kmalloc(YAFFS_CHECKPOINT_MAX_REMOVED * sizeof(u32),
+			    GFP_NOFS);
+	dev->n_checkpt_removed = 0;
+	dev->checkpt_removed_overflow = dev->checkpt_removed ? 0 : 1;
+}
+
+/* Can the next checkpoint be appended to the current stream as a delta,
+ * or is it time to compact it into a fresh full checkpoint?
+ */
+static int yaffs2_checkpt_delta_ok(struct yaffs_dev *dev)
+{
+	int full_blocks;
+
+	if (dev->param.disable_checkpt_deltas ||
+	    !dev->checkpt_appendable ||
+	    dev->checkpt_removed_overflow ||
+	    dev->checkpt_sections >= YAFFS_CHECKPOINT_MAX_SECTIONS)
+		return 0;
+
+	yaffs_calc_checkpt_blocks_required(dev);
+	full_blocks = dev->checkpoint_blocks_required;
 
+	/* Compact once the stream is twice the size of a full checkpoint,
+	 * and never let it outgrow what the reader will follow.
+	 */
+	if (dev->blocks_in_checkpt >= 2 * full_blocks ||
+	    dev->blocks_in_checkpt + full_blocks >
+	    yaffs2_checkpt_max_blocks(dev))
+		return 0;
+
+	return 1;
+}
+
+static int yaffs2_wr_checkpt_section(struct yaffs_dev *dev, u32 section)
+{
+	int ok;
+	int delta = (section == YAFFS_CHECKPT_SECTION_DELTA);
+
+	yaffs_trace(YAFFS_TRACE_CHECKPOINT,
+		"write checkpoint validity, section %d", section);
+	ok = yaffs2_wr_checkpt_validity_marker(dev, 1, section);
+
+	if (ok && section != YAFFS_CHECKPT_SECTION_STALE) {
+		yaffs_trace(YAFFS_TRACE_CHECKPOINT,
+			"write checkpoint device");
+		ok = yaffs2_wr_checkpt_dev(dev);
+		if (ok) {
+			yaffs_trace(YAFFS_TRACE_CHECKPOINT,
+				"write checkpoint objects");
+			ok = yaffs2_wr_checkpt_objs(dev, delta);
+		}
+	}
 	if (ok) {
 		yaffs_trace(YAFFS_TRACE_CHECKPOINT,
 			"write checkpoint validity");
-		ok = yaffs2_wr_checkpt_validity_marker(dev, 1);
+		ok = yaffs2_wr_checkpt_validity_marker(dev, 0, section);
 	}
-	if (ok) {
+
+	if (ok)
+		ok = yaffs2_wr_checkpt_sum(dev);
+
+	return ok;
+}
+
+static int yaffs2_rd_checkpt_section(struct yaffs_dev *dev, u32 section)
+{
+	int ok = 1;
+
+	switch (section) {
+	case YAFFS_CHECKPT_SECTION_FULL:
+	case YAFFS_CHECKPT_SECTION_DELTA:
 		yaffs_trace(YAFFS_TRACE_CHECKPOINT,
-			"write checkpoint device");
-		ok = yaffs2_wr_checkpt_dev(dev);
+			"read checkpoint device");
+		ok = yaffs2_rd_checkpt_dev(dev);
+		if (ok) {
+			yaffs_trace(YAFFS_TRACE_CHECKPOINT,
+				"read checkpoint objects");
+			ok = yaffs2_rd_checkpt_objs(dev,
+				section == YAFFS_CHECKPT_SECTION_DELTA);
+		}
+		break;
+	case YAFFS_CHECKPT_SECTION_STALE:
+		break;
+	default:
+		ok = 0;
+		break;
 	}
+
 	if (ok) {
 		yaffs_trace(YAFFS_TRACE_CHECKPOINT,
-			"write checkpoint objects");
-		ok = yaffs2_wr_checkpt_objs(dev);
+			"read checkpoint validity");
+		ok = yaffs2_rd_checkpt_validity_marker(dev, 0, section);
 	}
+
 	if (ok) {
+		ok = yaffs2_rd_checkpt_sum(dev);
 		yaffs_trace(YAFFS_TRACE_CHECKPOINT,
-			"write checkpoint validity");
-		ok = yaffs2_wr_checkpt_validity_marker(dev, 0);
+			"read checkpoint checksum %d", ok);
 	}
 
 	if (ok)
-		ok = yaffs2_wr_checkpt_sum(dev);
+		ok = yaffs2_checkpt_end_section(dev);
 
-	if (!yaffs_checkpt_close(dev))
+	return ok;
+}
+
+static int yaffs2_wr_checkpt_data(struct yaffs_dev *dev)
+{
+	int ok = 1;
+	int delta = 0;
+
+	if (!yaffs2_checkpt_required(dev)) {
+		yaffs_trace(YAFFS_TRACE_CHECKPOINT,
+			"skipping checkpoint write");
 		ok = 0;
+	}
 
-	if (ok)
+	if (ok && yaffs2_checkpt_delta_ok(dev))
+		delta = yaffs2_checkpt_open_append(dev);
+
+	if (ok && delta) {
+		ok = yaffs2_wr_checkpt_section(dev,
+					       YAFFS_CHECKPT_SECTION_DELTA);
+		if (!yaffs_checkpt_close(dev))
+			ok = 0;
+		if (!ok) {
+			yaffs_trace(YAFFS_TRACE_CHECKPOINT,
+				"checkpoint delta failed, writing it all");
+			delta = 0;
+			ok = 1;
+		}
+	}
+
+	if (ok && !delta) {
+		/* Start a fresh stream with a full checkpoint */
+		if (dev->blocks_in_checkpt > 0)
+			yaffs2_checkpt_invalidate_stream(dev);
+
+		ok = yaffs2_checkpt_open(dev, 1);
+		if (ok)
+			ok = yaffs2_wr_checkpt_section(dev,
+					YAFFS_CHECKPT_SECTION_FULL);
+		if (!yaffs_checkpt_close(dev))
+			ok = 0;
+	}
+
+	if (ok) {
 		dev->is_checkpointed = 1;
-	else
+		dev->checkpt_appendable = 1;
+		if (delta) {
+			dev->checkpt_sections++;
+			dev->checkpt_delta_writes++;
+		} else {
+			dev->checkpt_sections = 1;
+			dev->checkpt_full_writes++;
+		}
+		yaffs2_checkpt_mark_clean(dev);
+	} else {
 		dev->is_checkpointed = 0;
+		dev->checkpt_appendable = 0;
+	}
 
 	return dev->is_checkpointed;
 }
 
+/* Mark the stream as out of date by appending a stale section, rather
+ * than erasing it, so that the next checkpoint can be written as a delta.
+ *
+ * The stale section only goes into the block the stream is already
+ * writing. If that write is torn, the stream simply ends early, and the
+ * block is erased along with the rest of the stream later on.
+ *
+ * Returns 0 when the stream has to be erased instead, which is always the
+ * case with deltas disabled.
+ */
+static int yaffs2_wr_checkpt_stale(struct yaffs_dev *dev)
+{
+	int ok;
+
+	if (dev->param.disable_checkpt_deltas)
+		return 0;
+
+	if (!dev->checkpt_appendable ||
+	    dev->checkpt_cur_block < 0 ||
+	    dev->checkpt_sections >= YAFFS_CHECKPOINT_MAX_SECTIONS)
+		return 0;
+
+	if (!yaffs2_checkpt_open_append(dev))
+		return 0;
+
+	ok = yaffs2_wr_checkpt_section(dev, YAFFS_CHECKPT_SECTION_STALE);
+	if (!yaffs_checkpt_close(dev))
+		ok = 0;
+
+	if (ok) {
+		dev->checkpt_sections++;
+		dev->checkpt_stale_marks++;
+	} else {
+		dev->checkpt_appendable = 0;
+	}
+
+	return ok;
+}
+
 static int yaffs2_rd_checkpt_data(struct yaffs_dev *dev)
 {
 	int ok = 1;
+	int stale = 0;
+	int more;
+	u32 section = 0;
 
 	if (!dev->param.is_yaffs2)
 		ok = 0;
@@ -735,33 +1078,40 @@ static int yaffs2_rd_checkpt_data(struct yaffs_dev *dev)
 	if (ok)
 		ok = yaffs2_checkpt_open(dev, 0); /* open for read */
 
+	/* A full section, then any number of deltas and stale markers. The
+	 * checkpoint is only good if the last section is not stale.
+	 */
 	if (ok) {
 		yaffs_trace(YAFFS_TRACE_CHECKPOINT,
 			"read checkpoint validity");
-		ok = yaffs2_rd_checkpt_validity_marker(dev, 1);
-	}
-	if (ok) {
-		yaffs_trace(YAFFS_TRACE_CHECKPOINT,
-			"read checkpoint device");
-		ok = yaffs2_rd_checkpt_dev(dev);
+		ok = (yaffs2_rd_checkpt_section_head(dev, &section) == 1) &&
+		    section == YAFFS_CHECKPT_SECTION_FULL;
 	}
-	if (ok) {
-		yaffs_trace(YAFFS_TRACE_CHECKPOINT,
-			"read checkpoint objects");
-		ok = yaffs2_rd_checkpt_objs(dev);
-	}
-	if (ok) {
-		yaffs_trace(YAFFS_TRACE_CHECKPOINT,
-			"read checkpoint validity");
-		ok = yaffs2_rd_checkpt_validity_marker(dev, 0);
+
+	while (ok) {
+		ok = yaffs2_rd_checkpt_section(dev, section);
+		if (!ok)
+			break;
+		dev->checkpt_sections++;
+		stale = (section == YAFFS_CHECKPT_SECTION_STALE);
+
+		more = yaffs2_rd_checkpt_section_head(dev, &section);
+		if (more == 0)
+			break;
+		if (more < 0 || section == YAFFS_CHECKPT_SECTION_FULL)
+			ok = 0;
 	}
 
-	if (ok) {
-		ok = yaffs2_rd_checkpt_sum(dev);
+	if (ok && stale) {
 		yaffs_trace(YAFFS_TRACE_CHECKPOINT,
-			"read checkpoint checksum %d", ok);
+			"checkpoint is stale");
+		ok = 0;
 	}
 
+	yaffs_trace(YAFFS_TRACE_CHECKPOINT,
+		"read %d checkpoint sections, ok %d",
+		dev->checkpt_sections, ok);
+
 	if (!yaffs_checkpt_close(dev))
 		ok = 0;
 
@@ -775,14 +1125,39 @@ static int yaffs2_rd_checkpt_data(struct yaffs_dev *dev)
 
 void yaffs2_checkpt_invalidate(struct yaffs_dev *dev)
 {
-	if (dev->is_checkpointed || dev->blocks_in_checkpt > 0) {
+	if (dev->is_checkpointed) {
 		dev->is_checkpointed = 0;
+		if (!yaffs2_wr_checkpt_stale(dev))
+			yaffs2_checkpt_invalidate_stream(dev);
+	} else if (dev->blocks_in_checkpt > 0 && !dev->checkpt_appendable) {
 		yaffs2_checkpt_invalidate_stream(dev);
 	}
+	yaffs2_checkpt_release_stale(dev);
 	if (dev->param.sb_dirty_fn)
 		dev->param.sb_dirty_fn(dev);
 }
 
+/* A stale stream is only kept so that the next checkpoint can be a
+ * delta. Its blocks are not counted as free space, so erase it once it
+ * holds more blocks than a checkpoint needs, or once the erased blocks
+ * are down to the reserve.
+ */
+void yaffs2_checkpt_release_stale(struct yaffs_dev *dev)
+{
+	if (dev->is_checkpointed || dev->blocks_in_checkpt < 1)
+		return;
+
+	yaffs_calc_checkpt_blocks_required(dev);
+
+	if (dev->blocks_in_checkpt > dev->checkpoint_blocks_required ||
+	    dev->n_erased_blocks <= dev->param.n_reserved_blocks) {
+		yaffs_trace(YAFFS_TRACE_CHECKPOINT,
+			"releasing stale checkpoint of %d blocks, %d erased",
+			dev->blocks_in_checkpt, dev->n_erased_blocks);
+		yaffs2_checkpt_invalidate_stream(dev);
+	}
+}
+
 int yaffs_checkpoint_save(struct yaffs_dev *dev)
 {
 	yaffs_trace(YAFFS_TRACE_CHECKPOINT,
@@ -936,7 +1311,8 @@ static inline int yaffs2_scan_chunk(struct yaffs_dev *dev,
 		int *found_chunks,
 		u8 *chunk_data,
 		struct list_head *hard_list,
-		int summary_available)
+		int summary_available,
+		const struct yaffs_ext_tags *range_tags)
 {
 	struct yaffs_obj_hdr *oh;
 	struct yaffs_obj *in;
@@ -958,7 +1334,10 @@ static inline int yaffs2_scan_chunk(struct yaffs_dev *dev,
 		tags.seq_number = bi->seq_number;
 	}
 
-	if (!summary_available || tags.obj_id == 0) {
+	if (range_tags) {
+		tags = range_tags[chunk_in_block];
+		dev->tags_used++;
+	} else if (!summary_available || tags.obj_id == 0) {
 		result = yaffs_rd_chunk_tags_nand(dev, chunk, NULL, &tags);
 		dev->tags_used++;
 	} else {
@@ -1360,6 +1739,11 @@ int yaffs2_scan_backwards(struct yaffs_dev *dev)
 	struct yaffs_block_index *block_index = NULL;
 	int alt_block_index = 0;
 	int summary_available;
+	struct yaffs_ext_tags *range_tags = NULL;
+	struct yaffs_ext_tags *block_tags;
+	int alt_range_tags = 0;
+	u32 t_start;
+	u32 t_now;
 
 	yaffs_trace(YAFFS_TRACE_SCAN,
 		"yaffs2_scan_backwards starts  intstartblk %d intendblk %d...",
@@ -1383,10 +1767,25 @@ int yaffs2_scan_backwards(struct yaffs_dev *dev)
 		return YAFFS_FAIL;
 	}
 
+	/* Blocks without a usable summary have every chunk's tags read.
+	 * If the driver can, do that with one read per block.
+	 */
+	if (dev->tagger.read_chunk_tags_range_fn) {
+		range_tags = kmalloc(dev->param.chunks_per_block *
+				     sizeof(struct yaffs_ext_tags), GFP_NOFS);
+		if (!range_tags) {
+			range_tags = vmalloc(dev->param.chunks_per_block *
+					     sizeof(struct yaffs_ext_tags));
+			alt_range_tags = 1;
+		}
+	}
+
 	dev->blocks_in_checkpt = 0;
 
 	chunk_data = yaffs_get_temp_buffer(dev);
 
+	t_start = Y_CURRENT_MSECS;
+
 	/* Scan all the blocks to determine their state */
 	bi = dev->block_info;
 	for (blk = dev->internal_start_block; blk <= dev->internal_end_block;
@@ -1439,6 +1838,10 @@ int yaffs2_scan_backwards(struct yaffs_dev *dev)
 		bi++;
 	}
 
+	t_now = Y_CURRENT_MSECS;
+	dev->scan_query_ms = t_now - t_start;
+	t_start = t_now;
+
 	yaffs_trace(YAFFS_TRACE_SCAN, "%d blocks to be sorted...", n_to_scan);
 
 	cond_resched();
@@ -1449,6 +1852,10 @@ int yaffs2_scan_backwards(struct yaffs_dev *dev)
 
 	cond_resched();
 
+	t_now = Y_CURRENT_MSECS;
+	dev->scan_sort_ms = t_now - t_start;
+	t_start = t_now;
+
 	yaffs_trace(YAFFS_TRACE_SCAN, "...done");
 
 	/* Now scan the blocks looking at the data. */
@@ -1471,6 +1878,16 @@ int yaffs2_scan_backwards(struct yaffs_dev *dev)
 
 		summary_available = yaffs_summary_read(dev, dev->sum_tags, blk);
 
+		block_tags = NULL;
+		if (!summary_available && range_tags &&
+		    yaffs_rd_chunk_tags_range_nand(dev,
+				blk * dev->param.chunks_per_block,
+				dev->param.chunks_per_block,
+				range_tags) == YAFFS_OK) {
+			block_tags = range_tags;
+			dev->tags_range_reads++;
+		}
+
 		/* For each chunk in each block that needs scanning.... */
 		found_chunks = 0;
 		if (summary_available)
@@ -1488,7 +1905,8 @@ int yaffs2_scan_backwards(struct yaffs_dev *dev)
 			 */
 			if (yaffs2_scan_chunk(dev, bi, blk, c,
 					&found_chunks, chunk_data,
-					&hard_list, summary_available) ==
+					&hard_list, summary_available,
+					block_tags) ==
 					YAFFS_FAIL)
 				alloc_failed = 1;
 		}
@@ -1509,11 +1927,20 @@ int yaffs2_scan_backwards(struct yaffs_dev *dev)
 
 	yaffs_skip_rest_of_block(dev);
 
+	t_now = Y_CURRENT_MSECS;
+	dev->scan_blocks_ms = t_now - t_start;
+	t_start = t_now;
+
 	if (alt_block_index)
 		vfree(block_index);
 	else
 		kfree(block_index);
 
+	if (alt_range_tags)
+		vfree(range_tags);
+	else
+		kfree(range_tags);
+
 	/* Ok, we've done all the scanning.
 	 * Fix up the hard link chains.
 	 * We have scanned all the objects, now it's time to add these
@@ -1523,6 +1950,13 @@ int yaffs2_scan_backwards(struct yaffs_dev *dev)
 
 	yaffs_release_temp_buffer(dev, chunk_data);
 
+	dev->scan_fixup_ms = Y_CURRENT_MSECS - t_start;
+
+	yaffs_trace(YAFFS_TRACE_SCAN | YAFFS_TRACE_MOUNT,
+		"scan times ms: query %u sort %u blocks %u fixup %u, %u blocks scanned, %u tag range reads",
+		dev->scan_query_ms, dev->scan_sort_ms, dev->scan_blocks_ms,
+		dev->scan_fixup_ms, n_to_scan, dev->tags_range_reads);
+
 	if (alloc_failed)
 		return YAFFS_FAIL;
 
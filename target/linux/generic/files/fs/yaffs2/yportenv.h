@@ -69,6 +69,9 @@
 #define Y_TIME_CONVERT(x) (x)
 #endif
 
+/* Millisecond clock, only used for timing the mount scan */
+#define Y_CURRENT_MSECS jiffies_to_msecs(jiffies)
+
 #define compile_time_assertion(assertion) \
 	({ int x = __builtin_choose_expr(assertion, 0, (void)0); (void) x; })
 
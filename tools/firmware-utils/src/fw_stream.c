@@ -0,0 +1,297 @@
+/*
+ * Streaming output for firmware image generators
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as published
+ * by the Free Software Foundation.
+ *
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#ifdef __linux__
+#include <sys/sendfile.h>
+#include <sys/syscall.h>
+#endif
+
+#include "fw_stream.h"
+
+#define FW_STREAM_CHUNK	(64 * 1024)
+
+int fw_input_open(struct fw_input *in, const char *name)
+{
+	struct stat st;
+
+	memset(in, 0, sizeof(*in));
+	in->name = name;
+
+	in->fd = open(name, O_RDONLY);
+	if (in->fd < 0) {
+		fprintf(stderr, "could not open \"%s\" for reading: %s\n",
+			name, strerror(errno));
+		return -1;
+	}
+
+	if (fstat(in->fd, &st)) {
+		fprintf(stderr, "stat failed on \"%s\": %s\n",
+			name, strerror(errno));
+		close(in->fd);
+		in->fd = -1;
+		return -1;
+	}
+
+	in->size = st.st_size;
+	return 0;
+}
+
+int fw_input_map(struct fw_input *in)
+{
+	void *map;
+
+	if (in->map || !in->size)
+		return 0;
+
+	map = mmap(NULL, in->size, PROT_READ, MAP_PRIVATE, in->fd, 0);
+	if (map == MAP_FAILED) {
+		fprintf(stderr, "unable to map \"%s\": %s\n",
+			in->name, strerror(errno));
+		return -1;
+	}
+
+	in->map = map;
+	return 0;
+}
+
+void fw_input_close(struct fw_input *in)
+{
+	if (in->map)
+		munmap(in->map, in->size);
+	if (in->fd >= 0)
+		close(in->fd);
+
+	in->map = NULL;
+	in->fd = -1;
+}
+
+int fw_stream_open_fd(struct fw_stream *s, const char *name, int fd)
+{
+	memset(s, 0, sizeof(*s));
+	s->name = name;
+	s->fd = fd;
+
+	return 0;
+}
+
+int fw_stream_open(struct fw_stream *s, const char *name)
+{
+	int fd;
+
+	fd = open(name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		fprintf(stderr, "could not open \"%s\" for writing: %s\n",
+			name, strerror(errno));
+		return -1;
+	}
+
+	return fw_stream_open_fd(s, name, fd);
+}
+
+int fw_stream_close(struct fw_stream *s)
+{
+	int ret = 0;
+
+	if (close(s->fd)) {
+		fprintf(stderr, "unable to write \"%s\": %s\n",
+			s->name, strerror(errno));
+		ret = -1;
+	}
+
+	s->fd = -1;
+	return ret;
+}
+
+/* close and remove an incomplete image */
+void fw_stream_abort(struct fw_stream *s)
+{
+	close(s->fd);
+	s->fd = -1;
+	unlink(s->name);
+}
+
+static int write_all(struct fw_stream *s, const void *buf, size_t len)
+{
+	const uint8_t *p = buf;
+
+	while (len) {
+		ssize_t n = write(s->fd, p, len);
+
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+
+			fprintf(stderr, "unable to write \"%s\": %s\n",
+				s->name, strerror(errno));
+			return -1;
+		}
+
+		p += n;
+		len -= n;
+		s->pos += n;
+	}
+
+	return 0;
+}
+
+int fw_stream_write(struct fw_stream *s, const void *buf, size_t len)
+{
+	if (s->hash)
+		s->hash(s->hash_ctx, buf, len);
+
+	return write_all(s, buf, len);
+}
+
+int fw_stream_fill(struct fw_stream *s, uint8_t c, size_t len)
+{
+	uint8_t buf[4096];
+
+	memset(buf, c, sizeof(buf));
+	while (len) {
+		size_t n = (len > sizeof(buf)) ? sizeof(buf) : len;
+
+		if (fw_stream_write(s, buf, n))
+			return -1;
+
+		len -= n;
+	}
+
+	return 0;
+}
+
+int fw_stream_pad_to(struct fw_stream *s, uint8_t c, off_t pos)
+{
+	if (pos < s->pos) {
+		fprintf(stderr, "\"%s\": region at 0x%llx overlaps previous data\n",
+			s->name, (unsigned long long) pos);
+		return -1;
+	}
+
+	return fw_stream_fill(s, c, pos - s->pos);
+}
+
+/*
+ * Let the kernel move the data: copy_file_range() for file to file copies,
+ * sendfile() when the output is a pipe or the filesystems differ. Returns
+ * the number of bytes copied, which may be short if neither is available.
+ */
+static size_t copy_kernel(struct fw_stream *s, struct fw_input *in, off_t ofs,
+			  size_t len)
+{
+	size_t done = 0;
+
+#ifdef __linux__
+	loff_t in_ofs = ofs;
+	ssize_t n;
+
+#ifdef __NR_copy_file_range
+	while (done < len) {
+		n = syscall(__NR_copy_file_range, in->fd, &in_ofs, s->fd, NULL,
+			    len - done, 0);
+		if (n <= 0)
+			break;
+
+		done += n;
+	}
+
+	if (done == len)
+		goto out;
+#endif
+
+	while (done < len) {
+		off_t sf_ofs = ofs + done;
+
+		n = sendfile(s->fd, in->fd, &sf_ofs, len - done);
+		if (n <= 0)
+			break;
+
+		done += n;
+	}
+
+out:
+	s->pos += done;
+#endif
+
+	return done;
+}
+
+int fw_stream_copy(struct fw_stream *s, struct fw_input *in, off_t ofs,
+		   size_t len)
+{
+	size_t done;
+
+	if (ofs + len > in->size) {
+		fprintf(stderr, "\"%s\" is too short\n", in->name);
+		return -1;
+	}
+
+	/* the page cache mapping is hashed in place, nothing is copied */
+	if (s->hash && len) {
+		if (fw_input_map(in))
+			return -1;
+
+		s->hash(s->hash_ctx, in->map + ofs, len);
+	}
+
+	done = copy_kernel(s, in, ofs, len);
+	if (done == len)
+		return 0;
+
+	if (in->map)
+		return write_all(s, in->map + ofs + done, len - done);
+
+	while (done < len) {
+		uint8_t buf[FW_STREAM_CHUNK];
+		size_t n = len - done;
+		ssize_t r;
+
+		if (n > sizeof(buf))
+			n = sizeof(buf);
+
+		r = pread(in->fd, buf, n, ofs + done);
+		if (r < 0 && errno == EINTR)
+			continue;
+
+		if (r <= 0) {
+			fprintf(stderr, "unable to read \"%s\": %s\n", in->name,
+				r ? strerror(errno) : "unexpected end of file");
+			return -1;
+		}
+
+		if (write_all(s, buf, r))
+			return -1;
+
+		done += r;
+	}
+
+	return 0;
+}
+
+/* patch already written data, e.g. a checksum in the header */
+int fw_stream_pwrite(struct fw_stream *s, const void *buf, size_t len,
+		     off_t pos)
+{
+	if (pwrite(s->fd, buf, len, pos) != (ssize_t) len) {
+		fprintf(stderr, "unable to write \"%s\": %s\n",
+			s->name, strerror(errno));
+		return -1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,55 @@
+/*
+ * Streaming output for firmware image generators
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as published
+ * by the Free Software Foundation.
+ *
+ */
+
+#ifndef _FW_STREAM_H
+#define _FW_STREAM_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+/* an input file whose contents are copied into the image */
+struct fw_input {
+	const char	*name;
+	int		fd;
+	size_t		size;
+	uint8_t		*map;
+};
+
+/*
+ * The image is written sequentially. Headers and padding are written from
+ * memory, payloads are copied from the input files by the kernel where
+ * possible. Every byte passes through the optional hash callback on the
+ * way, so checksums are ready as soon as the last region is written.
+ */
+struct fw_stream {
+	const char	*name;
+	int		fd;
+	off_t		pos;
+	void		(*hash)(void *ctx, const void *buf, size_t len);
+	void		*hash_ctx;
+};
+
+int fw_input_open(struct fw_input *in, const char *name);
+int fw_input_map(struct fw_input *in);
+void fw_input_close(struct fw_input *in);
+
+int fw_stream_open(struct fw_stream *s, const char *name);
+int fw_stream_open_fd(struct fw_stream *s, const char *name, int fd);
+int fw_stream_close(struct fw_stream *s);
+void fw_stream_abort(struct fw_stream *s);
+
+int fw_stream_write(struct fw_stream *s, const void *buf, size_t len);
+int fw_stream_fill(struct fw_stream *s, uint8_t c, size_t len);
+int fw_stream_pad_to(struct fw_stream *s, uint8_t c, off_t pos);
+int fw_stream_copy(struct fw_stream *s, struct fw_input *in, off_t ofs,
+		   size_t len);
+int fw_stream_pwrite(struct fw_stream *s, const void *buf, size_t len,
+		     off_t pos);
+
+#endif /* _FW_STREAM_H */
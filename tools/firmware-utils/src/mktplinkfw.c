@@ -17,15 +17,20 @@
 #include <string.h>
 #include <unistd.h>     /* for unlink() */
 #include <libgen.h>
+#include <limits.h>
 #include <getopt.h>     /* for getopt() */
 #include <stdarg.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stddef.h>
 #include <sys/stat.h>
 
 #include <arpa/inet.h>
 #include <netinet/in.h>
 
 #include "md5.h"
+#include "fw_stream.h"
 
 #define ALIGN(x,a) ({ typeof(a) __a = (a); (((x) + __a - 1) & ~(__a - 1)); })
 
@@ -118,6 +123,21 @@ struct board_info {
 	char		*layout_id;
 };
 
+/* one output image, several of them are built in parallel in batch mode */
+struct fw_job {
+	char		*board_id;
+	char		*ofname;
+	struct flash_layout *layout;
+	uint32_t	hw_id;
+	uint32_t	hw_rev;
+	uint32_t	kernel_la;
+	uint32_t	kernel_ep;
+	uint32_t	kernel_len;
+	uint32_t	rootfs_ofs;
+	uint32_t	fw_max_len;
+	int		ret;
+};
+
 /*
  * Globals
  */
@@ -128,21 +148,18 @@ static char *version = "ver. 1.0";
 static char *fw_ver = "0.0.0";
 
 static char *board_id;
-static struct board_info *board;
 static char *layout_id;
-static struct flash_layout *layout;
 static char *opt_hw_id;
-static uint32_t hw_id;
 static char *opt_hw_rev;
-static uint32_t hw_rev;
 static int fw_ver_lo;
 static int fw_ver_mid;
 static int fw_ver_hi;
 static struct file_info kernel_info;
+static struct fw_input kernel_input = { .fd = -1 };
 static uint32_t kernel_la = 0;
 static uint32_t kernel_ep = 0;
-static uint32_t kernel_len = 0;
 static struct file_info rootfs_info;
+static struct fw_input rootfs_input = { .fd = -1 };
 static uint32_t rootfs_ofs = 0;
 static uint32_t rootfs_align;
 static struct file_info boot_info;
@@ -150,9 +167,14 @@ static int combined;
 static int strip_padding;
 static int add_jffs2_eof;
 static unsigned char jffs2_eof_mark[4] = {0xde, 0xad, 0xc0, 0xde};
-static uint32_t fw_max_len;
 static uint32_t reserved_space;
 
+static char *batch_file;
+static int batch_threads;
+static struct fw_job *jobs;
+static int num_jobs;
+static int next_job;
+
 static struct file_info inspect_info;
 static int extract = 0;
 
@@ -508,6 +530,10 @@ static void usage(int status)
 "  -i <file>       inspect given firmware file <file>\n"
 "  -x              extract kernel and rootfs while inspecting (requires -i)\n"
 "  -X <size>       reserve <size> bytes in the firmware image (hexval prefixed with 0x)\n"
+"  -b <file>       build one image per line of <file>, each line containing\n"
+"                  \"<board> <output file>\" (replaces -B and -o)\n"
+"  -t <threads>    number of images to build in parallel with -b\n"
+"                  (default: number of online CPUs)\n"
 "  -h              show this screen\n"
 	);
 
@@ -541,6 +567,22 @@ static int get_file_stat(struct file_info *fdata)
 	return 0;
 }
 
+static int open_input(struct file_info *fdata, struct fw_input *in)
+{
+	if (fdata->file_name == NULL)
+		return 0;
+
+	/*
+	 * Batch jobs hash the inputs concurrently, so map them once up front
+	 * rather than letting each stream do it on demand.
+	 */
+	if (fw_input_open(in, fdata->file_name) || fw_input_map(in))
+		return -1;
+
+	fdata->file_size = in->size;
+	return 0;
+}
+
 static int read_to_buf(struct file_info *fdata, char *buf)
 {
 	FILE *f;
@@ -582,165 +624,174 @@ static int check_options(void)
 		return -1;
 	}
 
-	if (board_id == NULL && opt_hw_id == NULL) {
-		ERR("either board or hardware id must be specified");
+	if (batch_file) {
+		if (board_id || opt_hw_id || ofname) {
+			ERR("-b can not be combined with -B, -H or -o");
+			return -1;
+		}
+	} else {
+		if (board_id == NULL && opt_hw_id == NULL) {
+			ERR("either board or hardware id must be specified");
+			return -1;
+		}
+
+		if (ofname == NULL) {
+			ERR("no output file specified");
+			return -1;
+		}
+	}
+
+	if (kernel_info.file_name == NULL) {
+		ERR("no kernel image specified");
 		return -1;
 	}
 
-	if (board_id) {
-		board = find_board(board_id);
+	ret = get_file_stat(&kernel_info);
+	if (ret)
+		return ret;
+
+	if (!combined) {
+		if (rootfs_info.file_name == NULL) {
+			ERR("no rootfs image specified");
+			return -1;
+		}
+
+		ret = get_file_stat(&rootfs_info);
+		if (ret)
+			return ret;
+	}
+
+	ret = sscanf(fw_ver, "%d.%d.%d", &fw_ver_hi, &fw_ver_mid, &fw_ver_lo);
+	if (ret != 3) {
+		ERR("invalid firmware version '%s'", fw_ver);
+		return -1;
+	}
+
+	return 0;
+}
+
+static int check_job(struct fw_job *job)
+{
+	struct board_info *board;
+	char *job_layout_id = layout_id;
+
+	if (job->board_id) {
+		board = find_board(job->board_id);
 		if (board == NULL) {
-			ERR("unknown/unsupported board id \"%s\"", board_id);
+			ERR("unknown/unsupported board id \"%s\"", job->board_id);
 			return -1;
 		}
-		if (layout_id == NULL)
-			layout_id = board->layout_id;
+		if (job_layout_id == NULL)
+			job_layout_id = board->layout_id;
 
-		hw_id = board->hw_id;
-		hw_rev = board->hw_rev;
+		job->hw_id = board->hw_id;
+		job->hw_rev = board->hw_rev;
 	} else {
-		if (layout_id == NULL) {
+		if (job_layout_id == NULL) {
 			ERR("flash layout is not specified");
 			return -1;
 		}
-		hw_id = strtoul(opt_hw_id, NULL, 0);
+		job->hw_id = strtoul(opt_hw_id, NULL, 0);
 
 		if (opt_hw_rev)
-			hw_rev = strtoul(opt_hw_rev, NULL, 0);
+			job->hw_rev = strtoul(opt_hw_rev, NULL, 0);
 		else
-			hw_rev = 1;
+			job->hw_rev = 1;
 	}
 
-	layout = find_layout(layout_id);
-	if (layout == NULL) {
-		ERR("unknown flash layout \"%s\"", layout_id);
+	job->layout = find_layout(job_layout_id);
+	if (job->layout == NULL) {
+		ERR("unknown flash layout \"%s\"", job_layout_id);
 		return -1;
 	}
 
-	if (!kernel_la)
-		kernel_la = layout->kernel_la;
-	if (!kernel_ep)
-		kernel_ep = layout->kernel_ep;
-	if (!rootfs_ofs)
-		rootfs_ofs = layout->rootfs_ofs;
+	job->kernel_la = kernel_la ? kernel_la : job->layout->kernel_la;
+	job->kernel_ep = kernel_ep ? kernel_ep : job->layout->kernel_ep;
+	job->rootfs_ofs = rootfs_ofs ? rootfs_ofs : job->layout->rootfs_ofs;
 
-	if (reserved_space > layout->fw_max_len) {
+	if (reserved_space > job->layout->fw_max_len) {
 		ERR("reserved space is not valid");
 		return -1;
 	}
 
-	fw_max_len = layout->fw_max_len - reserved_space;
-
-	if (kernel_info.file_name == NULL) {
-		ERR("no kernel image specified");
-		return -1;
-	}
-
-	ret = get_file_stat(&kernel_info);
-	if (ret)
-		return ret;
-
-	kernel_len = kernel_info.file_size;
+	job->fw_max_len = job->layout->fw_max_len - reserved_space;
+	job->kernel_len = kernel_info.file_size;
 
 	if (combined) {
 		if (kernel_info.file_size >
-		    fw_max_len - sizeof(struct fw_header)) {
+		    job->fw_max_len - sizeof(struct fw_header)) {
 			ERR("kernel image is too big");
 			return -1;
 		}
 	} else {
-		if (rootfs_info.file_name == NULL) {
-			ERR("no rootfs image specified");
-			return -1;
-		}
-
-		ret = get_file_stat(&rootfs_info);
-		if (ret)
-			return ret;
-
 		if (rootfs_align) {
-			kernel_len += sizeof(struct fw_header);
-			kernel_len = ALIGN(kernel_len, rootfs_align);
-			kernel_len -= sizeof(struct fw_header);
+			job->kernel_len += sizeof(struct fw_header);
+			job->kernel_len = ALIGN(job->kernel_len, rootfs_align);
+			job->kernel_len -= sizeof(struct fw_header);
 
-			DBG("kernel length aligned to %u", kernel_len);
+			DBG("kernel length aligned to %u", job->kernel_len);
 
-			if (kernel_len + rootfs_info.file_size >
-			    fw_max_len - sizeof(struct fw_header)) {
+			if (job->kernel_len + rootfs_info.file_size >
+			    job->fw_max_len - sizeof(struct fw_header)) {
 				ERR("images are too big");
 				return -1;
 			}
 		} else {
 			if (kernel_info.file_size >
-			    rootfs_ofs - sizeof(struct fw_header)) {
+			    job->rootfs_ofs - sizeof(struct fw_header)) {
 				ERR("kernel image is too big");
 				return -1;
 			}
 
 			if (rootfs_info.file_size >
-			    (fw_max_len - rootfs_ofs)) {
+			    (job->fw_max_len - job->rootfs_ofs)) {
 				ERR("rootfs image is too big");
 				return -1;
 			}
 		}
 	}
 
-	if (ofname == NULL) {
-		ERR("no output file specified");
-		return -1;
-	}
-
-	ret = sscanf(fw_ver, "%d.%d.%d", &fw_ver_hi, &fw_ver_mid, &fw_ver_lo);
-	if (ret != 3) {
-		ERR("invalid firmware version '%s'", fw_ver);
-		return -1;
-	}
-
 	return 0;
 }
 
-static void fill_header(char *buf, int len)
+static void fill_header(struct fw_job *job, struct fw_header *hdr)
 {
-	struct fw_header *hdr = (struct fw_header *)buf;
-
 	memset(hdr, 0, sizeof(struct fw_header));
 
 	hdr->version = htonl(HEADER_VERSION_V1);
 	strncpy(hdr->vendor_name, vendor, sizeof(hdr->vendor_name));
 	strncpy(hdr->fw_version, version, sizeof(hdr->fw_version));
-	hdr->hw_id = htonl(hw_id);
-	hdr->hw_rev = htonl(hw_rev);
+	hdr->hw_id = htonl(job->hw_id);
+	hdr->hw_rev = htonl(job->hw_rev);
 
 	if (boot_info.file_size == 0)
 		memcpy(hdr->md5sum1, md5salt_normal, sizeof(hdr->md5sum1));
 	else
 		memcpy(hdr->md5sum1, md5salt_boot, sizeof(hdr->md5sum1));
 
-	hdr->kernel_la = htonl(kernel_la);
-	hdr->kernel_ep = htonl(kernel_ep);
-	hdr->fw_length = htonl(layout->fw_max_len);
+	hdr->kernel_la = htonl(job->kernel_la);
+	hdr->kernel_ep = htonl(job->kernel_ep);
+	hdr->fw_length = htonl(job->layout->fw_max_len);
 	hdr->kernel_ofs = htonl(sizeof(struct fw_header));
-	hdr->kernel_len = htonl(kernel_len);
+	hdr->kernel_len = htonl(job->kernel_len);
 	if (!combined) {
-		hdr->rootfs_ofs = htonl(rootfs_ofs);
+		hdr->rootfs_ofs = htonl(job->rootfs_ofs);
 		hdr->rootfs_len = htonl(rootfs_info.file_size);
 	}
 
 	hdr->ver_hi = htons(fw_ver_hi);
 	hdr->ver_mid = htons(fw_ver_mid);
 	hdr->ver_lo = htons(fw_ver_lo);
-
-	get_md5(buf, len, hdr->md5sum1);
 }
 
-static int pad_jffs2(char *buf, int currlen)
+static int pad_jffs2(struct fw_job *job, struct fw_stream *s)
 {
 	int len;
 	uint32_t pad_mask;
 
-	len = currlen;
+	len = s->pos;
 	pad_mask = (64 * 1024);
-	while ((len < layout->fw_max_len) && (pad_mask != 0)) {
+	while ((len < job->layout->fw_max_len) && (pad_mask != 0)) {
 		uint32_t mask;
 		int i;
 
@@ -758,103 +809,204 @@ static int pad_jffs2(char *buf, int currlen)
 				pad_mask &= ~mask;
 		}
 
-		for (i = 0; i < sizeof(jffs2_eof_mark); i++)
-			buf[len + i] = jffs2_eof_mark[i];
+		if (fw_stream_pad_to(s, 0xff, len) ||
+		    fw_stream_write(s, jffs2_eof_mark, sizeof(jffs2_eof_mark)))
+			return -1;
 
 		len += sizeof(jffs2_eof_mark);
 	}
 
-	return len;
+	return 0;
+}
+
+static void md5_hash(void *ctx, const void *buf, size_t len)
+{
+	MD5_Update(ctx, buf, len);
 }
 
-static int write_fw(char *data, int len)
+/*
+ * The image is streamed to disk: the header and padding come from memory,
+ * the kernel and rootfs are copied straight from the input files. The md5
+ * covers the whole image with the salt in place of the checksum, so it is
+ * collected on the way and patched into the header at the end.
+ */
+static int build_fw(struct fw_job *job)
 {
-	FILE *f;
+	struct fw_header hdr;
+	struct fw_stream s;
+	MD5_CTX ctx;
+	uint8_t md5[MD5SUM_LEN];
 	int ret = EXIT_FAILURE;
 
-	f = fopen(ofname, "w");
-	if (f == NULL) {
-		ERRS("could not open \"%s\" for writing", ofname);
+	if (fw_stream_open(&s, job->ofname))
 		goto out;
-	}
 
-	errno = 0;
-	fwrite(data, len, 1, f);
-	if (errno) {
-		ERRS("unable to write output file");
-		goto out_flush;
+	MD5_Init(&ctx);
+	s.hash = md5_hash;
+	s.hash_ctx = &ctx;
+
+	fill_header(job, &hdr);
+	if (fw_stream_write(&s, &hdr, sizeof(hdr)) ||
+	    fw_stream_copy(&s, &kernel_input, 0, kernel_info.file_size))
+		goto out_abort;
+
+	if (!combined) {
+		if (rootfs_align) {
+			if (fw_stream_pad_to(&s, 0xff, sizeof(struct fw_header) +
+						      job->kernel_len))
+				goto out_abort;
+		} else {
+			if (fw_stream_pad_to(&s, 0xff, job->rootfs_ofs))
+				goto out_abort;
+		}
+
+		if (fw_stream_copy(&s, &rootfs_input, 0, rootfs_info.file_size))
+			goto out_abort;
+
+		if (add_jffs2_eof && pad_jffs2(job, &s))
+			goto out_abort;
 	}
 
-	DBG("firmware file \"%s\" completed", ofname);
+	if (!strip_padding &&
+	    fw_stream_pad_to(&s, 0xff, job->layout->fw_max_len))
+		goto out_abort;
 
-	ret = EXIT_SUCCESS;
+	MD5_Final(md5, &ctx);
+	if (fw_stream_pwrite(&s, md5, sizeof(md5),
+			     offsetof(struct fw_header, md5sum1)))
+		goto out_abort;
 
- out_flush:
-	fflush(f);
-	fclose(f);
-	if (ret != EXIT_SUCCESS) {
-		unlink(ofname);
+	if (fw_stream_close(&s)) {
+		unlink(job->ofname);
+		goto out;
 	}
+
+	DBG("firmware file \"%s\" completed", job->ofname);
+	ret = EXIT_SUCCESS;
+	goto out;
+
+ out_abort:
+	fw_stream_abort(&s);
  out:
 	return ret;
 }
 
-static int build_fw(void)
+static int read_manifest(void)
 {
-	int buflen;
-	char *buf;
-	char *p;
-	int ret = EXIT_FAILURE;
-	int writelen = 0;
+	char line[512];
+	char board[64], output[PATH_MAX];
+	int lineno = 0;
+	FILE *f;
+	int ret = -1;
 
-	buflen = layout->fw_max_len;
+	f = fopen(batch_file, "r");
+	if (f == NULL) {
+		ERRS("could not open \"%s\" for reading", batch_file);
+		return -1;
+	}
 
-	buf = malloc(buflen);
-	if (!buf) {
-		ERR("no memory for buffer\n");
+	while (fgets(line, sizeof(line), f)) {
+		struct fw_job *job;
+		int n;
+
+		lineno++;
+		n = sscanf(line, " %63s %4095s", board, output);
+		if (n <= 0 || board[0] == '#')
+			continue;
+
+		if (n != 2) {
+			ERR("%s:%d: expected \"<board> <output file>\"",
+			    batch_file, lineno);
+			goto out;
+		}
+
+		job = realloc(jobs, (num_jobs + 1) * sizeof(*jobs));
+		if (!job) {
+			ERR("no memory for batch jobs");
+			goto out;
+		}
+		jobs = job;
+
+		job = &jobs[num_jobs++];
+		memset(job, 0, sizeof(*job));
+		job->board_id = strdup(board);
+		job->ofname = strdup(output);
+		if (!job->board_id || !job->ofname) {
+			ERR("no memory for batch jobs");
+			goto out;
+		}
+
+		if (check_job(job)) {
+			ERR("%s:%d: invalid entry", batch_file, lineno);
+			goto out;
+		}
+	}
+
+	if (!num_jobs) {
+		ERR("no images listed in \"%s\"", batch_file);
 		goto out;
 	}
 
-	memset(buf, 0xff, buflen);
-	p = buf + sizeof(struct fw_header);
-	ret = read_to_buf(&kernel_info, p);
-	if (ret)
-		goto out_free_buf;
+	ret = 0;
 
-	writelen = sizeof(struct fw_header) + kernel_len;
+ out:
+	fclose(f);
+	return ret;
+}
 
-	if (!combined) {
-		if (rootfs_align)
-			p = buf + writelen;
-		else
-			p = buf + rootfs_ofs;
+static void *build_worker(void *arg)
+{
+	int i;
 
-		ret = read_to_buf(&rootfs_info, p);
-		if (ret)
-			goto out_free_buf;
+	while ((i = __sync_fetch_and_add(&next_job, 1)) < num_jobs)
+		jobs[i].ret = build_fw(&jobs[i]);
 
-		if (rootfs_align)
-			writelen += rootfs_info.file_size;
-		else
-			writelen = rootfs_ofs + rootfs_info.file_size;
+	return NULL;
+}
+
+static int build_batch(void)
+{
+	pthread_t *threads;
+	int nthreads = batch_threads;
+	int ret = EXIT_SUCCESS;
+	int i;
+
+	if (read_manifest())
+		return EXIT_FAILURE;
+
+	if (nthreads <= 0)
+		nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (nthreads <= 0)
+		nthreads = 1;
+	if (nthreads > num_jobs)
+		nthreads = num_jobs;
 
-		if (add_jffs2_eof)
-			writelen = pad_jffs2(buf, writelen);
+	threads = calloc(nthreads, sizeof(*threads));
+	if (!threads) {
+		ERR("no memory for worker threads");
+		return EXIT_FAILURE;
 	}
 
-	if (!strip_padding)
-		writelen = buflen;
+	/* the inputs are shared read-only between the workers */
+	for (i = 0; i < nthreads; i++) {
+		if (pthread_create(&threads[i], NULL, build_worker, NULL)) {
+			ERR("unable to start worker thread");
+			nthreads = i;
+			break;
+		}
+	}
 
-	fill_header(buf, writelen);
-	ret = write_fw(buf, writelen);
-	if (ret)
-		goto out_free_buf;
+	/* finish the remaining jobs here if no thread could be started */
+	build_worker(NULL);
 
-	ret = EXIT_SUCCESS;
+	for (i = 0; i < nthreads; i++)
+		pthread_join(threads[i], NULL);
 
- out_free_buf:
-	free(buf);
- out:
+	for (i = 0; i < num_jobs; i++)
+		if (jobs[i].ret)
+			ret = EXIT_FAILURE;
+
+	free(threads);
 	return ret;
 }
 
@@ -929,6 +1081,7 @@ static int inspect_fw(void)
 	struct fw_header *hdr;
 	uint8_t md5sum[MD5SUM_LEN];
 	struct board_info *board;
+	struct flash_layout *layout;
 	int ret = EXIT_FAILURE;
 
 	buf = malloc(inspect_info.file_size);
@@ -980,6 +1133,7 @@ static int inspect_fw(void)
 	inspect_fw_pstr("Vendor name", hdr->vendor_name);
 	inspect_fw_pstr("Firmware version", hdr->fw_version);
 	board = find_board_by_hwid(ntohl(hdr->hw_id));
+	layout = NULL;
 	if (board) {
 		layout = find_layout(board->layout_id);
 		inspect_fw_phexpost("Hardware ID",
@@ -1081,7 +1235,7 @@ int main(int argc, char *argv[])
 	while ( 1 ) {
 		int c;
 
-		c = getopt(argc, argv, "a:B:H:E:F:L:V:N:W:ci:k:r:R:o:xX:hsjv:");
+		c = getopt(argc, argv, "a:b:B:H:E:F:L:V:N:W:ci:k:r:R:o:t:xX:hsjv:");
 		if (c == -1)
 			break;
 
@@ -1089,6 +1243,9 @@ int main(int argc, char *argv[])
 		case 'a':
 			sscanf(optarg, "0x%x", &rootfs_align);
 			break;
+		case 'b':
+			batch_file = optarg;
+			break;
 		case 'B':
 			board_id = optarg;
 			break;
@@ -1131,6 +1288,9 @@ int main(int argc, char *argv[])
 		case 'o':
 			ofname = optarg;
 			break;
+		case 't':
+			batch_threads = atoi(optarg);
+			break;
 		case 's':
 			strip_padding = 1;
 			break;
@@ -1159,11 +1319,37 @@ int main(int argc, char *argv[])
 	if (ret)
 		goto out;
 
-	if (!inspect_info.file_name)
-		ret = build_fw();
-	else
+	if (inspect_info.file_name) {
 		ret = inspect_fw();
+		goto out;
+	}
 
+	ret = open_input(&kernel_info, &kernel_input);
+	if (ret)
+		goto out_close;
+
+	if (!combined) {
+		ret = open_input(&rootfs_info, &rootfs_input);
+		if (ret)
+			goto out_close;
+	}
+
+	if (batch_file) {
+		ret = build_batch();
+	} else {
+		struct fw_job job = {
+			.board_id = board_id,
+			.ofname = ofname,
+		};
+
+		ret = check_job(&job);
+		if (!ret)
+			ret = build_fw(&job);
+	}
+
+ out_close:
+	fw_input_close(&rootfs_input);
+	fw_input_close(&kernel_input);
  out:
 	return ret;
 }
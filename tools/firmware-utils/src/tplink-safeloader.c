@@ -48,16 +48,24 @@
 #include <sys/stat.h>
 
 #include "md5.h"
+#include "fw_stream.h"
 
 
 #define ALIGN(x,a) ({ typeof(a) __a = (a); (((x) + __a - 1) & ~(__a - 1)); })
 
 
-/** An image partition table entry */
+/**
+   An image partition table entry
+
+   Partitions read from files are not loaded into memory; their data is
+   copied from the file when the image is written, and everything past the
+   end of the file up to size is jffs2 padding.
+*/
 struct image_partition_entry {
 	const char *name;
 	size_t size;
 	uint8_t *data;
+	struct fw_input *file;
 };
 
 /** A flash partition table entry */
@@ -163,6 +171,11 @@ struct image_partition_entry alloc_image_partition(const char *name, size_t len)
 /** Frees an image partition */
 void free_image_partition(struct image_partition_entry entry) {
 	free(entry.data);
+
+	if (entry.file) {
+		fw_input_close(entry.file);
+		free(entry.file);
+	}
 }
 
 /** Generates the partition-table partition */
@@ -241,40 +254,48 @@ struct image_partition_entry make_support_list(const unsigned char *support_list
 
 /** Creates a new image partition with an arbitrary name from a file */
 struct image_partition_entry read_file(const char *part_name, const char *filename, bool add_jffs2_eof) {
-	struct stat statbuf;
+	struct fw_input *file = malloc(sizeof(*file));
+	if (!file)
+		error(1, errno, "malloc");
 
-	if (stat(filename, &statbuf) < 0)
-		error(1, errno, "unable to stat file `%s'", filename);
+	if (fw_input_open(file, filename))
+		exit(1);
 
-	size_t len = statbuf.st_size;
+	size_t len = file->size;
 
 	if (add_jffs2_eof)
 		len = ALIGN(len, 0x10000) + sizeof(jffs2_eof_mark);
 
-	struct image_partition_entry entry = alloc_image_partition(part_name, len);
-
-	FILE *file = fopen(filename, "rb");
-	if (!file)
-		error(1, errno, "unable to open file `%s'", filename);
-
-	if (fread(entry.data, statbuf.st_size, 1, file) != 1)
-		error(1, errno, "unable to read file `%s'", filename);
+	struct image_partition_entry entry = {part_name, len, NULL, file};
+	return entry;
+}
 
-	if (add_jffs2_eof) {
-		uint8_t *eof = entry.data + statbuf.st_size, *end = entry.data+entry.size;
+/** Removes the incomplete output file and exits if a stream operation has failed */
+static void check_stream(struct fw_stream *s, int ret) {
+	if (ret) {
+		fw_stream_abort(s);
+		exit(1);
+	}
+}
 
-		memset(eof, 0xff, end - eof - sizeof(jffs2_eof_mark));
-		memcpy(end - sizeof(jffs2_eof_mark), jffs2_eof_mark, sizeof(jffs2_eof_mark));
+/** Writes an image partition to the output */
+static void write_partition(struct fw_stream *s, const struct image_partition_entry *part) {
+	if (part->data) {
+		check_stream(s, fw_stream_write(s, part->data, part->size));
+		return;
 	}
 
-	fclose(file);
+	check_stream(s, fw_stream_copy(s, part->file, 0, part->file->size));
 
-	return entry;
+	if (part->size > part->file->size) {
+		check_stream(s, fw_stream_fill(s, 0xff, part->size - part->file->size - sizeof(jffs2_eof_mark)));
+		check_stream(s, fw_stream_write(s, jffs2_eof_mark, sizeof(jffs2_eof_mark)));
+	}
 }
 
 
 /**
-   Copies a list of image partitions into an image buffer and generates the image partition table while doing so
+   Generates the image partition table for a list of image partitions
 
    Example image partition table:
 
@@ -306,8 +327,6 @@ void put_partitions(uint8_t *buffer, const struct image_partition_entry *parts)
 
 	size_t base = 0x800;
 	for (i = 0; parts[i].name; i++) {
-		memcpy(buffer + base, parts[i].data, parts[i].size);
-
 		size_t len = end-image_pt;
 		size_t w = snprintf(image_pt, len, "fwup-ptn %s base 0x%05x size 0x%05x\t\r\n", parts[i].name, (unsigned)base, (unsigned)parts[i].size);
 
@@ -324,14 +343,8 @@ void put_partitions(uint8_t *buffer, const struct image_partition_entry *parts)
 	memset(image_pt, 0xff, end-image_pt);
 }
 
-/** Generates and writes the image MD5 checksum */
-void put_md5(uint8_t *md5, uint8_t *buffer, unsigned int len) {
-	MD5_CTX ctx;
-
-	MD5_Init(&ctx);
-	MD5_Update(&ctx, md5_salt, (unsigned int)sizeof(md5_salt));
-	MD5_Update(&ctx, buffer, len);
-	MD5_Final(md5, &ctx);
+static void md5_hash(void *ctx, const void *buf, size_t len) {
+	MD5_Update(ctx, buf, len);
 }
 
 
@@ -349,29 +362,53 @@ void put_md5(uint8_t *md5, uint8_t *buffer, unsigned int len) {
      1014-1813    Image partition table (2048 bytes, padded with 0xff)
      1814-xxxx    Firmware partitions
 */
-void * generate_factory_image(const unsigned char *vendor, size_t vendor_len, const struct image_partition_entry *parts, size_t *len) {
-	*len = 0x1814;
+void generate_factory_image(const char *output, const unsigned char *vendor, size_t vendor_len, const struct image_partition_entry *parts) {
+	size_t len = 0x1814;
 
 	size_t i;
 	for (i = 0; parts[i].name; i++)
-		*len += parts[i].size;
+		len += parts[i].size;
 
-	uint8_t *image = malloc(*len);
-	if (!image)
-		error(1, errno, "malloc");
+	uint8_t header[0x1814];
+
+	header[0] = len >> 24;
+	header[1] = len >> 16;
+	header[2] = len >> 8;
+	header[3] = len;
+
+	memset(header+0x04, 0, 0x10);
+
+	memcpy(header+0x14, vendor, vendor_len);
+	memset(header+0x14+vendor_len, 0xff, 4096-vendor_len);
+
+	put_partitions(header + 0x1014, parts);
+
+	struct fw_stream s;
+	if (fw_stream_open(&s, output))
+		exit(1);
+
+	check_stream(&s, fw_stream_write(&s, header, 0x14));
+
+	/* everything from 0x14 on is hashed while it is written */
+	MD5_CTX ctx;
+	MD5_Init(&ctx);
+	MD5_Update(&ctx, md5_salt, (unsigned int)sizeof(md5_salt));
 
-	image[0] = *len >> 24;
-	image[1] = *len >> 16;
-	image[2] = *len >> 8;
-	image[3] = *len;
+	s.hash = md5_hash;
+	s.hash_ctx = &ctx;
 
-	memcpy(image+0x14, vendor, vendor_len);
-	memset(image+0x14+vendor_len, 0xff, 4096-vendor_len);
+	check_stream(&s, fw_stream_write(&s, header+0x14, sizeof(header)-0x14));
 
-	put_partitions(image + 0x1014, parts);
-	put_md5(image+0x04, image+0x14, *len-0x14);
+	for (i = 0; parts[i].name; i++)
+		write_partition(&s, &parts[i]);
+
+	uint8_t md5[16];
+	MD5_Final(md5, &ctx);
 
-	return image;
+	check_stream(&s, fw_stream_pwrite(&s, md5, sizeof(md5), 0x04));
+
+	if (fw_stream_close(&s))
+		exit(1);
 }
 
 /**
@@ -381,7 +418,7 @@ void * generate_factory_image(const unsigned char *vendor, size_t vendor_len, co
    should be generalized when TP-LINK starts building its safeloader into hardware with
    different flash layouts.
 */
-void * generate_sysupgrade_image(const struct flash_partition_entry *flash_parts, const struct image_partition_entry *image_parts, size_t *len) {
+void generate_sysupgrade_image(const char *output, const struct flash_partition_entry *flash_parts, const struct image_partition_entry *image_parts) {
 	const struct flash_partition_entry *flash_os_image = &flash_parts[5];
 	const struct flash_partition_entry *flash_soft_version = &flash_parts[6];
 	const struct flash_partition_entry *flash_support_list = &flash_parts[7];
@@ -407,20 +444,23 @@ void * generate_sysupgrade_image(const struct flash_partition_entry *flash_parts
 	if (image_file_system->size > flash_file_system->size)
 		error(1, 0, "rootfs image too big (more than %u bytes)", (unsigned)flash_file_system->size);
 
-	*len = flash_file_system->base - flash_os_image->base + image_file_system->size;
+	struct fw_stream s;
+	if (fw_stream_open(&s, output))
+		exit(1);
 
-	uint8_t *image = malloc(*len);
-	if (!image)
-		error(1, errno, "malloc");
+	write_partition(&s, image_os_image);
+
+	check_stream(&s, fw_stream_pad_to(&s, 0xff, flash_soft_version->base - flash_os_image->base));
+	write_partition(&s, image_soft_version);
 
-	memset(image, 0xff, *len);
+	check_stream(&s, fw_stream_pad_to(&s, 0xff, flash_support_list->base - flash_os_image->base));
+	write_partition(&s, image_support_list);
 
-	memcpy(image, image_os_image->data, image_os_image->size);
-	memcpy(image + flash_soft_version->base - flash_os_image->base, image_soft_version->data, image_soft_version->size);
-	memcpy(image + flash_support_list->base - flash_os_image->base, image_support_list->data, image_support_list->size);
-	memcpy(image + flash_file_system->base - flash_os_image->base, image_file_system->data, image_file_system->size);
+	check_stream(&s, fw_stream_pad_to(&s, 0xff, flash_file_system->base - flash_os_image->base));
+	write_partition(&s, image_file_system);
 
-	return image;
+	if (fw_stream_close(&s))
+		exit(1);
 }
 
 
@@ -434,23 +474,10 @@ static void do_cpe510(const char *output, const char *kernel_image, const char *
 	parts[3] = read_file("os-image", kernel_image, false);
 	parts[4] = read_file("file-system", rootfs_image, add_jffs2_eof);
 
-	size_t len;
-	void *image;
 	if (sysupgrade)
-		image = generate_sysupgrade_image(cpe510_partitions, parts, &len);
+		generate_sysupgrade_image(output, cpe510_partitions, parts);
 	else
-		image = generate_factory_image(cpe510_vendor, sizeof(cpe510_vendor)-1, parts, &len);
-
-	FILE *file = fopen(output, "wb");
-	if (!file)
-		error(1, errno, "unable to open output file");
-
-	if (fwrite(image, len, 1, file) != 1)
-		error(1, 0, "unable to write output file");
-
-	fclose(file);
-
-	free(image);
+		generate_factory_image(output, cpe510_vendor, sizeof(cpe510_vendor)-1, parts);
 
 	size_t i;
 	for (i = 0; parts[i].name; i++)
@@ -24,7 +24,6 @@
  *
  * As an extension, you can specify a larger maximum length for the
  * .trx file using '-m'.  It will be rounded up to be a multiple of 4K.
- * NOTE: This space will be malloc()'d.
  *
  * August 16, 2004
  *
@@ -51,6 +50,8 @@
 #include <errno.h>
 #include <unistd.h>
 
+#include "fw_stream.h"
+
 #if __BYTE_ORDER == __BIG_ENDIAN
 #define STORE32_LE(X)		bswap_32(X)
 #define LOAD32_LE(X)		bswap_32(X)
@@ -61,7 +62,7 @@
 #error unkown endianness!
 #endif
 
-uint32_t crc32buf(char *buf, size_t len);
+uint32_t crc32buf(uint32_t crc, const uint8_t *buf, size_t len);
 
 /**********************************************************************/
 /* from trxhdr.h */
@@ -80,6 +81,146 @@ struct trx_header {
 
 /**********************************************************************/
 
+/*
+ * The image is not assembled in memory. Everything after the header is
+ * kept as a list of regions, either a piece of an input file or zero
+ * padding, which is checksummed from the mapped inputs and then copied
+ * to the output.
+ */
+struct trx_region {
+	struct fw_input *in;		/* NULL for zero padding */
+	uint32_t len;
+};
+
+static struct trx_region *regions;
+static int n_regions;
+
+static const uint8_t zeroes[0x1000];
+
+static void add_region(struct fw_input *in, uint32_t len)
+{
+	struct trx_region *r;
+
+	if (!len)
+		return;
+
+	if (n_regions && !in && !regions[n_regions - 1].in) {
+		regions[n_regions - 1].len += len;
+		return;
+	}
+
+	regions = realloc(regions, (n_regions + 1) * sizeof(*regions));
+	if (!regions) {
+		fprintf(stderr, "realloc failed\n");
+		exit(EXIT_FAILURE);
+	}
+
+	r = &regions[n_regions++];
+	r->in = in;
+	r->len = len;
+}
+
+/* drop everything past len, for negative -x offsets */
+static void truncate_regions(uint32_t len)
+{
+	uint32_t pos = 0;
+	int i;
+
+	for (i = 0; i < n_regions; i++) {
+		if (pos + regions[i].len >= len) {
+			regions[i].len = len - pos;
+			n_regions = regions[i].len ? i + 1 : i;
+			return;
+		}
+
+		pos += regions[i].len;
+	}
+}
+
+struct trx_crc {
+	uint32_t crc;
+	uint32_t end;			/* checksummed range is [flag_version, end) */
+	uint32_t ff_start;		/* TRXv2 bin-header flags, 0 if none */
+};
+
+/* for TRXv2 the bin-header flags are checksummed as 0xFF like CFE does */
+static void crc_data(struct trx_crc *c, uint32_t pos, const uint8_t *buf,
+		     uint32_t len)
+{
+	static const uint8_t ff[8] = {
+		0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff
+	};
+	uint32_t start = offsetof(struct trx_header, flag_version);
+	uint32_t a, b, n;
+
+	a = (pos > start) ? pos : start;
+	b = (pos + len < c->end) ? pos + len : c->end;
+
+	while (a < b) {
+		if (c->ff_start && a >= c->ff_start &&
+		    a < c->ff_start + sizeof(ff)) {
+			n = c->ff_start + sizeof(ff) - a;
+			if (n > b - a)
+				n = b - a;
+			c->crc = crc32buf(c->crc, ff, n);
+		} else {
+			n = b - a;
+			if (c->ff_start && a < c->ff_start && b > c->ff_start)
+				n = c->ff_start - a;
+			c->crc = crc32buf(c->crc, buf + (a - pos), n);
+		}
+		a += n;
+	}
+}
+
+static int write_regions(struct fw_stream *s)
+{
+	int i;
+
+	for (i = 0; i < n_regions; i++) {
+		struct trx_region *r = &regions[i];
+
+		if (r->in) {
+			if (fw_stream_copy(s, r->in, 0, r->len))
+				return -1;
+		} else {
+			if (fw_stream_fill(s, 0, r->len))
+				return -1;
+		}
+	}
+
+	return 0;
+}
+
+static int crc_regions(struct trx_crc *c, uint32_t pos)
+{
+	int i;
+
+	for (i = 0; i < n_regions && pos < c->end; i++) {
+		struct trx_region *r = &regions[i];
+		uint32_t ofs;
+
+		if (r->in) {
+			if (fw_input_map(r->in))
+				return -1;
+
+			crc_data(c, pos, r->in->map, r->len);
+		} else {
+			for (ofs = 0; ofs < r->len; ofs += sizeof(zeroes)) {
+				uint32_t n = r->len - ofs;
+
+				if (n > sizeof(zeroes))
+					n = sizeof(zeroes);
+				crc_data(c, pos + ofs, zeroes, n);
+			}
+		}
+
+		pos += r->len;
+	}
+
+	return 0;
+}
+
 void usage(void) __attribute__ (( __noreturn__ ));
 
 void usage(void)
@@ -92,31 +233,25 @@ void usage(void)
 
 int main(int argc, char **argv)
 {
-	FILE *out = stdout;
-	FILE *in;
-	char *ofn = NULL;
-	char *buf;
+	struct fw_stream out;
+	struct fw_input *in;
+	struct trx_header hdr;
+	struct trx_crc crc;
 	char *e;
 	int c, i, append = 0;
 	size_t n;
 	ssize_t n2;
-	uint32_t cur_len, fsmark=0;
+	uint32_t cur_len, hdr_len, fsmark=0;
 	unsigned long maxlen = TRX_MAX_LEN;
-	struct trx_header *p;
 	char trx_version = 1;
-	unsigned char binheader[32];
 
 	fprintf(stderr, "mjn3's trx replacement - v0.81.1\n");
 
-	if (!(buf = malloc(maxlen))) {
-		fprintf(stderr, "malloc failed\n");
-		return EXIT_FAILURE;
-	}
-
-	p = (struct trx_header *) buf;
+	fw_stream_open_fd(&out, "stdout", STDOUT_FILENO);
 
-	p->magic = STORE32_LE(TRX_MAGIC);
-	cur_len = sizeof(struct trx_header) - 4; /* assume v1 header */
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.magic = STORE32_LE(TRX_MAGIC);
+	cur_len = hdr_len = sizeof(struct trx_header) - 4; /* assume v1 header */
 
 	in = NULL;
 	i = 0;
@@ -124,13 +259,14 @@ int main(int argc, char **argv)
 	while ((c = getopt(argc, argv, "-:2o:m:a:x:b:f:A:F:")) != -1) {
 		switch (c) {
 			case '2':
-				/* take care that nothing was written to buf so far */
+				/* take care that nothing was added so far */
 				if (cur_len != sizeof(struct trx_header) - 4) {
 					fprintf(stderr, "-2 has to be used before any other argument!\n");
 				}
 				else {
 					trx_version = 2;
 					cur_len += 4;
+					hdr_len += 4;
 				}
 				break;
 			case 'F':
@@ -140,24 +276,31 @@ int main(int argc, char **argv)
 				/* fall through */
 			case 'f':
 			case 1:
-				if (!append)
-					p->offsets[i++] = STORE32_LE(cur_len);
+				if (!append) {
+					if (i >= 4) {
+						fprintf(stderr, "too many files\n");
+						usage();
+					}
+					hdr.offsets[i++] = STORE32_LE(cur_len);
+				}
 
-				if (!(in = fopen(optarg, "r"))) {
-					fprintf(stderr, "can not open \"%s\" for reading\n", optarg);
-					usage();
+				if (!(in = malloc(sizeof(*in)))) {
+					fprintf(stderr, "malloc failed\n");
+					return EXIT_FAILURE;
 				}
-				n = fread(buf + cur_len, 1, maxlen - cur_len, in);
-				if (!feof(in)) {
-					fprintf(stderr, "fread failure or file \"%s\" too large\n",optarg);
-					fclose(in);
+				if (fw_input_open(in, optarg))
+					usage();
+
+				n = in->size;
+				if (n > maxlen - cur_len) {
+					fprintf(stderr, "file \"%s\" too large\n",optarg);
 					return EXIT_FAILURE;
 				}
-				fclose(in);
+				add_region(in, n);
 #undef  ROUND
 #define ROUND 4
 				if (n & (ROUND-1)) {
-					memset(buf + cur_len + n, 0, ROUND - (n & (ROUND-1)));
+					add_region(NULL, ROUND - (n & (ROUND-1)));
 					n += ROUND - (n & (ROUND-1));
 				}
 				cur_len += n;
@@ -165,11 +308,8 @@ int main(int argc, char **argv)
 
 				break;
 			case 'o':
-				ofn = optarg;
-				if (ofn && !(out = fopen(ofn, "w"))) {
-					fprintf(stderr, "can not open \"%s\" for writing\n", ofn);
+				if (fw_stream_open(&out, optarg))
 					usage();
-				}
 
 				break;
 			case 'm':
@@ -191,11 +331,6 @@ int main(int argc, char **argv)
 				if (maxlen > TRX_MAX_LEN) {
 					fprintf(stderr, "WARNING: maxlen exceeds default maximum!  Beware of overwriting nvram!\n");
 				}
-				if (!(buf = realloc(buf,maxlen))) {
-					fprintf(stderr, "realloc failed");
-					return EXIT_FAILURE;
-				}
-				p = (struct trx_header *) buf;
 				break;
 			case 'a':
 				errno = 0;
@@ -206,7 +341,7 @@ int main(int argc, char **argv)
 				}
 				if (cur_len & (n-1)) {
 					n = n - (cur_len & (n-1));
-					memset(buf + cur_len, 0, n);
+					add_region(NULL, n);
 					cur_len += n;
 				}
 				break;
@@ -220,7 +355,7 @@ int main(int argc, char **argv)
 				if (n < cur_len) {
 					fprintf(stderr, "WARNING: current length exceeds -b %d offset\n",(int) n);
 				} else {
-					memset(buf + cur_len, 0, n - cur_len);
+					add_region(NULL, n - cur_len);
 					cur_len = n;
 				}
 				break;
@@ -232,13 +367,14 @@ int main(int argc, char **argv)
 					usage();
 				}
 				if (n2 < 0) {
-					if (-n2 > cur_len) {
-						fprintf(stderr, "WARNING: current length smaller then -x %d offset\n",(int) n2);
-						cur_len = 0;
-					} else
-						cur_len += n2;
+					if (-n2 > cur_len - hdr_len) {
+						fprintf(stderr, "-x %d offset rewinds into the trx header\n",(int) n2);
+						usage();
+					}
+					cur_len += n2;
+					truncate_regions(cur_len - hdr_len);
 				} else {
-					memset(buf + cur_len, 0, n2);
+					add_region(NULL, n2);
 					cur_len += n2;
 				}
 
@@ -247,7 +383,7 @@ int main(int argc, char **argv)
 				usage();
 		}
 	}
-	p->flag_version = STORE32_LE((trx_version << 16));
+	hdr.flag_version = STORE32_LE((trx_version << 16));
 
 	if (!in) {
 		fprintf(stderr, "we require atleast one filename\n");
@@ -258,38 +394,35 @@ int main(int argc, char **argv)
 #define ROUND 0x1000
 	n = cur_len & (ROUND-1);
 	if (n) {
-		memset(buf + cur_len, 0, ROUND - n);
+		add_region(NULL, ROUND - n);
 		cur_len += ROUND - n;
 	}
 
-	/* for TRXv2 set bin-header Flags to 0xFF for CRC calculation like CFE does */
+	crc.crc = 0xFFFFFFFF;
+	crc.end = (fsmark) ? fsmark : cur_len;
+	crc.ff_start = 0;
+
 	if (trx_version == 2) {
-		if(cur_len - LOAD32_LE(p->offsets[3]) < sizeof(binheader)) {
+		if(cur_len - LOAD32_LE(hdr.offsets[3]) < 32) {
 			fprintf(stderr, "TRXv2 binheader too small!\n");
 			return EXIT_FAILURE;
 		}
-		memcpy(binheader, buf + LOAD32_LE(p->offsets[3]), sizeof(binheader)); /* save header */
-		memset(buf + LOAD32_LE(p->offsets[3]) + 22, 0xFF, 8); /* set stable and try1-3 to 0xFF */
+		crc.ff_start = LOAD32_LE(hdr.offsets[3]) + 22; /* stable and try1-3 */
 	}
 
-	p->crc32 = crc32buf((char *) &p->flag_version,
-						((fsmark)?fsmark:cur_len) - offsetof(struct trx_header, flag_version));
-	p->crc32 = STORE32_LE(p->crc32);
-
-	p->len = STORE32_LE((fsmark) ? fsmark : cur_len);
+	crc_data(&crc, 0, (uint8_t *) &hdr, hdr_len);
+	if (crc_regions(&crc, hdr_len))
+		return EXIT_FAILURE;
 
-	/* restore TRXv2 bin-header */
-	if (trx_version == 2) {
-		memcpy(buf + LOAD32_LE(p->offsets[3]), binheader, sizeof(binheader));
-	}
+	hdr.crc32 = STORE32_LE(crc.crc);
+	hdr.len = STORE32_LE((fsmark) ? fsmark : cur_len);
 
-	if (!fwrite(buf, cur_len, 1, out) || fflush(out)) {
-		fprintf(stderr, "fwrite failed\n");
+	if (fw_stream_write(&out, &hdr, hdr_len) || write_regions(&out) ||
+	    fw_stream_close(&out)) {
+		fprintf(stderr, "write failed\n");
 		return EXIT_FAILURE;
 	}
 
-	fclose(out);
-
 	return EXIT_SUCCESS;
 }
 
@@ -403,12 +536,8 @@ static const uint32_t crc_32_tab[] = { /* CRC polynomial 0xedb88320 */
 
 #define UPDC32(octet,crc) (crc_32_tab[((crc) ^ (octet)) & 0xff] ^ ((crc) >> 8))
 
-uint32_t crc32buf(char *buf, size_t len)
+uint32_t crc32buf(uint32_t crc, const uint8_t *buf, size_t len)
 {
-      uint32_t crc;
-
-      crc = 0xFFFFFFFF;
-
       for ( ; len; --len, ++buf)
       {
             crc = UPDC32(*buf, crc);
@@ -0,0 +1,452 @@
+/*
+ * ecctest - check the yaffs ECC and erased-page code against the old
+ *           byte-wise versions
+ *
+ * Copyright (C) 2015 OpenWrt.org
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as published
+ * by the Free Software Foundation.
+ *
+ * yaffs_ecc_calc() and yaffs_check_ff() work a word at a time where the
+ * buffer allows it.  The ECC ends up in the OOB of every yaffs1 page, so
+ * it has to stay bit for bit what the byte loops used to produce.  This
+ * runs both over fixed and random blocks at every alignment, checks that
+ * yaffs_ecc_correct() still repairs single bit errors, and with -b times
+ * the old and new code.
+ */
+
+#include "yportenv.h"
+#include "yaffs_guts.h"
+#include "yaffs_ecc.h"
+#include "yaffs_trace.h"
+
+#include <libgen.h>
+#include <time.h>
+#include <unistd.h>
+
+unsigned int yaffs_trace_mask = YAFFS_TRACE_ALWAYS;
+unsigned int yaffs_wr_attempts = YAFFS_WR_ATTEMPTS;
+long yhost_time;
+
+static char *progname;
+static int failures;
+
+#define FAIL(fmt, ...) do { \
+	fprintf(stderr, "[%s] *** fail: " fmt "\n", \
+			progname, ## __VA_ARGS__ ); \
+	failures++; \
+} while (0)
+
+#define BLOCK_SIZE	256
+#define RANDOM_ROUNDS	4096
+
+/*
+ * The reference code: the column parity table as the definition of the
+ * SmartMedia ECC has it (bits 7..2 are p4 p4' p2 p2' p1 p1', bit 0 the
+ * parity of the whole byte), and the byte loops yaffs used before.
+ */
+static unsigned char ref_table[256];
+
+static void ref_init(void)
+{
+	int b;
+
+	for (b = 0; b < 256; b++) {
+		unsigned char t = 0;
+
+		if (hweight8(b & 0xf0) & 1)
+			t |= 0x80;
+		if (hweight8(b & 0x0f) & 1)
+			t |= 0x40;
+		if (hweight8(b & 0xcc) & 1)
+			t |= 0x20;
+		if (hweight8(b & 0x33) & 1)
+			t |= 0x10;
+		if (hweight8(b & 0xaa) & 1)
+			t |= 0x08;
+		if (hweight8(b & 0x55) & 1)
+			t |= 0x04;
+		if (hweight8(b) & 1)
+			t |= 0x01;
+		ref_table[b] = t;
+	}
+}
+
+static void ref_ecc_calc(const unsigned char *data, unsigned char *ecc)
+{
+	unsigned int i;
+	unsigned char col_parity = 0;
+	unsigned char line_parity = 0;
+	unsigned char line_parity_prime = 0;
+	unsigned char t;
+	unsigned char b;
+
+	for (i = 0; i < BLOCK_SIZE; i++) {
+		b = ref_table[*data++];
+		col_parity ^= b;
+
+		if (b & 0x01) {
+			line_parity ^= i;
+			line_parity_prime ^= ~i;
+		}
+	}
+
+	ecc[2] = (~col_parity) | 0x03;
+
+	t = 0;
+	for (i = 0; i < 4; i++) {
+		if (line_parity & (0x80 >> i))
+			t |= 0x80 >> (2 * i);
+		if (line_parity_prime & (0x80 >> i))
+			t |= 0x40 >> (2 * i);
+	}
+	ecc[1] = ~t;
+
+	t = 0;
+	for (i = 0; i < 4; i++) {
+		if (line_parity & (0x08 >> i))
+			t |= 0x80 >> (2 * i);
+		if (line_parity_prime & (0x08 >> i))
+			t |= 0x40 >> (2 * i);
+	}
+	ecc[0] = ~t;
+}
+
+static int ref_check_ff(const u8 *buffer, int n_bytes)
+{
+	while (n_bytes--) {
+		if (*buffer != 0xff)
+			return 0;
+		buffer++;
+	}
+	return 1;
+}
+
+/* xorshift, so every run sees the same "random" blocks */
+static u32 rnd_state = 2463534242u;
+
+static u32 rnd(void)
+{
+	rnd_state ^= rnd_state << 13;
+	rnd_state ^= rnd_state >> 17;
+	rnd_state ^= rnd_state << 5;
+	return rnd_state;
+}
+
+static void rnd_fill(u8 *buf, int n)
+{
+	while (n--)
+		*buf++ = rnd();
+}
+
+/* room for a block at any offset within a word */
+static unsigned long space[(BLOCK_SIZE + 4 * sizeof(long)) / sizeof(long)];
+
+static u8 *block_at(unsigned int offset)
+{
+	return (u8 *)space + offset;
+}
+
+static int check_ecc(const u8 *data, const char *what, unsigned int offset)
+{
+	unsigned char ecc[3];
+	unsigned char ref[3];
+
+	yaffs_ecc_calc(data, ecc);
+	ref_ecc_calc(data, ref);
+	if (memcmp(ecc, ref, sizeof(ecc))) {
+		FAIL("%s at offset %u: ecc %02x %02x %02x, expected %02x %02x %02x",
+		     what, offset, ecc[0], ecc[1], ecc[2],
+		     ref[0], ref[1], ref[2]);
+		return 0;
+	}
+	return 1;
+}
+
+/* Known answers, from the byte-wise yaffs_ecc_calc() */
+static const struct {
+	const char *name;
+	unsigned char ecc[3];
+} fixed_vectors[] = {
+	{ "zeroes",		{ 0xff, 0xff, 0xff } },
+	{ "ones",		{ 0xff, 0xff, 0xff } },
+	{ "ramp",		{ 0xff, 0xff, 0xff } },
+	{ "down ramp",		{ 0xff, 0xff, 0xff } },
+	{ "0x55",		{ 0xff, 0xff, 0xff } },
+	{ "0xaa",		{ 0xff, 0xff, 0xff } },
+	{ "first bit",		{ 0xaa, 0xaa, 0xab } },
+	{ "last bit",		{ 0x55, 0x55, 0x57 } },
+	{ "bit 0x5a.3",		{ 0x66, 0x99, 0x97 } },
+	{ "mixed",		{ 0xff, 0x3f, 0xff } },
+};
+
+static void fixed_fill(int k, u8 *d)
+{
+	int i;
+
+	memset(d, 0, BLOCK_SIZE);
+	switch (k) {
+	case 1:
+		memset(d, 0xff, BLOCK_SIZE);
+		break;
+	case 2:
+		for (i = 0; i < BLOCK_SIZE; i++)
+			d[i] = i;
+		break;
+	case 3:
+		for (i = 0; i < BLOCK_SIZE; i++)
+			d[i] = 255 - i;
+		break;
+	case 4:
+		memset(d, 0x55, BLOCK_SIZE);
+		break;
+	case 5:
+		memset(d, 0xaa, BLOCK_SIZE);
+		break;
+	case 6:
+		d[0] = 0x01;
+		break;
+	case 7:
+		d[255] = 0x80;
+		break;
+	case 8:
+		d[0x5a] = 0x08;
+		break;
+	case 9:
+		for (i = 0; i < BLOCK_SIZE; i++)
+			d[i] = (i * 37 + 11) ^ (i >> 3);
+		break;
+	}
+}
+
+static void test_fixed(void)
+{
+	unsigned int offset;
+	unsigned char ecc[3];
+	u8 *data;
+	int k;
+
+	for (k = 0; k < (int)ARRAY_SIZE(fixed_vectors); k++) {
+		for (offset = 0; offset < sizeof(long); offset++) {
+			data = block_at(offset);
+			fixed_fill(k, data);
+
+			ref_ecc_calc(data, ecc);
+			if (memcmp(ecc, fixed_vectors[k].ecc, sizeof(ecc)))
+				FAIL("reference is off for %s",
+				     fixed_vectors[k].name);
+			check_ecc(data, fixed_vectors[k].name, offset);
+		}
+	}
+}
+
+static void test_random(void)
+{
+	unsigned int offset;
+	u8 *data;
+	int i;
+
+	for (i = 0; i < RANDOM_ROUNDS; i++) {
+		offset = i % sizeof(long);
+		data = block_at(offset);
+		rnd_fill(data, BLOCK_SIZE);
+		check_ecc(data, "random block", offset);
+
+		/* sparse blocks hit the line parities one byte at a time */
+		memset(data, i & 1 ? 0xff : 0, BLOCK_SIZE);
+		data[rnd() % BLOCK_SIZE] ^= 1 << (rnd() % 8);
+		data[rnd() % BLOCK_SIZE] ^= 1 << (rnd() % 8);
+		check_ecc(data, "sparse block", offset);
+	}
+}
+
+static void test_correct(void)
+{
+	u8 good[BLOCK_SIZE];
+	unsigned char read_ecc[3];
+	unsigned char test_ecc[3];
+	unsigned int offset;
+	int bit, bit2;
+	u8 *data;
+	int ret;
+
+	rnd_fill(good, sizeof(good));
+
+	/* every single data bit */
+	for (bit = 0; bit < BLOCK_SIZE * 8; bit++) {
+		offset = bit % sizeof(long);
+		data = block_at(offset);
+		memcpy(data, good, BLOCK_SIZE);
+		yaffs_ecc_calc(data, read_ecc);
+
+		data[bit / 8] ^= 1 << (bit % 8);
+		yaffs_ecc_calc(data, test_ecc);
+		ret = yaffs_ecc_correct(data, read_ecc, test_ecc);
+		if (ret != 1 || memcmp(data, good, BLOCK_SIZE))
+			FAIL("data bit %d at offset %u: returned %d%s", bit,
+			     offset, ret, memcmp(data, good, BLOCK_SIZE) ?
+			     ", data not repaired" : "");
+	}
+
+	/* every ECC bit that carries parity, the low two of ecc[2] don't */
+	for (bit = 0; bit < 22; bit++) {
+		data = block_at(0);
+		memcpy(data, good, BLOCK_SIZE);
+		yaffs_ecc_calc(data, read_ecc);
+		yaffs_ecc_calc(data, test_ecc);
+
+		read_ecc[bit / 8] ^= 1 << (7 - bit % 8);
+		ret = yaffs_ecc_correct(data, read_ecc, test_ecc);
+		if (ret != 1 || memcmp(data, good, BLOCK_SIZE))
+			FAIL("ecc bit %d: returned %d", bit, ret);
+	}
+
+	/* two data bits are beyond it */
+	for (bit = 0; bit < RANDOM_ROUNDS; bit++) {
+		int a = rnd() % (BLOCK_SIZE * 8);
+
+		do {
+			bit2 = rnd() % (BLOCK_SIZE * 8);
+		} while (bit2 == a);
+
+		data = block_at(bit % sizeof(long));
+		memcpy(data, good, BLOCK_SIZE);
+		yaffs_ecc_calc(data, read_ecc);
+
+		data[a / 8] ^= 1 << (a % 8);
+		data[bit2 / 8] ^= 1 << (bit2 % 8);
+		yaffs_ecc_calc(data, test_ecc);
+		ret = yaffs_ecc_correct(data, read_ecc, test_ecc);
+		if (ret != -1)
+			FAIL("data bits %d and %d: returned %d", a, bit2, ret);
+	}
+}
+
+static void test_check_ff(void)
+{
+	static u8 buf[2 * BLOCK_SIZE + 4 * sizeof(long)];
+	int offset, len, pos, i;
+
+	for (i = 0; i < RANDOM_ROUNDS; i++) {
+		offset = rnd() % (2 * sizeof(long));
+		len = rnd() % (2 * BLOCK_SIZE + 1);
+
+		memset(buf, 0xff, sizeof(buf));
+		if (i & 1) {
+			/* a non-0xff byte in or just around the range */
+			pos = offset + (int)(rnd() % (len + 2)) - 1;
+			if (pos < 0)
+				pos = 0;
+			buf[pos] = rnd() % 0xff;
+		}
+
+		if (yaffs_check_ff(buf + offset, len) !=
+		    ref_check_ff(buf + offset, len))
+			FAIL("check_ff offset %d length %d: returned %d",
+			     offset, len, yaffs_check_ff(buf + offset, len));
+	}
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void bench(int rounds)
+{
+	unsigned char ecc[3];
+	unsigned int sum = 0;
+	double t;
+	u8 *data;
+	int i;
+
+	data = block_at(0);
+	rnd_fill(data, BLOCK_SIZE);
+
+	t = now();
+	for (i = 0; i < rounds; i++) {
+		data[0] = i;
+		ref_ecc_calc(data, ecc);
+		sum += ecc[0];
+	}
+	t = now() - t;
+	printf("ecc_calc byte-wise  %8.1f ns/block\n", t * 1e9 / rounds);
+
+	t = now();
+	for (i = 0; i < rounds; i++) {
+		data[0] = i;
+		yaffs_ecc_calc(data, ecc);
+		sum += ecc[0];
+	}
+	t = now() - t;
+	printf("ecc_calc            %8.1f ns/block\n", t * 1e9 / rounds);
+
+	memset(data, 0xff, BLOCK_SIZE);
+	t = now();
+	for (i = 0; i < rounds; i++)
+		sum += ref_check_ff(data, BLOCK_SIZE);
+	t = now() - t;
+	printf("check_ff byte-wise  %8.1f ns/block\n", t * 1e9 / rounds);
+
+	t = now();
+	for (i = 0; i < rounds; i++)
+		sum += yaffs_check_ff(data, BLOCK_SIZE);
+	t = now() - t;
+	printf("check_ff            %8.1f ns/block\n", t * 1e9 / rounds);
+
+	/* keep the loops from being thrown away */
+	if (sum == 1)
+		printf("\n");
+}
+
+static void usage(void)
+{
+	fprintf(stderr,
+		"Usage: %s [-b <rounds>]\n"
+		"\n"
+		"Checks yaffs_ecc_calc(), yaffs_ecc_correct() and yaffs_check_ff()\n"
+		"against the byte-wise reference code.\n"
+		"\n"
+		"  -b <rounds>  also time the old and new code over <rounds> blocks\n",
+		progname);
+	exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+	int rounds = 0;
+	int c;
+
+	progname = basename(argv[0]);
+
+	while ((c = getopt(argc, argv, "b:")) != -1) {
+		switch (c) {
+		case 'b':
+			rounds = atoi(optarg);
+			break;
+		default:
+			usage();
+		}
+	}
+
+	ref_init();
+	test_fixed();
+	test_random();
+	test_correct();
+	test_check_ff();
+
+	if (failures) {
+		fprintf(stderr, "[%s] %d failures\n", progname, failures);
+		return 1;
+	}
+	printf("[%s] all tests passed\n", progname);
+
+	if (rounds > 0)
+		bench(rounds);
+
+	return 0;
+}
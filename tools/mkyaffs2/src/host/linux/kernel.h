@@ -0,0 +1 @@
+#include "../yhost.h"
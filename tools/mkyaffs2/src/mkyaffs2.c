@@ -0,0 +1,1283 @@
+/*
+ * mkyaffs2 - build and check yaffs2 images with the kernel's yaffs code
+ *
+ * Copyright (C) 2015 OpenWrt.org
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as published
+ * by the Free Software Foundation.
+ *
+ * The image is made by running the in-tree yaffs core against a NAND
+ * model held in memory, the same way the kernel would fill a freshly
+ * erased partition, so it carries block summaries and a checkpoint and
+ * the first mount on the target does not have to scan.
+ *
+ * Every page in the image is the page data followed by the OOB area,
+ * with the yaffs tags at the start of the OOB.  That is the layout
+ * "nandwrite -a -o" expects: the kernel driver places tags in the free
+ * OOB bytes (MTD_OPS_AUTO_OOB) and leaves the ECC to the NAND driver.
+ */
+
+#include "yportenv.h"
+#include "yaffs_guts.h"
+#include "yaffs_packedtags2.h"
+#include "yaffs_trace.h"
+
+#include <fcntl.h>
+#include <libgen.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/time.h>
+#ifdef __linux__
+#include <sys/sysmacros.h>
+#endif
+
+unsigned int yaffs_trace_mask = YAFFS_TRACE_ALWAYS;
+unsigned int yaffs_wr_attempts = YAFFS_WR_ATTEMPTS;
+long yhost_time;
+
+static char *progname;
+
+#define ERR(fmt, ...) do { \
+	fflush(0); \
+	fprintf(stderr, "[%s] *** error: " fmt "\n", \
+			progname, ## __VA_ARGS__ ); \
+} while (0)
+
+#define ERRS(fmt, ...) do { \
+	int save = errno; \
+	fflush(0); \
+	fprintf(stderr, "[%s] *** error: " fmt ", %s\n", \
+			progname, ## __VA_ARGS__, strerror(save)); \
+} while (0)
+
+#define IO_BUF_SIZE	(64 * 1024)
+#define LINK_HASH_SIZE	256
+
+struct options {
+	unsigned int page_size;
+	unsigned int oob_size;
+	unsigned int oob_avail;
+	unsigned int block_size;
+	unsigned long long part_size;
+	int inband_tags;
+	int no_tags_ecc;
+	int no_summary;
+	int no_checkpoint;
+	int squash_owner;
+	int full_size;
+	int check;
+	int bench;
+	int verbose;
+	int have_time;
+	long fixed_time;
+	int have_epoch;
+	long epoch;
+	int have_endian;
+	int big_endian;
+};
+
+static struct options opts = {
+	.page_size = 2048,
+	.oob_size = 64,
+	.block_size = 128 * 1024,
+	.bench = 1,
+};
+
+/*
+ * NAND model: the whole partition, one page after the other, each page
+ * stored as data + OOB exactly as it goes into the image file.
+ */
+struct nand {
+	unsigned int page_size;
+	unsigned int oob_size;
+	unsigned int pages_per_block;
+	unsigned int n_blocks;
+	size_t stride;
+	size_t size;
+	u8 *mem;
+	unsigned long page_reads;
+	unsigned long page_writes;
+	unsigned long erases;
+};
+
+static u8 *nand_page(struct nand *nand, int chunk)
+{
+	return nand->mem + (size_t)chunk * nand->stride;
+}
+
+static int nand_write_chunk(struct yaffs_dev *dev, int nand_chunk,
+			    const u8 *data, int data_len,
+			    const u8 *oob, int oob_len)
+{
+	struct nand *nand = dev->driver_context;
+	u8 *page = nand_page(nand, nand_chunk);
+
+	if (data_len > (int)nand->page_size || oob_len > (int)nand->oob_size)
+		return YAFFS_FAIL;
+
+	if (data)
+		memcpy(page, data, data_len);
+	if (oob)
+		memcpy(page + nand->page_size, oob, oob_len);
+	nand->page_writes++;
+	return YAFFS_OK;
+}
+
+static int nand_read_chunk(struct yaffs_dev *dev, int nand_chunk,
+			   u8 *data, int data_len, u8 *oob, int oob_len,
+			   enum yaffs_ecc_result *ecc_result)
+{
+	struct nand *nand = dev->driver_context;
+	u8 *page = nand_page(nand, nand_chunk);
+
+	if (data_len > (int)nand->page_size || oob_len > (int)nand->oob_size)
+		return YAFFS_FAIL;
+
+	if (data)
+		memcpy(data, page, data_len);
+	if (oob)
+		memcpy(oob, page + nand->page_size, oob_len);
+	if (ecc_result)
+		*ecc_result = YAFFS_ECC_RESULT_NO_ERROR;
+	nand->page_reads++;
+	return YAFFS_OK;
+}
+
+static int nand_read_oob(struct yaffs_dev *dev, int nand_chunk, int n_chunks,
+			 u8 *oob, int oob_len,
+			 enum yaffs_ecc_result *ecc_result)
+{
+	struct nand *nand = dev->driver_context;
+	int i;
+
+	*ecc_result = YAFFS_ECC_RESULT_NO_ERROR;
+	if (oob_len > (int)nand->oob_size)
+		return YAFFS_FAIL;
+
+	for (i = 0; i < n_chunks; i++)
+		memcpy(oob + i * oob_len,
+		       nand_page(nand, nand_chunk + i) + nand->page_size,
+		       oob_len);
+	nand->page_reads += n_chunks;
+	return YAFFS_OK;
+}
+
+static int nand_erase(struct yaffs_dev *dev, int block_no)
+{
+	struct nand *nand = dev->driver_context;
+
+	memset(nand_page(nand, block_no * nand->pages_per_block), 0xff,
+	       nand->pages_per_block * nand->stride);
+	nand->erases++;
+	return YAFFS_OK;
+}
+
+static int nand_mark_bad(struct yaffs_dev *dev, int block_no)
+{
+	ERR("yaffs tried to mark block %d bad", block_no);
+	return YAFFS_OK;
+}
+
+static int nand_check_bad(struct yaffs_dev *dev, int block_no)
+{
+	return YAFFS_OK;
+}
+
+static int nand_init(struct nand *nand)
+{
+	nand->page_size = opts.page_size;
+	nand->oob_size = opts.oob_size;
+	nand->pages_per_block = opts.block_size / opts.page_size;
+	nand->n_blocks = opts.part_size / opts.block_size;
+	nand->stride = nand->page_size + nand->oob_size;
+	nand->size = (size_t)nand->n_blocks * nand->pages_per_block *
+		     nand->stride;
+
+	nand->mem = malloc(nand->size);
+	if (!nand->mem) {
+		ERR("no memory for a %zu byte NAND image", nand->size);
+		return -1;
+	}
+	memset(nand->mem, 0xff, nand->size);
+	return 0;
+}
+
+/*
+ * yaffs writes its object headers, tags, summaries and checkpoint as the
+ * CPU lays them out, bitfields included, so an image only mounts on a
+ * target with the byte order of the host that made it.
+ */
+static int host_big_endian(void)
+{
+	const u16 one = 1;
+
+	return *(const u8 *)&one == 0;
+}
+
+static const char *endian_name(int big)
+{
+	return big ? "big" : "little";
+}
+
+static int block_is_erased(struct nand *nand, unsigned int block)
+{
+	size_t len = nand->pages_per_block * nand->stride;
+	const u8 *p = nand_page(nand, block * nand->pages_per_block);
+
+	return p[0] == 0xff && !memcmp(p, p + 1, len - 1);
+}
+
+/* Set up the device the way yaffs_internal_read_super() does. */
+static void setup_dev(struct yaffs_dev *dev, struct nand *nand)
+{
+	struct yaffs_param *param = &dev->param;
+
+	memset(dev, 0, sizeof(*dev));
+	dev->driver_context = nand;
+
+	param->name = progname;
+	param->total_bytes_per_chunk = nand->page_size;
+	param->chunks_per_block = nand->pages_per_block;
+	param->start_block = 0;
+	param->end_block = nand->n_blocks - 1;
+	param->n_reserved_blocks = 5;
+	param->n_caches = 10;
+	param->is_yaffs2 = 1;
+	param->inband_tags = opts.inband_tags;
+	param->no_tags_ecc = opts.no_tags_ecc;
+	param->use_nand_ecc = 1;
+	param->enable_xattr = 1;
+	param->defered_dir_update = 1;
+	param->empty_lost_n_found = 1;
+	param->refresh_period = 500;
+	param->disable_summary = opts.no_summary;
+
+	dev->drv.drv_write_chunk_fn = nand_write_chunk;
+	dev->drv.drv_read_chunk_fn = nand_read_chunk;
+	dev->drv.drv_read_oob_fn = nand_read_oob;
+	dev->drv.drv_erase_fn = nand_erase;
+	dev->drv.drv_mark_bad_fn = nand_mark_bad;
+	dev->drv.drv_check_bad_fn = nand_check_bad;
+}
+
+static long obj_time(const struct stat *st)
+{
+	if (opts.have_time)
+		return opts.fixed_time;
+	if (opts.have_epoch && st->st_mtime > opts.epoch)
+		return opts.epoch;
+	return st->st_mtime;
+}
+
+/*
+ * yaffs stores device numbers the way the kernel's yaffs_mknod() hands
+ * them over, with old_encode_dev().
+ */
+static int encode_rdev(dev_t rdev, u32 *val)
+{
+	if (major(rdev) > 0xff || minor(rdev) > 0xff)
+		return -1;
+	*val = (major(rdev) << 8) | minor(rdev);
+	return 0;
+}
+
+/* Building */
+
+struct link_ent {
+	dev_t dev;
+	ino_t ino;
+	struct yaffs_obj *obj;
+	struct link_ent *next;
+};
+
+static struct link_ent *links[LINK_HASH_SIZE];
+static u8 *io_buf;
+
+static struct link_ent **link_bucket(const struct stat *st)
+{
+	return &links[(st->st_ino ^ st->st_dev) % LINK_HASH_SIZE];
+}
+
+static struct yaffs_obj *find_link(const struct stat *st)
+{
+	struct link_ent *l;
+
+	for (l = *link_bucket(st); l; l = l->next)
+		if (l->ino == st->st_ino && l->dev == st->st_dev)
+			return l->obj;
+	return NULL;
+}
+
+static int remember_link(const struct stat *st, struct yaffs_obj *obj)
+{
+	struct link_ent **bucket = link_bucket(st);
+	struct link_ent *l;
+
+	l = malloc(sizeof(*l));
+	if (!l) {
+		ERR("no memory for hard link table");
+		return -1;
+	}
+	l->dev = st->st_dev;
+	l->ino = st->st_ino;
+	l->obj = obj;
+	l->next = *bucket;
+	*bucket = l;
+	return 0;
+}
+
+static int skip_dots(const struct dirent *d)
+{
+	return strcmp(d->d_name, ".") && strcmp(d->d_name, "..");
+}
+
+/* Plain byte order, so the image doesn't depend on the build locale. */
+static int name_cmp(const struct dirent **a, const struct dirent **b)
+{
+	return strcmp((*a)->d_name, (*b)->d_name);
+}
+
+static int copy_file(struct yaffs_obj *obj, const char *path)
+{
+	loff_t offset = 0;
+	ssize_t n;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		ERRS("unable to open %s", path);
+		return -1;
+	}
+
+	while ((n = read(fd, io_buf, IO_BUF_SIZE)) > 0) {
+		if (yaffs_wr_file(obj, io_buf, offset, n, 0) != n) {
+			ERR("%s: image is full", path);
+			close(fd);
+			return -1;
+		}
+		offset += n;
+	}
+	if (n < 0) {
+		ERRS("unable to read %s", path);
+		close(fd);
+		return -1;
+	}
+	close(fd);
+
+	if (yaffs_flush_file(obj, 0, 0) != YAFFS_OK) {
+		ERR("%s: image is full", path);
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Directory headers are rewritten once, from the dirty list, after all
+ * of their entries exist.  Put the source directory's time on them
+ * first; creating the entries set it to theirs.
+ */
+static void set_dir_time(struct yaffs_obj *obj, long t)
+{
+	struct yaffs_dev *dev = obj->my_dev;
+	struct list_head *dirty = &obj->variant.dir_variant.dirty;
+
+	if (obj->yst_mtime == t && obj->yst_ctime == t && !obj->dirty)
+		return;
+
+	obj->yst_atime = t;
+	obj->yst_mtime = t;
+	obj->yst_ctime = t;
+	obj->dirty = 1;
+	if (list_empty(dirty))
+		list_add(dirty, &dev->dirty_dirs);
+}
+
+static int add_dir(struct yaffs_dev *dev, struct yaffs_obj *dir,
+		   const char *path);
+
+static int add_entry(struct yaffs_dev *dev, struct yaffs_obj *dir,
+		     const char *dir_path, const char *name)
+{
+	char path[PATH_MAX];
+	char target[YAFFS_MAX_ALIAS_LENGTH + 2];
+	struct yaffs_obj *obj = NULL;
+	struct stat st;
+	u32 uid, gid, rdev;
+	ssize_t len;
+
+	if (snprintf(path, sizeof(path), "%s/%s", dir_path, name) >=
+	    (int)sizeof(path)) {
+		ERR("path too long: %s/%s", dir_path, name);
+		return -1;
+	}
+
+	if (lstat(path, &st)) {
+		ERRS("unable to stat %s", path);
+		return -1;
+	}
+
+	/* yaffs provides its own lost+found in the root directory */
+	if (dir == yaffs_root(dev) && !strcmp(name, YAFFS_LOSTNFOUND_NAME)) {
+		if (opts.verbose)
+			fprintf(stderr, "skipping %s\n", path);
+		return 0;
+	}
+
+	if (strlen(name) > YAFFS_MAX_NAME_LENGTH) {
+		ERR("name too long: %s", path);
+		return -1;
+	}
+
+	uid = opts.squash_owner ? 0 : st.st_uid;
+	gid = opts.squash_owner ? 0 : st.st_gid;
+	yhost_time = obj_time(&st);
+
+	if (!S_ISDIR(st.st_mode) && st.st_nlink > 1) {
+		struct yaffs_obj *equiv = find_link(&st);
+
+		if (equiv) {
+			if (!yaffs_link_obj(dir, name, equiv)) {
+				ERR("unable to link %s", path);
+				return -1;
+			}
+			return 0;
+		}
+	}
+
+	if (S_ISDIR(st.st_mode)) {
+		obj = yaffs_create_dir(dir, name, st.st_mode, uid, gid);
+		if (obj) {
+			if (add_dir(dev, obj, path))
+				return -1;
+			set_dir_time(obj, obj_time(&st));
+		}
+	} else if (S_ISREG(st.st_mode)) {
+		obj = yaffs_create_file(dir, name, st.st_mode, uid, gid);
+		if (obj && copy_file(obj, path))
+			return -1;
+	} else if (S_ISLNK(st.st_mode)) {
+		len = readlink(path, target, sizeof(target));
+		if (len < 0) {
+			ERRS("unable to read link %s", path);
+			return -1;
+		}
+		if (len > YAFFS_MAX_ALIAS_LENGTH) {
+			ERR("link target too long: %s", path);
+			return -1;
+		}
+		target[len] = 0;
+		obj = yaffs_create_symlink(dir, name, st.st_mode, uid, gid,
+					   target);
+	} else if (S_ISCHR(st.st_mode) || S_ISBLK(st.st_mode) ||
+		   S_ISFIFO(st.st_mode) || S_ISSOCK(st.st_mode)) {
+		if (encode_rdev(st.st_rdev, &rdev)) {
+			ERR("%s: device number doesn't fit", path);
+			return -1;
+		}
+		obj = yaffs_create_special(dir, name, st.st_mode, uid, gid,
+					   rdev);
+	} else {
+		ERR("%s: unsupported file type", path);
+		return -1;
+	}
+
+	if (!obj) {
+		ERR("unable to create %s: image is full", path);
+		return -1;
+	}
+
+	if (!S_ISDIR(st.st_mode) && st.st_nlink > 1)
+		return remember_link(&st, obj);
+
+	return 0;
+}
+
+static int add_dir(struct yaffs_dev *dev, struct yaffs_obj *dir,
+		   const char *path)
+{
+	struct dirent **list;
+	int ret = 0;
+	int n, i;
+
+	n = scandir(path, &list, skip_dots, name_cmp);
+	if (n < 0) {
+		ERRS("unable to read directory %s", path);
+		return -1;
+	}
+
+	for (i = 0; i < n; i++) {
+		if (!ret)
+			ret = add_entry(dev, dir, path, list[i]->d_name);
+		free(list[i]);
+	}
+	free(list);
+
+	return ret;
+}
+
+static int write_image(struct nand *nand, const char *name)
+{
+	unsigned int n_blocks = nand->n_blocks;
+	size_t len;
+	FILE *f;
+
+	if (!opts.full_size)
+		while (n_blocks > 0 && block_is_erased(nand, n_blocks - 1))
+			n_blocks--;
+	len = (size_t)n_blocks * nand->pages_per_block * nand->stride;
+
+	f = fopen(name, "wb");
+	if (!f) {
+		ERRS("unable to create %s", name);
+		return -1;
+	}
+	if (fwrite(nand->mem, 1, len, f) != len || fclose(f)) {
+		ERRS("unable to write %s", name);
+		return -1;
+	}
+
+	if (opts.verbose)
+		fprintf(stderr, "%s: %u of %u blocks, %zu bytes, %s endian\n",
+			name, n_blocks, nand->n_blocks, len,
+			endian_name(host_big_endian()));
+	return 0;
+}
+
+static void print_blocks(struct yaffs_dev *dev)
+{
+	int bs[10];
+
+	yaffs_count_blocks_by_state(dev, bs);
+	fprintf(stderr,
+		"blocks: %d full, %d allocating, %d dirty, %d checkpoint, "
+		"%d empty; %d free chunks\n",
+		bs[YAFFS_BLOCK_STATE_FULL], bs[YAFFS_BLOCK_STATE_ALLOCATING],
+		bs[YAFFS_BLOCK_STATE_DIRTY], bs[YAFFS_BLOCK_STATE_CHECKPOINT],
+		bs[YAFFS_BLOCK_STATE_EMPTY], yaffs_get_n_free_chunks(dev));
+}
+
+static int build(const char *root, const char *image)
+{
+	struct yaffs_dev dev;
+	struct nand nand;
+	struct stat st;
+	int ret = -1;
+
+	memset(&nand, 0, sizeof(nand));
+	if (stat(root, &st) || !S_ISDIR(st.st_mode)) {
+		ERR("%s is not a directory", root);
+		return -1;
+	}
+
+	io_buf = malloc(IO_BUF_SIZE);
+	if (!io_buf || nand_init(&nand))
+		goto out;
+
+	yhost_time = opts.have_time ? opts.fixed_time :
+		     opts.have_epoch ? opts.epoch : time(NULL);
+
+	setup_dev(&dev, &nand);
+	if (yaffs_guts_initialise(&dev) != YAFFS_OK) {
+		ERR("yaffs failed to initialise");
+		goto out;
+	}
+
+	if (add_dir(&dev, yaffs_root(&dev), root))
+		goto deinit;
+
+	/* The same steps as yaffs_flush_super() on unmount */
+	yaffs_update_dirty_dirs(&dev);
+	yaffs_flush_whole_cache(&dev);
+	if (!opts.no_checkpoint && !yaffs_checkpoint_save(&dev))
+		fprintf(stderr, "%s: warning: no room for a checkpoint, "
+			"the image will be scanned on first mount\n",
+			progname);
+
+	if (opts.verbose) {
+		fprintf(stderr, "%u pages written, %u objects\n",
+			(unsigned int)nand.page_writes, dev.n_obj);
+		print_blocks(&dev);
+	}
+	ret = 0;
+
+deinit:
+	yaffs_deinitialise(&dev);
+	if (!ret)
+		ret = write_image(&nand, image);
+out:
+	free(io_buf);
+	free(nand.mem);
+	return ret;
+}
+
+/* Checking */
+
+struct walk {
+	const char *src;	/* source tree to compare against, or NULL */
+	u64 hash;
+	unsigned long n_files;
+	unsigned long n_dirs;
+	unsigned long n_symlinks;
+	unsigned long n_hardlinks;
+	unsigned long n_special;
+	unsigned long long data_bytes;
+	int errors;
+};
+
+struct child {
+	struct yaffs_obj *obj;
+	char name[YAFFS_MAX_NAME_LENGTH + 1];
+};
+
+static void hash_bytes(struct walk *w, const void *data, size_t len)
+{
+	const u8 *p = data;
+	u64 h = w->hash;
+
+	/* FNV-1a */
+	while (len--) {
+		h ^= *p++;
+		h *= 0x100000001b3ULL;
+	}
+	w->hash = h;
+}
+
+static void hash_u32(struct walk *w, u32 val)
+{
+	hash_bytes(w, &val, sizeof(val));
+}
+
+static void walk_error(struct walk *w, const char *path, const char *what)
+{
+	fprintf(stderr, "%s: %s\n", path, what);
+	w->errors++;
+}
+
+static int child_cmp(const void *a, const void *b)
+{
+	return strcmp(((const struct child *)a)->name,
+		      ((const struct child *)b)->name);
+}
+
+static int src_path(struct walk *w, const char *path, char *buf, size_t len)
+{
+	return snprintf(buf, len, "%s%s", w->src, path) >= (int)len;
+}
+
+static void check_src_attrs(struct walk *w, struct yaffs_obj *obj,
+			    const char *path, struct stat *st)
+{
+	char src[PATH_MAX];
+	u32 uid, gid;
+
+	if (src_path(w, path, src, sizeof(src)) || lstat(src, st)) {
+		walk_error(w, path, "not in the source tree");
+		st->st_mode = 0;
+		return;
+	}
+
+	uid = opts.squash_owner ? 0 : st->st_uid;
+	gid = opts.squash_owner ? 0 : st->st_gid;
+
+	if ((obj->yst_mode & S_IFMT) != (st->st_mode & S_IFMT))
+		walk_error(w, path, "file type differs from the source");
+	else if ((obj->yst_mode & 07777) != (st->st_mode & 07777))
+		walk_error(w, path, "permissions differ from the source");
+	if (obj->yst_uid != uid || obj->yst_gid != gid)
+		walk_error(w, path, "owner differs from the source");
+}
+
+static void walk_file(struct walk *w, struct yaffs_obj *obj, const char *path)
+{
+	char src[PATH_MAX];
+	loff_t len = yaffs_get_obj_length(obj);
+	loff_t offset;
+	struct stat st;
+	u8 *src_buf = NULL;
+	int fd = -1;
+
+	w->n_files++;
+	w->data_bytes += len;
+
+	if (w->src) {
+		check_src_attrs(w, obj, path, &st);
+		if (S_ISREG(st.st_mode)) {
+			if (st.st_size != len)
+				walk_error(w, path,
+					   "size differs from the source");
+			src_path(w, path, src, sizeof(src));
+			fd = open(src, O_RDONLY);
+			src_buf = malloc(IO_BUF_SIZE);
+			if (fd < 0 || !src_buf)
+				walk_error(w, path, "can't read the source");
+		}
+	}
+
+	for (offset = 0; offset < len; ) {
+		int n = min_t(loff_t, IO_BUF_SIZE, len - offset);
+
+		if (yaffs_file_rd(obj, io_buf, offset, n) != n) {
+			walk_error(w, path, "short read");
+			break;
+		}
+		hash_bytes(w, io_buf, n);
+
+		if (fd >= 0 && src_buf &&
+		    (pread(fd, src_buf, n, offset) != n ||
+		     memcmp(io_buf, src_buf, n))) {
+			walk_error(w, path, "data differs from the source");
+			close(fd);
+			fd = -1;
+		}
+		offset += n;
+	}
+
+	if (fd >= 0)
+		close(fd);
+	free(src_buf);
+}
+
+static void walk_dir(struct walk *w, struct yaffs_obj *dir, const char *path);
+
+static void walk_obj(struct walk *w, struct yaffs_obj *obj, const char *path)
+{
+	char src[PATH_MAX];
+	char target[YAFFS_MAX_ALIAS_LENGTH + 2];
+	struct yaffs_obj *equiv;
+	struct stat st;
+	YCHAR *alias;
+	ssize_t len;
+	u32 rdev;
+
+	hash_bytes(w, path, strlen(path) + 1);
+	hash_u32(w, obj->obj_id);
+	hash_u32(w, obj->variant_type);
+
+	if (obj->variant_type == YAFFS_OBJECT_TYPE_HARDLINK) {
+		w->n_hardlinks++;
+		equiv = yaffs_get_equivalent_obj(obj);
+		if (!equiv || equiv == obj) {
+			walk_error(w, path, "dangling hard link");
+			return;
+		}
+		hash_u32(w, equiv->obj_id);
+		if (w->src)
+			check_src_attrs(w, equiv, path, &st);
+		return;
+	}
+
+	hash_u32(w, obj->yst_mode);
+	hash_u32(w, obj->yst_uid);
+	hash_u32(w, obj->yst_gid);
+	hash_u32(w, obj->yst_mtime);
+
+	switch (obj->variant_type) {
+	case YAFFS_OBJECT_TYPE_FILE:
+		walk_file(w, obj, path);
+		break;
+	case YAFFS_OBJECT_TYPE_DIRECTORY:
+		w->n_dirs++;
+		if (w->src)
+			check_src_attrs(w, obj, path, &st);
+		walk_dir(w, obj, path);
+		break;
+	case YAFFS_OBJECT_TYPE_SYMLINK:
+		w->n_symlinks++;
+		alias = yaffs_get_symlink_alias(obj);
+		if (!alias) {
+			walk_error(w, path, "no memory for link target");
+			break;
+		}
+		hash_bytes(w, alias, strlen(alias) + 1);
+		if (w->src) {
+			check_src_attrs(w, obj, path, &st);
+			src_path(w, path, src, sizeof(src));
+			len = readlink(src, target, sizeof(target) - 1);
+			if (len >= 0)
+				target[len] = 0;
+			if (S_ISLNK(st.st_mode) &&
+			    (len < 0 || strcmp(target, alias)))
+				walk_error(w, path,
+					   "link target differs from the source");
+		}
+		kfree(alias);
+		break;
+	case YAFFS_OBJECT_TYPE_SPECIAL:
+		w->n_special++;
+		hash_u32(w, obj->yst_rdev);
+		if (w->src) {
+			check_src_attrs(w, obj, path, &st);
+			if ((S_ISCHR(st.st_mode) || S_ISBLK(st.st_mode)) &&
+			    (encode_rdev(st.st_rdev, &rdev) ||
+			     rdev != obj->yst_rdev))
+				walk_error(w, path,
+					   "device differs from the source");
+		}
+		break;
+	default:
+		walk_error(w, path, "object of unknown type");
+		break;
+	}
+}
+
+static void walk_dir(struct walk *w, struct yaffs_obj *dir, const char *path)
+{
+	char child_path[PATH_MAX];
+	struct dirent **list;
+	struct list_head *i;
+	struct child *children;
+	int n = 0;
+	int j;
+
+	list_for_each(i, &dir->variant.dir_variant.children)
+		n++;
+
+	children = calloc(n ? n : 1, sizeof(*children));
+	if (!children) {
+		walk_error(w, path, "no memory to list directory");
+		return;
+	}
+
+	n = 0;
+	list_for_each(i, &dir->variant.dir_variant.children) {
+		children[n].obj = list_entry(i, struct yaffs_obj, siblings);
+		yaffs_get_obj_name(children[n].obj, children[n].name,
+				   sizeof(children[n].name));
+		n++;
+	}
+	qsort(children, n, sizeof(*children), child_cmp);
+
+	for (j = 0; j < n; j++) {
+		struct yaffs_obj *obj = children[j].obj;
+
+		if (obj->obj_id == YAFFS_OBJECTID_LOSTNFOUND)
+			continue;
+		snprintf(child_path, sizeof(child_path), "%s/%s",
+			 path, children[j].name);
+		walk_obj(w, obj, child_path);
+	}
+	free(children);
+
+	/* Anything in the source that didn't make it into the image? */
+	if (w->src) {
+		char src[PATH_MAX];
+		int k;
+
+		src_path(w, path, src, sizeof(src));
+		n = scandir(src, &list, skip_dots, name_cmp);
+		for (k = 0; k < n; k++) {
+			if ((dir != yaffs_root(dir->my_dev) ||
+			     strcmp(list[k]->d_name, YAFFS_LOSTNFOUND_NAME)) &&
+			    !yaffs_find_by_name(dir, list[k]->d_name)) {
+				snprintf(child_path, sizeof(child_path),
+					 "%s/%s", path, list[k]->d_name);
+				walk_error(w, child_path,
+					   "missing from the image");
+			}
+			free(list[k]);
+		}
+		if (n >= 0)
+			free(list);
+	}
+}
+
+struct mount_stats {
+	int ok;
+	int checkpointed;
+	unsigned long page_reads;
+	unsigned long page_writes;
+	double ms;
+};
+
+static double now_ms(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec * 1000.0 + tv.tv_usec / 1000.0;
+}
+
+/*
+ * Mount the image from a pristine copy, once from the checkpoint and
+ * once by scanning, the way the kernel would with and without the
+ * no-checkpoint-read option.
+ */
+static int mount_image(struct yaffs_dev *dev, struct nand *nand,
+		       const u8 *pristine, int scan, struct mount_stats *ms)
+{
+	double start;
+	int i;
+
+	memset(ms, 0, sizeof(*ms));
+	for (i = 0; i < opts.bench; i++) {
+		if (i)
+			yaffs_deinitialise(dev);
+		memcpy(nand->mem, pristine, nand->size);
+		nand->page_reads = 0;
+		nand->page_writes = 0;
+
+		setup_dev(dev, nand);
+		dev->param.skip_checkpt_rd = scan;
+		dev->param.empty_lost_n_found = 0;
+		dev->read_only = 1;
+
+		start = now_ms();
+		if (yaffs_guts_initialise(dev) != YAFFS_OK)
+			return -1;
+		ms->ms += now_ms() - start;
+	}
+
+	ms->ok = 1;
+	ms->ms /= opts.bench;
+	ms->checkpointed = dev->is_checkpointed;
+	ms->page_reads = nand->page_reads;
+	ms->page_writes = nand->page_writes;
+	return 0;
+}
+
+static int check_lost_n_found(struct yaffs_dev *dev)
+{
+	struct yaffs_obj *lnf = yaffs_lost_n_found(dev);
+	struct list_head *i;
+	int n = 0;
+
+	if (lnf)
+		list_for_each(i, &lnf->variant.dir_variant.children)
+			n++;
+	if (n)
+		fprintf(stderr, "%d orphaned objects in %s\n", n,
+			YAFFS_LOSTNFOUND_NAME);
+	return n;
+}
+
+static int check(const char *image, const char *src)
+{
+	struct mount_stats ms_ckpt, ms_scan;
+	struct walk w_ckpt, w_scan;
+	struct yaffs_dev dev;
+	struct nand nand;
+	struct stat st;
+	u8 *pristine = NULL;
+	double start, walk_ms;
+	FILE *f;
+	size_t len;
+	int ret = 1;
+
+	memset(&nand, 0, sizeof(nand));
+	io_buf = malloc(IO_BUF_SIZE);
+	if (!io_buf || nand_init(&nand))
+		goto out;
+
+	pristine = malloc(nand.size);
+	if (!pristine) {
+		ERR("no memory for the image");
+		goto out;
+	}
+	memset(pristine, 0xff, nand.size);
+
+	f = fopen(image, "rb");
+	if (!f || fstat(fileno(f), &st)) {
+		ERRS("unable to open %s", image);
+		goto out;
+	}
+	if ((size_t)st.st_size > nand.size ||
+	    st.st_size % (nand.pages_per_block * nand.stride)) {
+		ERR("%s: size doesn't fit the given geometry", image);
+		fclose(f);
+		goto out;
+	}
+	len = fread(pristine, 1, st.st_size, f);
+	fclose(f);
+	if (len != (size_t)st.st_size) {
+		ERRS("unable to read %s", image);
+		goto out;
+	}
+
+	/* From the checkpoint, as the kernel's first mount would */
+	if (mount_image(&dev, &nand, pristine, 0, &ms_ckpt)) {
+		ERR("%s: mount failed", image);
+		goto out;
+	}
+	memset(&w_ckpt, 0, sizeof(w_ckpt));
+	w_ckpt.hash = 0xcbf29ce484222325ULL;
+	w_ckpt.src = src;
+	start = now_ms();
+	walk_dir(&w_ckpt, yaffs_root(&dev), "");
+	walk_ms = now_ms() - start;
+	check_lost_n_found(&dev);
+	if (opts.verbose)
+		print_blocks(&dev);
+	yaffs_deinitialise(&dev);
+
+	/* And by scanning, which has to agree */
+	if (mount_image(&dev, &nand, pristine, 1, &ms_scan)) {
+		ERR("%s: mount by scanning failed", image);
+		goto out;
+	}
+	memset(&w_scan, 0, sizeof(w_scan));
+	w_scan.hash = 0xcbf29ce484222325ULL;
+	walk_dir(&w_scan, yaffs_root(&dev), "");
+	check_lost_n_found(&dev);
+	yaffs_deinitialise(&dev);
+
+	printf("%s: %lu files, %lu directories, %lu symlinks, "
+	       "%lu hard links, %lu special, %llu bytes\n", image,
+	       w_ckpt.n_files, w_ckpt.n_dirs, w_ckpt.n_symlinks,
+	       w_ckpt.n_hardlinks, w_ckpt.n_special, w_ckpt.data_bytes);
+	/* Without a checkpoint the first mount scanned as well */
+	if (ms_ckpt.checkpointed)
+		printf("mount from %-10s %8.2f ms, %8lu page reads\n",
+		       "checkpoint", ms_ckpt.ms, ms_ckpt.page_reads);
+	printf("mount from %-10s %8.2f ms, %8lu page reads\n", "scan",
+	       ms_scan.ms, ms_scan.page_reads);
+	printf("read all files      %8.2f ms\n", walk_ms);
+
+	if (ms_ckpt.page_writes || ms_scan.page_writes)
+		printf("%s: mounting wrote %lu pages\n", image,
+		       ms_ckpt.page_writes + ms_scan.page_writes);
+
+	if (w_ckpt.hash != w_scan.hash) {
+		printf("%s: checkpoint and scanned contents differ\n", image);
+		goto out;
+	}
+	if (w_ckpt.errors || w_scan.errors) {
+		printf("%s: %d errors\n", image,
+		       w_ckpt.errors + w_scan.errors);
+		goto out;
+	}
+	if (!ms_ckpt.checkpointed && !opts.no_checkpoint) {
+		printf("%s: no valid checkpoint\n", image);
+		goto out;
+	}
+	ret = 0;
+
+out:
+	free(pristine);
+	free(io_buf);
+	free(nand.mem);
+	return ret;
+}
+
+static int parse_size(const char *s, unsigned long long *val)
+{
+	char *end;
+
+	errno = 0;
+	*val = strtoull(s, &end, 0);
+	if (errno || end == s)
+		return -1;
+
+	switch (*end) {
+	case 'g':
+	case 'G':
+		*val <<= 10;
+		/* fall through */
+	case 'm':
+	case 'M':
+		*val <<= 10;
+		/* fall through */
+	case 'k':
+	case 'K':
+		*val <<= 10;
+		end++;
+		break;
+	}
+	return *end ? -1 : 0;
+}
+
+static int parse_u32(const char *s, unsigned int *val)
+{
+	unsigned long long v;
+
+	if (parse_size(s, &v) || v > UINT_MAX)
+		return -1;
+	*val = v;
+	return 0;
+}
+
+static void usage(int status)
+{
+	FILE *stream = (status != EXIT_SUCCESS) ? stderr : stdout;
+
+	fprintf(stream,
+"Usage: %s [OPTIONS...] <rootdir> <image>\n"
+"       %s -c [OPTIONS...] <image> [<rootdir>]\n"
+"\n"
+"Geometry, which has to match the target's MTD partition:\n"
+"  -p <size>      page size (default 2048)\n"
+"  -s <size>      OOB bytes stored after each page (default 64),\n"
+"                 0 for a data-only image with inband tags\n"
+"  -a <size>      free OOB bytes on the target, mtd oobavail\n"
+"                 (default: all of them)\n"
+"  -b <size>      erase block size (default 128k)\n"
+"  -S <size>      partition size\n"
+"\n"
+"Filesystem, which has to match the mount options:\n"
+"  -i             inband tags (inband-tags)\n"
+"  -T             tags without ECC (tags-ecc-off)\n"
+"  -N             don't write block summaries\n"
+"  -C             don't write a checkpoint (with -c: don't expect one)\n"
+"  -e <endian>    the target's byte order, big or little; refused\n"
+"                 unless it is the host's\n"
+"\n"
+"Contents:\n"
+"  -U             make all files owned by root\n"
+"  -t <seconds>   use this time for all files; otherwise times are\n"
+"                 clamped to SOURCE_DATE_EPOCH if it is set\n"
+"  -f             write the whole partition, not just the used blocks\n"
+"\n"
+"Checking:\n"
+"  -c             check an image: mount it from the checkpoint and by\n"
+"                 scanning, read every file, compare the two and,\n"
+"                 if given, the source tree\n"
+"  -B <n>         mount each way n times and report the average\n"
+"\n"
+"  -v             verbose\n"
+"  -h             show this screen\n"
+"\n"
+"yaffs stores its structures in CPU byte order, so the image only\n"
+"mounts on targets with the host's byte order.  Erase the partition\n"
+"before writing the image, with \"nandwrite -a -o\" or a programmer that\n"
+"does not skip bad blocks; with -C the image tolerates skipped blocks.\n",
+		progname, progname);
+	exit(status);
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned long long v;
+	const char *env;
+	char *end;
+	int c;
+
+	progname = basename(argv[0]);
+
+	while ((c = getopt(argc, argv, "p:s:a:b:S:iTNCe:Ut:fcB:vh")) != -1) {
+		switch (c) {
+		case 'p':
+			if (parse_u32(optarg, &opts.page_size))
+				usage(EXIT_FAILURE);
+			break;
+		case 's':
+			if (parse_u32(optarg, &opts.oob_size))
+				usage(EXIT_FAILURE);
+			break;
+		case 'a':
+			if (parse_u32(optarg, &opts.oob_avail) ||
+			    !opts.oob_avail)
+				usage(EXIT_FAILURE);
+			break;
+		case 'b':
+			if (parse_u32(optarg, &opts.block_size))
+				usage(EXIT_FAILURE);
+			break;
+		case 'S':
+			if (parse_size(optarg, &opts.part_size))
+				usage(EXIT_FAILURE);
+			break;
+		case 'i':
+			opts.inband_tags = 1;
+			break;
+		case 'T':
+			opts.no_tags_ecc = 1;
+			break;
+		case 'N':
+			opts.no_summary = 1;
+			break;
+		case 'C':
+			opts.no_checkpoint = 1;
+			break;
+		case 'e':
+			if (!strcmp(optarg, "big"))
+				opts.big_endian = 1;
+			else if (strcmp(optarg, "little"))
+				usage(EXIT_FAILURE);
+			opts.have_endian = 1;
+			break;
+		case 'U':
+			opts.squash_owner = 1;
+			break;
+		case 't':
+			if (parse_size(optarg, &v) || v > LONG_MAX)
+				usage(EXIT_FAILURE);
+			opts.have_time = 1;
+			opts.fixed_time = v;
+			break;
+		case 'f':
+			opts.full_size = 1;
+			break;
+		case 'c':
+			opts.check = 1;
+			break;
+		case 'B':
+			opts.bench = strtol(optarg, &end, 0);
+			if (*end || opts.bench < 1)
+				usage(EXIT_FAILURE);
+			break;
+		case 'v':
+			opts.verbose = 1;
+			break;
+		case 'h':
+			usage(EXIT_SUCCESS);
+			break;
+		default:
+			usage(EXIT_FAILURE);
+			break;
+		}
+	}
+
+	if (argc - optind != 2 && !(opts.check && argc - optind == 1))
+		usage(EXIT_FAILURE);
+
+	env = getenv("SOURCE_DATE_EPOCH");
+	if (env && *env) {
+		opts.epoch = strtol(env, &end, 10);
+		if (*end || opts.epoch < 0) {
+			ERR("invalid SOURCE_DATE_EPOCH");
+			return EXIT_FAILURE;
+		}
+		opts.have_epoch = 1;
+	}
+
+	if (opts.have_endian && opts.big_endian != host_big_endian()) {
+		ERR("a %s endian host can't make or check images for a %s "
+		    "endian target", endian_name(host_big_endian()),
+		    endian_name(opts.big_endian));
+		return EXIT_FAILURE;
+	}
+
+	if (!opts.part_size) {
+		ERR("the partition size (-S) is required");
+		return EXIT_FAILURE;
+	}
+	if (opts.page_size < 1024 || opts.page_size & (opts.page_size - 1)) {
+		ERR("page size must be a power of two, 1024 or more");
+		return EXIT_FAILURE;
+	}
+	if (!opts.block_size || opts.block_size % opts.page_size ||
+	    opts.part_size % opts.block_size ||
+	    opts.part_size / opts.block_size > INT_MAX) {
+		ERR("block and partition size must be multiples of the "
+		    "page and block size");
+		return EXIT_FAILURE;
+	}
+
+	if (!opts.oob_avail)
+		opts.oob_avail = opts.oob_size;
+	if (opts.oob_avail > opts.oob_size) {
+		ERR("more free OOB bytes than OOB bytes");
+		return EXIT_FAILURE;
+	}
+	/* The same choice yaffs_internal_read_super() makes */
+	if (opts.oob_avail < sizeof(struct yaffs_packed_tags2))
+		opts.inband_tags = 1;
+
+	if (opts.check)
+		return check(argv[optind],
+			     argc - optind > 1 ? argv[optind + 1] : NULL) ?
+			EXIT_FAILURE : EXIT_SUCCESS;
+
+	return build(argv[optind], argv[optind + 1]) ?
+		EXIT_FAILURE : EXIT_SUCCESS;
+}